@@ -0,0 +1,261 @@
+#include "dsc_cache.h"
+
+#include <usbspec.h>
+
+#include "usbip_vhci_api.h"
+
+#define DSC_TYPE_HID_REPORT	0x22
+
+#define REQTYPE_STANDARD_IN_DEVICE	0x80
+#define REQTYPE_STANDARD_IN_INTERFACE	0x81
+
+extern ULONG	libdrv_pooltag;
+
+typedef struct {
+	LIST_ENTRY	list;
+	/* a lookup holds an entry while copying it without a lock */
+	LONG	refcnt;
+	UCHAR	reqtype;
+	USHORT	wValue, wIndex;
+	BOOLEAN	complete;
+	ULONG	len;
+	UCHAR	data[1];
+} dsc_entry_t;
+
+void
+dsc_cache_init(dsc_cache_t *cache)
+{
+	InitializeListHead(&cache->head);
+	KeInitializeSpinLock(&cache->lock);
+	cache->n_entries = 0;
+	cache->len_total = 0;
+}
+
+static void
+put_entry(dsc_entry_t *entry)
+{
+	if (InterlockedDecrement(&entry->refcnt) == 0)
+		ExFreePoolWithTag(entry, libdrv_pooltag);
+}
+
+/* should be called with a lock held */
+static void
+unlink_entry(dsc_cache_t *cache, dsc_entry_t *entry)
+{
+	RemoveEntryList(&entry->list);
+	cache->n_entries--;
+	cache->len_total -= entry->len;
+}
+
+void
+dsc_cache_clear(dsc_cache_t *cache)
+{
+	KIRQL	oldirql;
+
+	KeAcquireSpinLock(&cache->lock, &oldirql);
+	while (!IsListEmpty(&cache->head)) {
+		dsc_entry_t	*entry = CONTAINING_RECORD(cache->head.Flink, dsc_entry_t, list);
+
+		unlink_entry(cache, entry);
+		KeReleaseSpinLock(&cache->lock, oldirql);
+		put_entry(entry);
+		KeAcquireSpinLock(&cache->lock, &oldirql);
+	}
+	KeReleaseSpinLock(&cache->lock, oldirql);
+}
+
+BOOLEAN
+dsc_cache_is_cacheable(const usb_cspkt_t *csp)
+{
+	if (csp->bRequest != USB_REQUEST_GET_DESCRIPTOR)
+		return FALSE;
+
+	switch (csp->bmRequestType.B) {
+	case REQTYPE_STANDARD_IN_DEVICE:
+		switch (csp->wValue.HiByte) {
+		case USB_DEVICE_DESCRIPTOR_TYPE:
+		case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+		case USB_STRING_DESCRIPTOR_TYPE:
+		case USB_BOS_DESCRIPTOR_TYPE:
+			return TRUE;
+		default:
+			return FALSE;
+		}
+	case REQTYPE_STANDARD_IN_INTERFACE:
+		return csp->wValue.HiByte == DSC_TYPE_HID_REPORT;
+	default:
+		return FALSE;
+	}
+}
+
+/* returns 0 if a descriptor has no total length or is malformed */
+static ULONG
+get_dsc_total_len(UCHAR type, const UCHAR *dsc, ULONG len)
+{
+	switch (type) {
+	case USB_DEVICE_DESCRIPTOR_TYPE:
+	case USB_STRING_DESCRIPTOR_TYPE:
+		return dsc[0];
+	case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+	case USB_BOS_DESCRIPTOR_TYPE:
+		if (len < 4)
+			return 0;
+		return dsc[2] | ((ULONG)dsc[3] << 8);
+	default:
+		return 0;
+	}
+}
+
+static BOOLEAN
+is_valid_dsc(UCHAR type, const UCHAR *dsc, ULONG len)
+{
+	if (type == DSC_TYPE_HID_REPORT)
+		return len > 0;
+	return len >= 2 && dsc[1] == type;
+}
+
+static dsc_entry_t *
+find_entry(dsc_cache_t *cache, const usb_cspkt_t *csp)
+{
+	PLIST_ENTRY	le;
+
+	for (le = cache->head.Flink; le != &cache->head; le = le->Flink) {
+		dsc_entry_t	*entry = CONTAINING_RECORD(le, dsc_entry_t, list);
+
+		if (entry->reqtype == csp->bmRequestType.B && entry->wValue == csp->wValue.W && entry->wIndex == csp->wIndex.W)
+			return entry;
+	}
+	return NULL;
+}
+
+BOOLEAN
+dsc_cache_lookup(dsc_cache_t *cache, const usb_cspkt_t *csp, PVOID buf, PULONG plen)
+{
+	dsc_entry_t	*entry;
+	KIRQL	oldirql;
+	ULONG	len;
+
+	if (!dsc_cache_is_cacheable(csp))
+		return FALSE;
+
+	KeAcquireSpinLock(&cache->lock, &oldirql);
+	entry = find_entry(cache, csp);
+	if (entry != NULL && (entry->complete || entry->len >= csp->wLength))
+		InterlockedIncrement(&entry->refcnt);
+	else
+		entry = NULL;
+	KeReleaseSpinLock(&cache->lock, oldirql);
+
+	if (entry == NULL)
+		return FALSE;
+	len = entry->len < csp->wLength ? entry->len : csp->wLength;
+	RtlCopyMemory(buf, entry->data, len);
+	put_entry(entry);
+
+	*plen = len;
+	return TRUE;
+}
+
+static void
+store_entry(dsc_cache_t *cache, const usb_cspkt_t *csp, const UCHAR *dsc, ULONG len, BOOLEAN complete)
+{
+	dsc_entry_t	*entry, *entry_old, *entry_drop = NULL;
+	KIRQL	oldirql;
+
+	entry = ExAllocatePoolWithTag(NonPagedPool, sizeof(dsc_entry_t) + len, libdrv_pooltag);
+	if (entry == NULL)
+		return;
+	entry->refcnt = 1;
+	entry->reqtype = csp->bmRequestType.B;
+	entry->wValue = csp->wValue.W;
+	entry->wIndex = csp->wIndex.W;
+	entry->complete = complete;
+	entry->len = len;
+	RtlCopyMemory(entry->data, dsc, len);
+
+	KeAcquireSpinLock(&cache->lock, &oldirql);
+	entry_old = find_entry(cache, csp);
+	if (entry_old != NULL && (entry_old->complete || entry_old->len >= len)) {
+		entry_drop = entry;
+		entry_old = NULL;
+	}
+	else {
+		/* a longer reply replaces a partial one */
+		if (entry_old != NULL)
+			unlink_entry(cache, entry_old);
+		if (cache->n_entries < DSC_CACHE_MAX_ENTRIES && cache->len_total + len <= DSC_CACHE_MAX_LEN) {
+			InsertTailList(&cache->head, &entry->list);
+			cache->n_entries++;
+			cache->len_total += len;
+		}
+		else
+			entry_drop = entry;
+	}
+	KeReleaseSpinLock(&cache->lock, oldirql);
+
+	if (entry_old != NULL)
+		put_entry(entry_old);
+	if (entry_drop != NULL)
+		put_entry(entry_drop);
+}
+
+void
+dsc_cache_store(dsc_cache_t *cache, const usb_cspkt_t *csp, const VOID *dsc, ULONG len)
+{
+	UCHAR	type = csp->wValue.HiByte;
+	ULONG	len_total;
+
+	if (!dsc_cache_is_cacheable(csp) || len == 0 || len > csp->wLength)
+		return;
+	if (!is_valid_dsc(type, (const UCHAR *)dsc, len))
+		return;
+	len_total = get_dsc_total_len(type, (const UCHAR *)dsc, len);
+	if (len_total != 0 && len > len_total)
+		return;
+	store_entry(cache, csp, (const UCHAR *)dsc, len, len < csp->wLength || len == len_total);
+}
+
+void
+dsc_cache_store_full(dsc_cache_t *cache, UCHAR type, UCHAR index, USHORT langid, const VOID *dsc, ULONG len)
+{
+	usb_cspkt_t	csp;
+
+	RtlZeroMemory(&csp, sizeof(csp));
+	csp.bmRequestType.B = REQTYPE_STANDARD_IN_DEVICE;
+	csp.bRequest = USB_REQUEST_GET_DESCRIPTOR;
+	csp.wValue.HiByte = type;
+	csp.wValue.LowByte = index;
+	csp.wIndex.W = langid;
+	csp.wLength = (USHORT)len;
+	if (!dsc_cache_is_cacheable(&csp) || len == 0 || len > 0xffff || !is_valid_dsc(type, (const UCHAR *)dsc, len))
+		return;
+	store_entry(cache, &csp, (const UCHAR *)dsc, len, TRUE);
+}
+
+void
+dsc_cache_store_records(dsc_cache_t *cache, const VOID *records, ULONG len)
+{
+	const UCHAR	*p = (const UCHAR *)records;
+
+	while (len >= sizeof(vhci_pluginfo_dscr_t)) {
+		vhci_pluginfo_dscr_t	rec;
+		usb_cspkt_t	csp;
+
+		RtlCopyMemory(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+		len -= sizeof(rec);
+		if (rec.len > len)
+			break;
+
+		RtlZeroMemory(&csp, sizeof(csp));
+		csp.bmRequestType.B = rec.reqtype;
+		csp.bRequest = USB_REQUEST_GET_DESCRIPTOR;
+		csp.wValue.W = rec.wValue;
+		csp.wIndex.W = rec.wIndex;
+		csp.wLength = rec.len;
+		dsc_cache_store(cache, &csp, p, rec.len);
+
+		p += rec.len;
+		len -= rec.len;
+	}
+}
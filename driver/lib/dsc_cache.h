@@ -0,0 +1,42 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "usb_util.h"
+
+/*
+ * Cache of descriptors of a device, which answers a repeated GET_DESCRIPTOR
+ * without a round trip to the device.
+ *
+ * Device, configuration, string, BOS and HID report descriptors are cached,
+ * keyed by bmRequestType, wValue and wIndex of a setup packet. An entry keeps
+ * the longest reply seen, and is complete if it is shorter than what was
+ * requested or as long as its total length field. A request is answered from
+ * an entry which is complete or not shorter than wLength.
+ */
+#define DSC_CACHE_MAX_ENTRIES	128
+#define DSC_CACHE_MAX_LEN	(64 * 1024)
+
+typedef struct {
+	LIST_ENTRY	head;
+	KSPIN_LOCK	lock;
+	ULONG	n_entries, len_total;
+} dsc_cache_t;
+
+void dsc_cache_init(dsc_cache_t *cache);
+/* drops all entries, which a reset of a device requires */
+void dsc_cache_clear(dsc_cache_t *cache);
+
+BOOLEAN dsc_cache_is_cacheable(const usb_cspkt_t *csp);
+
+/*
+ * copies a cached descriptor into buf of csp->wLength bytes.
+ * Returns TRUE with a copied length if found. buf may be pageable.
+ */
+BOOLEAN dsc_cache_lookup(dsc_cache_t *cache, const usb_cspkt_t *csp, PVOID buf, PULONG plen);
+/* keeps a reply of len bytes to csp */
+void dsc_cache_store(dsc_cache_t *cache, const usb_cspkt_t *csp, const VOID *dsc, ULONG len);
+/* keeps a whole descriptor, which is known before a request such as those of pluginfo */
+void dsc_cache_store_full(dsc_cache_t *cache, UCHAR type, UCHAR index, USHORT langid, const VOID *dsc, ULONG len);
+/* keeps descriptors of vhci_pluginfo_dscr_t records. A truncated record is ignored */
+void dsc_cache_store_records(dsc_cache_t *cache, const VOID *records, ULONG len);
@@ -0,0 +1,70 @@
+#include "frame_clock.h"
+
+/* a skew beyond this many frames is not slewed */
+#define MAX_SKEW_FRAMES	32
+/* 1/SLEW_RATIO of a skew is corrected per sync */
+#define SLEW_RATIO	8
+
+void
+frame_clock_init(frame_clock_t *fclk, unsigned long long now, unsigned lead)
+{
+	if (lead > FRAME_CLOCK_MAX_LEAD)
+		lead = FRAME_CLOCK_MAX_LEAD;
+	fclk->t_zero = now;
+	fclk->offset = 0;
+	fclk->lead = lead;
+	fclk->synced = 0;
+	fclk->n_resyncs = 0;
+}
+
+unsigned long
+frame_clock_frame(frame_clock_t *fclk, unsigned long long now)
+{
+	return (unsigned long)((now - fclk->t_zero) / 1000);
+}
+
+unsigned long
+frame_clock_microframe(frame_clock_t *fclk, unsigned long long now)
+{
+	return (unsigned long)((now - fclk->t_zero) / 125);
+}
+
+void
+frame_clock_sync(frame_clock_t *fclk, unsigned long long now, unsigned long start_frame, unsigned long n_frames)
+{
+	unsigned long	offset;
+	long	skew;
+
+	/* a server is at least at the end of a transfer by now */
+	offset = frame_clock_frame(fclk, now) - (start_frame + n_frames);
+	if (!fclk->synced) {
+		fclk->offset = offset;
+		fclk->synced = 1;
+		return;
+	}
+
+	skew = (long)(offset - fclk->offset);
+	if (skew > MAX_SKEW_FRAMES || skew < -MAX_SKEW_FRAMES) {
+		fclk->offset = offset;
+		fclk->n_resyncs++;
+		return;
+	}
+	if (skew / SLEW_RATIO != 0)
+		fclk->offset += skew / SLEW_RATIO;
+	else if (skew > 0)
+		fclk->offset++;
+	else if (skew < 0)
+		fclk->offset--;
+}
+
+unsigned long
+frame_clock_to_server(frame_clock_t *fclk, unsigned long frame)
+{
+	return frame - fclk->offset + fclk->lead;
+}
+
+unsigned long
+frame_clock_from_server(frame_clock_t *fclk, unsigned long frame)
+{
+	return frame + fclk->offset - fclk->lead;
+}
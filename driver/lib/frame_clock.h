@@ -0,0 +1,45 @@
+#pragma once
+
+/*
+ * Virtual USB frame clock of an imported device.
+ *
+ * It counts 1ms frames of a local monotonic clock, which class drivers see as
+ * a current frame number. Frame numbers of a server, which come back in
+ * start_frame of ISO RET_SUBMIT's, are tracked as an offset to it. A frame
+ * which a class driver asks for is sent lead frames later on a server, so that
+ * a CMD_SUBMIT reaches a server before its frame. A lead should cover a round
+ * trip to a server.
+ *
+ * It has no dependency on a kernel. Times are microseconds of a monotonic clock.
+ */
+#define FRAME_CLOCK_DEFAULT_LEAD	8
+#define FRAME_CLOCK_MAX_LEAD		1000
+
+typedef struct {
+	/* when virtual frame 0 began */
+	unsigned long long	t_zero;
+	/* virtual frame - server frame, modulo 2^32 */
+	unsigned long	offset;
+	unsigned	lead;
+	/* 0 until a server frame is known */
+	int	synced;
+	unsigned long	n_resyncs;
+} frame_clock_t;
+
+void frame_clock_init(frame_clock_t *fclk, unsigned long long now, unsigned lead);
+
+/* current virtual frame */
+unsigned long frame_clock_frame(frame_clock_t *fclk, unsigned long long now);
+/* current virtual microframe, 8 per frame */
+unsigned long frame_clock_microframe(frame_clock_t *fclk, unsigned long long now);
+
+/*
+ * a transfer of n_frames frames started at start_frame of a server has just
+ * completed. A small skew is corrected gradually, but a large one, such as a
+ * wrap of server frame numbers, replaces an offset at once.
+ */
+void frame_clock_sync(frame_clock_t *fclk, unsigned long long now, unsigned long start_frame, unsigned long n_frames);
+
+/* a virtual frame into a server frame, and vice versa */
+unsigned long frame_clock_to_server(frame_clock_t *fclk, unsigned long frame);
+unsigned long frame_clock_from_server(frame_clock_t *fclk, unsigned long frame);
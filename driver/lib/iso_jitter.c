@@ -0,0 +1,103 @@
+#include "iso_jitter.h"
+
+/* a release this far behind a clock starts over rather than catching up */
+#define MAX_LAG_PERIODS	4
+
+void
+iso_jitter_init(iso_jitter_t *jit, unsigned depth)
+{
+	if (depth > ISO_JITTER_MAX_DEPTH)
+		depth = ISO_JITTER_MAX_DEPTH;
+	jit->depth = depth > 0 ? depth : 1;
+	jit->n_underruns = 0;
+	jit->n_overruns = 0;
+	jit->period = 0;
+	iso_jitter_reset(jit);
+}
+
+void
+iso_jitter_reset(iso_jitter_t *jit)
+{
+	jit->n_held = 0;
+	jit->started = 0;
+	jit->t_next = 0;
+}
+
+unsigned long long
+iso_jitter_period_us(unsigned n_pkts, unsigned char bInterval, int high_speed)
+{
+	unsigned long long	interval;
+
+	if (bInterval < 1)
+		bInterval = 1;
+	if (bInterval > 16)
+		bInterval = 16;
+	/* 2^(bInterval-1) (micro)frames */
+	interval = 1ULL << (bInterval - 1);
+	return n_pkts * interval * (high_speed ? 125 : 1000);
+}
+
+void
+iso_jitter_push(iso_jitter_t *jit, unsigned long long now, unsigned long long period)
+{
+	jit->period = period;
+	jit->n_held++;
+	if (!jit->started) {
+		if (jit->n_held == 1)
+			jit->t_next = now + period * jit->depth;
+		if (jit->n_held >= jit->depth) {
+			jit->started = 1;
+			jit->t_next = now;
+		}
+		return;
+	}
+	if (jit->n_held > jit->depth * 2)
+		jit->n_overruns++;
+}
+
+void
+iso_jitter_drop(iso_jitter_t *jit)
+{
+	if (jit->n_held > 0)
+		jit->n_held--;
+}
+
+unsigned
+iso_jitter_pop_due(iso_jitter_t *jit, unsigned long long now)
+{
+	unsigned	n_due = 0;
+
+	if (!jit->started) {
+		if (jit->n_held == 0 || now < jit->t_next)
+			return 0;
+		jit->started = 1;
+		jit->t_next = now;
+	}
+
+	while (jit->n_held > jit->depth * 2) {
+		jit->n_held--;
+		n_due++;
+	}
+	if (now > jit->t_next + jit->period * MAX_LAG_PERIODS)
+		jit->t_next = now;
+	while (jit->t_next <= now) {
+		if (jit->n_held == 0) {
+			/* nothing for a class driver in time */
+			jit->n_underruns++;
+			jit->started = 0;
+			break;
+		}
+		jit->n_held--;
+		n_due++;
+		jit->t_next += jit->period > 0 ? jit->period : 1;
+	}
+	return n_due;
+}
+
+unsigned long long
+iso_jitter_wait(iso_jitter_t *jit, unsigned long long now)
+{
+	if (!jit->started && jit->n_held == 0)
+		return ISO_JITTER_IDLE;
+	return jit->t_next > now ? jit->t_next - now : 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Timing core of a jitter buffer, which releases completions of ISO IN
+ * transfers at a steady cadence instead of as they arrive from a network.
+ *
+ * It only counts what a caller holds, and has no dependency on a kernel so
+ * that it can be built anywhere. Times are microseconds of a monotonic clock.
+ * Releasing starts after depth completions are held, or depth periods after
+ * the first one if a class driver has fewer transfers outstanding. Each one
+ * is released a transfer period after its predecessor. A buffer is primed
+ * again if nothing is held when a release is due(under-run). Completions held
+ * beyond twice depth are released at once(over-run).
+ */
+#define ISO_JITTER_MAX_DEPTH	32
+/* iso_jitter_wait() for no release scheduled */
+#define ISO_JITTER_IDLE		((unsigned long long)-1)
+
+typedef struct {
+	unsigned	depth;
+	unsigned	n_held;
+	int	started;
+	/* duration of the latest transfer, which a release waits for */
+	unsigned long long	period;
+	/* when the next completion is released if started, otherwise when releasing starts */
+	unsigned long long	t_next;
+	unsigned long	n_underruns, n_overruns;
+} iso_jitter_t;
+
+void iso_jitter_init(iso_jitter_t *jit, unsigned depth);
+/* forgets held completions, which a caller releases on its own. Counters are kept */
+void iso_jitter_reset(iso_jitter_t *jit);
+
+/*
+ * duration of a transfer of n_pkts packets. bInterval is that of an endpoint
+ * descriptor, in frames for full speed and in microframes for high speed or faster.
+ */
+unsigned long long iso_jitter_period_us(unsigned n_pkts, unsigned char bInterval, int high_speed);
+
+/* a completion of period microseconds is held */
+void iso_jitter_push(iso_jitter_t *jit, unsigned long long now, unsigned long long period);
+/* a held completion went away without being released, such as by cancellation */
+void iso_jitter_drop(iso_jitter_t *jit);
+/* how many of the oldest held completions should be released by now */
+unsigned iso_jitter_pop_due(iso_jitter_t *jit, unsigned long long now);
+/* microseconds until iso_jitter_pop_due() should be called again, or ISO_JITTER_IDLE */
+unsigned long long iso_jitter_wait(iso_jitter_t *jit, unsigned long long now);
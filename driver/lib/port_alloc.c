@@ -0,0 +1,69 @@
+#include "port_alloc.h"
+
+void
+port_alloc_init(port_alloc_t *palloc, unsigned n_ports, void *mem)
+{
+	unsigned	i;
+
+	palloc->n_ports = n_ports;
+	palloc->n_free = n_ports;
+	palloc->free = (unsigned *)mem;
+	palloc->pos = palloc->free + n_ports;
+	for (i = 0; i < n_ports; i++) {
+		palloc->free[i] = n_ports - 1 - i;
+		palloc->pos[n_ports - 1 - i] = i;
+	}
+}
+
+int
+port_alloc_get(port_alloc_t *palloc)
+{
+	int	port;
+
+	port = port_alloc_peek(palloc);
+	if (port >= 0)
+		port_alloc_take(palloc, (unsigned)port);
+	return port;
+}
+
+int
+port_alloc_peek(port_alloc_t *palloc)
+{
+	if (palloc->n_free == 0)
+		return -1;
+	return (int)palloc->free[palloc->n_free - 1];
+}
+
+int
+port_alloc_take(port_alloc_t *palloc, unsigned port)
+{
+	unsigned	idx, last;
+
+	if (!port_alloc_is_free(palloc, port))
+		return 0;
+
+	/* the top one fills a hole */
+	idx = palloc->pos[port];
+	last = palloc->free[palloc->n_free - 1];
+	palloc->free[idx] = last;
+	palloc->pos[last] = idx;
+	palloc->n_free--;
+	palloc->pos[port] = palloc->n_ports;
+	return 1;
+}
+
+void
+port_alloc_put(port_alloc_t *palloc, unsigned port)
+{
+	if (port >= palloc->n_ports || palloc->pos[port] != palloc->n_ports)
+		return;
+	palloc->free[palloc->n_free] = port;
+	palloc->pos[port] = palloc->n_free;
+	palloc->n_free++;
+}
+
+int
+port_alloc_is_free(port_alloc_t *palloc, unsigned port)
+{
+	return port < palloc->n_ports && palloc->pos[port] != palloc->n_ports;
+}
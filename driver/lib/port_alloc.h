@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+ * Free ports of a virtual hub, which are taken and put back in O(1) however
+ * many ports a hub has. Free ports are kept in a stack, and each port knows
+ * its position in it, so that a specific port can be taken as well.
+ *
+ * It has no dependency on a kernel. A caller provides memory of
+ * PORT_ALLOC_MEMSIZE(n_ports) bytes, and serializes calls.
+ */
+#define PORT_ALLOC_MEMSIZE(n_ports)	(sizeof(unsigned) * 2 * (n_ports))
+
+typedef struct {
+	unsigned	n_ports;
+	unsigned	n_free;
+	/* free ports. The top one at n_free - 1 is handed out first */
+	unsigned	*free;
+	/* index of a port in free, or n_ports if it is in use */
+	unsigned	*pos;
+} port_alloc_t;
+
+/* all ports are free. Lower ports are handed out first */
+void port_alloc_init(port_alloc_t *palloc, unsigned n_ports, void *mem);
+
+/* any free port, or -1 if all are in use */
+int port_alloc_get(port_alloc_t *palloc);
+/* a port which port_alloc_get() hands out next, or -1 */
+int port_alloc_peek(port_alloc_t *palloc);
+/* a given port. 0 if it is in use or out of range */
+int port_alloc_take(port_alloc_t *palloc, unsigned port);
+void port_alloc_put(port_alloc_t *palloc, unsigned port);
+
+int port_alloc_is_free(port_alloc_t *palloc, unsigned port);
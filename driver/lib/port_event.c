@@ -0,0 +1,65 @@
+#include "port_event.h"
+
+static unsigned
+next_seq(unsigned seq)
+{
+	seq++;
+	return seq != 0 ? seq : 1;
+}
+
+void
+port_event_ring_init(port_event_ring_t *ring)
+{
+	ring->seq_next = 1;
+	ring->head = 0;
+	ring->n_events = 0;
+}
+
+void
+port_event_ring_post(port_event_ring_t *ring, unsigned short type, int port,
+	unsigned short vendor, unsigned short product, unsigned char speed)
+{
+	vhci_port_event_t	*ev;
+
+	ev = &ring->events[ring->head];
+	ev->seq = ring->seq_next;
+	ev->type = type;
+	ev->speed = speed;
+	ev->unused = 0;
+	ev->port = port;
+	ev->vendor = vendor;
+	ev->product = product;
+
+	ring->seq_next = next_seq(ring->seq_next);
+	ring->head = (ring->head + 1) % PORT_EVENT_RING_SIZE;
+	if (ring->n_events < PORT_EVENT_RING_SIZE)
+		ring->n_events++;
+}
+
+unsigned
+port_event_ring_read(port_event_ring_t *ring, unsigned seq, vhci_port_event_t *evs, unsigned n_max, int *plost)
+{
+	unsigned	behind, n;
+
+	*plost = 0;
+	if (seq == 0)
+		seq = ring->seq_next;
+
+	/* how far seq is behind the next change, where 0 is skipped */
+	behind = ring->seq_next - seq;
+	if (ring->seq_next < seq)
+		behind--;
+	if (behind > ring->n_events) {
+		/* too old, or a seq which was never handed out */
+		*plost = 1;
+		behind = ring->n_events;
+	}
+
+	for (n = 0; n < behind && n < n_max; n++) {
+		unsigned	idx;
+
+		idx = (ring->head + PORT_EVENT_RING_SIZE - behind + n) % PORT_EVENT_RING_SIZE;
+		evs[n] = ring->events[idx];
+	}
+	return n;
+}
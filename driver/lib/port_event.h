@@ -0,0 +1,32 @@
+#pragma once
+
+#include "usbip_vhci_event.h"
+
+/*
+ * Latest changes of ports, which are read from a sequence number.
+ *
+ * It has no dependency on a kernel, and a caller serializes calls. Sequence
+ * numbers start from 1 and skip 0 when they wrap around, since 0 asks for
+ * changes from now on.
+ */
+#define PORT_EVENT_RING_SIZE	64
+
+typedef struct {
+	vhci_port_event_t	events[PORT_EVENT_RING_SIZE];
+	/* a sequence number of the next change */
+	unsigned	seq_next;
+	/* where the next change goes in events */
+	unsigned	head;
+	unsigned	n_events;
+} port_event_ring_t;
+
+void port_event_ring_init(port_event_ring_t *ring);
+
+void port_event_ring_post(port_event_ring_t *ring, unsigned short type, int port,
+	unsigned short vendor, unsigned short product, unsigned char speed);
+
+/*
+ * changes from seq are copied into evs, up to n_max of them. *plost is set
+ * if some of them are not kept any more. Returns how many are copied.
+ */
+unsigned port_event_ring_read(port_event_ring_t *ring, unsigned seq, vhci_port_event_t *evs, unsigned n_max, int *plost);
@@ -2,6 +2,7 @@
 #include "stub_dbg.h"
 #include "stub_dev.h"
 #include "stub_reg.h"
+#include "stub_iso.h"
 
 #define INITGUID
 #include "usbip_stub_api.h"
@@ -234,10 +235,13 @@ stub_add_device(PDRIVER_OBJECT drvobj, PDEVICE_OBJECT pdo)
 
 	devstub->sres_ongoing = NULL;
 	devstub->len_sent_partial = 0;
+	devstub->sres_dropped = FALSE;
 
 	init_dev_removal_lock(devstub);
+	dsc_cache_init(&devstub->dsc_cache);
 	InitializeListHead(&devstub->sres_head_pending);
 	InitializeListHead(&devstub->sres_head_done);
+	init_stub_isos(devstub);
 
 	status = IoRegisterDeviceInterface(pdo, (LPGUID)&GUID_DEVINTERFACE_STUB_USBIP, NULL, &devstub->interface_name);
 	if (NT_ERROR(status)) {
@@ -6,6 +6,7 @@
 #include <usbdlib.h>
 
 #include "stub_devconf.h"
+#include "dsc_cache.h"
 
 #define N_DEVICES_USBIP_STUB	32
 
@@ -28,6 +29,8 @@ typedef struct {
 	char	id_hw[256];
 
 	devconf_t	*devconf;
+	/* descriptors which are read repeatedly by every enumeration of a client */
+	dsc_cache_t	dsc_cache;
 
 	UNICODE_STRING	interface_name;
 
@@ -41,6 +44,18 @@ typedef struct {
 
 	LIST_ENTRY	sres_head_done;
 	LIST_ENTRY	sres_head_pending;
+	/* nobody reads results of a device being removed */
+	BOOLEAN		sres_dropped;
+
+	/* entries for ISO transfers */
+	KSPIN_LOCK	lock_isos;
+	LIST_ENTRY	isos_head_free;
+	ULONG		n_isos_free;
+	LIST_ENTRY	isos_head_used;
+	ULONG		n_isos_used;
+	/* once set, entries are not handed out and returned ones are kept until freed all at once */
+	BOOLEAN		isos_removing;
+	KEVENT		isos_idle;
 } usbip_stub_dev_t;
 
 void init_dev_removal_lock(usbip_stub_dev_t *devstub);
@@ -22,6 +22,7 @@
 #include "stub_irp.h"
 #include "usbip_stub_api.h"
 #include "usbip_proto.h"
+#include "usbip_dscr_hash.h"
 
 #include "stub_usbd.h"
 #include "stub_devconf.h"
@@ -47,6 +48,30 @@ get_speed_from_bcdUSB(USHORT bcdUSB)
 	}
 }
 
+static ULONG
+get_dscr_hash(usbip_stub_dev_t *devstub, PUSB_DEVICE_DESCRIPTOR dsc_dev)
+{
+	USB_CONFIGURATION_DESCRIPTOR	ConfDesc;
+	PUSB_CONFIGURATION_DESCRIPTOR	dsc_conf;
+	ULONG	len = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+	ULONG	hash = USBIP_DSCR_HASH_NONE;
+
+	if (!get_usb_desc(devstub, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, &ConfDesc, &len) || len < sizeof(ConfDesc))
+		return USBIP_DSCR_HASH_NONE;
+	dsc_conf = ExAllocatePoolWithTag(NonPagedPool, ConfDesc.wTotalLength, USBIP_STUB_POOL_TAG);
+	if (dsc_conf == NULL)
+		return USBIP_DSCR_HASH_NONE;
+	len = ConfDesc.wTotalLength;
+	if (get_usb_desc(devstub, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, dsc_conf, &len) && len == ConfDesc.wTotalLength) {
+		hash = usbip_dscr_hash(dsc_dev, dsc_conf, (USHORT)len);
+		/* a client fetches them right after an import */
+		dsc_cache_store_full(&devstub->dsc_cache, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, dsc_dev, sizeof(USB_DEVICE_DESCRIPTOR));
+		dsc_cache_store_full(&devstub->dsc_cache, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, dsc_conf, len);
+	}
+	ExFreePoolWithTag(dsc_conf, USBIP_STUB_POOL_TAG);
+	return hash;
+}
+
 static NTSTATUS
 process_get_devinfo(usbip_stub_dev_t *devstub, IRP *irp)
 {
@@ -58,7 +83,7 @@ process_get_devinfo(usbip_stub_dev_t *devstub, IRP *irp)
 
 	outlen = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
 	irp->IoStatus.Information = 0;
-	if (outlen < sizeof(ioctl_usbip_stub_devinfo_t))
+	if (outlen < IOCTL_USBIP_STUB_DEVINFO_SIZE_V1)
 		status = STATUS_INVALID_PARAMETER;
 	else {
 		USB_DEVICE_DESCRIPTOR	desc;
@@ -73,7 +98,13 @@ process_get_devinfo(usbip_stub_dev_t *devstub, IRP *irp)
 			devinfo->class = desc.bDeviceClass;
 			devinfo->subclass = desc.bDeviceSubClass;
 			devinfo->protocol = desc.bDeviceProtocol;
-			irp->IoStatus.Information = sizeof(ioctl_usbip_stub_devinfo_t);
+			irp->IoStatus.Information = IOCTL_USBIP_STUB_DEVINFO_SIZE_V1;
+			/* an old usbipd asks for the first fields only */
+			if (outlen >= sizeof(ioctl_usbip_stub_devinfo_t)) {
+				devinfo->bcdDevice = desc.bcdDevice;
+				devinfo->dscr_hash = get_dscr_hash(devstub, &desc);
+				irp->IoStatus.Information = sizeof(ioctl_usbip_stub_devinfo_t);
+			}
 		}
 		else {
 			status = STATUS_UNSUCCESSFUL;
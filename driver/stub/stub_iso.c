@@ -0,0 +1,199 @@
+#include "stub_driver.h"
+#include "stub_dbg.h"
+#include "stub_iso.h"
+
+/* free entries kept per device. More are released */
+#define MAX_ISOS_FREE	32
+#define MIN_ISO_BUFLEN	PAGE_SIZE
+#define MIN_ISO_PKTS	8
+
+static ULONG
+round_up_pow2(ULONG n, ULONG min)
+{
+	ULONG	r = min;
+
+	while (r < n && r < 0x80000000)
+		r <<= 1;
+	return r;
+}
+
+static void
+free_stub_iso(stub_iso_t *iso)
+{
+	if (iso->purb != NULL)
+		USBD_UrbFree(iso->devstub->hUSBD, iso->purb);
+	if (iso->irp != NULL)
+		IoFreeIrp(iso->irp);
+	if (iso->buf != NULL)
+		ExFreePoolWithTag(iso->buf, USBIP_STUB_POOL_TAG);
+	ExFreePoolWithTag(iso, USBIP_STUB_POOL_TAG);
+}
+
+/* sizes are rounded up so that entries fit transfers of an endpoint which vary a little */
+static stub_iso_t *
+alloc_stub_iso(usbip_stub_dev_t *devstub, ULONG n_pkts, ULONG buflen)
+{
+	stub_iso_t	*iso;
+
+	iso = ExAllocatePoolWithTag(NonPagedPool, sizeof(stub_iso_t), USBIP_STUB_POOL_TAG);
+	if (iso == NULL)
+		return NULL;
+	RtlZeroMemory(iso, sizeof(stub_iso_t));
+	iso->devstub = devstub;
+	iso->n_pkts_max = round_up_pow2(n_pkts, MIN_ISO_PKTS);
+	iso->buflen_max = round_up_pow2(buflen, MIN_ISO_BUFLEN);
+
+	if (NT_ERROR(USBD_IsochUrbAllocate(devstub->hUSBD, iso->n_pkts_max, &iso->purb))) {
+		iso->purb = NULL;
+		free_stub_iso(iso);
+		return NULL;
+	}
+	iso->irp = IoAllocateIrp(devstub->self->StackSize + 1, FALSE);
+	iso->buf = ExAllocatePoolWithTag(NonPagedPool, iso->buflen_max, USBIP_STUB_POOL_TAG);
+	if (iso->irp == NULL || iso->buf == NULL) {
+		free_stub_iso(iso);
+		return NULL;
+	}
+	return iso;
+}
+
+void
+init_stub_isos(usbip_stub_dev_t *devstub)
+{
+	KeInitializeSpinLock(&devstub->lock_isos);
+	InitializeListHead(&devstub->isos_head_free);
+	devstub->n_isos_free = 0;
+	InitializeListHead(&devstub->isos_head_used);
+	devstub->n_isos_used = 0;
+	devstub->isos_removing = FALSE;
+	KeInitializeEvent(&devstub->isos_idle, NotificationEvent, FALSE);
+}
+
+/*
+ * an irp which is cancelled may complete within IoCancelIrp and return its
+ * entry. Returned entries are kept while removing, so an irp stays valid.
+ */
+static void
+cancel_used_isos(usbip_stub_dev_t *devstub)
+{
+	KIRQL	oldirql;
+
+	for (;;) {
+		PLIST_ENTRY	le;
+		PIRP	irp = NULL;
+
+		KeAcquireSpinLock(&devstub->lock_isos, &oldirql);
+		for (le = devstub->isos_head_used.Flink; le != &devstub->isos_head_used; le = le->Flink) {
+			stub_iso_t	*iso = CONTAINING_RECORD(le, stub_iso_t, list);
+
+			if (!iso->cancelled) {
+				iso->cancelled = TRUE;
+				irp = iso->irp;
+				break;
+			}
+		}
+		KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+
+		if (irp == NULL)
+			break;
+		IoCancelIrp(irp);
+	}
+}
+
+/* called at removal after results are dropped and before a USBD handle is closed */
+void
+free_stub_isos(usbip_stub_dev_t *devstub)
+{
+	KIRQL	oldirql;
+	ULONG	n_used;
+
+	KeAcquireSpinLock(&devstub->lock_isos, &oldirql);
+	devstub->isos_removing = TRUE;
+	n_used = devstub->n_isos_used;
+	KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+
+	if (n_used > 0) {
+		DBGI(DBG_GENERAL, "free_stub_isos: waiting for entries in use: %u\n", n_used);
+		cancel_used_isos(devstub);
+		KeWaitForSingleObject(&devstub->isos_idle, Executive, KernelMode, FALSE, NULL);
+	}
+
+	/* nothing else touches a pool from now on */
+	while (!IsListEmpty(&devstub->isos_head_free)) {
+		stub_iso_t	*iso;
+
+		iso = CONTAINING_RECORD(RemoveHeadList(&devstub->isos_head_free), stub_iso_t, list);
+		free_stub_iso(iso);
+	}
+	devstub->n_isos_free = 0;
+}
+
+stub_iso_t *
+get_stub_iso(usbip_stub_dev_t *devstub, ULONG n_pkts, ULONG buflen)
+{
+	stub_iso_t	*iso;
+	PLIST_ENTRY	le;
+	KIRQL	oldirql;
+
+	KeAcquireSpinLock(&devstub->lock_isos, &oldirql);
+	if (devstub->isos_removing) {
+		KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+		return NULL;
+	}
+	for (le = devstub->isos_head_free.Flink; le != &devstub->isos_head_free; le = le->Flink) {
+		iso = CONTAINING_RECORD(le, stub_iso_t, list);
+		if (iso->n_pkts_max >= n_pkts && iso->buflen_max >= buflen) {
+			RemoveEntryList(le);
+			devstub->n_isos_free--;
+			InsertTailList(&devstub->isos_head_used, &iso->list);
+			devstub->n_isos_used++;
+			iso->cancelled = FALSE;
+			KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+			return iso;
+		}
+	}
+	KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+
+	iso = alloc_stub_iso(devstub, n_pkts, buflen);
+	if (iso == NULL) {
+		DBGE(DBG_GENERAL, "get_stub_iso: out of memory: packets: %u, length: %u\n", n_pkts, buflen);
+		return NULL;
+	}
+
+	KeAcquireSpinLock(&devstub->lock_isos, &oldirql);
+	if (devstub->isos_removing) {
+		KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+		free_stub_iso(iso);
+		return NULL;
+	}
+	InsertTailList(&devstub->isos_head_used, &iso->list);
+	devstub->n_isos_used++;
+	KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+	return iso;
+}
+
+void
+put_stub_iso(stub_iso_t *iso)
+{
+	usbip_stub_dev_t	*devstub = iso->devstub;
+	BOOLEAN	idle = FALSE;
+	KIRQL	oldirql;
+
+	KeAcquireSpinLock(&devstub->lock_isos, &oldirql);
+	RemoveEntryList(&iso->list);
+	devstub->n_isos_used--;
+	if (devstub->isos_removing || devstub->n_isos_free < MAX_ISOS_FREE) {
+		InsertHeadList(&devstub->isos_head_free, &iso->list);
+		devstub->n_isos_free++;
+		iso = NULL;
+	}
+	if (devstub->isos_removing && devstub->n_isos_used == 0)
+		idle = TRUE;
+	KeReleaseSpinLock(&devstub->lock_isos, oldirql);
+
+	if (iso != NULL)
+		free_stub_iso(iso);
+	/* devstub may go away right after this */
+	if (idle)
+		KeSetEvent(&devstub->isos_idle, IO_NO_INCREMENT, FALSE);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "stub_dev.h"
+#include "stub_res.h"
+
+/*
+ * Everything an ISO transfer needs, which is pooled per device so that a
+ * stream of transfers allocates nothing once a pool has warmed up.
+ * A buffer holds OUT data or IN data followed by result descriptors.
+ */
+typedef struct stub_iso {
+	LIST_ENTRY	list;
+	usbip_stub_dev_t	*devstub;
+	/* a result whose data is buf. Freeing it puts this back to a pool */
+	stub_res_t	sres;
+	PURB	purb;
+	ULONG	n_pkts_max;
+	PIRP	irp;
+	PVOID	buf;
+	ULONG	buflen_max;
+	/* requested length of a transfer */
+	ULONG	datalen;
+	/* an irp has been cancelled by removal of a device */
+	BOOLEAN	cancelled;
+} stub_iso_t;
+
+void init_stub_isos(usbip_stub_dev_t *devstub);
+void free_stub_isos(usbip_stub_dev_t *devstub);
+
+stub_iso_t *get_stub_iso(usbip_stub_dev_t *devstub, ULONG n_pkts, ULONG buflen);
+void put_stub_iso(stub_iso_t *iso);
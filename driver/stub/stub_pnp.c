@@ -19,6 +19,7 @@
 #include "stub_driver.h"
 #include "stub_dbg.h"
 #include "stub_irp.h"
+#include "stub_iso.h"
 
 static NTSTATUS
 on_start_complete(DEVICE_OBJECT *devobj, IRP *irp, void *context)
@@ -84,6 +85,11 @@ stub_dispatch_pnp(usbip_stub_dev_t *devstub, IRP *irp)
 		/* wait until all outstanding requests are finished */
 		unlock_wait_dev_removal(devstub);
 
+		/* ISO entries of results come back to a pool only if results are dropped */
+		drop_stub_res(devstub);
+		/* pooled URB's are freed with a USBD handle */
+		free_stub_isos(devstub);
+
 		/* USBD_CloseHandle should be ahead of pass_irp_down */
 		USBD_CloseHandle(devstub->hUSBD);
 
@@ -94,6 +100,7 @@ stub_dispatch_pnp(usbip_stub_dev_t *devstub, IRP *irp)
 		remove_devlink(devstub);
 		free_devconf(devstub->devconf);
 		devstub->devconf = NULL;
+		dsc_cache_clear(&devstub->dsc_cache);
 
 		/* delete the device object */
 		IoDetachDevice(devstub->next_stack_dev);
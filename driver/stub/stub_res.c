@@ -2,6 +2,7 @@
 
 #include "usbip_proto.h"
 #include "stub_res.h"
+#include "stub_iso.h"
 #include "stub_dbg.h"
 #include "pdu.h"
 
@@ -30,11 +31,42 @@ free_stub_res(stub_res_t *sres)
 {
 	if (sres == NULL)
 		return;
+	if (sres->iso != NULL) {
+		/* data belongs to a pooled entry */
+		put_stub_iso(sres->iso);
+		return;
+	}
 	if (sres->data)
 		ExFreePoolWithTag(sres->data, USBIP_STUB_POOL_TAG);
 	ExFreePoolWithTag(sres, USBIP_STUB_POOL_TAG);
 }
 
+void
+init_stub_res(stub_res_t *sres, unsigned int cmd, unsigned long seqnum, int err, PVOID data, int data_len, ULONG n_pkts)
+{
+	RtlZeroMemory(&sres->header, sizeof(struct usbip_header));
+	sres->irp = NULL;
+	sres->iso = NULL;
+	sres->header.base.command = cmd;
+	sres->header.base.seqnum = seqnum;
+	sres->data = data;
+	sres->data_len = data_len;
+
+	switch (cmd) {
+	case USBIP_RET_SUBMIT:
+		sres->header.u.ret_submit.status = err;
+		sres->header.u.ret_submit.actual_length = data_len;
+		sres->header.u.ret_submit.number_of_packets = n_pkts;
+		break;
+	case USBIP_RET_UNLINK:
+		sres->header.u.ret_unlink.status = err;
+		break;
+	default:
+		break;
+	}
+	InitializeListHead(&sres->list);
+}
+
 stub_res_t *
 create_stub_res(unsigned int cmd, unsigned long seqnum, int err, PVOID data, int data_len, ULONG n_pkts, BOOLEAN need_copy)
 {
@@ -61,27 +93,7 @@ create_stub_res(unsigned int cmd, unsigned long seqnum, int err, PVOID data, int
 		data = data_copied;
 	}
 
-	RtlZeroMemory(&sres->header, sizeof(struct usbip_header));
-	sres->irp = NULL;
-	sres->header.base.command = cmd;
-	sres->header.base.seqnum = seqnum;
-	sres->data = data;
-	sres->data_len = data_len;
-
-	switch (cmd) {
-	case USBIP_RET_SUBMIT:
-		sres->header.u.ret_submit.status = err;
-		sres->header.u.ret_submit.actual_length = data_len;
-		sres->header.u.ret_submit.number_of_packets = n_pkts;
-		break;
-	case USBIP_RET_UNLINK:
-		sres->header.u.ret_unlink.status = err;
-		break;
-	default:
-		break;
-	}
-	InitializeListHead(&sres->list);
-
+	init_stub_res(sres, cmd, seqnum, err, data, data_len, n_pkts);
 	return sres;
 }
 
@@ -172,48 +184,83 @@ send_stub_res(usbip_stub_dev_t *devstub, PIRP irp_read, stub_res_t *sres)
 }
 
 void
-add_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres, PIRP irp)
+add_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres, PIRP irp, PIO_COMPLETION_ROUTINE completion, PVOID ctx)
 {
 	KIRQL	oldirql;
 
 	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
 	sres->irp = irp;
+	sres->completion = completion;
+	sres->ctx_completion = ctx;
+	sres->cancelling = FALSE;
+	sres->completion_deferred = FALSE;
 	InsertTailList(&devstub->sres_head_pending, &sres->list);
 	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
 }
 
-void
+/*
+ * called first by a completion routine. FALSE if an unlink is cancelling irp,
+ * which then runs a completion routine again after IoCancelIrp returns.
+ * Until then irp is neither freed nor reused by a pooled ISO entry.
+ */
+BOOLEAN
 del_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres)
 {
 	KIRQL	oldirql;
+	BOOLEAN	owned;
 
 	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
 	RemoveEntryList(&sres->list);
 	InitializeListHead(&sres->list);
 	sres->irp = NULL;
+	owned = !sres->cancelling;
+	if (!owned)
+		sres->completion_deferred = TRUE;
 	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+	return owned;
 }
 
+/*
+ * IoCancelIrp may complete irp within it, where a completion routine takes
+ * lock_stub_res, so irp is cancelled after unlocking while sres is pinned.
+ */
 BOOLEAN
 cancel_pending_stub_res(usbip_stub_dev_t *devstub, unsigned int seqnum)
 {
 	KIRQL	oldirql;
 	PLIST_ENTRY	le;
+	stub_res_t	*sres = NULL;
+	PIRP	irp;
+	BOOLEAN	cancelled, deferred;
 
 	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
 	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending; le = le->Flink) {
-		stub_res_t	*sres;
+		stub_res_t	*sres_pending = CONTAINING_RECORD(le, stub_res_t, list);
 
-		sres = CONTAINING_RECORD(le, stub_res_t, list);
-		if (sres->header.base.seqnum == seqnum) {
-			PIRP	irp = sres->irp;
-			KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
-			return IoCancelIrp(irp);
+		if (sres_pending->header.base.seqnum == seqnum && !sres_pending->cancelling) {
+			sres = sres_pending;
+			break;
 		}
 	}
+	if (sres == NULL) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		return FALSE;
+	}
+	sres->cancelling = TRUE;
+	irp = sres->irp;
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	cancelled = IoCancelIrp(irp);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	sres->cancelling = FALSE;
+	deferred = sres->completion_deferred;
+	sres->completion_deferred = FALSE;
 	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
 
-	return FALSE;
+	if (deferred)
+		sres->completion(devstub->self, irp, sres->ctx_completion);
+	return cancelled;
 }
 
 static VOID
@@ -279,12 +326,41 @@ collect_done_stub_res(usbip_stub_dev_t *devstub, PIRP irp_read)
 	}
 }
 
+/* results done or being sent are freed, and those done later are freed on a reply */
+void
+drop_stub_res(usbip_stub_dev_t *devstub)
+{
+	LIST_ENTRY	head;
+	stub_res_t	*sres;
+	KIRQL	oldirql;
+
+	InitializeListHead(&head);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	devstub->sres_dropped = TRUE;
+	while (!IsListEmpty(&devstub->sres_head_done))
+		InsertTailList(&head, RemoveHeadList(&devstub->sres_head_done));
+	sres = devstub->sres_ongoing;
+	devstub->sres_ongoing = NULL;
+	devstub->len_sent_partial = 0;
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	free_stub_res(sres);
+	while (!IsListEmpty(&head))
+		free_stub_res(CONTAINING_RECORD(RemoveHeadList(&head), stub_res_t, list));
+}
+
 void
 reply_stub_req(usbip_stub_dev_t *devstub, stub_res_t *sres)
 {
 	KIRQL	oldirql;
 
 	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	if (devstub->sres_dropped) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		free_stub_res(sres);
+		return;
+	}
 	InsertTailList(&devstub->sres_head_done, &sres->list);
 	if (devstub->irp_stub_read == NULL) {
 		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
@@ -3,25 +3,37 @@
 #include "stub_dev.h"
 #include "usbip_proto.h"
 
+struct stub_iso;
+
 typedef struct stub_res {
 	PIRP	irp;
 	struct usbip_header	header;
 	PVOID	data;
 	int	data_len;
 	LIST_ENTRY	list;
+	/* non-NULL if embedded in a pooled ISO entry */
+	struct stub_iso	*iso;
+	/* a completion of irp, which is left to an unlink while it cancels irp */
+	PIO_COMPLETION_ROUTINE	completion;
+	PVOID	ctx_completion;
+	BOOLEAN	cancelling;
+	BOOLEAN	completion_deferred;
 } stub_res_t;
 
 #ifdef DBG
 const char *dbg_stub_res(stub_res_t *sres, usbip_stub_dev_t* devstub);
 #endif
 
+void
+init_stub_res(stub_res_t *sres, unsigned int cmd, unsigned long seqnum, int err, PVOID data, int data_len, ULONG n_pkts);
 stub_res_t *
 create_stub_res(unsigned int cmd, unsigned long seqnum, int err, PVOID data, int data_len, ULONG n_pkts, BOOLEAN need_copy);
 void free_stub_res(stub_res_t *sres);
 
-void add_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres, PIRP irp);
-void del_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres);
+void add_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres, PIRP irp, PIO_COMPLETION_ROUTINE completion, PVOID ctx);
+BOOLEAN del_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres);
 BOOLEAN cancel_pending_stub_res(usbip_stub_dev_t *devstub, unsigned int seqnum);
+void drop_stub_res(usbip_stub_dev_t *devstub);
 
 NTSTATUS collect_done_stub_res(usbip_stub_dev_t *devstub, PIRP irp_read);
 
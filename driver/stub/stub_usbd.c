@@ -20,6 +20,7 @@
 #include "stub_dbg.h"
 #include "stub_dev.h"
 #include "stub_res.h"
+#include "stub_iso.h"
 #include "usbd_helper.h"
 
 #include "stub_cspkt.h"
@@ -47,7 +48,8 @@ do_safe_completion(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
 	DBGI(DBG_GENERAL, "do_safe_completion: status = %s\n", dbg_usbd_status(safe_completion->purb->UrbHeader.Status));
 
 	devstub = (usbip_stub_dev_t *)safe_completion->devobj->DeviceExtension;
-	del_pending_stub_res(devstub, safe_completion->sres);
+	if (!del_pending_stub_res(devstub, safe_completion->sres))
+		return STATUS_MORE_PROCESSING_REQUIRED;
 
 	safe_completion->cb_urb_done(devstub, irp->IoStatus.Status, safe_completion->purb, safe_completion->sres);
 
@@ -57,13 +59,32 @@ do_safe_completion(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
 	return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+static void
+send_urb_nb(usbip_stub_dev_t *devstub, PIRP irp, PURB purb, PIO_COMPLETION_ROUTINE completion, PVOID ctx, stub_res_t *sres)
+{
+	IO_STACK_LOCATION	*irpstack;
+	NTSTATUS status;
+
+	irpstack = IoGetNextIrpStackLocation(irp);
+	irpstack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irpstack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irpstack->Parameters.Others.Argument1 = purb;
+	irpstack->Parameters.Others.Argument2 = NULL;
+	irpstack->DeviceObject = devstub->self;
+
+	IoSetCompletionRoutine(irp, completion, ctx, TRUE, TRUE, TRUE);
+
+	add_pending_stub_res(devstub, sres, irp, completion, ctx);
+	DBGI(DBG_GENERAL, "call_usbd_nb: call_usbd_nb: %s\n", dbg_stub_res(sres, devstub));
+	status = IoCallDriver(devstub->next_stack_dev, irp);
+	DBGI(DBG_GENERAL, "call_usbd_nb: status = %s\n", dbg_ntstatus(status));
+}
+
 static NTSTATUS
 call_usbd_nb(usbip_stub_dev_t *devstub, PURB purb, cb_urb_done_t cb_urb_done, stub_res_t *sres)
 {
 	IRP *irp;
-	IO_STACK_LOCATION	*irpstack;
 	safe_completion_t	*safe_completion;
-	NTSTATUS status;
 
 	DBGI(DBG_GENERAL, "call_usbd_nb: enter\n");
 
@@ -84,25 +105,12 @@ call_usbd_nb(usbip_stub_dev_t *devstub, PURB purb, cb_urb_done_t cb_urb_done, st
 		return STATUS_NO_MEMORY;
 	}
 
-	irpstack = IoGetNextIrpStackLocation(irp);
-	irpstack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-	irpstack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
-	irpstack->Parameters.Others.Argument1 = purb;
-	irpstack->Parameters.Others.Argument2 = NULL;
-	irpstack->DeviceObject = devstub->self;
-
-	IoSetCompletionRoutine(irp, do_safe_completion, safe_completion, TRUE, TRUE, TRUE);
-
-	add_pending_stub_res(devstub, sres, irp);
-	DBGI(DBG_GENERAL, "call_usbd_nb: call_usbd_nb: %s\n", dbg_stub_res(sres, devstub));
-	status = IoCallDriver(devstub->next_stack_dev, irp);
-	DBGI(DBG_GENERAL, "call_usbd_nb: status = %s\n", dbg_ntstatus(status));
+	send_urb_nb(devstub, irp, purb, do_safe_completion, safe_completion, sres);
 
 	/* Completion routine will treat remaining works depending on success or failure.
 	 * Just return success code so a caller doesn't have to take any action such as releasing sres.  
 	 */
-	status = STATUS_SUCCESS;
-	return status;
+	return STATUS_SUCCESS;
 }
 
 static NTSTATUS
@@ -427,101 +435,119 @@ submit_bulk_intr_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, uns
 	return call_usbd_nb(devstub, purb, done_bulk_intr_transfer, sres);
 }
 
+/* packets of an IN transfer are sent back to back, as usbip expects */
+static ULONG
+pack_iso_data(struct _URB_ISOCH_TRANSFER *purb_iso, char *data)
+{
+	ULONG	len = 0;
+	ULONG	i;
+
+	for (i = 0; i < purb_iso->NumberOfPackets; i++) {
+		USBD_ISO_PACKET_DESCRIPTOR	*usbd_iso_desc = purb_iso->IsoPacket + i;
+
+		if (usbd_iso_desc->Length > 0 && usbd_iso_desc->Offset != len)
+			RtlMoveMemory(data + len, data + usbd_iso_desc->Offset, usbd_iso_desc->Length);
+		len += usbd_iso_desc->Length;
+	}
+	return len;
+}
+
+/* usbip expects length fields to be intact. Packets of a request are contiguous */
 static void
-done_iso_transfer(usbip_stub_dev_t *devstub, NTSTATUS status, PURB purb, stub_res_t *sres)
+set_iso_descs_len(ULONG n_pkts, struct usbip_iso_packet_descriptor *iso_descs, ULONG datalen)
 {
+	ULONG	i;
+
+	for (i = 0; i < n_pkts; i++) {
+		ULONG	end = (i + 1 < n_pkts) ? iso_descs[i + 1].offset : datalen;
+		iso_descs[i].length = end - iso_descs[i].offset;
+	}
+}
+
+/* results are written in place over a buffer of a transfer */
+static void
+done_iso_transfer(usbip_stub_dev_t *devstub, NTSTATUS status, stub_iso_t *iso)
+{
+	struct _URB_ISOCH_TRANSFER	*purb_iso = &iso->purb->UrbIsochronousTransfer;
+	stub_res_t	*sres = &iso->sres;
+	struct usbip_iso_packet_descriptor	*iso_descs;
+	ULONG	actual_len = 0, n_pkts;
+
 	DBGI(DBG_GENERAL, "done_iso_transfer: sres:%s,status:%s,usbd_status:%s\n",
-		dbg_stub_res(sres, devstub), dbg_ntstatus(status), dbg_usbd_status(purb->UrbHeader.Status));
+		dbg_stub_res(sres, devstub), dbg_ntstatus(status), dbg_usbd_status(purb_iso->Hdr.Status));
 
 	if (status == STATUS_CANCELLED) {
 		/* cancelled. just drop it */
 		free_stub_res(sres);
+		return;
+	}
+
+	n_pkts = purb_iso->NumberOfPackets;
+	if (NT_SUCCESS(status)) {
+		if (purb_iso->TransferFlags & USBD_TRANSFER_DIRECTION_IN)
+			actual_len = pack_iso_data(purb_iso, iso->buf);
+		sres->header.u.ret_submit.start_frame = purb_iso->StartFrame;
+		sres->header.u.ret_submit.error_count = purb_iso->ErrorCount;
 	}
 	else {
-		if (NT_SUCCESS(status)) {
-			struct _URB_ISOCH_TRANSFER	*purb_iso = &purb->UrbIsochronousTransfer;
-			struct usbip_iso_packet_descriptor	*iso_descs;
-			int	actual_len, n_pkts, iso_descs_len;
-
-			n_pkts = sres->header.u.ret_submit.number_of_packets;
-			iso_descs_len = sizeof(struct usbip_iso_packet_descriptor) * n_pkts;
-
-			if (sres->data != NULL) { /* direction IN case */
-				actual_len = get_usbd_iso_descs_len(purb_iso->NumberOfPackets, purb_iso->IsoPacket);
-				/* TODO: check if it is later */
-				NT_ASSERT(actual_len <= sres->data_len);
-				if (actual_len < sres->data_len) {
-					/* usbip expects a length field in iso descriptor to be intact.
-					 * Copying old isochronous descriptors maintain only length field.
-					 * Other fields will be overwritten by to_iso_descs() routine.
-					 */
-					RtlCopyMemory((char *)sres->data + actual_len, (char *)sres->data + sres->data_len, iso_descs_len);
-				}
-			}
-			else {
-				sres->data = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)sres->data_len, USBIP_STUB_POOL_TAG);
-				if (sres->data == NULL) {
-					DBGE(DBG_GENERAL, "done_iso_transfer: out of memory\n");
-					sres->data_len = 0;
-				}
-				else {
-					/* Copy old iso descriptors. */
-					RtlCopyMemory(sres->data, (char *)purb_iso->TransferBuffer + sres->data_len, iso_descs_len);
-				}
-				sres->data_len = iso_descs_len;
-				actual_len = 0;
-				ExFreePoolWithTag(purb_iso->TransferBuffer, USBIP_STUB_POOL_TAG);
-			}
-
-			iso_descs = (struct usbip_iso_packet_descriptor *)((char *)sres->data + actual_len);
-			to_iso_descs(n_pkts, iso_descs, purb_iso->IsoPacket, TRUE);
-			sres->data_len = actual_len + iso_descs_len;
-			sres->header.u.ret_submit.actual_length = actual_len;
-			sres->header.u.ret_submit.start_frame = purb_iso->StartFrame;
-			sres->header.u.ret_submit.error_count = purb_iso->ErrorCount;
-		}
-		else {
-			sres->header.u.ret_submit.status = to_usbip_status(purb->UrbHeader.Status);
-		}
-		reply_stub_req(devstub, sres);
+		ULONG	i;
+
+		sres->header.u.ret_submit.status = to_usbip_status(purb_iso->Hdr.Status);
+		for (i = 0; i < n_pkts; i++)
+			purb_iso->IsoPacket[i].Length = 0;
 	}
-	USBD_UrbFree(devstub->hUSBD, purb);
+
+	/* a client reads descriptors even for a failed transfer */
+	iso_descs = (struct usbip_iso_packet_descriptor *)((char *)iso->buf + actual_len);
+	to_iso_descs(n_pkts, iso_descs, purb_iso->IsoPacket, TRUE);
+	set_iso_descs_len(n_pkts, iso_descs, iso->datalen);
+	sres->data_len = actual_len + sizeof(struct usbip_iso_packet_descriptor) * n_pkts;
+	sres->header.u.ret_submit.actual_length = actual_len;
+	reply_stub_req(devstub, sres);
 }
 
-NTSTATUS
-submit_iso_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, unsigned long seqnum,
-	ULONG usbd_flags, ULONG n_pkts, ULONG start_frame, struct usbip_iso_packet_descriptor *iso_descs, PVOID data, ULONG datalen)
+static NTSTATUS
+do_iso_completion(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
 {
-	PURB	purb;
-	struct _URB_ISOCH_TRANSFER	*purb_iso;
-	stub_res_t	*sres;
-	BOOLEAN		is_in;
-	NTSTATUS	status;
+	stub_iso_t	*iso = (stub_iso_t *)ctx;
 
-	status = USBD_IsochUrbAllocate(devstub->hUSBD, n_pkts, &purb);
-	if (NT_ERROR(status)) {
-		DBGE(DBG_GENERAL, "submit_iso_transfer: out of memory: urb\n");
-		return status;
-	}
+	UNREFERENCED_PARAMETER(devobj);
+
+	if (!del_pending_stub_res(iso->devstub, &iso->sres))
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	done_iso_transfer(iso->devstub, irp->IoStatus.Status, iso);
+
+	/* an irp is reused by a pooled entry */
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/* OUT data should be in a buffer of iso already */
+void
+submit_iso_transfer(usbip_stub_dev_t *devstub, stub_iso_t *iso, USBD_PIPE_HANDLE hPipe, unsigned long seqnum,
+	ULONG usbd_flags, ULONG n_pkts, ULONG start_frame, struct usbip_iso_packet_descriptor *iso_descs, ULONG datalen)
+{
+	struct _URB_ISOCH_TRANSFER	*purb_iso = &iso->purb->UrbIsochronousTransfer;
 
-	purb_iso = &purb->UrbIsochronousTransfer;
 	purb_iso->Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
 	purb_iso->Hdr.Length = (USHORT)GET_ISO_URB_SIZE(n_pkts - 1);
+	purb_iso->Hdr.Status = USBD_STATUS_SUCCESS;
 	purb_iso->PipeHandle = hPipe;
 	purb_iso->TransferFlags = usbd_flags;
-	purb_iso->TransferBuffer = data;
+	purb_iso->TransferBuffer = iso->buf;
+	purb_iso->TransferBufferMDL = NULL;
 	purb_iso->TransferBufferLength = datalen;
 	purb_iso->NumberOfPackets = n_pkts;
 	purb_iso->StartFrame = start_frame;
+	purb_iso->ErrorCount = 0;
+	RtlZeroMemory(purb_iso->IsoPacket, sizeof(USBD_ISO_PACKET_DESCRIPTOR) * n_pkts);
 	to_usbd_iso_descs(n_pkts, purb_iso->IsoPacket, iso_descs, FALSE);
+	iso->datalen = datalen;
 
-	is_in = usbd_flags & USBD_TRANSFER_DIRECTION_IN ? TRUE: FALSE;
-	sres = create_stub_res(USBIP_RET_SUBMIT, seqnum, 0, is_in ? data: NULL, datalen, n_pkts, FALSE);
-	if (sres == NULL) {
-		USBD_UrbFree(devstub->hUSBD, purb);
-		return STATUS_UNSUCCESSFUL;
-	}
-	return call_usbd_nb(devstub, purb, done_iso_transfer, sres);
+	init_stub_res(&iso->sres, USBIP_RET_SUBMIT, seqnum, 0, iso->buf, datalen, n_pkts);
+	iso->sres.iso = iso;
+
+	IoReuseIrp(iso->irp, STATUS_SUCCESS);
+	send_urb_nb(devstub, iso->irp, iso->purb, do_iso_completion, iso, &iso->sres);
 }
 
 BOOLEAN
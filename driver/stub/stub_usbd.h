@@ -1,6 +1,7 @@
 #pragma once
 
 #include "stub_dev.h"
+#include "stub_iso.h"
 
 #include "usbip_proto.h"
 #include "usb_util.h"
@@ -20,9 +21,9 @@ BOOLEAN submit_class_vendor_req(usbip_stub_dev_t *devstub, BOOLEAN is_in, USHORT
 NTSTATUS
 submit_bulk_intr_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, unsigned long seqnum, PVOID data, ULONG pdatalen, BOOLEAN is_in);
 
-NTSTATUS
-submit_iso_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, unsigned long seqnum, ULONG usbd_flags, ULONG n_pkts, ULONG start_frame,
-	struct usbip_iso_packet_descriptor *iso_descs, PVOID data, ULONG datalen);
+void
+submit_iso_transfer(usbip_stub_dev_t *devstub, struct stub_iso *iso, USBD_PIPE_HANDLE hPipe, unsigned long seqnum, ULONG usbd_flags,
+	ULONG n_pkts, ULONG start_frame, struct usbip_iso_packet_descriptor *iso_descs, ULONG datalen);
 
 BOOLEAN
 submit_control_transfer(usbip_stub_dev_t *devstub, usb_cspkt_t *csp, PVOID data, PULONG pdata_len);
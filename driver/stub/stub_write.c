@@ -76,6 +76,11 @@ process_get_desc(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t *cs
 		return;
 	}
 
+	if (dsc_cache_lookup(&devstub->dsc_cache, csp, pdesc, &len)) {
+		reply_stub_req_data(devstub, seqnum, pdesc, len, FALSE);
+		return;
+	}
+
 	len = csp->wLength;
 	if (descType == 0x22) {
 		/* NOTE: Try to tweak in a clumsy way.
@@ -97,6 +102,7 @@ process_get_desc(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t *cs
 		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, seqnum, -32);
 		return;
 	}
+	dsc_cache_store(&devstub->dsc_cache, csp, pdesc, len);
 	reply_stub_req_data(devstub, seqnum, pdesc, len, FALSE);
 }
 
@@ -129,6 +135,8 @@ process_clear_feature(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_
 static void
 process_select_conf(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t *csp)
 {
+	/* some devices report other descriptors in another configuration */
+	dsc_cache_clear(&devstub->dsc_cache);
 	if (select_usb_conf(devstub, csp->wValue.W))
 		reply_stub_req_hdr(devstub, USBIP_RET_SUBMIT, seqnum);
 	else
@@ -231,6 +239,13 @@ process_class_vendor_request(usbip_stub_dev_t *devstub, usb_cspkt_t *csp, struct
 	}
 }
 
+/* SET_FEATURE(PORT_RESET) of vhci, after which a device may come up with new firmware */
+static BOOLEAN
+is_port_reset(usb_cspkt_t *csp)
+{
+	return CSPKT_RECIPIENT(csp) == BMREQUEST_TO_OTHER && csp->bRequest == USB_REQUEST_SET_FEATURE && csp->wValue.W == 4;
+}
+
 static void
 process_control_transfer(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 {
@@ -247,6 +262,8 @@ process_control_transfer(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 		process_standard_request(devstub, hdr->base.seqnum, csp);
 		break;
 	case BMREQUEST_CLASS:
+		if (is_port_reset(csp))
+			dsc_cache_clear(&devstub->dsc_cache);
 		process_class_vendor_request(devstub, csp, hdr, FALSE);
 		break;
 	case BMREQUEST_VENDOR:
@@ -293,13 +310,12 @@ process_bulk_intr_transfer(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION inf
 static void
 process_iso_transfer(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
 {
-	PVOID	data;
+	stub_iso_t	*iso;
 	ULONG	datalen;
 	struct usbip_iso_packet_descriptor	*iso_descs;
 	ULONG	usbd_flags, n_pkts;
-	int	iso_descs_len;
+	ULONG	iso_descs_len;
 	BOOLEAN	is_in;
-	NTSTATUS	status;
 
 	DBGI(DBG_READWRITE, "iso_transfer: seq:%u, ep:%s\n", hdr->base.seqnum, dbg_info_pipe(info_pipe));
 
@@ -313,34 +329,24 @@ process_iso_transfer(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe
 	if (is_in) {
 		iso_descs = (struct usbip_iso_packet_descriptor *)(hdr + 1);
 		datalen = get_iso_descs_len(n_pkts, iso_descs, FALSE);
-		data = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)datalen + sizeof(struct usbip_iso_packet_descriptor) * n_pkts, USBIP_STUB_POOL_TAG);
-		if (data == NULL) {
-			DBGE(DBG_GENERAL, "process_iso_transfer: out of memory\n");
-			reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
-			return;
-		}
-		RtlCopyMemory((char *)data + datalen, iso_descs, iso_descs_len);
 	}
 	else {
-		/* Allocate more space for iso descriptors which will maintain length field */
 		datalen = (ULONG)hdr->u.cmd_submit.transfer_buffer_length;
 		iso_descs = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + datalen);
-		data = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)(datalen + iso_descs_len), USBIP_STUB_POOL_TAG);
-		if (data == NULL) {
-			DBGE(DBG_GENERAL, "process_iso_transfer: out of memory\n");
-			reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
-			return;
-		}
-		RtlCopyMemory((char *)data, hdr + 1, datalen + iso_descs_len);
 	}
 
-	status = submit_iso_transfer(devstub, info_pipe->PipeHandle, hdr->base.seqnum, usbd_flags, n_pkts,
-		hdr->u.cmd_submit.start_frame, iso_descs, data, datalen);
-	if (NT_ERROR(status)) {
+	/* room for result descriptors after IN data */
+	iso = get_stub_iso(devstub, n_pkts, datalen + iso_descs_len);
+	if (iso == NULL) {
 		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
-		if (is_in)
-			ExFreePoolWithTag(data, USBIP_STUB_POOL_TAG);
+		return;
 	}
+	/* a write irp goes away after this, so OUT data is copied once */
+	if (!is_in)
+		RtlCopyMemory(iso->buf, hdr + 1, datalen);
+
+	submit_iso_transfer(devstub, iso, info_pipe->PipeHandle, hdr->base.seqnum, usbd_flags, n_pkts,
+		hdr->u.cmd_submit.start_frame, iso_descs, datalen);
 }
 
 static UCHAR
@@ -45,6 +45,7 @@ find_sent_urbr(pvpdo_dev_t vpdo, struct usbip_header *hdr)
 		if (urbr->seq_num == hdr->base.seqnum) {
 			RemoveEntryListInit(&urbr->list_all);
 			RemoveEntryListInit(&urbr->list_state);
+			RemoveEntryListInit(&urbr->list_ep);
 			KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 			return urbr;
 		}
@@ -92,6 +93,7 @@ remove_cancelled_urbr(pvpdo_dev_t vpdo, struct urb_req *urbr)
 
 	RemoveEntryListInit(&urbr->list_state);
 	RemoveEntryListInit(&urbr->list_all);
+	RemoveEntryListInit(&urbr->list_ep);
 	if (vpdo->urbr_sent_partial == urbr) {
 		vpdo->urbr_sent_partial = NULL;
 		vpdo->len_sent_partial = 0;
@@ -148,6 +150,7 @@ create_urbr(pvpdo_dev_t vpdo, PIRP irp, unsigned long seq_num_unlink)
 	urbr->seq_num_unlink = seq_num_unlink;
 	InitializeListHead(&urbr->list_all);
 	InitializeListHead(&urbr->list_state);
+	InitializeListHead(&urbr->list_ep);
 	return urbr;
 }
 
@@ -156,39 +159,80 @@ free_urbr(struct urb_req *urbr)
 {
 	ASSERT(IsListEmpty(&urbr->list_all));
 	ASSERT(IsListEmpty(&urbr->list_state));
+	ASSERT(IsListEmpty(&urbr->list_ep));
 	ExFreeToNPagedLookasideList(&g_lookaside, urbr);
 }
 
-BOOLEAN
-is_port_urbr(struct urb_req *urbr, unsigned char epaddr)
+/* a pipe is looked up once when an urbr is queued, not on every abort */
+static USBD_PIPE_HANDLE
+get_urbr_pipe(struct urb_req *urbr)
 {
 	PIRP	irp = urbr->irp;
 	PURB	urb;
 	PIO_STACK_LOCATION	irpstack;
-	USBD_PIPE_HANDLE	hPipe;
 
 	if (irp == NULL)
-		return FALSE;
+		return NULL;
 
 	irpstack = IoGetCurrentIrpStackLocation(irp);
+	if (irpstack->Parameters.DeviceIoControl.IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)
+		return NULL;
 	urb = irpstack->Parameters.Others.Argument1;
 	if (urb == NULL)
-		return FALSE;
+		return NULL;
 
 	switch (urb->UrbHeader.Function) {
 	case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
-		hPipe = urb->UrbBulkOrInterruptTransfer.PipeHandle;
-		break;
+		return urb->UrbBulkOrInterruptTransfer.PipeHandle;
 	case URB_FUNCTION_ISOCH_TRANSFER:
-		hPipe = urb->UrbIsochronousTransfer.PipeHandle;
-		break;
+		return urb->UrbIsochronousTransfer.PipeHandle;
 	default:
-		return FALSE;
+		return NULL;
 	}
+}
 
-	if (PIPE2ADDR(hPipe) == epaddr)
-		return TRUE;
-	return FALSE;
+/* lock_urbr should be held */
+static void
+insert_urbr(pvpdo_dev_t vpdo, struct urb_req *urbr)
+{
+	USBD_PIPE_HANDLE	hPipe;
+
+	InsertTailList(&vpdo->head_urbr, &urbr->list_all);
+	hPipe = get_urbr_pipe(urbr);
+	if (hPipe != NULL)
+		InsertTailList(&vpdo->head_urbr_ep[PIPE2EPIDX(hPipe)], &urbr->list_ep);
+}
+
+/*
+ * CMD_UNLINK's of urbr's in head_unlink are queued under a single lock.
+ * Only the first one goes through submit_urbr(), which may hand it to a
+ * pending read irp. Others follow on subsequent reads.
+ */
+void
+submit_urbrs_unlink(pvpdo_dev_t vpdo, PLIST_ENTRY head_unlink)
+{
+	struct urb_req	*urbr_first;
+	KIRQL	oldirql;
+
+	if (IsListEmpty(head_unlink))
+		return;
+	urbr_first = CONTAINING_RECORD(RemoveHeadList(head_unlink), struct urb_req, list_state);
+	InitializeListHead(&urbr_first->list_state);
+
+	KeAcquireSpinLock(&vpdo->lock_urbr, &oldirql);
+	while (!IsListEmpty(head_unlink)) {
+		struct urb_req	*urbr;
+
+		urbr = CONTAINING_RECORD(RemoveHeadList(head_unlink), struct urb_req, list_state);
+		InsertTailList(&vpdo->head_urbr_pending, &urbr->list_state);
+		insert_urbr(vpdo, urbr);
+	}
+	KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
+
+	if (NT_ERROR(submit_urbr(vpdo, urbr_first))) {
+		DBGI(DBG_GENERAL, "failed to submit unlink urb: %s\n", dbg_urbr(urbr_first));
+		free_urbr(urbr_first);
+	}
 }
 
 NTSTATUS
@@ -209,7 +253,7 @@ submit_urbr(pvpdo_dev_t vpdo, struct urb_req *urbr)
 			IoMarkIrpPending(urbr->irp);
 		}
 		InsertTailList(&vpdo->head_urbr_pending, &urbr->list_state);
-		InsertTailList(&vpdo->head_urbr, &urbr->list_all);
+		insert_urbr(vpdo, urbr);
 		KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
 		DBGI(DBG_URB, "submit_urbr: urb pending\n");
@@ -251,7 +295,7 @@ submit_urbr(pvpdo_dev_t vpdo, struct urb_req *urbr)
 			InsertTailList(&vpdo->head_urbr_sent, &urbr->list_state);
 		}
 
-		InsertTailList(&vpdo->head_urbr, &urbr->list_all);
+		insert_urbr(vpdo, urbr);
 
 		vpdo->pending_read_irp = NULL;
 		KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
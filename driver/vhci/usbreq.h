@@ -11,6 +11,8 @@
 #define PIPE2ADDR(handle)	((unsigned char)((INT_PTR)(handle) & 0x7f))
 #define PIPE2TYPE(handle)	((unsigned char)(((INT_PTR)(handle) & 0xff0000) >> 16))
 #define PIPE2INTERVAL(handle)	((unsigned char)(((INT_PTR)(handle) & 0xff00) >> 8))
+/* index of vpdo->head_urbr_ep, which tells IN from OUT of an endpoint number */
+#define PIPE2EPIDX(handle)	((unsigned char)(((INT_PTR)(handle) & 0x0f) | (((INT_PTR)(handle) & 0x80) >> 3)))
 
 struct urb_req {
 	pvpdo_dev_t	vpdo;
@@ -19,6 +21,8 @@ struct urb_req {
 	unsigned long	seq_num, seq_num_unlink;
 	LIST_ENTRY	list_all;
 	LIST_ENTRY	list_state;
+	// urb_req's of the same endpoint, only for bulk, interrupt or isochronous transfers
+	LIST_ENTRY	list_ep;
 };
 
 #define RemoveEntryListInit(le)	do { RemoveEntryList(le); InitializeListHead(le); } while (0)
@@ -35,5 +39,5 @@ create_urbr(pvpdo_dev_t vpdo, PIRP irp, unsigned long seq_num_unlink);
 extern void
 free_urbr(struct urb_req *urbr);
 
-extern BOOLEAN
-is_port_urbr(struct urb_req *urbr, unsigned char epaddr);
+extern void
+submit_urbrs_unlink(pvpdo_dev_t vpdo, PLIST_ENTRY head_unlink);
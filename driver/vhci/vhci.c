@@ -62,6 +62,36 @@ vhci_driverUnload(__in PDRIVER_OBJECT drvobj)
 		ExFreePool(Globals.RegistryPath.Buffer);
 }
 
+static PAGEABLE void
+read_parameters(PCWSTR regpath)
+{
+	RTL_QUERY_REGISTRY_TABLE	tbl[4];
+	ULONG	lead = iso_frame_lead;
+	ULONG	n_ports = vhub_n_ports;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(tbl, sizeof(tbl));
+	tbl[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+	tbl[0].Name = L"Parameters";
+	tbl[1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	tbl[1].Name = L"IsoFrameLead";
+	tbl[1].EntryContext = &lead;
+	tbl[1].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+	tbl[2].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	tbl[2].Name = L"MaxPorts";
+	tbl[2].EntryContext = &n_ports;
+	tbl[2].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+
+	if (NT_SUCCESS(RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, regpath, tbl, NULL, NULL))) {
+		iso_frame_lead = lead;
+		if (n_ports >= 1 && n_ports <= VHUB_MAX_PORTS)
+			vhub_n_ports = n_ports;
+	}
+
+	DBGI(DBG_GENERAL, "iso frame lead: %u, max ports: %u\n", iso_frame_lead, vhub_n_ports);
+}
+
 static PAGEABLE NTSTATUS
 vhci_create(__in PDEVICE_OBJECT devobj, __in PIRP Irp)
 {
@@ -101,7 +131,7 @@ cleanup_vpdo(pvhci_dev_t vhci, PIRP irp)
 		vpdo->fo = NULL;
 		irpstack->FileObject->FsContext = NULL;
 		if (vpdo->plugged)
-			vhci_unplug_port(vhci, (CHAR)vpdo->port);
+			vhci_unplug_port(vhci, (LONG)vpdo->port);
 	}
 }
 
@@ -122,7 +152,11 @@ vhci_cleanup(__in PDEVICE_OBJECT devobj, __in PIRP irp)
 		return STATUS_NO_SUCH_DEVICE;
 	}
 	if (IS_DEVOBJ_VHCI(devobj)) {
+		pvhub_dev_t	vhub = VHUB_FROM_VHCI(DEVOBJ_TO_VHCI(devobj));
+
 		cleanup_vpdo(DEVOBJ_TO_VHCI(devobj), irp);
+		if (vhub != NULL)
+			vhub_flush_port_events(vhub, IoGetCurrentIrpStackLocation(irp)->FileObject, STATUS_CANCELLED);
 	}
 
 	irp->IoStatus.Information = 0;
@@ -176,6 +210,8 @@ DriverEntry(__in PDRIVER_OBJECT drvobj, __in PUNICODE_STRING RegistryPath)
 
 	RtlCopyUnicodeString(&Globals.RegistryPath, RegistryPath);
 
+	read_parameters(Globals.RegistryPath.Buffer);
+
 	// Set entry points into the driver
 	drvobj->MajorFunction[IRP_MJ_CREATE] = vhci_create;
 	drvobj->MajorFunction[IRP_MJ_CLEANUP] = vhci_cleanup;
@@ -15,3 +15,9 @@
 #define WTEXT_LEN(wtext)	(sizeof(wtext) / sizeof(WCHAR))
 
 extern NPAGED_LOOKASIDE_LIST g_lookaside;
+extern ULONG iso_frame_lead;
+
+#define VHUB_DEFAULT_PORTS	6
+#define VHUB_MAX_PORTS		4096
+/* MaxPorts of a Parameters key */
+extern ULONG vhub_n_ports;
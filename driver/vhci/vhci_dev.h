@@ -4,6 +4,10 @@
 #include <wmilib.h>	// required for WMILIB_CONTEXT
 
 #include "vhci_devconf.h"
+#include "dsc_cache.h"
+#include "frame_clock.h"
+#include "port_alloc.h"
+#include "port_event.h"
 
 #define IS_DEVOBJ_VHCI(devobj)	(((pvdev_t)(devobj)->DeviceExtension)->type == VDEV_VHCI)
 #define IS_DEVOBJ_VPDO(devobj)	(((pvdev_t)(devobj)->DeviceExtension)->type == VDEV_VPDO)
@@ -18,6 +22,9 @@
 
 #define TO_DEVOBJ(vdev)		((vdev)->common.Self)
 
+/* 16 endpoint numbers of each direction */
+#define N_URBR_EPS	32
+
 #define VHUB_FROM_VHCI(vhci)	((pvhub_dev_t)(vhci)->common.child_pdo ? (pvhub_dev_t)(vhci)->common.child_pdo->fdo: NULL)
 #define VHUB_FROM_VPDO(vpdo)	((pvhub_dev_t)(vpdo)->common.parent)
 
@@ -90,6 +97,7 @@ struct urb_req;
 struct _cpdo;
 struct _vhub;
 struct _hpdo;
+struct _vpdo;
 
 typedef struct
 {
@@ -128,11 +136,20 @@ typedef struct _vhub
 	LIST_ENTRY	head_vpdo;
 
 	ULONG		n_max_ports;
+	// vpdo's indexed by port. NULL if a port is free or reserved for a plugin
+	struct _vpdo	**vpdos;
+	// ports which are neither used nor reserved
+	port_alloc_t	ports;
 
 	// the number of current vpdo's
 	ULONG		n_vpdos;
 	ULONG		n_vpdos_plugged;
 
+	// changes of ports, and irps waiting for them
+	port_event_ring_t	events;
+	LIST_ENTRY	head_irp_events;
+	KSPIN_LOCK	lock_events;
+
 	// A synchronization for access to the device extension.
 	FAST_MUTEX	Mutex;
 
@@ -149,7 +166,7 @@ typedef struct _vhub
 
 // The device extension for the vpdo.
 // That's of the USBIP device which this bus driver enumerates.
-typedef struct
+typedef struct _vpdo
 {
 	vdev_t	common;
 
@@ -188,12 +205,19 @@ typedef struct
 	LIST_ENTRY	head_urbr_pending;
 	// urb_req's which had been sent and have waited for response
 	LIST_ENTRY	head_urbr_sent;
+	// urb_req's of each endpoint, indexed by PIPE2EPIDX()
+	LIST_ENTRY	head_urbr_ep[N_URBR_EPS];
 	KSPIN_LOCK	lock_urbr;
 	PFILE_OBJECT	fo;
 	unsigned int	devid;
 	unsigned long	seq_num;
 	PUSB_DEVICE_DESCRIPTOR	dsc_dev;
 	PUSB_CONFIGURATION_DESCRIPTOR	dsc_conf;
+	// descriptors answered without a round trip to a device
+	dsc_cache_t	dsc_cache;
+	// virtual frame numbers, served to class drivers
+	frame_clock_t	frame_clock;
+	KSPIN_LOCK	lock_frame;
 	UNICODE_STRING	usb_dev_interface;
 	UCHAR	current_intf_num, current_intf_alt;
 } vpdo_dev_t, *pvpdo_dev_t;
@@ -206,8 +230,19 @@ void vdev_del_ref(pvdev_t vdev);
 
 pvpdo_dev_t vhub_find_vpdo(pvhub_dev_t vhub, unsigned port);
 
+void vpdo_init_frame_clock(pvpdo_dev_t vpdo);
+ULONG vpdo_get_frame(pvpdo_dev_t vpdo);
+ULONG vpdo_get_microframe(pvpdo_dev_t vpdo);
+BOOLEAN vpdo_frame_to_server(pvpdo_dev_t vpdo, ULONG frame, PULONG pframe_server);
+void vpdo_sync_frame(pvpdo_dev_t vpdo, struct _URB_ISOCH_TRANSFER *urb_iso, ULONG start_frame);
+
 void
 vhub_mark_unplugged_vpdo(pvhub_dev_t vhub, pvpdo_dev_t vpdo);
 
+void vhub_init_port_events(pvhub_dev_t vhub);
+void vhub_post_port_event(pvhub_dev_t vhub, USHORT type, pvpdo_dev_t vpdo);
+void vhub_flush_port_events(pvhub_dev_t vhub, PFILE_OBJECT fo, NTSTATUS status);
+NTSTATUS vhub_get_port_events(pvhub_dev_t vhub, PIRP irp, ULONG inlen, PULONG poutlen);
+
 LPWSTR
 get_device_prop(PDEVICE_OBJECT pdo, DEVICE_REGISTRY_PROPERTY prop, PULONG plen);
@@ -0,0 +1,214 @@
+#include "vhci.h"
+
+#include "vhci_dev.h"
+#include "usbip_vhci_api.h"
+
+/*
+ * IOCTL_USBIP_VHCI_GET_PORT_EVENTS irps are pended on a vhub until ports
+ * change. Changes are posted with vhub->Mutex held, and irps are handled
+ * under lock_events, which goes before the cancel spin lock.
+ */
+
+void
+vhub_init_port_events(pvhub_dev_t vhub)
+{
+	port_event_ring_init(&vhub->events);
+	InitializeListHead(&vhub->head_irp_events);
+	KeInitializeSpinLock(&vhub->lock_events);
+}
+
+/* no change but where the next one starts */
+static void
+fill_seq_next(port_event_ring_t *ring, ioctl_usbip_vhci_port_events *evs)
+{
+	evs->size = (unsigned)VHCI_PORT_EVENTS_SIZE(0);
+	evs->seq_next = ring->seq_next;
+	evs->flags = 0;
+	evs->n_events = 0;
+}
+
+/* FALSE if there's no change from a seq which irp asks for. lock_events should be held */
+static BOOLEAN
+fill_port_events(pvhub_dev_t vhub, PIRP irp)
+{
+	PIO_STACK_LOCATION	irpstack = IoGetCurrentIrpStackLocation(irp);
+	ULONG	outlen = irpstack->Parameters.DeviceIoControl.OutputBufferLength;
+	ioctl_usbip_vhci_port_events	*evs = (ioctl_usbip_vhci_port_events *)irp->AssociatedIrp.SystemBuffer;
+	unsigned	seq, n_max, n;
+	int	lost;
+
+	/* an input buffer overlaps an output one */
+	seq = ((ioctl_usbip_vhci_get_port_events *)evs)->seq;
+	n_max = (unsigned)((outlen - VHCI_PORT_EVENTS_SIZE(0)) / sizeof(vhci_port_event_t));
+	n = port_event_ring_read(&vhub->events, seq, evs->events, n_max, &lost);
+	if (n == 0 && !lost)
+		return FALSE;
+
+	evs->size = (unsigned)VHCI_PORT_EVENTS_SIZE(n);
+	evs->seq_next = n > 0 ? evs->events[n - 1].seq + 1 : vhub->events.seq_next;
+	if (evs->seq_next == 0)
+		evs->seq_next = 1;
+	evs->flags = lost ? VHCI_PORT_EVENTS_LOST : 0;
+	evs->n_events = n;
+	irp->IoStatus.Information = evs->size;
+	return TRUE;
+}
+
+static void
+cancel_irp_port_events(PDEVICE_OBJECT devobj, PIRP irp)
+{
+	pvhub_dev_t	vhub = (pvhub_dev_t)irp->Tail.Overlay.DriverContext[0];
+	KIRQL	oldirql;
+
+	UNREFERENCED_PARAMETER(devobj);
+
+	IoReleaseCancelSpinLock(irp->CancelIrql);
+
+	KeAcquireSpinLock(&vhub->lock_events, &oldirql);
+	RemoveEntryList(&irp->Tail.Overlay.ListEntry);
+	KeReleaseSpinLock(&vhub->lock_events, oldirql);
+
+	irp->IoStatus.Status = STATUS_CANCELLED;
+	irp->IoStatus.Information = 0;
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
+
+/* pending irps, which are not cancelled, are moved to head. lock_events should be held */
+static void
+take_irps_port_events(pvhub_dev_t vhub, PFILE_OBJECT fo, PLIST_ENTRY head)
+{
+	PLIST_ENTRY	entry, next;
+
+	for (entry = vhub->head_irp_events.Flink; entry != &vhub->head_irp_events; entry = next) {
+		PIRP	irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+		KIRQL	oldirql_cancel;
+		BOOLEAN	valid_irp;
+
+		next = entry->Flink;
+		if (fo != NULL && IoGetCurrentIrpStackLocation(irp)->FileObject != fo)
+			continue;
+
+		RemoveEntryList(entry);
+		IoAcquireCancelSpinLock(&oldirql_cancel);
+		valid_irp = IoSetCancelRoutine(irp, NULL) != NULL;
+		IoReleaseCancelSpinLock(oldirql_cancel);
+		if (valid_irp)
+			InsertTailList(head, entry);
+		else {
+			/* a cancel routine will remove it again */
+			InitializeListHead(entry);
+		}
+	}
+}
+
+/* all irps in head get completed */
+static void
+complete_irps_port_events(PLIST_ENTRY head, NTSTATUS status)
+{
+	while (!IsListEmpty(head)) {
+		PIRP	irp = CONTAINING_RECORD(RemoveHeadList(head), IRP, Tail.Overlay.ListEntry);
+
+		irp->IoStatus.Status = status;
+		if (status != STATUS_SUCCESS)
+			irp->IoStatus.Information = 0;
+		IoCompleteRequest(irp, IO_NO_INCREMENT);
+	}
+}
+
+/* a change of vpdo->port is recorded, and all pending irps get it */
+void
+vhub_post_port_event(pvhub_dev_t vhub, USHORT type, pvpdo_dev_t vpdo)
+{
+	LIST_ENTRY	head_done;
+	PLIST_ENTRY	entry;
+	KIRQL	oldirql;
+	ULONG	seq;
+
+	InitializeListHead(&head_done);
+
+	KeAcquireSpinLock(&vhub->lock_events, &oldirql);
+
+	seq = vhub->events.seq_next;
+	port_event_ring_post(&vhub->events, type, (int)vpdo->port, vpdo->vendor, vpdo->product, vpdo->speed);
+	take_irps_port_events(vhub, NULL, &head_done);
+	for (entry = head_done.Flink; entry != &head_done; entry = entry->Flink) {
+		PIRP	irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+		/* a seq of a pending irp is not newer than a new change */
+		if (!fill_port_events(vhub, irp))
+			irp->IoStatus.Information = 0;
+	}
+
+	KeReleaseSpinLock(&vhub->lock_events, oldirql);
+
+	complete_irps_port_events(&head_done, STATUS_SUCCESS);
+
+	DBGI(DBG_VHUB, "port event: type: %hu, port: %u, seq: %u\n", type, vpdo->port, seq);
+}
+
+/* pending irps of fo, or all of them if fo is NULL, are completed with status */
+void
+vhub_flush_port_events(pvhub_dev_t vhub, PFILE_OBJECT fo, NTSTATUS status)
+{
+	LIST_ENTRY	head_done;
+	KIRQL	oldirql;
+
+	InitializeListHead(&head_done);
+
+	KeAcquireSpinLock(&vhub->lock_events, &oldirql);
+	take_irps_port_events(vhub, fo, &head_done);
+	KeReleaseSpinLock(&vhub->lock_events, oldirql);
+
+	complete_irps_port_events(&head_done, status);
+}
+
+/*
+ * An irp is completed at once if there are changes from a seq asked for,
+ * and otherwise pended. A seq of 0 is replaced with that of the next change.
+ */
+NTSTATUS
+vhub_get_port_events(pvhub_dev_t vhub, PIRP irp, ULONG inlen, PULONG poutlen)
+{
+	ioctl_usbip_vhci_get_port_events	*req = (ioctl_usbip_vhci_get_port_events *)irp->AssociatedIrp.SystemBuffer;
+	KIRQL	oldirql, oldirql_cancel;
+
+	if (inlen < sizeof(ioctl_usbip_vhci_get_port_events) || *poutlen < VHCI_PORT_EVENTS_SIZE(0)) {
+		*poutlen = 0;
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	KeAcquireSpinLock(&vhub->lock_events, &oldirql);
+
+	if (*poutlen < VHCI_PORT_EVENTS_SIZE(1)) {
+		fill_seq_next(&vhub->events, (ioctl_usbip_vhci_port_events *)req);
+		KeReleaseSpinLock(&vhub->lock_events, oldirql);
+		*poutlen = (ULONG)VHCI_PORT_EVENTS_SIZE(0);
+		return STATUS_SUCCESS;
+	}
+
+	if (req->seq == 0)
+		req->seq = vhub->events.seq_next;
+	if (fill_port_events(vhub, irp)) {
+		KeReleaseSpinLock(&vhub->lock_events, oldirql);
+		*poutlen = (ULONG)irp->IoStatus.Information;
+		return STATUS_SUCCESS;
+	}
+
+	IoAcquireCancelSpinLock(&oldirql_cancel);
+	if (irp->Cancel) {
+		IoReleaseCancelSpinLock(oldirql_cancel);
+		KeReleaseSpinLock(&vhub->lock_events, oldirql);
+		*poutlen = 0;
+		return STATUS_CANCELLED;
+	}
+	irp->Tail.Overlay.DriverContext[0] = vhub;
+	IoSetCancelRoutine(irp, cancel_irp_port_events);
+	IoReleaseCancelSpinLock(oldirql_cancel);
+
+	IoMarkIrpPending(irp);
+	InsertTailList(&vhub->head_irp_events, &irp->Tail.Overlay.ListEntry);
+
+	KeReleaseSpinLock(&vhub->lock_events, oldirql);
+
+	return STATUS_PENDING;
+}
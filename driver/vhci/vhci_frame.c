@@ -0,0 +1,73 @@
+#include "vhci.h"
+
+#include "vhci_dev.h"
+#include "usbreq.h"
+#include "usbip_proto.h"
+#include "iso_jitter.h"
+
+/* frames by which a server runs behind frames asked by a class driver */
+ULONG	iso_frame_lead = FRAME_CLOCK_DEFAULT_LEAD;
+
+static unsigned long long
+get_time_us(void)
+{
+	/* 100ns units */
+	return KeQueryInterruptTime() / 10;
+}
+
+void
+vpdo_init_frame_clock(pvpdo_dev_t vpdo)
+{
+	KeInitializeSpinLock(&vpdo->lock_frame);
+	frame_clock_init(&vpdo->frame_clock, get_time_us(), iso_frame_lead);
+}
+
+ULONG
+vpdo_get_frame(pvpdo_dev_t vpdo)
+{
+	return frame_clock_frame(&vpdo->frame_clock, get_time_us());
+}
+
+ULONG
+vpdo_get_microframe(pvpdo_dev_t vpdo)
+{
+	return frame_clock_microframe(&vpdo->frame_clock, get_time_us());
+}
+
+/* FALSE if frames of a server are not known yet */
+BOOLEAN
+vpdo_frame_to_server(pvpdo_dev_t vpdo, ULONG frame, PULONG pframe_server)
+{
+	KIRQL	oldirql;
+	BOOLEAN	synced;
+
+	KeAcquireSpinLock(&vpdo->lock_frame, &oldirql);
+	synced = vpdo->frame_clock.synced ? TRUE : FALSE;
+	if (synced)
+		*pframe_server = frame_clock_to_server(&vpdo->frame_clock, frame);
+	KeReleaseSpinLock(&vpdo->lock_frame, oldirql);
+	return synced;
+}
+
+/* a completed ISO transfer gets a virtual start frame back */
+void
+vpdo_sync_frame(pvpdo_dev_t vpdo, struct _URB_ISOCH_TRANSFER *urb_iso, ULONG start_frame)
+{
+	ULONG	n_frames, n_resyncs;
+	BOOLEAN	resynced;
+	KIRQL	oldirql;
+
+	n_frames = (ULONG)(iso_jitter_period_us(urb_iso->NumberOfPackets, PIPE2INTERVAL(urb_iso->PipeHandle),
+		vpdo->speed >= USB_SPEED_HIGH) / 1000);
+
+	KeAcquireSpinLock(&vpdo->lock_frame, &oldirql);
+	n_resyncs = vpdo->frame_clock.n_resyncs;
+	frame_clock_sync(&vpdo->frame_clock, get_time_us(), start_frame, n_frames);
+	urb_iso->StartFrame = frame_clock_from_server(&vpdo->frame_clock, start_frame);
+	resynced = n_resyncs != vpdo->frame_clock.n_resyncs;
+	n_resyncs = vpdo->frame_clock.n_resyncs;
+	KeReleaseSpinLock(&vpdo->lock_frame, oldirql);
+
+	if (resynced)
+		DBGI(DBG_WRITE, "frame clock resynced: port: %u, total: %u\n", vpdo->port, n_resyncs);
+}
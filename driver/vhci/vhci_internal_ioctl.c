@@ -3,56 +3,92 @@
 #include "vhci_dev.h"
 #include "usbreq.h"
 
+extern BOOLEAN
+vpdo_get_dsc_from_cache(pvpdo_dev_t vpdo, PURB urb);
+
+/*
+ * Only urbr's of an aborted endpoint are visited. A sent urbr is reused for
+ * its own CMD_UNLINK, and those are queued as a batch. A partially sent urbr
+ * is left alone, and completes as usual.
+ */
 NTSTATUS
 vhci_ioctl_abort_pipe(pvpdo_dev_t vpdo, USBD_PIPE_HANDLE hPipe)
 {
+	LIST_ENTRY	head_aborted, head_unlink;
+	PLIST_ENTRY	head_ep;
 	KIRQL		oldirql;
 	PLIST_ENTRY	le;
-	unsigned char	epaddr;
 
 	if (!hPipe) {
 		DBGI(DBG_IOCTL, "vhci_ioctl_abort_pipe: empty pipe handle\n");
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	epaddr = PIPE2ADDR(hPipe);
+	DBGI(DBG_IOCTL, "vhci_ioctl_abort_pipe: EP: %02x\n", PIPE2ADDR(hPipe));
 
-	DBGI(DBG_IOCTL, "vhci_ioctl_abort_pipe: EP: %02x\n", epaddr);
+	InitializeListHead(&head_aborted);
+	InitializeListHead(&head_unlink);
+	head_ep = &vpdo->head_urbr_ep[PIPE2EPIDX(hPipe)];
 
 	KeAcquireSpinLock(&vpdo->lock_urbr, &oldirql);
 
 	// remove all URBRs of the aborted pipe
-	for (le = vpdo->head_urbr.Flink; le != &vpdo->head_urbr;) {
-		struct urb_req	*urbr_local = CONTAINING_RECORD(le, struct urb_req, list_all);
+	for (le = head_ep->Flink; le != head_ep;) {
+		struct urb_req	*urbr_local = CONTAINING_RECORD(le, struct urb_req, list_ep);
 		le = le->Flink;
 
-		if (!is_port_urbr(urbr_local, epaddr))
+		if (urbr_local == vpdo->urbr_sent_partial)
 			continue;
-
-		DBGI(DBG_IOCTL, "aborted urbr removed: %s\n", dbg_urbr(urbr_local));
-
 		if (urbr_local->irp) {
-			PIRP	irp = urbr_local->irp;
 			BOOLEAN	valid_irp;
 
 			KIRQL oldirql_cancel;
 			IoAcquireCancelSpinLock(&oldirql_cancel);
-			valid_irp = IoSetCancelRoutine(irp, NULL) != NULL;
+			valid_irp = IoSetCancelRoutine(urbr_local->irp, NULL) != NULL;
 			IoReleaseCancelSpinLock(oldirql_cancel);
 
-			if (valid_irp) {
-				irp->IoStatus.Status = STATUS_CANCELLED;
-				irp->IoStatus.Information = 0;
-				IoCompleteRequest(irp, IO_NO_INCREMENT);
-			}
+			/* cancel_urbr() takes care of it */
+			if (!valid_irp)
+				continue;
 		}
-		RemoveEntryListInit(&urbr_local->list_state);
+
+		RemoveEntryListInit(&urbr_local->list_ep);
 		RemoveEntryListInit(&urbr_local->list_all);
-		free_urbr(urbr_local);
+		RemoveEntryListInit(&urbr_local->list_state);
+		InsertTailList(&head_aborted, &urbr_local->list_state);
 	}
 
 	KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
+	while (!IsListEmpty(&head_aborted)) {
+		struct urb_req	*urbr_local;
+		PIRP	irp;
+
+		urbr_local = CONTAINING_RECORD(RemoveHeadList(&head_aborted), struct urb_req, list_state);
+		InitializeListHead(&urbr_local->list_state);
+
+		DBGI(DBG_IOCTL, "aborted urbr removed: %s\n", dbg_urbr(urbr_local));
+
+		irp = urbr_local->irp;
+		if (irp) {
+			irp->IoStatus.Status = STATUS_CANCELLED;
+			irp->IoStatus.Information = 0;
+			IoCompleteRequest(irp, IO_NO_INCREMENT);
+		}
+
+		/* a pending urbr has no sequence number, and a server never saw it */
+		if (urbr_local->seq_num == 0) {
+			free_urbr(urbr_local);
+			continue;
+		}
+		urbr_local->irp = NULL;
+		urbr_local->seq_num_unlink = urbr_local->seq_num;
+		urbr_local->seq_num = 0;
+		InsertTailList(&head_unlink, &urbr_local->list_state);
+	}
+
+	submit_urbrs_unlink(vpdo, &head_unlink);
+
 	return STATUS_SUCCESS;
 }
 
@@ -60,9 +96,8 @@ static NTSTATUS
 process_urb_get_frame(pvpdo_dev_t vpdo, PURB urb)
 {
 	struct _URB_GET_CURRENT_FRAME_NUMBER	*urb_get = &urb->UrbGetCurrentFrameNumber;
-	UNREFERENCED_PARAMETER(vpdo);
 
-	urb_get->FrameNumber = 0;
+	urb_get->FrameNumber = vpdo_get_frame(vpdo);
 	return STATUS_SUCCESS;
 }
 
@@ -110,13 +145,16 @@ process_irp_urb_req(pvpdo_dev_t vpdo, PIRP irp, PURB urb)
 	case URB_FUNCTION_VENDOR_INTERFACE:
 	case URB_FUNCTION_VENDOR_ENDPOINT:
 	case URB_FUNCTION_VENDOR_OTHER:
-	case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
-	case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
 	case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
 	case URB_FUNCTION_SELECT_INTERFACE:
 	case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
+		return submit_urbr_irp(vpdo, irp);
+	case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+	case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
 	case URB_FUNCTION_CONTROL_TRANSFER:
 	case URB_FUNCTION_CONTROL_TRANSFER_EX:
+		if (vpdo_get_dsc_from_cache(vpdo, urb))
+			return STATUS_SUCCESS;
 		return submit_urbr_irp(vpdo, irp);
 	default:
 		DBGW(DBG_IOCTL, "process_irp_urb_req: unhandled function: %s: len: %d\n",
@@ -175,6 +213,8 @@ vhci_internal_ioctl(__in PDEVICE_OBJECT devobj, __in PIRP Irp)
 		*(unsigned long *)irpStack->Parameters.Others.Argument1 = USBD_PORT_ENABLED | USBD_PORT_CONNECTED;
 		break;
 	case IOCTL_INTERNAL_USB_RESET_PORT:
+		/* a device may come back with other descriptors */
+		dsc_cache_clear(&vpdo->dsc_cache);
 		status = submit_urbr_irp(vpdo, Irp);
 		break;
 	case IOCTL_INTERNAL_USB_GET_TOPOLOGY_ADDRESS:
@@ -3,7 +3,7 @@
 #include "vhci_dev.h"
 
 extern NTSTATUS
-vhci_ioctl_vhci(pvhci_dev_t vhci, PIO_STACK_LOCATION irpstack, ULONG ioctl_code, PVOID buffer, ULONG inlen, ULONG *poutlen);
+vhci_ioctl_vhci(pvhci_dev_t vhci, PIRP irp, ULONG ioctl_code, PVOID buffer, ULONG inlen, ULONG *poutlen);
 extern  NTSTATUS
 vhci_ioctl_vhub(pvhub_dev_t vhub, PIRP irp, ULONG ioctl_code, PVOID buffer, ULONG inlen, ULONG *poutlen);
 
@@ -37,7 +37,7 @@ vhci_ioctl(__in PDEVICE_OBJECT devobj, __in PIRP irp)
 
 	switch (DEVOBJ_VDEV_TYPE(devobj)) {
 	case VDEV_VHCI:
-		status = vhci_ioctl_vhci(DEVOBJ_TO_VHCI(devobj), irpstack, ioctl_code, buffer, inlen, &outlen);
+		status = vhci_ioctl_vhci(DEVOBJ_TO_VHCI(devobj), irp, ioctl_code, buffer, inlen, &outlen);
 		break;
 	case VDEV_VHUB:
 		status = vhci_ioctl_vhub(DEVOBJ_TO_VHUB(devobj), irp, ioctl_code, buffer, inlen, &outlen);
@@ -48,7 +48,9 @@ vhci_ioctl(__in PDEVICE_OBJECT devobj, __in PIRP irp)
 		break;
 	}
 
-	irp->IoStatus.Information = outlen;
+	/* a pending irp may have been completed already */
+	if (status != STATUS_PENDING)
+		irp->IoStatus.Information = outlen;
 END:
 	if (status != STATUS_PENDING) {
 		irp->IoStatus.Status = status;
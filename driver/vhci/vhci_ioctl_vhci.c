@@ -6,8 +6,9 @@
 #include "usbip_vhci_api.h"
 #include "vhci_pnp.h"
 
-extern NTSTATUS vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE_OBJECT fo);
+extern NTSTATUS vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE_OBJECT fo, PULONG pport);
 extern NTSTATUS vhub_get_ports_status(pvhub_dev_t vhub, ioctl_usbip_vhci_get_ports_status *st);
+extern NTSTATUS vhub_get_ports_status_ex(pvhub_dev_t vhub, ioctl_usbip_vhci_get_ports_status_ex *st, PULONG poutlen);
 extern NTSTATUS vhub_get_imported_devs(pvhub_dev_t vhub, pioctl_usbip_vhci_imported_dev_t idevs, PULONG poutlen);
 extern NTSTATUS vhci_ioctl_user_request(pvhci_dev_t vhci, PVOID buffer, ULONG inlen, PULONG poutlen);
 
@@ -83,26 +84,70 @@ vhub_get_roothub_name(pvhub_dev_t vhub, PVOID buffer, ULONG inlen, PULONG poutle
 	return STATUS_SUCCESS;
 }
 
+/* a plugged port goes to an output buffer if any, which overlaps pluginfo */
+static PAGEABLE NTSTATUS
+plugin_vpdo(pvhci_dev_t vhci, PIO_STACK_LOCATION irpstack, PVOID buffer, ULONG inlen, PULONG poutlen)
+{
+	ULONG	port;
+	NTSTATUS	status;
+
+	status = vhci_plugin_vpdo(vhci, (pvhci_pluginfo_t)buffer, inlen, irpstack->FileObject, &port);
+	if (NT_SUCCESS(status) && *poutlen >= sizeof(ULONG)) {
+		*(PULONG)buffer = port;
+		*poutlen = sizeof(ULONG);
+	}
+	else
+		*poutlen = 0;
+	return status;
+}
+
+static PAGEABLE NTSTATUS
+unplug_vpdo(pvhci_dev_t vhci, PVOID buffer, ULONG inlen)
+{
+	if (inlen == sizeof(ioctl_usbip_vhci_unplug))
+		return vhci_unplug_port(vhci, ((ioctl_usbip_vhci_unplug *)buffer)->addr);
+	if (inlen == sizeof(ioctl_usbip_vhci_unplug_ex) && ((ioctl_usbip_vhci_unplug_ex *)buffer)->size == inlen)
+		return vhci_unplug_port(vhci, ((ioctl_usbip_vhci_unplug_ex *)buffer)->port);
+	return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+static NTSTATUS
+get_port_events(pvhci_dev_t vhci, PIRP irp, ULONG inlen, PULONG poutlen)
+{
+	pvhub_dev_t	vhub = VHUB_FROM_VHCI(vhci);
+
+	if (vhub == NULL) {
+		*poutlen = 0;
+		return STATUS_NO_SUCH_DEVICE;
+	}
+	return vhub_get_port_events(vhub, irp, inlen, poutlen);
+}
+
 PAGEABLE NTSTATUS
-vhci_ioctl_vhci(pvhci_dev_t vhci, PIO_STACK_LOCATION irpstack, ULONG ioctl_code, PVOID buffer, ULONG inlen, ULONG *poutlen)
+vhci_ioctl_vhci(pvhci_dev_t vhci, PIRP irp, ULONG ioctl_code, PVOID buffer, ULONG inlen, ULONG *poutlen)
 {
+	PIO_STACK_LOCATION	irpstack = IoGetCurrentIrpStackLocation(irp);
 	NTSTATUS	status = STATUS_INVALID_DEVICE_REQUEST;
 
 	switch (ioctl_code) {
 	case IOCTL_USBIP_VHCI_PLUGIN_HARDWARE:
-		status = vhci_plugin_vpdo(vhci, (pvhci_pluginfo_t)buffer, inlen, irpstack->FileObject);
-		*poutlen = 0;
+		status = plugin_vpdo(vhci, irpstack, buffer, inlen, poutlen);
 		break;
 	case IOCTL_USBIP_VHCI_GET_PORTS_STATUS:
 		if (*poutlen == sizeof(ioctl_usbip_vhci_get_ports_status))
 			status = vhub_get_ports_status(VHUB_FROM_VHCI(vhci), (ioctl_usbip_vhci_get_ports_status *)buffer);
 		break;
+	case IOCTL_USBIP_VHCI_GET_PORTS_STATUS_EX:
+		status = vhub_get_ports_status_ex(VHUB_FROM_VHCI(vhci), (ioctl_usbip_vhci_get_ports_status_ex *)buffer, poutlen);
+		break;
+	case IOCTL_USBIP_VHCI_GET_PORT_EVENTS:
+		status = get_port_events(vhci, irp, inlen, poutlen);
+		break;
 	case IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES:
 		status = vhub_get_imported_devs(VHUB_FROM_VHCI(vhci), (pioctl_usbip_vhci_imported_dev_t)buffer, poutlen);
 		break;
 	case IOCTL_USBIP_VHCI_UNPLUG_HARDWARE:
-		if (inlen == sizeof(ioctl_usbip_vhci_unplug))
-			status = vhci_unplug_port(vhci, ((ioctl_usbip_vhci_unplug *)buffer)->addr);
+		status = unplug_vpdo(vhci, buffer, inlen);
 		*poutlen = 0;
 		break;
 	case IOCTL_GET_HCD_DRIVERKEY_NAME:
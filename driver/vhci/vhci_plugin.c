@@ -9,7 +9,8 @@
 #include "usb_util.h"
 #include "usbip_proto.h"
 
-extern BOOLEAN vhub_is_empty_port(pvhub_dev_t vhub, ULONG port);
+extern LONG vhub_reserve_port(pvhub_dev_t vhub, LONG port);
+extern void vhub_release_port(pvhub_dev_t vhub, LONG port);
 extern void vhub_attach_vpdo(pvhub_dev_t vhub, pvpdo_dev_t vpdo);
 
 extern void vhub_mark_unplugged_all_vpdos(pvhub_dev_t vhub);
@@ -17,6 +18,8 @@ extern void vhub_mark_unplugged_all_vpdos(pvhub_dev_t vhub);
 static PAGEABLE void
 vhci_init_vpdo(pvpdo_dev_t vpdo)
 {
+	int	i;
+
 	PAGED_CODE();
 
 	DBGI(DBG_PNP, "vhci_init_vpdo: 0x%p\n", vpdo);
@@ -35,7 +38,10 @@ vhci_init_vpdo(pvpdo_dev_t vpdo)
 	InitializeListHead(&vpdo->head_urbr);
 	InitializeListHead(&vpdo->head_urbr_pending);
 	InitializeListHead(&vpdo->head_urbr_sent);
+	for (i = 0; i < N_URBR_EPS; i++)
+		InitializeListHead(&vpdo->head_urbr_ep[i]);
 	KeInitializeSpinLock(&vpdo->lock_urbr);
+	vpdo_init_frame_clock(vpdo);
 
 	TO_DEVOBJ(vpdo)->Flags |= DO_POWER_PAGABLE|DO_DIRECT_IO;
 
@@ -101,12 +107,28 @@ setup_vpdo_with_dsc_conf(pvpdo_dev_t vpdo, PUSB_CONFIGURATION_DESCRIPTOR dsc_con
 	}
 }
 
+/* descriptors in pluginfo are known to be complete */
+static void
+setup_vpdo_dsc_cache(pvpdo_dev_t vpdo, pvhci_pluginfo_t pluginfo, ULONG inlen)
+{
+	PUSB_CONFIGURATION_DESCRIPTOR	dsc_conf = (PUSB_CONFIGURATION_DESCRIPTOR)pluginfo->dscr_conf;
+	ULONG	len_base = (ULONG)VHCI_PLUGINFO_SIZE(dsc_conf->wTotalLength);
+
+	dsc_cache_init(&vpdo->dsc_cache);
+	dsc_cache_store_full(&vpdo->dsc_cache, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, pluginfo->dscr_dev, sizeof(pluginfo->dscr_dev));
+	dsc_cache_store_full(&vpdo->dsc_cache, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, dsc_conf, dsc_conf->wTotalLength);
+	/* descriptors persisted by a client from a former attach */
+	dsc_cache_store_records(&vpdo->dsc_cache, (PUCHAR)pluginfo + len_base, inlen - len_base);
+}
+
 PAGEABLE NTSTATUS
-vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE_OBJECT fo)
+vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE_OBJECT fo, PULONG pport)
 {
+	pvhub_dev_t	vhub = VHUB_FROM_VHCI(vhci);
 	PDEVICE_OBJECT	devobj;
 	pvpdo_dev_t	vpdo, devpdo_old;
 	PUSHORT		pdscr_fullsize;
+	LONG		port;
 
 	PAGED_CODE();
 
@@ -115,24 +137,32 @@ vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE
 		return STATUS_INVALID_PARAMETER;
 	}
 	pdscr_fullsize = (PUSHORT)pluginfo->dscr_conf + 1;
-	if (inlen != sizeof(vhci_pluginfo_t) + *pdscr_fullsize - 9) {
-		DBGE(DBG_IOCTL, "invalid pluginfo format: %lld != %lld", inlen, sizeof(vhci_pluginfo_t) + *pdscr_fullsize - 9);
+	if (inlen < VHCI_PLUGINFO_SIZE(*pdscr_fullsize)) {
+		DBGE(DBG_IOCTL, "invalid pluginfo format: %lld < %lld", inlen, VHCI_PLUGINFO_SIZE(*pdscr_fullsize));
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	DBGI(DBG_VPDO, "Plugin vpdo: port: %hhd\n", pluginfo->port);
+	DBGI(DBG_VPDO, "Plugin vpdo: port: %d\n", pluginfo->port);
 
-	if (pluginfo->port < 0)
-		return STATUS_INVALID_PARAMETER;
+	if (vhub == NULL) {
+		DBGI(DBG_VPDO, "vhub has gone\n");
+		return STATUS_NO_SUCH_DEVICE;
+	}
 
-	if (!vhub_is_empty_port(VHUB_FROM_VHCI(vhci), pluginfo->port))
+	/* -1 for any free port */
+	port = vhub_reserve_port(vhub, pluginfo->port);
+	if (port < 0) {
+		DBGI(DBG_VPDO, "no port available: port: %d\n", pluginfo->port);
 		return STATUS_INVALID_PARAMETER;
+	}
 
-	if ((devobj = vdev_create(TO_DEVOBJ(vhci)->DriverObject, VDEV_VPDO)) == NULL)
+	if ((devobj = vdev_create(TO_DEVOBJ(vhci)->DriverObject, VDEV_VPDO)) == NULL) {
+		vhub_release_port(vhub, port);
 		return STATUS_UNSUCCESSFUL;
+	}
 
 	vpdo = DEVOBJ_TO_VPDO(devobj);
-	vpdo->common.parent = &VHUB_FROM_VHCI(vhci)->common;
+	vpdo->common.parent = &vhub->common;
 
 	setup_vpdo_with_dsc_dev(vpdo, (PUSB_DEVICE_DESCRIPTOR)pluginfo->dscr_dev);
 	setup_vpdo_with_dsc_conf(vpdo, (PUSB_CONFIGURATION_DESCRIPTOR)pluginfo->dscr_conf);
@@ -146,12 +176,15 @@ vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE
 	if (devpdo_old) {
 		DBGI(DBG_GENERAL, "you can't plugin again");
 		IoDeleteDevice(devobj);
+		vhub_release_port(vhub, port);
 		return STATUS_INVALID_PARAMETER;
 	}
-	vpdo->port = pluginfo->port;
+	vpdo->port = (ULONG)port;
 	vpdo->fo = fo;
 	vpdo->devid = pluginfo->devid;
 
+	setup_vpdo_dsc_cache(vpdo, pluginfo, inlen);
+
 	vhci_init_vpdo(vpdo);
 
 	// Device Relation changes if a new vpdo is created. So let
@@ -159,11 +192,14 @@ vhci_plugin_vpdo(pvhci_dev_t vhci, pvhci_pluginfo_t pluginfo, ULONG inlen, PFILE
 	// queries and cause the function driver to be loaded.
 	IoInvalidateDeviceRelations(vhci->common.pdo, BusRelations);
 
+	DBGI(DBG_VPDO, "vpdo plugged in: port: %u\n", vpdo->port);
+
+	*pport = vpdo->port;
 	return STATUS_SUCCESS;
 }
 
 PAGEABLE NTSTATUS
-vhci_unplug_port(pvhci_dev_t vhci, CHAR port)
+vhci_unplug_port(pvhci_dev_t vhci, LONG port)
 {
 	pvhub_dev_t	vhub = VHUB_FROM_VHCI(vhci);
 	pvpdo_dev_t	vpdo;
@@ -181,11 +217,11 @@ vhci_unplug_port(pvhci_dev_t vhci, CHAR port)
 		return STATUS_SUCCESS;
 	}
 
-	DBGI(DBG_PNP, "plugging out device: port: %u\n", port);
+	DBGI(DBG_PNP, "plugging out device: port: %d\n", port);
 
 	vpdo = vhub_find_vpdo(vhub, port);
 	if (vpdo == NULL) {
-		DBGI(DBG_PNP, "no matching vpdo: port: %u\n", port);
+		DBGI(DBG_PNP, "no matching vpdo: port: %d\n", port);
 		return STATUS_NO_SUCH_DEVICE;
 	}
 
@@ -2,7 +2,7 @@
 
 #include "vhci_pnp.h"
 
-#define MAX_HUB_PORTS		6
+extern NTSTATUS vhub_init_ports(pvhub_dev_t vhub, ULONG n_ports);
 
 static PAGEABLE BOOLEAN
 is_valid_vdev_hwid(PDEVICE_OBJECT devobj)
@@ -81,7 +81,7 @@ init_dev_vhci(pvdev_t vdev)
 	RtlUnicodeStringInitEx(&vhci->DevIntfUSBHC, NULL, STRSAFE_IGNORE_NULLS);
 }
 
-static PAGEABLE void
+static PAGEABLE NTSTATUS
 init_dev_vhub(pvdev_t vdev)
 {
 	pvhub_dev_t	vhub = (pvhub_dev_t)vdev;
@@ -95,7 +95,9 @@ init_dev_vhub(pvdev_t vdev)
 	// will be set when the OutstandingIO will become 0.
 	KeInitializeEvent(&vhub->RemoveEvent, SynchronizationEvent, FALSE);
 
-	vhub->n_max_ports = MAX_HUB_PORTS;
+	vhub_init_port_events(vhub);
+
+	return vhub_init_ports(vhub, vhub_n_ports);
 }
 
 static PAGEABLE NTSTATUS
@@ -103,6 +105,7 @@ add_vdev(__in PDRIVER_OBJECT drvobj, __in PDEVICE_OBJECT pdo, vdev_type_t type)
 {
 	PDEVICE_OBJECT	devobj;
 	pvdev_t		vdev;
+	NTSTATUS	status = STATUS_SUCCESS;
 
 	PAGED_CODE();
 
@@ -140,12 +143,20 @@ add_vdev(__in PDRIVER_OBJECT drvobj, __in PDEVICE_OBJECT pdo, vdev_type_t type)
 		init_dev_vhci(vdev);
 		break;
 	case VDEV_VHUB:
-		init_dev_vhub(vdev);
+		status = init_dev_vhub(vdev);
 		break;
 	default:
 		break;
 	}
 
+	if (NT_ERROR(status)) {
+		if (type != VDEV_ROOT)
+			DEVOBJ_TO_VDEV(pdo)->fdo = NULL;
+		IoDetachDevice(vdev->devobj_lower);
+		IoDeleteDevice(devobj);
+		return status;
+	}
+
 	DBGI(DBG_PNP, "%s added: vdev: %p\n", dbg_vdev_type(type), vdev);
 
 	// We are done with initializing, so let's indicate that and return.
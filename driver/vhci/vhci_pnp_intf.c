@@ -59,11 +59,19 @@ SubmitIsoOutUrb(IN PVOID context, IN PURB urb)
 static NTSTATUS USB_BUSIFFN
 QueryBusTime(IN PVOID context, IN OUT PULONG currentusbframe)
 {
-	UNREFERENCED_PARAMETER(context);
-	UNREFERENCED_PARAMETER(currentusbframe);
+	pvpdo_dev_t	vpdo = context;
 
-	DBGI(DBG_GENERAL, "QueryBusTime called\n");
-	return STATUS_UNSUCCESSFUL;
+	*currentusbframe = vpdo_get_frame(vpdo);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS USB_BUSIFFN
+QueryBusTimeEx(IN PVOID context, OUT PULONG HighSpeedFrameCounter)
+{
+	pvpdo_dev_t	vpdo = context;
+
+	*HighSpeedFrameCounter = vpdo_get_microframe(vpdo);
+	return STATUS_SUCCESS;
 }
 
 static VOID USB_BUSIFFN
@@ -133,7 +141,7 @@ query_interface_usbdi(pvpdo_dev_t vpdo, USHORT size, USHORT version, PINTERFACE
 	switch (version) {
 	case USB_BUSIF_USBDI_VERSION_3:
 		bus_intf->QueryControllerType = QueryControllerType;
-		bus_intf->QueryBusTimeEx = NULL;
+		bus_intf->QueryBusTimeEx = QueryBusTimeEx;
 		/* passthrough */
 	case USB_BUSIF_USBDI_VERSION_2:
 		bus_intf->EnumLogEntry = NULL;
@@ -8,6 +8,7 @@
 extern NTSTATUS dereg_wmi(pvhci_dev_t vhci);
 
 extern PAGEABLE void vhub_detach_vpdo(pvhub_dev_t vhub, pvpdo_dev_t vpdo);
+extern PAGEABLE void vhub_free_ports(pvhub_dev_t vhub);
 
 static PAGEABLE void
 complete_pending_read_irp(pvpdo_dev_t vpdo)
@@ -53,6 +54,7 @@ complete_pending_irp(pvpdo_dev_t vpdo)
 
 		RemoveEntryListInit(&urbr->list_all);
 		RemoveEntryListInit(&urbr->list_state);
+		RemoveEntryListInit(&urbr->list_ep);
 		/* FIMXE event */
 		KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
@@ -102,6 +104,8 @@ invalidate_vhub(pvhub_dev_t vhub)
 
 	/* At this point, vhub should has no vpdo. With this assumption, there's no need to remove all vpdos */
 	DBGI(DBG_PNP, "VHUB has no vpdos: current # of vpdos: %u\n", vhub->n_vpdos);
+	vhub_flush_port_events(vhub, NULL, STATUS_DEVICE_REMOVED);
+	vhub_free_ports(vhub);
 
 	DBGI(DBG_PNP, "invalidating vhub device object: 0x%p\n", TO_DEVOBJ(vhub));
 }
@@ -121,6 +125,8 @@ invalidate_vpdo(pvpdo_dev_t vpdo)
 		vpdo->winstid = NULL;
 	}
 
+	dsc_cache_clear(&vpdo->dsc_cache);
+
 	//FIXME
 	if (vpdo->fo) {
 		vpdo->fo->FsContext = NULL;
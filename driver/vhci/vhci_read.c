@@ -568,6 +568,7 @@ store_urb_iso(PIRP irp, PURB urb, struct urb_req *urbr)
 {
 	struct _URB_ISOCH_TRANSFER	*urb_iso = &urb->UrbIsochronousTransfer;
 	struct usbip_header	*hdr;
+	ULONG	flags, start_frame = 0;
 	int	in, type;
 
 	in = PIPE2DIRECT(urb_iso->PipeHandle);
@@ -582,10 +583,14 @@ store_urb_iso(PIRP irp, PURB urb, struct urb_req *urbr)
 		return STATUS_BUFFER_TOO_SMALL;
 	}
 
+	flags = urb_iso->TransferFlags | USBD_SHORT_TRANSFER_OK;
+	/* until the first ISO transfer completes, frames of a server are unknown */
+	if (!(flags & USBD_START_ISO_TRANSFER_ASAP) && !vpdo_frame_to_server(urbr->vpdo, urb_iso->StartFrame, &start_frame))
+		flags |= USBD_START_ISO_TRANSFER_ASAP;
+
 	set_cmd_submit_usbip_header(hdr, urbr->seq_num, urbr->vpdo->devid,
-				    in, urb_iso->PipeHandle, urb_iso->TransferFlags | USBD_SHORT_TRANSFER_OK,
-				    urb_iso->TransferBufferLength);
-	hdr->u.cmd_submit.start_frame = urb_iso->StartFrame;
+				    in, urb_iso->PipeHandle, flags, urb_iso->TransferBufferLength);
+	hdr->u.cmd_submit.start_frame = start_frame;
 	hdr->u.cmd_submit.number_of_packets = urb_iso->NumberOfPackets;
 
 	irp->IoStatus.Information = sizeof(struct usbip_header);
@@ -966,6 +971,7 @@ process_read_irp(pvpdo_dev_t vpdo, PIRP read_irp)
 
 	if (status != STATUS_SUCCESS) {
 		RemoveEntryListInit(&urbr->list_all);
+		RemoveEntryListInit(&urbr->list_ep);
 		KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
 		PIRP irp = urbr->irp;
@@ -3,54 +3,105 @@
 #include "vhci_dev.h"
 #include "usbip_vhci_api.h"
 
+/* MaxPorts of a Parameters key */
+ULONG	vhub_n_ports = VHUB_DEFAULT_PORTS;
+
+/* a table of vpdo's and a stack of free ports share an allocation */
+PAGEABLE NTSTATUS
+vhub_init_ports(pvhub_dev_t vhub, ULONG n_ports)
+{
+	SIZE_T	size_vpdos = sizeof(pvpdo_dev_t) * n_ports;
+
+	vhub->vpdos = ExAllocatePoolWithTag(NonPagedPool, size_vpdos + PORT_ALLOC_MEMSIZE(n_ports), USBIP_VHCI_POOL_TAG);
+	if (vhub->vpdos == NULL) {
+		DBGE(DBG_VHUB, "failed to allocate ports: out of memory\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(vhub->vpdos, size_vpdos);
+	port_alloc_init(&vhub->ports, n_ports, (PUCHAR)vhub->vpdos + size_vpdos);
+	vhub->n_max_ports = n_ports;
+
+	DBGI(DBG_VHUB, "ports: %u\n", n_ports);
+	return STATUS_SUCCESS;
+}
+
+PAGEABLE void
+vhub_free_ports(pvhub_dev_t vhub)
+{
+	if (vhub->vpdos != NULL) {
+		ExFreePoolWithTag(vhub->vpdos, USBIP_VHCI_POOL_TAG);
+		vhub->vpdos = NULL;
+	}
+	vhub->n_max_ports = 0;
+}
+
 PAGEABLE pvpdo_dev_t
 vhub_find_vpdo(pvhub_dev_t vhub, unsigned port)
 {
-	PLIST_ENTRY	entry;
+	pvpdo_dev_t	vpdo = NULL;
 
 	ExAcquireFastMutex(&vhub->Mutex);
 
-	for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
-		pvpdo_dev_t	vpdo = CONTAINING_RECORD(entry, vpdo_dev_t, Link);
-
-		if (vpdo->port == port) {
+	if (port < vhub->n_max_ports) {
+		vpdo = vhub->vpdos[port];
+		if (vpdo != NULL)
 			vdev_add_ref((pvdev_t)vpdo);
-			ExReleaseFastMutex(&vhub->Mutex);
-			return vpdo;
-		}
 	}
 
 	ExReleaseFastMutex(&vhub->Mutex);
 
-	return NULL;
+	return vpdo;
 }
 
-PAGEABLE BOOLEAN
-vhub_is_empty_port(pvhub_dev_t vhub, ULONG port)
+/*
+ * A port is reserved for a vpdo to be plugged in, or any free port if port is -1.
+ * A port of a surprise-removed vpdo may be reserved again. Returns -1 if none.
+ */
+PAGEABLE LONG
+vhub_reserve_port(pvhub_dev_t vhub, LONG port)
 {
-	pvpdo_dev_t	vpdo;
+	ExAcquireFastMutex(&vhub->Mutex);
 
-	vpdo = vhub_find_vpdo(vhub, port);
-	if (vpdo == NULL)
-		return TRUE;
-	if (vpdo->common.DevicePnPState == SurpriseRemovePending) {
-		vdev_del_ref((pvdev_t)vpdo);
-		return TRUE;
+	if (port < 0)
+		port = port_alloc_get(&vhub->ports);
+	else if ((ULONG)port >= vhub->n_max_ports)
+		port = -1;
+	else if (!port_alloc_take(&vhub->ports, port)) {
+		pvpdo_dev_t	vpdo = vhub->vpdos[port];
+
+		/* it will not put a port back when it goes away */
+		if (vpdo != NULL && vpdo->common.DevicePnPState == SurpriseRemovePending)
+			vhub->vpdos[port] = NULL;
+		else
+			port = -1;
 	}
 
-	vdev_del_ref((pvdev_t)vpdo);
-	return FALSE;
+	ExReleaseFastMutex(&vhub->Mutex);
+
+	return port;
+}
+
+/* a reserved port, for which no vpdo has been attached */
+PAGEABLE void
+vhub_release_port(pvhub_dev_t vhub, LONG port)
+{
+	ExAcquireFastMutex(&vhub->Mutex);
+	port_alloc_put(&vhub->ports, port);
+	ExReleaseFastMutex(&vhub->Mutex);
 }
 
+/* vpdo->port should have been reserved */
 PAGEABLE void
 vhub_attach_vpdo(pvhub_dev_t vhub, pvpdo_dev_t vpdo)
 {
 	ExAcquireFastMutex(&vhub->Mutex);
 
 	InsertTailList(&vhub->head_vpdo, &vpdo->Link);
+	vhub->vpdos[vpdo->port] = vpdo;
 	vhub->n_vpdos++;
 	if (vpdo->plugged)
 		vhub->n_vpdos_plugged++;
+	vhub_post_port_event(vhub, VHCI_PORT_EV_PLUGGED, vpdo);
 
 	ExReleaseFastMutex(&vhub->Mutex);
 }
@@ -62,6 +113,12 @@ vhub_detach_vpdo(pvhub_dev_t vhub, pvpdo_dev_t vpdo)
 
 	RemoveEntryList(&vpdo->Link);
 	InitializeListHead(&vpdo->Link);
+	/* a port may have been taken over by a new vpdo */
+	if (vhub->vpdos[vpdo->port] == vpdo) {
+		vhub->vpdos[vpdo->port] = NULL;
+		port_alloc_put(&vhub->ports, vpdo->port);
+		vhub_post_port_event(vhub, VHCI_PORT_EV_REMOVED, vpdo);
+	}
 	ASSERT(vhub->n_vpdos > 0);
 	vhub->n_vpdos--;
 
@@ -73,7 +130,11 @@ vhub_get_hub_descriptor(pvhub_dev_t vhub, PUSB_HUB_DESCRIPTOR pdesc)
 {
 	pdesc->bDescriptorLength = 9;
 	pdesc->bDescriptorType = 0x29;
-	pdesc->bNumberOfPorts = (UCHAR)vhub->n_max_ports;
+	/*
+	 * a hub descriptor counts ports in a byte. Ports above 255 are not in it,
+	 * but vpdo's on them are still enumerated as children of vhub.
+	 */
+	pdesc->bNumberOfPorts = (UCHAR)min(vhub->n_max_ports, 255);
 	pdesc->wHubCharacteristics = 0;
 	pdesc->bPowerOnToPowerGood = 1;
 	pdesc->bHubControlCurrent = 1;
@@ -83,7 +144,7 @@ PAGEABLE NTSTATUS
 vhub_get_information_ex(pvhub_dev_t vhub, PUSB_HUB_INFORMATION_EX pinfo)
 {
 	pinfo->HubType = UsbRootHub;
-	pinfo->HighestPortNumber = (USHORT)vhub->n_max_ports;
+	pinfo->HighestPortNumber = (USHORT)min(vhub->n_max_ports, 255);
 
 	vhub_get_hub_descriptor(vhub, &pinfo->u.UsbHubDescriptor);
 
@@ -140,6 +201,7 @@ mark_unplugged_vpdo(pvhub_dev_t vhub, pvpdo_dev_t vpdo)
 		vhub->n_vpdos_plugged--;
 
 		IoInvalidateDeviceRelations(vhub->common.pdo, BusRelations);
+		vhub_post_port_event(vhub, VHCI_PORT_EV_UNPLUGGED, vpdo);
 
 		DBGI(DBG_VPDO, "the device is marked as unplugged: port: %u\n", vpdo->port);
 	}
@@ -174,8 +236,7 @@ vhub_mark_unplugged_all_vpdos(pvhub_dev_t vhub)
 PAGEABLE NTSTATUS
 vhub_get_ports_status(pvhub_dev_t vhub, ioctl_usbip_vhci_get_ports_status *st)
 {
-	pvpdo_dev_t	vpdo;
-	PLIST_ENTRY	entry;
+	ULONG	n_ports, i;
 
 	PAGED_CODE();
 
@@ -184,17 +245,56 @@ vhub_get_ports_status(pvhub_dev_t vhub, ioctl_usbip_vhci_get_ports_status *st)
 	RtlZeroMemory(st, sizeof(*st));
 	ExAcquireFastMutex(&vhub->Mutex);
 
-	for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
-		vpdo = CONTAINING_RECORD (entry, vpdo_dev_t, Link);
-		if (vpdo->port >= 127) {
-			DBGE(DBG_VHUB, "strange port");
-			continue;
-		}
-		st->port_status[vpdo->port] = 1;
+	n_ports = min(vhub->n_max_ports, sizeof(st->port_status));
+	for (i = 0; i < n_ports; i++) {
+		if (!port_alloc_is_free(&vhub->ports, i))
+			st->port_status[i] = 1;
 	}
 	ExReleaseFastMutex(&vhub->Mutex);
 
-	st->n_max_ports = 127;
+	st->n_max_ports = (UCHAR)n_ports;
+	return STATUS_SUCCESS;
+}
+
+PAGEABLE NTSTATUS
+vhub_get_ports_status_ex(pvhub_dev_t vhub, ioctl_usbip_vhci_get_ports_status_ex *st, PULONG poutlen)
+{
+	ULONG	len_hdr = (ULONG)VHCI_PORTS_STATUS_EX_SIZE(0);
+	ULONG	size, i;
+
+	PAGED_CODE();
+
+	DBGI(DBG_VHUB, "get ports status ex\n");
+
+	if (*poutlen < len_hdr) {
+		*poutlen = 0;
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	ExAcquireFastMutex(&vhub->Mutex);
+
+	size = (ULONG)VHCI_PORTS_STATUS_EX_SIZE(vhub->n_max_ports);
+	st->size = size;
+	st->version = VHCI_PORTS_STATUS_VERSION;
+	st->n_max_ports = vhub->n_max_ports;
+	st->n_used_ports = vhub->n_max_ports - vhub->ports.n_free;
+	st->free_port = port_alloc_peek(&vhub->ports);
+
+	if (*poutlen < size) {
+		ExReleaseFastMutex(&vhub->Mutex);
+		*poutlen = len_hdr;
+		return STATUS_BUFFER_OVERFLOW;
+	}
+
+	RtlZeroMemory(st->port_status, size - len_hdr);
+	for (i = 0; i < vhub->n_max_ports; i++) {
+		if (!port_alloc_is_free(&vhub->ports, i))
+			st->port_status[i / 8] |= (UCHAR)(1 << (i % 8));
+	}
+
+	ExReleaseFastMutex(&vhub->Mutex);
+
+	*poutlen = size;
 	return STATUS_SUCCESS;
 }
 
@@ -203,7 +303,7 @@ vhub_get_imported_devs(pvhub_dev_t vhub, pioctl_usbip_vhci_imported_dev_t idevs,
 {
 	pioctl_usbip_vhci_imported_dev_t	idev = idevs;
 	ULONG	n_idevs_max;
-	unsigned char	n_used_ports = 0;
+	ULONG	n_used_ports = 0;
 	PLIST_ENTRY	entry;
 
 	PAGED_CODE();
@@ -223,7 +323,7 @@ vhub_get_imported_devs(pvhub_dev_t vhub, pioctl_usbip_vhci_imported_dev_t idevs,
 			break;
 		vpdo = CONTAINING_RECORD(entry, vpdo_dev_t, Link);
 
-		idev->port = (CHAR)(vpdo->port);
+		idev->port = (int)vpdo->port;
 		idev->status = 2; /* SDEV_ST_USED */;
 		idev->vendor = vpdo->vendor;
 		idev->product = vpdo->product;
@@ -235,7 +335,7 @@ vhub_get_imported_devs(pvhub_dev_t vhub, pioctl_usbip_vhci_imported_dev_t idevs,
 
 	ExReleaseFastMutex(&vhub->Mutex);
 
-	idev->port = 0xff; /* end of mark */
+	idev->port = -1; /* end of mark */
 
 	return STATUS_SUCCESS;
 }
@@ -27,6 +27,44 @@ req_fetch_dsc(pvpdo_dev_t vpdo, PIRP irp)
 	return irp_done(irp, status);
 }
 
+/* setup packet of a descriptor request from a node connection, which is built as vhci_read does */
+static void
+build_nodeconn_cspkt(usb_cspkt_t *csp, PUSB_DESCRIPTOR_REQUEST dsc_req, ULONG outlen)
+{
+	build_setup_packet(csp, BMREQUEST_DEVICE_TO_HOST, BMREQUEST_STANDARD, BMREQUEST_TO_DEVICE, USB_REQUEST_GET_DESCRIPTOR);
+	csp->wValue.W = dsc_req->SetupPacket.wValue;
+	csp->wIndex.W = dsc_req->SetupPacket.wIndex;
+	csp->wLength = dsc_req->SetupPacket.wLength;
+	if (csp->wLength > outlen - sizeof(USB_DESCRIPTOR_REQUEST))
+		csp->wLength = (USHORT)(outlen - sizeof(USB_DESCRIPTOR_REQUEST));
+}
+
+static BOOLEAN
+get_dsc_from_cache_nodeconn(pvpdo_dev_t vpdo, PUSB_DESCRIPTOR_REQUEST dsc_req, PULONG psize)
+{
+	usb_cspkt_t	csp;
+	ULONG	len;
+
+	if (*psize < sizeof(USB_DESCRIPTOR_REQUEST))
+		return FALSE;
+	build_nodeconn_cspkt(&csp, dsc_req, *psize);
+	if (!dsc_cache_lookup(&vpdo->dsc_cache, &csp, dsc_req->Data, &len))
+		return FALSE;
+	*psize = sizeof(USB_DESCRIPTOR_REQUEST) + len;
+	return TRUE;
+}
+
+void
+vpdo_cache_dsc_from_nodeconn(pvpdo_dev_t vpdo, PUSB_DESCRIPTOR_REQUEST dsc_req, ULONG outlen, PVOID dsc, ULONG len)
+{
+	usb_cspkt_t	csp;
+
+	if (outlen < sizeof(USB_DESCRIPTOR_REQUEST))
+		return;
+	build_nodeconn_cspkt(&csp, dsc_req, outlen);
+	dsc_cache_store(&vpdo->dsc_cache, &csp, dsc, len);
+}
+
 PAGEABLE NTSTATUS
 vpdo_get_dsc_from_nodeconn(pvpdo_dev_t vpdo, PIRP irp, PUSB_DESCRIPTOR_REQUEST dsc_req, PULONG psize)
 {
@@ -47,7 +85,10 @@ vpdo_get_dsc_from_nodeconn(pvpdo_dev_t vpdo, PIRP irp, PUSB_DESCRIPTOR_REQUEST d
 			dsc_len = vpdo->dsc_conf->wTotalLength;
 		break;
 	case USB_STRING_DESCRIPTOR_TYPE:
-		status = req_fetch_dsc(vpdo, irp);
+		if (get_dsc_from_cache_nodeconn(vpdo, dsc_req, psize))
+			status = STATUS_SUCCESS;
+		else
+			status = req_fetch_dsc(vpdo, irp);
 		break;
 	default:
 		DBGE(DBG_GENERAL, "unhandled descriptor type: %s\n", dbg_usb_descriptor_type(csp->wValue.HiByte));
@@ -134,3 +175,95 @@ try_to_cache_descriptor(pvpdo_dev_t vpdo, struct _URB_CONTROL_DESCRIPTOR_REQUEST
 		break;
 	}
 }
+
+/*
+ * setup packet of a descriptor request urb, which is built as vhci_read does.
+ * Returns FALSE if the urb is not for a cacheable descriptor.
+ */
+BOOLEAN
+get_dsc_cspkt(PURB urb, usb_cspkt_t *csp)
+{
+	struct _URB_CONTROL_DESCRIPTOR_REQUEST	*urb_cdr = &urb->UrbControlDescriptorRequest;
+	ULONG	len;
+
+	switch (urb->UrbHeader.Function) {
+	case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+		build_setup_packet(csp, USBIP_DIR_IN, BMREQUEST_STANDARD, BMREQUEST_TO_DEVICE, USB_REQUEST_GET_DESCRIPTOR);
+		csp->wIndex.W = urb_cdr->DescriptorType == USB_STRING_DESCRIPTOR_TYPE ? urb_cdr->LanguageId: 0;
+		break;
+	case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+		build_setup_packet(csp, USBIP_DIR_IN, BMREQUEST_STANDARD, BMREQUEST_TO_INTERFACE, USB_REQUEST_GET_DESCRIPTOR);
+		csp->wIndex.W = urb_cdr->LanguageId;
+		break;
+	case URB_FUNCTION_CONTROL_TRANSFER:
+		RtlCopyMemory(csp, urb->UrbControlTransfer.SetupPacket, sizeof(usb_cspkt_t));
+		len = urb->UrbControlTransfer.TransferBufferLength;
+		if (csp->wLength > len)
+			csp->wLength = (USHORT)len;
+		return dsc_cache_is_cacheable(csp);
+	case URB_FUNCTION_CONTROL_TRANSFER_EX:
+		RtlCopyMemory(csp, urb->UrbControlTransferEx.SetupPacket, sizeof(usb_cspkt_t));
+		len = urb->UrbControlTransferEx.TransferBufferLength;
+		if (csp->wLength > len)
+			csp->wLength = (USHORT)len;
+		return dsc_cache_is_cacheable(csp);
+	default:
+		return FALSE;
+	}
+	csp->wLength = (USHORT)urb_cdr->TransferBufferLength;
+	csp->wValue.HiByte = urb_cdr->DescriptorType;
+	csp->wValue.LowByte = urb_cdr->Index;
+	return dsc_cache_is_cacheable(csp);
+}
+
+static PVOID
+get_urb_transfer_buf(PURB urb, PULONG *pplen)
+{
+	PVOID	buf;
+	PMDL	bufMDL;
+
+	switch (urb->UrbHeader.Function) {
+	case URB_FUNCTION_CONTROL_TRANSFER:
+		buf = urb->UrbControlTransfer.TransferBuffer;
+		bufMDL = urb->UrbControlTransfer.TransferBufferMDL;
+		*pplen = &urb->UrbControlTransfer.TransferBufferLength;
+		break;
+	case URB_FUNCTION_CONTROL_TRANSFER_EX:
+		buf = urb->UrbControlTransferEx.TransferBuffer;
+		bufMDL = urb->UrbControlTransferEx.TransferBufferMDL;
+		*pplen = &urb->UrbControlTransferEx.TransferBufferLength;
+		break;
+	default:
+		buf = urb->UrbControlDescriptorRequest.TransferBuffer;
+		bufMDL = urb->UrbControlDescriptorRequest.TransferBufferMDL;
+		*pplen = &urb->UrbControlDescriptorRequest.TransferBufferLength;
+		break;
+	}
+	if (buf == NULL && bufMDL != NULL)
+		buf = MmGetSystemAddressForMdlSafe(bufMDL, NormalPagePriority);
+	return buf;
+}
+
+/* completes a descriptor request urb from the cache of vpdo */
+BOOLEAN
+vpdo_get_dsc_from_cache(pvpdo_dev_t vpdo, PURB urb)
+{
+	usb_cspkt_t	csp;
+	PVOID	buf;
+	PULONG	plen;
+	ULONG	len;
+
+	if (!get_dsc_cspkt(urb, &csp))
+		return FALSE;
+	buf = get_urb_transfer_buf(urb, &plen);
+	if (buf == NULL)
+		return FALSE;
+	if (!dsc_cache_lookup(&vpdo->dsc_cache, &csp, buf, &len))
+		return FALSE;
+
+	DBGI(DBG_GENERAL, "descriptor from cache: %s: len: %u\n", dbg_usb_descriptor_type(csp.wValue.HiByte), len);
+
+	*plen = len;
+	urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
+	return TRUE;
+}
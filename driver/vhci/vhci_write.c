@@ -8,6 +8,10 @@ extern struct urb_req *
 find_sent_urbr(pvpdo_dev_t vpdo, struct usbip_header *hdr);
 extern NTSTATUS
 try_to_cache_descriptor(pvpdo_dev_t vpdo, struct _URB_CONTROL_DESCRIPTOR_REQUEST* urb_cdr, PUSB_COMMON_DESCRIPTOR dsc);
+extern BOOLEAN
+get_dsc_cspkt(PURB urb, usb_cspkt_t *csp);
+extern void
+vpdo_cache_dsc_from_nodeconn(pvpdo_dev_t vpdo, PUSB_DESCRIPTOR_REQUEST dsc_req, ULONG outlen, PVOID dsc, ULONG len);
 extern NTSTATUS
 vpdo_select_config(pvpdo_dev_t vpdo, struct _URB_SELECT_CONFIGURATION *urb_selc);
 extern NTSTATUS
@@ -291,6 +295,8 @@ store_urb_data(PURB urb, struct usbip_header *hdr)
 static NTSTATUS
 process_urb_res_submit(pvpdo_dev_t vpdo, PURB urb, struct usbip_header *hdr)
 {
+	usb_cspkt_t	csp;
+	BOOLEAN	is_dsc;
 	NTSTATUS	status;
 
 	if (urb == NULL)
@@ -305,8 +311,12 @@ process_urb_res_submit(pvpdo_dev_t vpdo, PURB urb, struct usbip_header *hdr)
 		return STATUS_UNSUCCESSFUL;
 	}
 
+	/* TransferBufferLength of urb will be overwritten */
+	is_dsc = get_dsc_cspkt(urb, &csp);
 	status = store_urb_data(urb, hdr);
 	if (status == STATUS_SUCCESS) {
+		if (is_dsc)
+			dsc_cache_store(&vpdo->dsc_cache, &csp, hdr + 1, hdr->u.ret_submit.actual_length);
 		switch (urb->UrbHeader.Function) {
 		case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
 		case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
@@ -319,6 +329,9 @@ process_urb_res_submit(pvpdo_dev_t vpdo, PURB urb, struct usbip_header *hdr)
 		case URB_FUNCTION_SELECT_INTERFACE:
 			status = post_select_interface(vpdo, urb);
 			break;
+		case URB_FUNCTION_ISOCH_TRANSFER:
+			vpdo_sync_frame(vpdo, &urb->UrbIsochronousTransfer, hdr->u.ret_submit.start_frame);
+			break;
 		default:
 			break;
 		}
@@ -336,17 +349,19 @@ process_urb_dsc_req(struct urb_req *urbr, struct usbip_header *hdr)
 	else {
 		PIO_STACK_LOCATION	irpstack;
 		PIRP	irp = urbr->irp;
+		PUSB_DESCRIPTOR_REQUEST	dsc_req = (PUSB_DESCRIPTOR_REQUEST)irp->AssociatedIrp.SystemBuffer;
 		ULONG	outlen;
 
 		irpstack = IoGetCurrentIrpStackLocation(irp);
 		outlen = irpstack->Parameters.DeviceIoControl.OutputBufferLength;
 
+		vpdo_cache_dsc_from_nodeconn(urbr->vpdo, dsc_req, outlen, hdr + 1, hdr->u.ret_submit.actual_length);
+
 		irp->IoStatus.Information = hdr->u.ret_submit.actual_length + sizeof(USB_DESCRIPTOR_REQUEST);
 		if (outlen < hdr->u.ret_submit.actual_length + sizeof(USB_DESCRIPTOR_REQUEST)) {
 			irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
 		}
 		else {
-			PUSB_DESCRIPTOR_REQUEST	dsc_req = (PUSB_DESCRIPTOR_REQUEST)urbr->irp->AssociatedIrp.SystemBuffer;
 			RtlCopyMemory(dsc_req->Data, hdr + 1, hdr->u.ret_submit.actual_length);
 			irp->IoStatus.Status = STATUS_SUCCESS;
 		}
@@ -3,6 +3,11 @@
 #include <ntddk.h>
 #include <wdf.h>
 
+#include "dsc_cache.h"
+#include "iso_jitter.h"
+#include "port_alloc.h"
+#include "port_event.h"
+
 EXTERN_C_START
 
 struct _ctx_vusb;
@@ -13,7 +18,12 @@ typedef struct
 	ULONG		n_max_ports;
 	WDFQUEUE	queue;
 	struct _ctx_vusb	**vusbs;
+	/* ports of which vusbs are NULL */
+	port_alloc_t	ports;
 	WDFSPINLOCK	spin_lock;
+	/* changes of ports, and IOCTL_USBIP_VHCI_GET_PORT_EVENTS requests waiting for them */
+	port_event_ring_t	events;
+	WDFQUEUE	queue_events;
 } ctx_vhci_t, *pctx_vhci_t;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ctx_vhci_t, TO_VHCI)
@@ -66,6 +76,8 @@ typedef struct _ctx_vusb
 	PSHORT		intf_altsettings;
 	/* a first value in configuration descriptor */
 	UCHAR		default_conf_value;
+	/* descriptors answered without a round trip to a device */
+	dsc_cache_t	dsc_cache;
 } ctx_vusb_t, *pctx_vusb_t;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ctx_vusb_t, TO_VUSB)
@@ -81,6 +93,10 @@ typedef struct _ctx_ep
 	UCHAR		intf_num, altsetting;
 	UDECXUSBENDPOINT	ude_ep;
 	WDFQUEUE	queue;
+	/* completed ISO IN urbr's held by a jitter buffer, which is off if timer_jitter is NULL */
+	WDFTIMER	timer_jitter;
+	iso_jitter_t	jitter;
+	LIST_ENTRY	head_urbr_held;
 } ctx_ep_t, *pctx_ep_t;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ctx_ep_t, TO_EP)
@@ -99,6 +115,9 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ctx_safe_vusb_t, TO_SAFE_VUSB)
 #define VUSB_DELETING	((pctx_vusb_t)1)
 #define VUSB_IS_VALID(vusb)	((vusb) != NULL && (vusb) != VUSB_CREATING && (vusb) != VUSB_DELETING)
 
-extern NTSTATUS plugout_vusb(pctx_vhci_t vhci, CHAR port);
+extern NTSTATUS plugout_vusb(pctx_vhci_t vhci, LONG port);
+
+extern VOID post_port_event(pctx_vhci_t vhci, USHORT type, ULONG port, pctx_vusb_t vusb);
+extern VOID flush_port_events(pctx_vhci_t vhci, WDFFILEOBJECT fo);
 
 EXTERN_C_END
@@ -23,6 +23,25 @@ driver_unload(_In_ WDFDRIVER drvobj)
 	WPP_CLEANUP(WdfDriverWdmGetDriverObject((WDFDRIVER)drvobj));
 }
 
+static INITABLE VOID
+read_parameters(WDFDRIVER drv)
+{
+	DECLARE_CONST_UNICODE_STRING(name_jitter_depth, L"IsoJitterDepth");
+	DECLARE_CONST_UNICODE_STRING(name_max_ports, L"MaxPorts");
+	WDFKEY	key;
+	ULONG	value;
+
+	if (NT_ERROR(WdfDriverOpenParametersRegistryKey(drv, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key)))
+		return;
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &name_jitter_depth, &value)))
+		iso_jitter_depth = value;
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &name_max_ports, &value)) && value >= 1 && value <= VHCI_MAX_PORTS)
+		vhci_n_ports = value;
+	WdfRegistryClose(key);
+
+	TRD(DRIVER, "iso jitter depth: %u, max ports: %u", iso_jitter_depth, vhci_n_ports);
+}
+
 DRIVER_INITIALIZE DriverEntry;
 
 INITABLE NTSTATUS
@@ -31,6 +50,7 @@ DriverEntry(_In_ PDRIVER_OBJECT drvobj, _In_ PUNICODE_STRING regpath)
 	WDF_DRIVER_CONFIG	conf;
 	NTSTATUS		status;
 	WDF_OBJECT_ATTRIBUTES	attrs;
+	WDFDRIVER	drv;
 
 	PAGED_CODE();
 	WPP_INIT_TRACING(drvobj, regpath);
@@ -44,13 +64,15 @@ DriverEntry(_In_ PDRIVER_OBJECT drvobj, _In_ PUNICODE_STRING regpath)
 	conf.DriverPoolTag = VHCI_POOLTAG;
 	conf.EvtDriverUnload = driver_unload;
 
-	status = WdfDriverCreate(drvobj, regpath, &attrs, &conf, WDF_NO_HANDLE);
+	status = WdfDriverCreate(drvobj, regpath, &attrs, &conf, &drv);
 	if (!NT_SUCCESS(status)) {
 		TRE(DRIVER, "WdfDriverCreate failed: %!STATUS!", status);
 		WPP_CLEANUP(drvobj);
 		return status;
 	}
 
+	read_parameters(drv);
+
 	TRD(DRIVER, "Leave: %!STATUS!", status);
 
 	return status;
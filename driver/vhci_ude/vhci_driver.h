@@ -18,4 +18,13 @@ EXTERN_C_START
 
 #define VHCI_POOLTAG	'ichv'
 
+/* IsoJitterDepth of a Parameters key */
+extern ULONG	iso_jitter_depth;
+
+#define VHCI_DEFAULT_PORTS	16
+/* ports of a root hub are numbered in a byte */
+#define VHCI_MAX_PORTS		255
+/* MaxPorts of a Parameters key */
+extern ULONG	vhci_n_ports;
+
 EXTERN_C_END
@@ -1,6 +1,7 @@
 #include "vhci_driver.h"
 #include "vhci_ep.tmh"
 #include "devconf.h"
+#include "vhci_urbr.h"
 
 extern WDFQUEUE
 create_queue_ep(pctx_ep_t ep);
@@ -30,6 +31,8 @@ ep_purge(_In_ UDECXUSBENDPOINT ude_ep)
 
 	TRD(VUSB, "Enter: ep->addr=0x%x", ep->addr);
 
+	release_ep_jitter(ep);
+
 	/* WdfIoQueuePurgeSynchronously would suffer from blocking */
 	WdfIoQueuePurge(ep->queue, purge_complete, NULL);
 
@@ -121,6 +124,8 @@ add_ep(pctx_vusb_t vusb, PUDECXUSBENDPOINT_INIT *pepinit, PUSB_ENDPOINT_DESCRIPT
 	UdecxUsbEndpointSetWdfIoQueue(ude_ep, queue);
 
 	ep->queue = queue;
+	/* an endpoint works without a jitter buffer */
+	setup_ep_jitter(ep);
 	if (dscr_ep == NULL) {
 		vusb->ep_default = ep;
 	}
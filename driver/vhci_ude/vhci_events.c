@@ -0,0 +1,164 @@
+#include "vhci_driver.h"
+#include "vhci_events.tmh"
+
+#include "usbip_vhci_api.h"
+
+/*
+ * IOCTL_USBIP_VHCI_GET_PORT_EVENTS requests wait in a manual queue until
+ * ports change. A request is checked and queued under vhci->spin_lock, which
+ * guards a ring as well, so that a change posted meanwhile is not missed.
+ */
+
+PAGEABLE NTSTATUS
+create_queue_events(pctx_vhci_t vhci)
+{
+	WDF_IO_QUEUE_CONFIG	conf;
+	NTSTATUS	status;
+
+	PAGED_CODE();
+
+	port_event_ring_init(&vhci->events);
+
+	WDF_IO_QUEUE_CONFIG_INIT(&conf, WdfIoQueueDispatchManual);
+	conf.PowerManaged = WdfFalse;
+	status = WdfIoQueueCreate(vhci->hdev, &conf, WDF_NO_OBJECT_ATTRIBUTES, &vhci->queue_events);
+	if (NT_ERROR(status))
+		TRE(IOCTL, "failed to create event queue: %!STATUS!", status);
+	return status;
+}
+
+/* length of a reply, or 0 if there's no change from evs->seq. vhci->spin_lock should be held */
+static ULONG
+fill_port_events(pctx_vhci_t vhci, ioctl_usbip_vhci_port_events *evs, size_t len)
+{
+	unsigned	seq, n_max, n;
+	int	lost;
+
+	/* an input buffer overlaps an output one */
+	seq = ((ioctl_usbip_vhci_get_port_events *)evs)->seq;
+	n_max = (unsigned)((len - VHCI_PORT_EVENTS_SIZE(0)) / sizeof(vhci_port_event_t));
+	n = port_event_ring_read(&vhci->events, seq, evs->events, n_max, &lost);
+	if (n == 0 && !lost)
+		return 0;
+
+	evs->size = (unsigned)VHCI_PORT_EVENTS_SIZE(n);
+	evs->seq_next = n > 0 ? evs->events[n - 1].seq + 1 : vhci->events.seq_next;
+	if (evs->seq_next == 0)
+		evs->seq_next = 1;
+	evs->flags = lost ? VHCI_PORT_EVENTS_LOST : 0;
+	evs->n_events = n;
+	return evs->size;
+}
+
+static VOID
+complete_req_port_events(pctx_vhci_t vhci, WDFREQUEST req)
+{
+	ioctl_usbip_vhci_port_events	*evs;
+	size_t	len;
+	ULONG	size;
+	NTSTATUS	status;
+
+	status = WdfRequestRetrieveOutputBuffer(req, VHCI_PORT_EVENTS_SIZE(1), &evs, &len);
+	if (NT_ERROR(status)) {
+		WdfRequestComplete(req, status);
+		return;
+	}
+
+	WdfSpinLockAcquire(vhci->spin_lock);
+	/* a seq of a queued request is not newer than a new change */
+	size = fill_port_events(vhci, evs, len);
+	WdfSpinLockRelease(vhci->spin_lock);
+
+	WdfRequestCompleteWithInformation(req, STATUS_SUCCESS, size);
+}
+
+/*
+ * A change of a port is recorded, and queued requests get it. vendor, product
+ * and speed are 0 if vusb has gone.
+ */
+VOID
+post_port_event(pctx_vhci_t vhci, USHORT type, ULONG port, pctx_vusb_t vusb)
+{
+	WDFREQUEST	req;
+	ULONG	seq;
+
+	WdfSpinLockAcquire(vhci->spin_lock);
+	seq = vhci->events.seq_next;
+	if (vusb != NULL)
+		port_event_ring_post(&vhci->events, type, (int)port, vusb->id_vendor, vusb->id_product, (UCHAR)vusb->dev_speed);
+	else
+		port_event_ring_post(&vhci->events, type, (int)port, 0, 0, 0);
+	WdfSpinLockRelease(vhci->spin_lock);
+
+	TRD(IOCTL, "port event: type: %hu, port: %u, seq: %u", type, port, seq);
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(vhci->queue_events, &req)))
+		complete_req_port_events(vhci, req);
+}
+
+/* queued requests of a closing file are cancelled */
+VOID
+flush_port_events(pctx_vhci_t vhci, WDFFILEOBJECT fo)
+{
+	WDFREQUEST	req;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(vhci->queue_events, fo, &req)))
+		WdfRequestComplete(req, STATUS_CANCELLED);
+}
+
+/*
+ * A request is completed at once if there are changes from a seq asked for,
+ * and otherwise queued. A seq of 0 is replaced with that of the next change.
+ */
+NTSTATUS
+ioctl_get_port_events(WDFQUEUE queue, WDFREQUEST req, size_t inlen, size_t outlen)
+{
+	pctx_vhci_t	vhci;
+	ioctl_usbip_vhci_get_port_events	*req_evs;
+	ioctl_usbip_vhci_port_events	*evs;
+	size_t	len;
+	ULONG	size;
+	NTSTATUS	status;
+
+	if (inlen < sizeof(ioctl_usbip_vhci_get_port_events) || outlen < VHCI_PORT_EVENTS_SIZE(0))
+		return STATUS_INVALID_PARAMETER;
+	status = WdfRequestRetrieveInputBuffer(req, sizeof(ioctl_usbip_vhci_get_port_events), &req_evs, NULL);
+	if (NT_ERROR(status))
+		return status;
+	status = WdfRequestRetrieveOutputBuffer(req, VHCI_PORT_EVENTS_SIZE(0), &evs, &len);
+	if (NT_ERROR(status))
+		return status;
+
+	vhci = *TO_PVHCI(queue);
+
+	WdfSpinLockAcquire(vhci->spin_lock);
+
+	if (len < VHCI_PORT_EVENTS_SIZE(1)) {
+		/* no change but where the next one starts */
+		evs->seq_next = vhci->events.seq_next;
+		WdfSpinLockRelease(vhci->spin_lock);
+		evs->size = (unsigned)VHCI_PORT_EVENTS_SIZE(0);
+		evs->flags = 0;
+		evs->n_events = 0;
+		WdfRequestSetInformation(req, VHCI_PORT_EVENTS_SIZE(0));
+		return STATUS_SUCCESS;
+	}
+
+	if (req_evs->seq == 0)
+		req_evs->seq = vhci->events.seq_next;
+	size = fill_port_events(vhci, evs, len);
+	if (size == 0) {
+		status = WdfRequestForwardToIoQueue(req, vhci->queue_events);
+		if (NT_SUCCESS(status)) {
+			WdfSpinLockRelease(vhci->spin_lock);
+			return STATUS_PENDING;
+		}
+		TRE(IOCTL, "failed to queue an event request: %!STATUS!", status);
+	}
+
+	WdfSpinLockRelease(vhci->spin_lock);
+
+	if (size > 0)
+		WdfRequestSetInformation(req, size);
+	return status;
+}
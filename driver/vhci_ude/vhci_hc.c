@@ -1,11 +1,13 @@
 #include "vhci_driver.h"
 #include "vhci_hc.tmh"
 
-#define MAX_HUB_PORTS		16
+/* MaxPorts of a Parameters key */
+ULONG	vhci_n_ports = VHCI_DEFAULT_PORTS;
 
 #include "usbip_vhci_api.h"
 
 extern NTSTATUS create_queue_hc(pctx_vhci_t vhci);
+extern NTSTATUS create_queue_events(pctx_vhci_t vhci);
 
 static NTSTATUS
 controller_query_usb_capability(WDFDEVICE UdecxWdfDevice, PGUID CapabilityType,
@@ -41,7 +43,7 @@ create_ucx_controller(WDFDEVICE hdev)
 	UDECX_WDF_DEVICE_CONFIG_INIT(&conf, controller_query_usb_capability);
 	conf.EvtUdecxWdfDeviceReset = controller_reset;
 	/* conf.NumberOfUsb30Ports=1 by UDECX_WDF_DEVICE_CONFIG_INIT */
-	conf.NumberOfUsb20Ports = MAX_HUB_PORTS;
+	conf.NumberOfUsb20Ports = (USHORT)vhci_n_ports;
 	/* UdecxWdfDeviceAddUsbDeviceEmulation() will fail if NumberOfUsb20Ports or NumberOfUsb30Ports is 0 */
 	status = UdecxWdfDeviceAddUsbDeviceEmulation(hdev, &conf);
 	if (NT_ERROR(status)) {
@@ -80,8 +82,9 @@ cleanup_fileobject(_In_ WDFFILEOBJECT fo)
 	 * So after checked, proceed to plug out.
 	 */
 	if (svusb->vusb != NULL && svusb->vhci->vusbs[svusb->port] == svusb->vusb) {
-		plugout_vusb(svusb->vhci, (CHAR)svusb->port);
+		plugout_vusb(svusb->vhci, (LONG)svusb->port);
 	}
+	flush_port_events(svusb->vhci, fo);
 
 	TRD(VHCI, "Leave");
 }
@@ -120,6 +123,7 @@ static BOOLEAN
 setup_vhci(pctx_vhci_t vhci)
 {
 	WDF_OBJECT_ATTRIBUTES       attrs;
+	SIZE_T	size_vusbs;
 	NTSTATUS	status;
 
 	WDF_OBJECT_ATTRIBUTES_INIT(&attrs);
@@ -129,14 +133,17 @@ setup_vhci(pctx_vhci_t vhci)
 		TRE(VHCI, "failed to create spin lock: %!STATUS!", status);
 		return FALSE;
 	}
-	vhci->n_max_ports = MAX_HUB_PORTS;
+	vhci->n_max_ports = vhci_n_ports;
 
-	vhci->vusbs = ExAllocatePoolWithTag(NonPagedPool, sizeof(pctx_vusb_t) * vhci->n_max_ports, VHCI_POOLTAG);
+	/* a stack of free ports follows vusbs */
+	size_vusbs = sizeof(pctx_vusb_t) * vhci->n_max_ports;
+	vhci->vusbs = ExAllocatePoolWithTag(NonPagedPool, size_vusbs + PORT_ALLOC_MEMSIZE(vhci->n_max_ports), VHCI_POOLTAG);
 	if (vhci->vusbs == NULL) {
 		TRE(VHCI, "failed to allocate ports: out of memory");
 		return FALSE;
 	}
-	RtlZeroMemory(vhci->vusbs, sizeof(pctx_vusb_t) * vhci->n_max_ports);
+	RtlZeroMemory(vhci->vusbs, size_vusbs);
+	port_alloc_init(&vhci->ports, vhci->n_max_ports, (PUCHAR)vhci->vusbs + size_vusbs);
 
 	return TRUE;
 }
@@ -200,6 +207,8 @@ evt_add_vhci(_In_ WDFDRIVER drv, _Inout_ PWDFDEVICE_INIT dinit)
 	}
 
 	status = create_queue_hc(vhci);
+	if (NT_SUCCESS(status))
+		status = create_queue_events(vhci);
 out:
 	TRD(VHCI, "Leave: %!STATUS!", status);
 
@@ -4,20 +4,24 @@
 #include "usbip_vhci_api.h"
 
 NTSTATUS
-plugin_vusb(pctx_vhci_t vhci, WDFREQUEST req, pvhci_pluginfo_t pluginfo);
+plugin_vusb(pctx_vhci_t vhci, WDFREQUEST req, pvhci_pluginfo_t pluginfo, ULONG len, PULONG pport);
+NTSTATUS
+ioctl_get_port_events(WDFQUEUE queue, WDFREQUEST req, size_t inlen, size_t outlen);
 
 static VOID
 get_ports_status(pctx_vhci_t vhci, ioctl_usbip_vhci_get_ports_status *ports_status)
 {
-	ULONG	i;
+	ULONG	n_ports, i;
 
 	TRD(IOCTL, "Enter\n");
 
 	RtlZeroMemory(ports_status, sizeof(ioctl_usbip_vhci_get_ports_status));
 
+	n_ports = min(vhci->n_max_ports, sizeof(ports_status->port_status));
+
 	WdfSpinLockAcquire(vhci->spin_lock);
 
-	for (i = 0; i != vhci->n_max_ports; i++) {
+	for (i = 0; i != n_ports; i++) {
 		pctx_vusb_t	vusb = vhci->vusbs[i];
 		if (vusb != NULL) {
 			ports_status->port_status[i] = 1;
@@ -26,7 +30,7 @@ get_ports_status(pctx_vhci_t vhci, ioctl_usbip_vhci_get_ports_status *ports_stat
 
 	WdfSpinLockRelease(vhci->spin_lock);
 
-	ports_status->n_max_ports = (UCHAR)vhci->n_max_ports;
+	ports_status->n_max_ports = (UCHAR)n_ports;
 
 	TRD(IOCTL, "Leave\n");
 }
@@ -50,6 +54,49 @@ ioctl_get_ports_status(WDFQUEUE queue, WDFREQUEST req)
 	return STATUS_SUCCESS;
 }
 
+static NTSTATUS
+ioctl_get_ports_status_ex(WDFQUEUE queue, WDFREQUEST req)
+{
+	pctx_vhci_t	vhci;
+	ioctl_usbip_vhci_get_ports_status_ex	*st;
+	size_t	len, len_hdr = VHCI_PORTS_STATUS_EX_SIZE(0);
+	ULONG	size, i;
+	NTSTATUS	status;
+
+	status = WdfRequestRetrieveOutputBuffer(req, len_hdr, &st, &len);
+	if (NT_ERROR(status))
+		return status;
+
+	vhci = *TO_PVHCI(queue);
+	size = (ULONG)VHCI_PORTS_STATUS_EX_SIZE(vhci->n_max_ports);
+
+	WdfSpinLockAcquire(vhci->spin_lock);
+
+	st->size = size;
+	st->version = VHCI_PORTS_STATUS_VERSION;
+	st->n_max_ports = vhci->n_max_ports;
+	st->n_used_ports = vhci->n_max_ports - vhci->ports.n_free;
+	st->free_port = port_alloc_peek(&vhci->ports);
+
+	if (len < size) {
+		WdfSpinLockRelease(vhci->spin_lock);
+		WdfRequestSetInformation(req, len_hdr);
+		return STATUS_BUFFER_OVERFLOW;
+	}
+
+	RtlZeroMemory(st->port_status, size - len_hdr);
+	for (i = 0; i != vhci->n_max_ports; i++) {
+		if (vhci->vusbs[i] != NULL)
+			st->port_status[i / 8] |= (UCHAR)(1 << (i % 8));
+	}
+
+	WdfSpinLockRelease(vhci->spin_lock);
+
+	WdfRequestSetInformation(req, size);
+
+	return STATUS_SUCCESS;
+}
+
 static VOID
 get_imported_devices(pctx_vhci_t vhci, pioctl_usbip_vhci_imported_dev_t idevs, ULONG n_idevs_max)
 {
@@ -64,7 +111,7 @@ get_imported_devices(pctx_vhci_t vhci, pioctl_usbip_vhci_imported_dev_t idevs, U
 	for (i = 0; i != vhci->n_max_ports && n_idevs < n_idevs_max - 1; i++) {
 		pctx_vusb_t	vusb = vhci->vusbs[i];
 		if (VUSB_IS_VALID(vusb)) {
-			idev->port = (CHAR)i;
+			idev->port = (int)i;
 			idev->status = 2; /* SDEV_ST_USED */;
 			idev->vendor = vusb->id_vendor;
 			idev->product = vusb->id_product;
@@ -75,7 +122,7 @@ get_imported_devices(pctx_vhci_t vhci, pioctl_usbip_vhci_imported_dev_t idevs, U
 
 	WdfSpinLockRelease(vhci->spin_lock);
 
-	idev->port = 0xff; /* end of mark */
+	idev->port = -1; /* end of mark */
 
 	TRD(IOCTL, "Leave\n");
 }
@@ -105,11 +152,13 @@ ioctl_get_imported_devices(WDFQUEUE queue, WDFREQUEST req, size_t outlen)
 }
 
 static NTSTATUS
-ioctl_plugin_vusb(WDFQUEUE queue, WDFREQUEST req, size_t inlen)
+ioctl_plugin_vusb(WDFQUEUE queue, WDFREQUEST req, size_t inlen, size_t outlen)
 {
 	pctx_vhci_t	vhci;
 	pvhci_pluginfo_t	pluginfo;
 	PUSHORT		pdscr_fullsize;
+	PULONG		pport;
+	ULONG		port;
 	size_t		len;
 	NTSTATUS	status;
 
@@ -123,38 +172,55 @@ ioctl_plugin_vusb(WDFQUEUE queue, WDFREQUEST req, size_t inlen)
 		return status;
 	}
 	pdscr_fullsize = (PUSHORT)pluginfo->dscr_conf + 1;
-	if (len != sizeof(vhci_pluginfo_t) + *pdscr_fullsize - 9) {
-		TRE(IOCTL, "invalid pluginfo format: %lld != %lld", len, sizeof(vhci_pluginfo_t) + *pdscr_fullsize - 9);
+	if (len < VHCI_PLUGINFO_SIZE(*pdscr_fullsize)) {
+		TRE(IOCTL, "invalid pluginfo format: %lld < %lld", len, VHCI_PLUGINFO_SIZE(*pdscr_fullsize));
 		return STATUS_INVALID_PARAMETER;
 	}
 	vhci = *TO_PVHCI(queue);
-	if (pluginfo->port < 0 || (ULONG)pluginfo->port >= vhci->n_max_ports)
+	/* -1 for any free port */
+	if (pluginfo->port < -1 || (pluginfo->port >= 0 && (ULONG)pluginfo->port >= vhci->n_max_ports))
 		return STATUS_INVALID_PARAMETER;
-	return plugin_vusb(vhci, req, pluginfo);
+	status = plugin_vusb(vhci, req, pluginfo, (ULONG)len, &port);
+	if (NT_ERROR(status))
+		return status;
+
+	/* an output buffer overlaps pluginfo */
+	if (outlen >= sizeof(ULONG) && NT_SUCCESS(WdfRequestRetrieveOutputBuffer(req, sizeof(ULONG), &pport, NULL))) {
+		*pport = port;
+		WdfRequestSetInformation(req, sizeof(ULONG));
+	}
+	TRD(IOCTL, "plugged in: port: %u", port);
+	return STATUS_SUCCESS;
 }
 
 static NTSTATUS
 ioctl_plugout_vusb(WDFQUEUE queue, WDFREQUEST req, size_t inlen)
 {
-	pvhci_unpluginfo_t	unpluginfo;
+	PVOID		unpluginfo;
 	pctx_vhci_t	vhci;
-	CHAR		port;
+	LONG		port;
 	NTSTATUS	status;
 
-	if (inlen != sizeof(ioctl_usbip_vhci_unplug)) {
-		TRE(IOCTL, "invalid unplug input size: %lld < %lld", inlen, sizeof(ioctl_usbip_vhci_unplug));
+	if (inlen != sizeof(ioctl_usbip_vhci_unplug) && inlen != sizeof(ioctl_usbip_vhci_unplug_ex)) {
+		TRE(IOCTL, "invalid unplug input size: %lld", inlen);
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	status = WdfRequestRetrieveInputBuffer(req, sizeof(ioctl_usbip_vhci_unplug), &unpluginfo, NULL);
+	status = WdfRequestRetrieveInputBuffer(req, inlen, &unpluginfo, NULL);
 	if (NT_ERROR(status)) {
 		TRE(IOCTL, "failed to get unplug buffer: %!STATUS!", status);
 		return status;
 	}
 
-	port = unpluginfo->addr;
+	if (inlen == sizeof(ioctl_usbip_vhci_unplug))
+		port = ((pvhci_unpluginfo_t)unpluginfo)->addr;
+	else {
+		if (((ioctl_usbip_vhci_unplug_ex *)unpluginfo)->size != inlen)
+			return STATUS_INVALID_PARAMETER;
+		port = ((ioctl_usbip_vhci_unplug_ex *)unpluginfo)->port;
+	}
 	vhci = *TO_PVHCI(queue);
-	if (port >= (CHAR)vhci->n_max_ports)
+	if (port >= (LONG)vhci->n_max_ports)
 		return STATUS_INVALID_PARAMETER;
 
 	return plugout_vusb(vhci, port);
@@ -174,11 +240,21 @@ io_device_control(_In_ WDFQUEUE queue, _In_ WDFREQUEST req,
 	case IOCTL_USBIP_VHCI_GET_PORTS_STATUS:
 		status = ioctl_get_ports_status(queue, req);
 		break;
+	case IOCTL_USBIP_VHCI_GET_PORTS_STATUS_EX:
+		status = ioctl_get_ports_status_ex(queue, req);
+		break;
 	case IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES:
 		status = ioctl_get_imported_devices(queue, req, outlen);
 		break;
+	case IOCTL_USBIP_VHCI_GET_PORT_EVENTS:
+		status = ioctl_get_port_events(queue, req, inlen, outlen);
+		if (status == STATUS_PENDING) {
+			TRD(IOCTL, "Leave: pending");
+			return;
+		}
+		break;
 	case IOCTL_USBIP_VHCI_PLUGIN_HARDWARE:
-		status = ioctl_plugin_vusb(queue, req, inlen);
+		status = ioctl_plugin_vusb(queue, req, inlen, outlen);
 		break;
 	case IOCTL_USBIP_VHCI_UNPLUG_HARDWARE:
 		status = ioctl_plugout_vusb(queue, req, inlen);
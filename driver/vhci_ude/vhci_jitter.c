@@ -0,0 +1,166 @@
+#include "vhci_driver.h"
+#include "vhci_jitter.tmh"
+
+#include "usbip_proto.h"
+#include "vhci_urbr.h"
+
+/* completions held per ISO IN endpoint, 0 if not buffered */
+ULONG	iso_jitter_depth;
+
+static unsigned long long
+get_time_us(void)
+{
+	/* 100ns units */
+	return KeQueryInterruptTime() / 10;
+}
+
+static void
+start_timer_jitter(pctx_ep_t ep, unsigned long long wait)
+{
+	if (wait == ISO_JITTER_IDLE)
+		return;
+	WdfTimerStart(ep->timer_jitter, WDF_REL_TIMEOUT_IN_US(wait > 0 ? wait : 1));
+}
+
+/* held urbr's which are due, or all of them, are completed */
+static void
+release_urbrs_jitter(pctx_ep_t ep, BOOLEAN all)
+{
+	pctx_vusb_t	vusb = ep->vusb;
+	LIST_ENTRY	head_release;
+	unsigned long long	now, wait = ISO_JITTER_IDLE;
+	ULONG	n_underruns;
+	unsigned	n_due;
+
+	InitializeListHead(&head_release);
+
+	WdfSpinLockAcquire(vusb->spin_lock);
+
+	now = get_time_us();
+	n_underruns = ep->jitter.n_underruns;
+	if (all) {
+		n_due = (unsigned)-1;
+		iso_jitter_reset(&ep->jitter);
+	}
+	else {
+		n_due = iso_jitter_pop_due(&ep->jitter, now);
+		wait = iso_jitter_wait(&ep->jitter, now);
+	}
+	while (n_due > 0 && !IsListEmpty(&ep->head_urbr_held)) {
+		purb_req_t	urbr;
+
+		urbr = CONTAINING_RECORD(ep->head_urbr_held.Flink, urb_req_t, list_state);
+		RemoveEntryListInit(&urbr->list_state);
+		RemoveEntryListInit(&urbr->list_all);
+		n_due--;
+		/* a cancel routine completes it */
+		if (!unmark_cancelable_urbr(urbr))
+			continue;
+		InsertTailList(&head_release, &urbr->list_state);
+	}
+
+	WdfSpinLockRelease(vusb->spin_lock);
+
+	if (n_underruns != ep->jitter.n_underruns)
+		TRW(EP, "jitter buffer under-run: ep: 0x%x, total: %u", (ULONG)ep->addr, (ULONG)ep->jitter.n_underruns);
+
+	while (!IsListEmpty(&head_release)) {
+		purb_req_t	urbr;
+
+		urbr = CONTAINING_RECORD(head_release.Flink, urb_req_t, list_state);
+		RemoveEntryListInit(&urbr->list_state);
+		complete_urbr(urbr, STATUS_SUCCESS);
+	}
+
+	start_timer_jitter(ep, wait);
+}
+
+static VOID
+timer_jitter_func(_In_ WDFTIMER timer)
+{
+	release_urbrs_jitter(*TO_PEP(timer), FALSE);
+}
+
+NTSTATUS
+setup_ep_jitter(pctx_ep_t ep)
+{
+	WDF_TIMER_CONFIG	conf;
+	WDF_OBJECT_ATTRIBUTES	attrs;
+	NTSTATUS	status;
+
+	InitializeListHead(&ep->head_urbr_held);
+	ep->timer_jitter = NULL;
+
+	if (iso_jitter_depth == 0 || ep->type != USB_ENDPOINT_TYPE_ISOCHRONOUS || !USB_ENDPOINT_DIRECTION_IN(ep->addr))
+		return STATUS_SUCCESS;
+
+	WDF_TIMER_CONFIG_INIT(&conf, timer_jitter_func);
+	conf.AutomaticSerialization = FALSE;
+	conf.UseHighResolutionTimer = WdfTrue;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attrs, pctx_ep_t);
+	attrs.ParentObject = ep->queue;
+
+	status = WdfTimerCreate(&conf, &attrs, &ep->timer_jitter);
+	if (NT_ERROR(status)) {
+		TRE(EP, "failed to create jitter timer: %!STATUS!", status);
+		ep->timer_jitter = NULL;
+		return status;
+	}
+	*TO_PEP(ep->timer_jitter) = ep;
+
+	iso_jitter_init(&ep->jitter, iso_jitter_depth);
+	TRD(EP, "jitter buffer: ep: 0x%x, depth: %u", (ULONG)ep->addr, iso_jitter_depth);
+	return STATUS_SUCCESS;
+}
+
+/*
+ * A completed ISO IN urbr is held instead of being completed. It stays
+ * cancelable, and is not unlinked if cancelled since a server is done with it.
+ */
+BOOLEAN
+hold_urbr_jitter(purb_req_t urbr)
+{
+	pctx_ep_t	ep = urbr->ep;
+	pctx_vusb_t	vusb = ep->vusb;
+	PURB	urb;
+	unsigned long long	period;
+	ULONG	n_overruns;
+
+	if (ep->timer_jitter == NULL || urbr->type != URBR_TYPE_URB)
+		return FALSE;
+	urb = urbr->u.urb.urb;
+	if (urb == NULL || urb->UrbHeader.Function != URB_FUNCTION_ISOCH_TRANSFER)
+		return FALSE;
+	period = iso_jitter_period_us(urb->UrbIsochronousTransfer.NumberOfPackets, ep->interval, vusb->dev_speed >= USB_SPEED_HIGH);
+
+	WdfSpinLockAcquire(vusb->spin_lock);
+	if (vusb->invalid || !urbr->u.urb.cancelable) {
+		WdfSpinLockRelease(vusb->spin_lock);
+		return FALSE;
+	}
+	urbr->u.urb.held = TRUE;
+	InsertTailList(&ep->head_urbr_held, &urbr->list_state);
+	InsertTailList(&vusb->head_urbr, &urbr->list_all);
+	n_overruns = ep->jitter.n_overruns;
+	iso_jitter_push(&ep->jitter, get_time_us(), period);
+	WdfSpinLockRelease(vusb->spin_lock);
+
+	if (n_overruns != ep->jitter.n_overruns)
+		TRW(EP, "jitter buffer over-run: ep: 0x%x, total: %u", (ULONG)ep->addr, (ULONG)ep->jitter.n_overruns);
+
+	release_urbrs_jitter(ep, FALSE);
+	return TRUE;
+}
+
+/* a purged endpoint gets all held urbr's back at once */
+void
+release_ep_jitter(pctx_ep_t ep)
+{
+	if (ep->timer_jitter == NULL)
+		return;
+	WdfTimerStop(ep->timer_jitter, FALSE);
+	release_urbrs_jitter(ep, TRUE);
+	TRD(EP, "jitter buffer released: ep: 0x%x, under-runs: %u, over-runs: %u", (ULONG)ep->addr,
+		(ULONG)ep->jitter.n_underruns, (ULONG)ep->jitter.n_overruns);
+}
@@ -21,6 +21,7 @@ setup_with_dsc_dev(pctx_vusb_t vusb, PUSB_DEVICE_DESCRIPTOR dsc_dev)
 		vusb->id_product = dsc_dev->idProduct;
 		vusb->dev_speed = get_usb_speed(dsc_dev->bcdUSB);
 		vusb->iSerial = dsc_dev->iSerialNumber;
+		dsc_cache_store_full(&vusb->dsc_cache, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, dsc_dev, sizeof(USB_DEVICE_DESCRIPTOR));
 	}
 	else {
 		vusb->id_vendor = 0;
@@ -54,14 +55,17 @@ setup_with_dsc_conf(pctx_vusb_t vusb, PUSB_CONFIGURATION_DESCRIPTOR dsc_conf)
 	}
 	vusb->default_conf_value = dsc_conf->bConfigurationValue;
 
+	dsc_cache_store_full(&vusb->dsc_cache, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, dsc_conf, dsc_conf->wTotalLength);
+
 	return TRUE;
 }
 
 static BOOLEAN
-setup_vusb(UDECXUSBDEVICE ude_usbdev, pvhci_pluginfo_t pluginfo)
+setup_vusb(UDECXUSBDEVICE ude_usbdev, pvhci_pluginfo_t pluginfo, ULONG len)
 {
 	pctx_vusb_t	vusb = TO_VUSB(ude_usbdev);
 	WDF_OBJECT_ATTRIBUTES       attrs, attrs_hmem;
+	ULONG	len_base;
 	NTSTATUS	status;
 
 	WDF_OBJECT_ATTRIBUTES_INIT(&attrs);
@@ -70,6 +74,7 @@ setup_vusb(UDECXUSBDEVICE ude_usbdev, pvhci_pluginfo_t pluginfo)
 	vusb->dsc_conf = NULL;
 	vusb->intf_altsettings = NULL;
 	vusb->wserial = NULL;
+	dsc_cache_init(&vusb->dsc_cache);
 
 	status = WdfSpinLockCreate(&attrs, &vusb->spin_lock);
 	if (NT_ERROR(status)) {
@@ -92,6 +97,9 @@ setup_vusb(UDECXUSBDEVICE ude_usbdev, pvhci_pluginfo_t pluginfo)
 		TRE(PLUGIN, "failed to setup usb with configuration descritor");
 		return FALSE;
 	}
+	/* descriptors persisted by a client from a former attach */
+	len_base = (ULONG)VHCI_PLUGINFO_SIZE(((PUSB_CONFIGURATION_DESCRIPTOR)pluginfo->dscr_conf)->wTotalLength);
+	dsc_cache_store_records(&vusb->dsc_cache, (PUCHAR)pluginfo + len_base, len - len_base);
 
 	vusb->devid = pluginfo->devid;
 
@@ -204,6 +212,7 @@ vusb_cleanup(_In_ WDFOBJECT ude_usbdev)
 	if (vusb->intf_altsettings != NULL)
 		ExFreePoolWithTag(vusb->intf_altsettings, VHCI_POOLTAG);
 	libdrv_free(vusb->wserial);
+	dsc_cache_clear(&vusb->dsc_cache);
 }
 
 static void
@@ -267,7 +276,7 @@ get_device_speed(pvhci_pluginfo_t pluginfo)
 }
 
 static pctx_vusb_t
-vusb_plugin(pctx_vhci_t vhci, pvhci_pluginfo_t pluginfo)
+vusb_plugin(pctx_vhci_t vhci, ULONG port, pvhci_pluginfo_t pluginfo, ULONG len)
 {
 	pctx_vusb_t	vusb;
 	PUDECXUSBDEVICE_INIT	pdinit;
@@ -295,14 +304,15 @@ vusb_plugin(pctx_vhci_t vhci, pvhci_pluginfo_t pluginfo)
 
 	vusb = TO_VUSB(ude_usbdev);
 	vusb->vhci = vhci;
+	vusb->port = port;
 
 	vusb->ep_default = NULL;
 	vusb->is_simple_ep_alloc = (eptype == UdecxEndpointTypeSimple) ? TRUE : FALSE;
 
 	UDECX_USB_DEVICE_PLUG_IN_OPTIONS_INIT(&opts);
-	opts.Usb20PortNumber = pluginfo->port + 1;
+	opts.Usb20PortNumber = port + 1;
 
-	if (!setup_vusb(ude_usbdev, pluginfo)) {
+	if (!setup_vusb(ude_usbdev, pluginfo, len)) {
 		WdfObjectDelete(ude_usbdev);
 		return NULL;
 	}
@@ -320,24 +330,30 @@ vusb_plugin(pctx_vhci_t vhci, pvhci_pluginfo_t pluginfo)
 	return vusb;
 }
 
+/* a port of pluginfo is -1 for any free one */
 NTSTATUS
-plugin_vusb(pctx_vhci_t vhci, WDFREQUEST req, pvhci_pluginfo_t pluginfo)
+plugin_vusb(pctx_vhci_t vhci, WDFREQUEST req, pvhci_pluginfo_t pluginfo, ULONG len, PULONG pport)
 {
 	pctx_vusb_t	vusb;
+	LONG	port = pluginfo->port;
 	NTSTATUS	status = STATUS_UNSUCCESSFUL;
 
 	WdfSpinLockAcquire(vhci->spin_lock);
 
-	if (vhci->vusbs[pluginfo->port] != NULL) {
+	if (port < 0)
+		port = port_alloc_get(&vhci->ports);
+	else if (!port_alloc_take(&vhci->ports, port))
+		port = -1;
+	if (port < 0) {
 		WdfSpinLockRelease(vhci->spin_lock);
-		return STATUS_OBJECT_NAME_COLLISION;
+		return pluginfo->port < 0 ? STATUS_INVALID_PARAMETER: STATUS_OBJECT_NAME_COLLISION;
 	}
 
 	/* assign a temporary non-null value indicating on-going vusb allocation */
-	vhci->vusbs[pluginfo->port] = VUSB_CREATING;
+	vhci->vusbs[port] = VUSB_CREATING;
 	WdfSpinLockRelease(vhci->spin_lock);
 
-	vusb = vusb_plugin(vhci, pluginfo);
+	vusb = vusb_plugin(vhci, port, pluginfo, len);
 
 	WdfSpinLockAcquire(vhci->spin_lock);
 	if (vusb != NULL) {
@@ -346,17 +362,22 @@ plugin_vusb(pctx_vhci_t vhci, WDFREQUEST req, pvhci_pluginfo_t pluginfo)
 			pctx_safe_vusb_t	svusb = TO_SAFE_VUSB(fo);
 
 			svusb->vhci = vhci;
-			svusb->port = pluginfo->port;
+			svusb->port = port;
 			svusb->vusb = vusb;
 		}
 		else {
 			TRE(PLUGIN, "empty fileobject. setup failed");
 		}
 		status = STATUS_SUCCESS;
+		*pport = port;
 	}
-	vhci->vusbs[pluginfo->port] = vusb;
+	else
+		port_alloc_put(&vhci->ports, port);
+	vhci->vusbs[port] = vusb;
 	WdfSpinLockRelease(vhci->spin_lock);
 
+	if (vusb != NULL)
+		post_port_event(vhci, VHCI_PORT_EV_PLUGGED, port, vusb);
 	if ((vusb != NULL) && (vusb->is_simple_ep_alloc)) {
 		/* UDE framework ignores SELECT CONF & INTF for a simple type */
 		submit_req_select(vusb->ep_default, NULL, TRUE, vusb->default_conf_value, 0, 0);
@@ -99,6 +99,12 @@ plugout_all_vusbs(pctx_vhci_t vhci)
 			return STATUS_UNSUCCESSFUL;
 		}
 		vhci->vusbs[i] = NULL;
+		port_alloc_put(&vhci->ports, i);
+		WdfSpinLockRelease(vhci->spin_lock);
+
+		post_port_event(vhci, VHCI_PORT_EV_REMOVED, i, NULL);
+
+		WdfSpinLockAcquire(vhci->spin_lock);
 	}
 	WdfSpinLockRelease(vhci->spin_lock);
 
@@ -106,7 +112,7 @@ plugout_all_vusbs(pctx_vhci_t vhci)
 }
 
 NTSTATUS
-plugout_vusb(pctx_vhci_t vhci, CHAR port)
+plugout_vusb(pctx_vhci_t vhci, LONG port)
 {
 	pctx_vusb_t	vusb;
 	NTSTATUS	status;
@@ -114,13 +120,13 @@ plugout_vusb(pctx_vhci_t vhci, CHAR port)
 	if (port < 0)
 		return plugout_all_vusbs(vhci);
 
-	TRD(IOCTL, "plugging out device: port: %u", port);
+	TRD(IOCTL, "plugging out device: port: %d", port);
 
 	WdfSpinLockAcquire(vhci->spin_lock);
 
 	vusb = vhci->vusbs[port];
 	if (vusb == NULL) {
-		TRD(PLUGIN, "no matching vusb: port: %u", port);
+		TRD(PLUGIN, "no matching vusb: port: %d", port);
 		WdfSpinLockRelease(vhci->spin_lock);
 		return STATUS_NO_SUCH_DEVICE;
 	}
@@ -137,10 +143,13 @@ plugout_vusb(pctx_vhci_t vhci, CHAR port)
 		return STATUS_UNSUCCESSFUL;
 	}
 	vhci->vusbs[port] = NULL;
+	port_alloc_put(&vhci->ports, port);
 
 	WdfSpinLockRelease(vhci->spin_lock);
 
-	TRD(IOCTL, "completed to plug out: port: %u", port);
+	post_port_event(vhci, VHCI_PORT_EV_REMOVED, port, NULL);
+
+	TRD(IOCTL, "completed to plug out: port: %d", port);
 
 	return STATUS_SUCCESS;
 }
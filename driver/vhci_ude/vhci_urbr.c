@@ -166,8 +166,13 @@ urbr_cancelled(_In_ WDFREQUEST req)
 {
 	purb_req_t	urbr = (purb_req_t)WdfRequestGetInformation(req);
 	pctx_vusb_t	vusb = urbr->ep->vusb;
+	BOOLEAN	held;
 
 	WdfSpinLockAcquire(vusb->spin_lock);
+	held = urbr->u.urb.held;
+	/* not yet taken off by a jitter buffer */
+	if (held && !IsListEmpty(&urbr->list_state))
+		iso_jitter_drop(&urbr->ep->jitter);
 	RemoveEntryListInit(&urbr->list_state);
 	RemoveEntryListInit(&urbr->list_all);
 	if (vusb->urbr_sent_partial == urbr) {
@@ -177,7 +182,8 @@ urbr_cancelled(_In_ WDFREQUEST req)
 	WdfSpinLockRelease(vusb->spin_lock);
 
 	if (urbr != NULL && urbr->seq_num != 0) {
-		submit_urbr_unlink(urbr->ep, urbr->seq_num);
+		if (!held)
+			submit_urbr_unlink(urbr->ep, urbr->seq_num);
 		TRD(URBR, "cancelled urbr destroyed: %!URBR!", urbr);
 		complete_urbr(urbr, STATUS_CANCELLED);
 	}
@@ -288,11 +294,95 @@ submit_urbr_free(purb_req_t urbr)
 	return status;
 }
 
+/*
+ * setup packet of a descriptor request urb, which is built as store_urbr_dscr_dev does.
+ * Returns FALSE if the urb is not for a cacheable descriptor.
+ */
+BOOLEAN
+get_dsc_cspkt(PURB urb, usb_cspkt_t *csp)
+{
+	struct _URB_CONTROL_DESCRIPTOR_REQUEST	*urb_dscr = &urb->UrbControlDescriptorRequest;
+	ULONG	len;
+
+	switch (urb->UrbHeader.Function) {
+	case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+		build_setup_packet(csp, USBIP_DIR_IN, BMREQUEST_STANDARD, BMREQUEST_TO_DEVICE, USB_REQUEST_GET_DESCRIPTOR);
+		csp->wIndex.W = urb_dscr->DescriptorType == USB_STRING_DESCRIPTOR_TYPE ? urb_dscr->LanguageId: 0;
+		break;
+	case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+		build_setup_packet(csp, USBIP_DIR_IN, BMREQUEST_STANDARD, BMREQUEST_TO_INTERFACE, USB_REQUEST_GET_DESCRIPTOR);
+		csp->wIndex.W = urb_dscr->LanguageId;
+		break;
+	case URB_FUNCTION_CONTROL_TRANSFER:
+		RtlCopyMemory(csp, urb->UrbControlTransfer.SetupPacket, sizeof(usb_cspkt_t));
+		len = urb->UrbControlTransfer.TransferBufferLength;
+		if (csp->wLength > len)
+			csp->wLength = (USHORT)len;
+		return dsc_cache_is_cacheable(csp);
+	case URB_FUNCTION_CONTROL_TRANSFER_EX:
+		RtlCopyMemory(csp, urb->UrbControlTransferEx.SetupPacket, sizeof(usb_cspkt_t));
+		len = urb->UrbControlTransferEx.TransferBufferLength;
+		if (csp->wLength > len)
+			csp->wLength = (USHORT)len;
+		return dsc_cache_is_cacheable(csp);
+	default:
+		return FALSE;
+	}
+	csp->wLength = (USHORT)urb_dscr->TransferBufferLength;
+	csp->wValue.HiByte = urb_dscr->DescriptorType;
+	csp->wValue.LowByte = urb_dscr->Index;
+	return dsc_cache_is_cacheable(csp);
+}
+
+static PVOID
+get_urb_transfer_buf(PURB urb, PULONG *pplen)
+{
+	switch (urb->UrbHeader.Function) {
+	case URB_FUNCTION_CONTROL_TRANSFER:
+		*pplen = &urb->UrbControlTransfer.TransferBufferLength;
+		return get_buf(urb->UrbControlTransfer.TransferBuffer, urb->UrbControlTransfer.TransferBufferMDL);
+	case URB_FUNCTION_CONTROL_TRANSFER_EX:
+		*pplen = &urb->UrbControlTransferEx.TransferBufferLength;
+		return get_buf(urb->UrbControlTransferEx.TransferBuffer, urb->UrbControlTransferEx.TransferBufferMDL);
+	default:
+		*pplen = &urb->UrbControlDescriptorRequest.TransferBufferLength;
+		return get_buf(urb->UrbControlDescriptorRequest.TransferBuffer, urb->UrbControlDescriptorRequest.TransferBufferMDL);
+	}
+}
+
+/* answers a descriptor request urb from the cache of vusb */
+static BOOLEAN
+get_dsc_from_cache(pctx_vusb_t vusb, WDFREQUEST req)
+{
+	PURB	urb = get_urb_from_req(req);
+	usb_cspkt_t	csp;
+	PVOID	buf;
+	PULONG	plen;
+	ULONG	len;
+
+	if (urb == NULL || !get_dsc_cspkt(urb, &csp))
+		return FALSE;
+	buf = get_urb_transfer_buf(urb, &plen);
+	if (buf == NULL)
+		return FALSE;
+	if (!dsc_cache_lookup(&vusb->dsc_cache, &csp, buf, &len))
+		return FALSE;
+
+	TRD(URBR, "descriptor from cache: type: %u, len: %u", (ULONG)csp.wValue.HiByte, len);
+
+	*plen = len;
+	urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
+	return TRUE;
+}
+
 NTSTATUS
 submit_req_urb(pctx_ep_t ep, WDFREQUEST req)
 {
 	purb_req_t	urbr;
 
+	if (ep != NULL && ep->vusb != NULL && get_dsc_from_cache(ep->vusb, req))
+		return STATUS_SUCCESS;
+
 	urbr = create_urbr(ep, URBR_TYPE_URB, req);
 	if (urbr == NULL)
 		return STATUS_UNSUCCESSFUL;
@@ -25,6 +25,8 @@ typedef struct _urb_req {
 		struct {
 			PURB	urb;
 			BOOLEAN	cancelable;
+			/* completed by a server, and held by a jitter buffer */
+			BOOLEAN	held;
 		} urb;
 		unsigned long	seq_num_unlink;
 		UCHAR	conf_value;
@@ -62,6 +64,9 @@ extern void set_cmd_unlink_usbip_header(struct usbip_header *h, unsigned long se
 extern void
 build_setup_packet(usb_cspkt_t *csp, unsigned char direct_in, unsigned char type, unsigned char recip, unsigned char request);
 
+extern BOOLEAN
+get_dsc_cspkt(PURB urb, usb_cspkt_t *csp);
+
 extern NTSTATUS
 submit_req_urb(pctx_ep_t ep, WDFREQUEST req);
 extern NTSTATUS
@@ -75,3 +80,10 @@ extern BOOLEAN
 unmark_cancelable_urbr(purb_req_t urbr);
 extern void
 complete_urbr(purb_req_t urbr, NTSTATUS status);
+
+extern NTSTATUS
+setup_ep_jitter(pctx_ep_t ep);
+extern BOOLEAN
+hold_urbr_jitter(purb_req_t urbr);
+extern void
+release_ep_jitter(pctx_ep_t ep);
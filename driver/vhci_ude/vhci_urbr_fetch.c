@@ -121,10 +121,20 @@ fetch_urbr(purb_req_t urbr, struct usbip_header *hdr)
 		status = STATUS_SUCCESS;
 	}
 	else {
+		PURB	urb = urbr->u.urb.urb;
+		usb_cspkt_t	csp;
+		BOOLEAN	is_dsc = FALSE;
+
 		if (hdr->u.ret_submit.status != 0)
 			handle_urbr_error(urbr, hdr);
-
-		status = fetch_urbr_urb(urbr->u.urb.urb, hdr);
+		else {
+			/* TransferBufferLength of urb will be overwritten */
+			is_dsc = get_dsc_cspkt(urb, &csp);
+		}
+
+		status = fetch_urbr_urb(urb, hdr);
+		if (status == STATUS_SUCCESS && is_dsc)
+			dsc_cache_store(&urbr->ep->vusb->dsc_cache, &csp, hdr + 1, hdr->u.ret_submit.actual_length);
 	}
 
 	TRD(WRITE, "Leave: %!STATUS!", status);
@@ -52,6 +52,8 @@ write_vusb(pctx_vusb_t vusb, WDFREQUEST req_write)
 	}
 
 	status = fetch_urbr(urbr, hdr);
+	if (status == STATUS_SUCCESS && hold_urbr_jitter(urbr))
+		goto out;
 
 	WdfSpinLockAcquire(vusb->spin_lock);
 	if (unmark_cancelable_urbr(urbr)) {
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Hash of descriptors of a device, which a server reports so that a client
+ * can validate its persisted descriptors without downloading them.
+ * It covers a device descriptor and a full configuration descriptor of
+ * index 0, and is a 32-bit FNV-1a. 0 means that a hash is not available.
+ */
+#define USBIP_DSCR_HASH_NONE	0
+
+static __inline unsigned int
+usbip_dscr_hash_update(unsigned int hash, const void *data, unsigned int len)
+{
+	const unsigned char	*p = (const unsigned char *)data;
+	unsigned int	i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static __inline unsigned int
+usbip_dscr_hash(const void *dscr_dev, const void *dscr_conf, unsigned short len_conf)
+{
+	unsigned int	hash = 2166136261u;
+
+	hash = usbip_dscr_hash_update(hash, dscr_dev, 18);
+	hash = usbip_dscr_hash_update(hash, dscr_conf, len_conf);
+	return hash == USBIP_DSCR_HASH_NONE ? 1 : hash;
+}
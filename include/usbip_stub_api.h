@@ -27,6 +27,13 @@ typedef struct _ioctl_usbip_stub_devinfo
 	unsigned char	class;
 	unsigned char	subclass;
 	unsigned char	protocol;
+	/* below fields are filled only if an output buffer has room for them */
+	unsigned short	bcdDevice;
+	/* see usbip_dscr_hash.h */
+	unsigned int	dscr_hash;
 } ioctl_usbip_stub_devinfo_t;
 
+/* size of devinfo which an old stub fills */
+#define IOCTL_USBIP_STUB_DEVINFO_SIZE_V1	FIELD_OFFSET(ioctl_usbip_stub_devinfo_t, bcdDevice)
+
 #pragma pack(pop)
\ No newline at end of file
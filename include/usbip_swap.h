@@ -0,0 +1,196 @@
+#pragma once
+
+/*
+ * Byte order conversion of usbip headers and ISO descriptor arrays.
+ *
+ * Every field on the wire is a big endian 32 bit word, so conversion in
+ * either direction is a byte shuffle of each word. SSSE3 or AVX2 kernels
+ * are chosen at runtime. AVX2 is not used in kernel mode, where YMM state
+ * would have to be saved around it, and neither is SSSE3 in an x86 driver.
+ */
+
+#include <stdlib.h>
+
+#include "usbip_proto.h"
+
+#if defined(_M_X64) || (defined(_M_IX86) && !defined(_KERNEL_MODE))
+#include <intrin.h>
+#include <immintrin.h>
+#define USBIP_SWAP_SIMD
+#endif
+
+#define USBIP_SWAP_SCALAR	0
+#define USBIP_SWAP_SSSE3	1
+#define USBIP_SWAP_AVX2		2
+
+static __inline int
+usbip_swap_detect(void)
+{
+#ifdef USBIP_SWAP_SIMD
+	int	info[4];
+	int	max_leaf;
+
+	__cpuid(info, 0);
+	max_leaf = info[0];
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 9)) == 0)
+		return USBIP_SWAP_SCALAR;
+#ifndef _KERNEL_MODE
+	/* OSXSAVE and AVX, and YMM state enabled by OS */
+	if (max_leaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return USBIP_SWAP_AVX2;
+	}
+#endif
+	return USBIP_SWAP_SSSE3;
+#else
+	return USBIP_SWAP_SCALAR;
+#endif
+}
+
+static __inline int
+usbip_swap_level(void)
+{
+	/* racing initializations store the same value */
+	static int	level = -1;
+
+	if (level < 0)
+		level = usbip_swap_detect();
+	return level;
+}
+
+static __inline void
+usbip_swap_words_scalar(UINT32 *words, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		words[i] = _byteswap_ulong(words[i]);
+}
+
+#ifdef USBIP_SWAP_SIMD
+
+static __inline void
+usbip_swap_words_ssse3(UINT32 *words, size_t n)
+{
+	const __m128i	mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m128i	*p = (__m128i *)words;
+	size_t	i = 0;
+
+	for (; i + 16 <= n; i += 16, p += 4) {
+		__m128i	v0 = _mm_loadu_si128(p), v1 = _mm_loadu_si128(p + 1);
+		__m128i	v2 = _mm_loadu_si128(p + 2), v3 = _mm_loadu_si128(p + 3);
+
+		_mm_storeu_si128(p, _mm_shuffle_epi8(v0, mask));
+		_mm_storeu_si128(p + 1, _mm_shuffle_epi8(v1, mask));
+		_mm_storeu_si128(p + 2, _mm_shuffle_epi8(v2, mask));
+		_mm_storeu_si128(p + 3, _mm_shuffle_epi8(v3, mask));
+	}
+	for (; i + 4 <= n; i += 4, p++)
+		_mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+	usbip_swap_words_scalar(words + i, n - i);
+}
+
+#ifndef _KERNEL_MODE
+
+static __inline void
+usbip_swap_words_avx2(UINT32 *words, size_t n)
+{
+	const __m256i	mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i	*p = (__m256i *)words;
+	size_t	i = 0;
+
+	for (; i + 32 <= n; i += 32, p += 4) {
+		__m256i	v0 = _mm256_loadu_si256(p), v1 = _mm256_loadu_si256(p + 1);
+		__m256i	v2 = _mm256_loadu_si256(p + 2), v3 = _mm256_loadu_si256(p + 3);
+
+		_mm256_storeu_si256(p, _mm256_shuffle_epi8(v0, mask));
+		_mm256_storeu_si256(p + 1, _mm256_shuffle_epi8(v1, mask));
+		_mm256_storeu_si256(p + 2, _mm256_shuffle_epi8(v2, mask));
+		_mm256_storeu_si256(p + 3, _mm256_shuffle_epi8(v3, mask));
+	}
+	for (; i + 8 <= n; i += 8, p++)
+		_mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask));
+	/* avoid SSE transition penalty in the code that follows */
+	_mm256_zeroupper();
+	usbip_swap_words_ssse3(words + i, n - i);
+}
+
+#endif
+
+#endif
+
+static __inline void
+usbip_swap_words(UINT32 *words, size_t n)
+{
+#ifdef USBIP_SWAP_SIMD
+	switch (usbip_swap_level()) {
+#ifndef _KERNEL_MODE
+	case USBIP_SWAP_AVX2:
+		if (n >= 32) {
+			usbip_swap_words_avx2(words, n);
+			return;
+		}
+		/* FALLTHROUGH */
+#endif
+	case USBIP_SWAP_SSSE3:
+		if (n >= 4) {
+			usbip_swap_words_ssse3(words, n);
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+#endif
+	usbip_swap_words_scalar(words, n);
+}
+
+static __inline void
+usbip_swap_iso_descs(struct usbip_iso_packet_descriptor *iso_descs, int n_pkts)
+{
+	if (n_pkts > 0)
+		usbip_swap_words((UINT32 *)iso_descs, (size_t)n_pkts * 4);
+}
+
+/* cmd: command of a header in host byte order. setup of CMD_SUBMIT is kept */
+static __inline void
+usbip_swap_header(struct usbip_header *hdr, UINT32 cmd)
+{
+	size_t	n_words;
+
+	switch (cmd) {
+	case USBIP_CMD_SUBMIT:
+	case USBIP_RET_SUBMIT:
+		n_words = 10;
+		break;
+	case USBIP_CMD_UNLINK:
+	case USBIP_RET_UNLINK:
+		n_words = 6;
+		break;
+	default:
+		n_words = 5;
+		break;
+	}
+
+#ifdef USBIP_SWAP_SIMD
+	if (n_words > 5 && usbip_swap_level() != USBIP_SWAP_SCALAR) {
+		const __m128i	mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+		const __m128i	mask_half = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 8, 9, 10, 11, 12, 13, 14, 15);
+		__m128i	*p = (__m128i *)hdr;
+
+		_mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+		if (n_words == 10) {
+			_mm_storeu_si128(p + 1, _mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask));
+			_mm_storeu_si128(p + 2, _mm_shuffle_epi8(_mm_loadu_si128(p + 2), mask_half));
+		}
+		else {
+			_mm_storeu_si128(p + 1, _mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask_half));
+		}
+		return;
+	}
+#endif
+	usbip_swap_words_scalar((UINT32 *)hdr, n_words);
+}
@@ -7,6 +7,8 @@
 #include <winioctl.h>
 #endif
 
+#include "usbip_vhci_event.h"
+
 //
 // Define an Interface Guid for bus vhci class.
 // This GUID is used to register (IoRegisterDeviceInterface) 
@@ -55,6 +57,9 @@ DEFINE_GUID(USBIP_NOTIFY_DEVICE_ARRIVAL_EVENT,
 /* EJECT(0x2) removed. 0x2 will be used later */
 #define IOCTL_USBIP_VHCI_GET_PORTS_STATUS	USBIP_VHCI_IOCTL(0x3)
 #define IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES	USBIP_VHCI_IOCTL(0x4)
+#define IOCTL_USBIP_VHCI_GET_PORTS_STATUS_EX	USBIP_VHCI_IOCTL(0x5)
+/* pending until ports change. See usbip_vhci_event.h */
+#define IOCTL_USBIP_VHCI_GET_PORT_EVENTS	USBIP_VHCI_IOCTL(0x6)
 
 #define MAX_VHCI_SERIAL_ID	127
 
@@ -63,6 +68,10 @@ typedef struct _vhci_pluginfo
 	/* vhci_pluginfo_t structure size */
 	unsigned long	size;
 	unsigned int	devid;
+	/*
+	 * -1 lets vhci assign a free port, which is returned in an output
+	 * buffer of an unsigned long. Only ports below 128 can be given.
+	 */
 	signed char	port;
 	wchar_t		wserial[MAX_VHCI_SERIAL_ID + 1];
 	unsigned char	dscr_dev[18];
@@ -70,7 +79,28 @@ typedef struct _vhci_pluginfo
 	unsigned char	dscr_conf[9];
 } vhci_pluginfo_t, *pvhci_pluginfo_t;
 
-/* usbip-win assumes max port is 127 */
+/* size of pluginfo without additional descriptors */
+#define VHCI_PLUGINFO_SIZE(conf_dscr_len)	(sizeof(vhci_pluginfo_t) + (conf_dscr_len) - 9)
+
+#pragma pack(push,1)
+
+/*
+ * Additional descriptors, which a client knows in advance, may follow a
+ * configuration descriptor of pluginfo. Each of them is a record below
+ * followed by len bytes of a reply to GET_DESCRIPTOR with a given setup.
+ * vhci answers such requests without a round trip to a device.
+ */
+typedef struct _vhci_pluginfo_dscr
+{
+	unsigned char	reqtype;
+	unsigned short	wValue;
+	unsigned short	wIndex;
+	unsigned short	len;
+} vhci_pluginfo_dscr_t;
+
+#pragma pack(pop)
+
+/* status of the first 127 ports only. See ioctl_usbip_vhci_get_ports_status_ex */
 typedef struct _ioctl_usbip_vhci_get_ports_status
 {
 	/* maximum number of ports */
@@ -78,14 +108,51 @@ typedef struct _ioctl_usbip_vhci_get_ports_status
 	unsigned char port_status[127];
 } ioctl_usbip_vhci_get_ports_status;
 
+#define VHCI_PORTS_STATUS_VERSION	1
+
+/*
+ * Variable-length status of all ports. If an output buffer is too small,
+ * vhci fails with STATUS_BUFFER_OVERFLOW(ERROR_MORE_DATA) but fills fields
+ * before port_status, where size tells a length needed.
+ */
+typedef struct _ioctl_usbip_vhci_get_ports_status_ex
+{
+	/* length of a whole status */
+	unsigned long	size;
+	unsigned long	version;
+	unsigned long	n_max_ports;
+	unsigned long	n_used_ports;
+	/* a port which vhci assigns next, or -1 if all are in use */
+	long		free_port;
+	/* a bit per port, set if it is in use. variable length */
+	unsigned char	port_status[1];
+} ioctl_usbip_vhci_get_ports_status_ex;
+
+#define VHCI_PORTS_STATUS_EX_SIZE(n_max_ports)	\
+	(FIELD_OFFSET(ioctl_usbip_vhci_get_ports_status_ex, port_status) + ((n_max_ports) + 7) / 8)
+#define VHCI_PORT_IS_USED(st, port)	(((st)->port_status[(port) / 8] >> ((port) % 8)) & 1)
+
 typedef struct _ioctl_usbip_vhci_unplug
 {
 	signed char addr;
 	char unused[3];
 } ioctl_usbip_vhci_unplug, *pvhci_unpluginfo_t;
 
+/* unplug of any port. vhci tells it from ioctl_usbip_vhci_unplug by a length */
+typedef struct _ioctl_usbip_vhci_unplug_ex
+{
+	/* ioctl_usbip_vhci_unplug_ex structure size */
+	unsigned long	size;
+	/* -1 for all ports */
+	int		port;
+} ioctl_usbip_vhci_unplug_ex;
+
 typedef struct usbip_imported_device {
-	char		port;
+	/*
+	 * It was a char. Its first byte is still where an old char was,
+	 * and an end of entries is marked by -1.
+	 */
+	int		port;
 	enum usbip_device_status	status;
 	unsigned short	vendor;
 	unsigned short	product;
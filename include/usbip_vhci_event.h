@@ -0,0 +1,55 @@
+#pragma once
+
+/*
+ * Changes of vhci ports, which IOCTL_USBIP_VHCI_GET_PORT_EVENTS reports.
+ * It has no dependency on Windows headers so that a consumer of events can
+ * be built anywhere.
+ *
+ * Every change gets a sequence number. A request asks for changes from a
+ * sequence number, and vhci keeps it pending until there's any. vhci keeps
+ * a limited number of latest changes. If older ones are asked for, a reply
+ * has VHCI_PORT_EVENTS_LOST and starts from the oldest one kept, which means
+ * a consumer should query imported devices again.
+ * An output buffer of VHCI_PORT_EVENTS_SIZE(0) bytes is not pended, and gets
+ * seq_next only. A consumer gets it before querying imported devices so that
+ * no change is missed in between.
+ */
+
+/* a device is attached to a port */
+#define VHCI_PORT_EV_PLUGGED	1
+/* a device is being detached, and a port is still in use. Only vhci(wdm) has this state */
+#define VHCI_PORT_EV_UNPLUGGED	2
+/* a port is free. vendor, product and speed may be 0 */
+#define VHCI_PORT_EV_REMOVED	3
+
+#define VHCI_PORT_EVENTS_LOST	0x1
+
+typedef struct _vhci_port_event {
+	unsigned int	seq;
+	unsigned short	type;
+	/* enum usb_device_speed as in ioctl_usbip_vhci_imported_dev */
+	unsigned char	speed;
+	unsigned char	unused;
+	int		port;
+	unsigned short	vendor;
+	unsigned short	product;
+} vhci_port_event_t;
+
+typedef struct _ioctl_usbip_vhci_get_port_events {
+	/* the first change wanted. 0 for changes from now on */
+	unsigned int	seq;
+} ioctl_usbip_vhci_get_port_events;
+
+typedef struct _ioctl_usbip_vhci_port_events {
+	/* length of a reply */
+	unsigned int	size;
+	/* a sequence number to ask for next */
+	unsigned int	seq_next;
+	unsigned int	flags;
+	unsigned int	n_events;
+	/* variable length */
+	vhci_port_event_t	events[1];
+} ioctl_usbip_vhci_port_events;
+
+#define VHCI_PORT_EVENTS_SIZE(n_events)	\
+	(sizeof(ioctl_usbip_vhci_port_events) - sizeof(vhci_port_event_t) + (n_events) * sizeof(vhci_port_event_t))
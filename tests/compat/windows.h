@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+ * just enough of windows.h for portable sources under test. A performance
+ * counter ticks in microseconds of compat_now_us, which a test advances.
+ */
+
+#include <stdint.h>
+/* windows.h brings in these */
+#include <string.h>
+#include <stdlib.h>
+
+typedef int		BOOL;
+typedef uint32_t	UINT32;
+typedef int64_t		LONGLONG;
+
+#define TRUE	1
+#define FALSE	0
+
+typedef union {
+	LONGLONG	QuadPart;
+} LARGE_INTEGER;
+
+/* tests run on a single thread */
+typedef struct {
+	void	*ptr;
+} SRWLOCK;
+
+#define SRWLOCK_INIT	{ 0 }
+
+#define AcquireSRWLockExclusive(lock)	((void)(lock))
+#define ReleaseSRWLockExclusive(lock)	((void)(lock))
+#define AcquireSRWLockShared(lock)	((void)(lock))
+#define ReleaseSRWLockShared(lock)	((void)(lock))
+
+extern LONGLONG	compat_now_us;
+
+static inline BOOL
+QueryPerformanceCounter(LARGE_INTEGER *pcount)
+{
+	pcount->QuadPart = compat_now_us;
+	return TRUE;
+}
+
+static inline BOOL
+QueryPerformanceFrequency(LARGE_INTEGER *pfreq)
+{
+	pfreq->QuadPart = 1000000;
+	return TRUE;
+}
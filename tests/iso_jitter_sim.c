@@ -0,0 +1,225 @@
+/*
+ * iso_jitter_sim: simulation of the jitter buffer timing core of vhci(ude)
+ *
+ * Completions of ISO IN transfers arrive with network jitter on a virtual
+ * clock, and are released as iso_jitter_pop_due() tells. Releases should keep
+ * a transfer period apart once primed, and under-runs and over-runs should be
+ * counted only where arrivals starve or flood a buffer.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "iso_jitter.h"
+
+#define N_XFERS_MAX	4096
+
+typedef struct {
+	unsigned long long	arrivals[N_XFERS_MAX];
+	unsigned	n_xfers;
+	unsigned long long	releases[N_XFERS_MAX];
+	unsigned	n_releases;
+	unsigned	n_held_max;
+} sim_t;
+
+static int	n_fails;
+
+static unsigned	rand_state = 0x2545f491;
+
+static unsigned
+rand_next(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static void
+check(int cond, const char *name, const char *fmt, ...)
+{
+	va_list	ap;
+
+	printf("%-6s %s: ", cond ? "ok" : "FAIL", name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!cond)
+		n_fails++;
+}
+
+/* completions of a TCP stream arrive in order, each not before its predecessor */
+static void
+gen_arrivals(sim_t *sim, unsigned n_xfers, unsigned long long period, unsigned long long jitter)
+{
+	unsigned long long	t_prev = 0;
+	unsigned	i;
+
+	sim->n_xfers = n_xfers;
+	for (i = 0; i < n_xfers; i++) {
+		unsigned long long	t = 10000 + i * period + (jitter > 0 ? rand_next() % (jitter + 1) : 0);
+
+		if (t < t_prev)
+			t = t_prev;
+		sim->arrivals[i] = t_prev = t;
+	}
+}
+
+/* a virtual clock goes to whichever of a next arrival or a due release comes first */
+static void
+run(sim_t *sim, iso_jitter_t *jit, unsigned long long period)
+{
+	unsigned long long	now = 0;
+	unsigned	idx = 0;
+
+	sim->n_releases = 0;
+	sim->n_held_max = 0;
+	while (idx < sim->n_xfers || jit->n_held > 0) {
+		unsigned long long	wait = iso_jitter_wait(jit, now);
+		unsigned	n_due, i;
+
+		if (idx < sim->n_xfers && (wait == ISO_JITTER_IDLE || sim->arrivals[idx] <= now + wait))
+			now = sim->arrivals[idx];
+		else if (wait != ISO_JITTER_IDLE)
+			now += wait;
+		else
+			break;
+
+		while (idx < sim->n_xfers && sim->arrivals[idx] <= now) {
+			iso_jitter_push(jit, now, period);
+			idx++;
+		}
+		n_due = iso_jitter_pop_due(jit, now);
+		for (i = 0; i < n_due && sim->n_releases < N_XFERS_MAX; i++)
+			sim->releases[sim->n_releases++] = now;
+		if (jit->n_held > sim->n_held_max)
+			sim->n_held_max = jit->n_held;
+	}
+}
+
+/* largest deviation from a period between releases from first to last */
+static unsigned long long
+max_gap_error(sim_t *sim, unsigned first, unsigned last, unsigned long long period)
+{
+	unsigned long long	err_max = 0;
+	unsigned	i;
+
+	for (i = first + 1; i <= last && i < sim->n_releases; i++) {
+		unsigned long long	gap = sim->releases[i] - sim->releases[i - 1];
+		unsigned long long	err = gap > period ? gap - period : period - gap;
+
+		if (err > err_max)
+			err_max = err;
+	}
+	return err_max;
+}
+
+static void
+test_period(void)
+{
+	check(iso_jitter_period_us(8, 1, 1) == 1000, "period", "8 packets, high speed: %llu us", iso_jitter_period_us(8, 1, 1));
+	check(iso_jitter_period_us(1, 1, 0) == 1000, "period", "1 packet, full speed: %llu us", iso_jitter_period_us(1, 1, 0));
+	check(iso_jitter_period_us(2, 4, 1) == 2000, "period", "2 packets, bInterval 4, high speed: %llu us", iso_jitter_period_us(2, 4, 1));
+}
+
+/* jitter within depth periods is absorbed: a steady cadence and no under-run or over-run */
+static void
+test_steady(void)
+{
+	static sim_t	sim;
+	iso_jitter_t	jit;
+	unsigned long long	period = 1000;
+
+	iso_jitter_init(&jit, 4);
+	gen_arrivals(&sim, 2000, period, 3 * period);
+	run(&sim, &jit, period);
+
+	check(sim.n_releases == sim.n_xfers, "steady", "%u of %u released", sim.n_releases, sim.n_xfers);
+	check(max_gap_error(&sim, 0, sim.n_releases - 1, period) == 0, "steady", "release gap error: %llu us, period %llu us",
+	      max_gap_error(&sim, 0, sim.n_releases - 1, period), period);
+	check(jit.n_underruns == 0, "steady", "under-runs: %lu", jit.n_underruns);
+	check(jit.n_overruns == 0, "steady", "over-runs: %lu", jit.n_overruns);
+	check(sim.n_held_max <= 2 * jit.depth, "steady", "held at most: %u, depth %u", sim.n_held_max, jit.depth);
+}
+
+/* a stall of a sender starves a buffer, which primes again and goes on steadily */
+static void
+test_underrun(void)
+{
+	static sim_t	sim;
+	iso_jitter_t	jit;
+	unsigned long long	period = 1000;
+	unsigned	i, idx_resume = 0;
+
+	iso_jitter_init(&jit, 4);
+	gen_arrivals(&sim, 1000, period, period / 2);
+	for (i = 500; i < sim.n_xfers; i++)
+		sim.arrivals[i] += 20 * period;
+	run(&sim, &jit, period);
+
+	for (i = 1; i < sim.n_releases; i++) {
+		if (sim.releases[i] - sim.releases[i - 1] > 10 * period)
+			idx_resume = i;
+	}
+	check(jit.n_underruns >= 1 && jit.n_underruns <= 2, "underrun", "under-runs: %lu", jit.n_underruns);
+	check(idx_resume > 0, "underrun", "releases resumed at %u", idx_resume);
+	check(max_gap_error(&sim, idx_resume, sim.n_releases - 1, period) == 0, "underrun", "gap error after a stall: %llu us",
+	      max_gap_error(&sim, idx_resume, sim.n_releases - 1, period));
+	check(sim.n_releases == sim.n_xfers, "underrun", "%u of %u released", sim.n_releases, sim.n_xfers);
+}
+
+/* a burst beyond twice depth is released at once and counted */
+static void
+test_overrun(void)
+{
+	static sim_t	sim;
+	iso_jitter_t	jit;
+	unsigned long long	period = 1000;
+	unsigned	i;
+
+	iso_jitter_init(&jit, 4);
+	gen_arrivals(&sim, 400, period, 0);
+	/* 32 completions held back by a network arrive together */
+	for (i = 200; i < 232; i++)
+		sim.arrivals[i] = sim.arrivals[232];
+	run(&sim, &jit, period);
+
+	check(jit.n_overruns > 0, "overrun", "over-runs: %lu", jit.n_overruns);
+	check(sim.n_held_max <= 2 * jit.depth, "overrun", "held at most: %u, depth %u", sim.n_held_max, jit.depth);
+	check(sim.n_releases == sim.n_xfers, "overrun", "%u of %u released", sim.n_releases, sim.n_xfers);
+}
+
+/* a class driver with fewer transfers outstanding than depth is not held forever */
+static void
+test_shallow(void)
+{
+	static sim_t	sim;
+	iso_jitter_t	jit;
+	unsigned long long	period = 1000;
+
+	iso_jitter_init(&jit, 8);
+	gen_arrivals(&sim, 2, period, 0);
+	run(&sim, &jit, period);
+
+	check(sim.n_releases == 2, "shallow", "%u of %u released", sim.n_releases, sim.n_xfers);
+	check(sim.n_releases > 0 && sim.releases[0] == sim.arrivals[0] + 8 * period, "shallow", "first release after %llu us, depth %u periods",
+	      sim.n_releases > 0 ? sim.releases[0] - sim.arrivals[0] : 0, jit.depth);
+}
+
+int
+main(void)
+{
+	test_period();
+	test_steady();
+	test_underrun();
+	test_overrun();
+	test_shallow();
+
+	if (n_fails > 0) {
+		printf("%d checks failed\n", n_fails);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * port_events_test: a consumer of vhci port changes against a mock source
+ *
+ * A mock source keeps a limited number of latest changes as vhci does, and
+ * replies to IOCTL_USBIP_VHCI_GET_PORT_EVENTS requests from them. A reply may
+ * be corrupted on purpose to check that a consumer rejects it.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "usbip_common.h"
+#include "usbip_port_events.h"
+
+int	usbip_use_stderr = 1;
+int	usbip_use_debug = 0;
+const char	*usbip_progname = "port_events_test";
+
+#define N_KEPT_MAX	64
+#define N_CBS_MAX	64
+
+typedef struct {
+	usbip_port_event_src_t	src;
+	/* latest changes, seq of events[i] is seq_first + i */
+	vhci_port_event_t	events[N_KEPT_MAX];
+	unsigned int	n_kept_max;
+	unsigned int	seq_first;
+	unsigned int	n_events;
+	/* what a last request asked for */
+	unsigned int	seq_asked;
+	unsigned int	len_asked;
+	/* a reply is corrupted by these if set */
+	int	err;
+	int	size_delta;
+	int	n_events_delta;
+} mock_src_t;
+
+typedef struct {
+	vhci_port_event_t	evs[N_CBS_MAX];
+	unsigned int	n_evs;
+} cbs_t;
+
+static int	n_fails;
+
+static void
+check(int cond, const char *name, const char *fmt, ...)
+{
+	va_list	ap;
+
+	printf("%-6s %s: ", cond ? "ok" : "FAIL", name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!cond)
+		n_fails++;
+}
+
+/* seq 0 is never given to a change, as in vhci */
+static void
+mock_init(mock_src_t *mock, unsigned int n_kept_max)
+{
+	memset(mock, 0, sizeof(*mock));
+	mock->src.ctx = mock;
+	mock->n_kept_max = n_kept_max;
+	mock->seq_first = 1;
+}
+
+static void
+mock_add(mock_src_t *mock, unsigned short type, int port)
+{
+	vhci_port_event_t	*ev;
+
+	if (mock->n_events == mock->n_kept_max) {
+		memmove(mock->events, mock->events + 1, sizeof(vhci_port_event_t) * (mock->n_kept_max - 1));
+		mock->n_events--;
+		mock->seq_first++;
+	}
+	ev = &mock->events[mock->n_events];
+	memset(ev, 0, sizeof(*ev));
+	ev->seq = mock->seq_first + mock->n_events;
+	ev->type = type;
+	ev->port = port;
+	ev->vendor = 0x1234;
+	ev->product = (unsigned short)port;
+	mock->n_events++;
+}
+
+static int
+mock_fetch(usbip_port_event_src_t *src, unsigned int seq, ioctl_usbip_vhci_port_events *evs, unsigned int len)
+{
+	mock_src_t	*mock = (mock_src_t *)src->ctx;
+	unsigned int	seq_next = mock->seq_first + mock->n_events;
+	unsigned int	n_room, n = 0;
+
+	mock->seq_asked = seq;
+	mock->len_asked = len;
+	if (mock->err < 0)
+		return mock->err;
+
+	evs->flags = 0;
+	if (len > VHCI_PORT_EVENTS_SIZE(0)) {
+		n_room = (len - (unsigned int)VHCI_PORT_EVENTS_SIZE(0)) / sizeof(vhci_port_event_t);
+		if (seq == 0)
+			seq = seq_next;
+		if (seq < mock->seq_first) {
+			evs->flags |= VHCI_PORT_EVENTS_LOST;
+			seq = mock->seq_first;
+		}
+		/* a mock never pends, so a request without any change gets none */
+		for (; seq < seq_next && n < n_room; seq++, n++)
+			evs->events[n] = mock->events[seq - mock->seq_first];
+		seq_next = seq;
+	}
+	evs->n_events = n + mock->n_events_delta;
+	evs->seq_next = seq_next;
+	evs->size = (unsigned int)VHCI_PORT_EVENTS_SIZE(n) + mock->size_delta;
+	return 0;
+}
+
+static void
+on_event(const vhci_port_event_t *ev, void *data)
+{
+	cbs_t	*cbs = (cbs_t *)data;
+
+	if (cbs->n_evs < N_CBS_MAX)
+		cbs->evs[cbs->n_evs++] = *ev;
+}
+
+/* callbacks got changes from seq_first in order, with nothing else */
+static int
+is_seq_run(cbs_t *cbs, unsigned int seq_first, unsigned int n)
+{
+	unsigned int	i;
+
+	if (cbs->n_evs != n)
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (cbs->evs[i].seq != seq_first + i)
+			return 0;
+	}
+	return 1;
+}
+
+/* changes before init are not reported. init asks for seq_next only */
+static void
+test_handshake(void)
+{
+	mock_src_t	mock;
+	usbip_port_events_t	pevs;
+	cbs_t	cbs = { 0 };
+	int	rc;
+
+	mock_init(&mock, 16);
+	mock.src.fetch = mock_fetch;
+	mock_add(&mock, VHCI_PORT_EV_PLUGGED, 1);
+	mock_add(&mock, VHCI_PORT_EV_PLUGGED, 2);
+	mock_add(&mock, VHCI_PORT_EV_REMOVED, 1);
+
+	rc = usbip_port_events_init(&pevs, &mock.src, 8);
+	check(rc == 0, "handshake", "init: %d", rc);
+	check(mock.len_asked == VHCI_PORT_EVENTS_SIZE(0) && mock.seq_asked == 0, "handshake",
+	      "init asked seq %u with %u bytes", mock.seq_asked, mock.len_asked);
+	check(pevs.seq == 4, "handshake", "changes start at seq %u", pevs.seq);
+
+	mock_add(&mock, VHCI_PORT_EV_PLUGGED, 3);
+	rc = usbip_port_events_wait(&pevs, on_event, &cbs);
+	check(mock.seq_asked == 4, "handshake", "wait asked seq %u", mock.seq_asked);
+	check(rc == 1 && is_seq_run(&cbs, 4, 1) && cbs.evs[0].port == 3 && cbs.evs[0].type == VHCI_PORT_EV_PLUGGED,
+	      "handshake", "%d reported, first seq %u", rc, cbs.n_evs > 0 ? cbs.evs[0].seq : 0);
+	check(!pevs.lost, "handshake", "lost: %d", pevs.lost);
+
+	usbip_port_events_cleanup(&pevs);
+}
+
+/* more changes than a reply holds come over waits, each from where a last one ended */
+static void
+test_incremental(void)
+{
+	mock_src_t	mock;
+	usbip_port_events_t	pevs;
+	cbs_t	cbs = { 0 };
+	unsigned int	seqs_asked[3];
+	int	rcs[3], i;
+
+	mock_init(&mock, 16);
+	mock.src.fetch = mock_fetch;
+	usbip_port_events_init(&pevs, &mock.src, 2);
+	for (i = 0; i < 5; i++)
+		mock_add(&mock, VHCI_PORT_EV_PLUGGED, i);
+
+	for (i = 0; i < 3; i++) {
+		rcs[i] = usbip_port_events_wait(&pevs, on_event, &cbs);
+		seqs_asked[i] = mock.seq_asked;
+	}
+	check(rcs[0] == 2 && rcs[1] == 2 && rcs[2] == 1, "incremental", "reported: %d, %d, %d", rcs[0], rcs[1], rcs[2]);
+	check(seqs_asked[0] == 1 && seqs_asked[1] == 3 && seqs_asked[2] == 5, "incremental", "asked seq %u, %u, %u",
+	      seqs_asked[0], seqs_asked[1], seqs_asked[2]);
+	check(is_seq_run(&cbs, 1, 5), "incremental", "%u changes in order from seq 1", cbs.n_evs);
+	check(pevs.seq == 6, "incremental", "next seq %u", pevs.seq);
+
+	/* nothing new is nothing reported */
+	rcs[0] = usbip_port_events_wait(&pevs, on_event, &cbs);
+	check(rcs[0] == 0 && cbs.n_evs == 5 && pevs.seq == 6, "incremental", "without changes: %d, next seq %u", rcs[0], pevs.seq);
+
+	usbip_port_events_cleanup(&pevs);
+}
+
+/* changes dropped by a source are flagged once, and a consumer goes on from the oldest kept */
+static void
+test_lost(void)
+{
+	mock_src_t	mock;
+	usbip_port_events_t	pevs;
+	cbs_t	cbs = { 0 };
+	int	rc, i;
+
+	mock_init(&mock, 4);
+	mock.src.fetch = mock_fetch;
+	usbip_port_events_init(&pevs, &mock.src, 8);
+	for (i = 0; i < 10; i++)
+		mock_add(&mock, VHCI_PORT_EV_PLUGGED, i);
+
+	rc = usbip_port_events_wait(&pevs, on_event, &cbs);
+	check(pevs.lost, "lost", "lost: %d", pevs.lost);
+	check(rc == 4 && is_seq_run(&cbs, 7, 4), "lost", "%d reported from seq %u", rc, cbs.n_evs > 0 ? cbs.evs[0].seq : 0);
+	check(pevs.seq == 11, "lost", "next seq %u", pevs.seq);
+
+	/* a consumer which has resynced is in step again */
+	cbs.n_evs = 0;
+	mock_add(&mock, VHCI_PORT_EV_UNPLUGGED, 9);
+	rc = usbip_port_events_wait(&pevs, on_event, &cbs);
+	check(!pevs.lost, "lost", "lost after resync: %d", pevs.lost);
+	check(rc == 1 && is_seq_run(&cbs, 11, 1), "lost", "%d reported after resync", rc);
+
+	usbip_port_events_cleanup(&pevs);
+}
+
+/* a reply whose size disagrees with its events is rejected before any callback */
+static void
+test_malformed(void)
+{
+	static const struct {
+		const char	*desc;
+		int	size_delta;
+		int	n_events_delta;
+	} cases[] = {
+		{ "short by a byte", -1, 0 },
+		{ "shorter than a header", -(int)VHCI_PORT_EVENTS_SIZE(2), 0 },
+		{ "longer by a byte", 1, 0 },
+		{ "more events than a size", 0, 1 },
+		{ "beyond a buffer", (int)sizeof(vhci_port_event_t) * 8, 8 },
+	};
+	unsigned int	i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		mock_src_t	mock;
+		usbip_port_events_t	pevs;
+		cbs_t	cbs = { 0 };
+		int	rc;
+
+		mock_init(&mock, 16);
+		mock.src.fetch = mock_fetch;
+		usbip_port_events_init(&pevs, &mock.src, 2);
+		mock_add(&mock, VHCI_PORT_EV_PLUGGED, 1);
+		mock_add(&mock, VHCI_PORT_EV_PLUGGED, 2);
+
+		mock.size_delta = cases[i].size_delta;
+		mock.n_events_delta = cases[i].n_events_delta;
+		rc = usbip_port_events_wait(&pevs, on_event, &cbs);
+		check(rc == ERR_PROTOCOL && cbs.n_evs == 0 && pevs.seq == 1, "malformed", "%s: %d, %u reported, next seq %u",
+		      cases[i].desc, rc, cbs.n_evs, pevs.seq);
+
+		/* a good reply after a bad one is taken */
+		mock.size_delta = mock.n_events_delta = 0;
+		rc = usbip_port_events_wait(&pevs, on_event, &cbs);
+		check(rc == 2 && is_seq_run(&cbs, 1, 2), "malformed", "%s: then %d reported", cases[i].desc, rc);
+
+		usbip_port_events_cleanup(&pevs);
+	}
+}
+
+/* an error of a source goes to a caller, and a consumer stays where it was */
+static void
+test_fetch_error(void)
+{
+	mock_src_t	mock;
+	usbip_port_events_t	pevs;
+	cbs_t	cbs = { 0 };
+	int	rc;
+
+	mock_init(&mock, 16);
+	mock.src.fetch = mock_fetch;
+	mock.err = ERR_DRIVER;
+	rc = usbip_port_events_init(&pevs, &mock.src, 8);
+	check(rc == ERR_DRIVER && pevs.evs == NULL, "fetch error", "init: %d", rc);
+
+	mock.err = 0;
+	usbip_port_events_init(&pevs, &mock.src, 8);
+	mock_add(&mock, VHCI_PORT_EV_PLUGGED, 1);
+	mock.err = ERR_DRIVER;
+	rc = usbip_port_events_wait(&pevs, on_event, &cbs);
+	check(rc == ERR_DRIVER && cbs.n_evs == 0 && pevs.seq == 1, "fetch error", "wait: %d, next seq %u", rc, pevs.seq);
+	usbip_port_events_cleanup(&pevs);
+
+	rc = usbip_port_events_init(&pevs, &mock.src, 0);
+	check(rc == ERR_INVARG, "fetch error", "init with no room: %d", rc);
+}
+
+int
+main(void)
+{
+	test_handshake();
+	test_incremental();
+	test_lost();
+	test_malformed();
+	test_fetch_error();
+
+	if (n_fails > 0) {
+		printf("%d checks failed\n", n_fails);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
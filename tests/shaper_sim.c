@@ -0,0 +1,247 @@
+/*
+ * shaper_sim: simulation of forwarders sharing usbip_shaper.c
+ *
+ * Each flow stands for a forwarder which always has bulk PDUs to send, or
+ * one charging priority PDUs at a rate. They ask for admission on a virtual
+ * clock, and go on right away or after the wait a shaper tells.
+ * Throughputs are measured after a warm-up.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "usbip_common.h"
+#include "usbip_shaper.h"
+
+int	usbip_use_stderr = 1;
+int	usbip_use_debug = 0;
+const char	*usbip_progname = "shaper_sim";
+
+LONGLONG	compat_now_us;
+
+#define MB	1000000ULL
+#define SEC	1000000LL
+#define LEN_BULK	16384
+#define LEN_PRIO	1024
+
+typedef struct {
+	usbip_shaper_dev_t	*sdev;
+	/* 0 for a flow of bulk PDUs */
+	unsigned long long	rate_prio;
+	/* a flow sends nothing before this */
+	LONGLONG	ts_start;
+	LONGLONG	ts_next;
+	unsigned long long	n_bytes;
+} flow_t;
+
+static int	n_fails;
+
+static void
+check(int cond, const char *name, const char *fmt, ...)
+{
+	va_list	ap;
+
+	printf("%-6s %s: ", cond ? "ok" : "FAIL", name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!cond)
+		n_fails++;
+}
+
+static int
+is_near(double val, double expected, double tolerance)
+{
+	return val >= expected * (1 - tolerance) && val <= expected * (1 + tolerance);
+}
+
+static double
+mbps(const flow_t *flow, LONGLONG duration)
+{
+	return (double)flow->n_bytes / duration;
+}
+
+/* starts a virtual clock and shaping. 0 is not a valid time for a shaper */
+static void
+setup(unsigned long long rate_link)
+{
+	compat_now_us = SEC;
+	usbip_shaper_setup(rate_link);
+}
+
+/* bytes sent from ts_from until ts_end are counted */
+static void
+run(flow_t *flows, int n_flows, LONGLONG ts_from, LONGLONG ts_end)
+{
+	int	i;
+
+	for (i = 0; i < n_flows; i++) {
+		flows[i].ts_next = flows[i].ts_start > compat_now_us ? flows[i].ts_start : compat_now_us;
+		flows[i].n_bytes = 0;
+	}
+	for (;;) {
+		flow_t	*flow = &flows[0];
+		unsigned long	wait;
+
+		for (i = 1; i < n_flows; i++) {
+			if (flows[i].ts_next < flow->ts_next)
+				flow = &flows[i];
+		}
+		if (flow->ts_next >= ts_end)
+			break;
+		compat_now_us = flow->ts_next;
+
+		if (flow->rate_prio > 0) {
+			usbip_shaper_charge(flow->sdev, LEN_PRIO);
+			if (compat_now_us >= ts_from)
+				flow->n_bytes += LEN_PRIO;
+			flow->ts_next += (LONGLONG)(LEN_PRIO * SEC / flow->rate_prio);
+			continue;
+		}
+		wait = usbip_shaper_admit(flow->sdev, LEN_BULK);
+		if (wait == 0) {
+			if (compat_now_us >= ts_from)
+				flow->n_bytes += LEN_BULK;
+		}
+		else
+			flow->ts_next += wait;
+	}
+	compat_now_us = ts_end;
+}
+
+static void
+close_flows(flow_t *flows, int n_flows)
+{
+	int	i;
+
+	for (i = 0; i < n_flows; i++) {
+		if (flows[i].rate_prio == 0)
+			usbip_shaper_close(flows[i].sdev);
+	}
+}
+
+/* two saturating devices share a link by weight */
+static void
+test_weights(void)
+{
+	flow_t	flows[2];
+	double	mbps1, mbps2;
+
+	memset(flows, 0, sizeof(flows));
+	setup(20 * MB);
+	flows[0].sdev = usbip_shaper_open(1, 1, 0);
+	flows[1].sdev = usbip_shaper_open(2, 4, 0);
+	run(flows, 2, 2 * SEC, 5 * SEC);
+
+	mbps1 = mbps(&flows[0], 3 * SEC);
+	mbps2 = mbps(&flows[1], 3 * SEC);
+	check(is_near(mbps1, 4, 0.05) && is_near(mbps2, 16, 0.05), "weights", "link 20 MB/s, weights 1:4: %.2f, %.2f MB/s",
+	      mbps1, mbps2);
+	check(flows[0].sdev->n_throttles > 0 && flows[1].sdev->n_throttles > 0, "weights", "throttles: %llu, %llu",
+	      flows[0].sdev->n_throttles, flows[1].sdev->n_throttles);
+	close_flows(flows, 2);
+}
+
+/* a capped device leaves the rest of a link to others */
+static void
+test_cap(void)
+{
+	flow_t	flows[2];
+	double	mbps1, mbps2;
+
+	memset(flows, 0, sizeof(flows));
+	setup(20 * MB);
+	flows[0].sdev = usbip_shaper_open(1, 1, 2 * MB);
+	flows[1].sdev = usbip_shaper_open(2, 4, 0);
+	run(flows, 2, 2 * SEC, 5 * SEC);
+
+	mbps1 = mbps(&flows[0], 3 * SEC);
+	mbps2 = mbps(&flows[1], 3 * SEC);
+	check(is_near(mbps1, 2, 0.05) && is_near(mbps2, 18, 0.05), "cap", "device 1 capped at 2 MB/s: %.2f, %.2f MB/s",
+	      mbps1, mbps2);
+	close_flows(flows, 2);
+}
+
+/* a device alone takes a whole link whatever its weight */
+static void
+test_alone(void)
+{
+	flow_t	flows[1];
+	usbip_shaper_dev_t	*sdev_idle;
+	double	mbps1;
+
+	memset(flows, 0, sizeof(flows));
+	setup(20 * MB);
+	flows[0].sdev = usbip_shaper_open(1, 1, 0);
+	sdev_idle = usbip_shaper_open(2, 4, 0);
+	run(flows, 1, 2 * SEC, 5 * SEC);
+
+	mbps1 = mbps(&flows[0], 3 * SEC);
+	check(is_near(mbps1, 20, 0.05), "alone", "weight 1 beside an idle device: %.2f MB/s", mbps1);
+	close_flows(flows, 1);
+	usbip_shaper_close(sdev_idle);
+}
+
+/* priority PDUs are not held, and bulk ones back off for them */
+static void
+test_priority(void)
+{
+	flow_t	flows[3];
+	double	mbps1, mbps2, mbps_prio;
+
+	memset(flows, 0, sizeof(flows));
+	setup(20 * MB);
+	flows[0].sdev = usbip_shaper_open(1, 1, 0);
+	flows[1].sdev = usbip_shaper_open(2, 4, 0);
+	flows[2].sdev = flows[1].sdev;
+	flows[2].rate_prio = 2 * MB;
+	run(flows, 3, 2 * SEC, 5 * SEC);
+
+	mbps1 = mbps(&flows[0], 3 * SEC);
+	mbps2 = mbps(&flows[1], 3 * SEC);
+	mbps_prio = mbps(&flows[2], 3 * SEC);
+	check(is_near(mbps_prio, 2, 0.01), "priority", "priority PDUs: %.2f MB/s", mbps_prio);
+	check(is_near(mbps1 + mbps2, 18, 0.05) && is_near(mbps2 / mbps1, 4, 0.05), "priority", "bulk beside them: %.2f, %.2f MB/s",
+	      mbps1, mbps2);
+	close_flows(flows, 3);
+}
+
+/* a device coming late is not credited for its idle time */
+static void
+test_late(void)
+{
+	flow_t	flows[2];
+	double	mbps1, mbps2;
+
+	memset(flows, 0, sizeof(flows));
+	setup(20 * MB);
+	flows[0].sdev = usbip_shaper_open(1, 1, 0);
+	flows[1].sdev = usbip_shaper_open(2, 4, 0);
+	flows[1].ts_start = 3 * SEC;
+	run(flows, 2, 3 * SEC, 3 * SEC + SEC / 2);
+
+	mbps1 = mbps(&flows[0], SEC / 2);
+	mbps2 = mbps(&flows[1], SEC / 2);
+	check(is_near(mbps1, 4, 0.1) && is_near(mbps2, 16, 0.1), "late", "first 0.5 s after weight 4 comes: %.2f, %.2f MB/s",
+	      mbps1, mbps2);
+	close_flows(flows, 2);
+}
+
+int
+main(void)
+{
+	test_weights();
+	test_cap();
+	test_alone();
+	test_priority();
+	test_late();
+
+	if (n_fails > 0) {
+		printf("%d checks failed\n", n_fails);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
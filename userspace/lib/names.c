@@ -33,282 +33,225 @@
 #include <ctype.h>
 
 #include "names.h"
+#include "names_db.h"
 #include "usbip_common.h"
 
-struct vendor {
-	struct vendor *next;
-	uint16_t vendorid;
-	char name[1];
-};
-
-struct product {
-	struct product *next;
-	uint16_t vendorid, productid;
-	char name[1];
-};
-
-struct class {
-	struct class *next;
-	uint8_t classid;
-	char name[1];
-};
-
-struct subclass {
-	struct subclass *next;
-	uint8_t classid, subclassid;
-	char name[1];
-};
-
-struct protocol {
-	struct protocol *next;
-	uint8_t classid, subclassid, protocolid;
-	char name[1];
-};
-
-struct audioterminal {
-	struct audioterminal *next;
-	uint16_t termt;
-	char name[1];
+/*
+ * Names are kept in open-addressing hash tables keyed the same way as the
+ * precompiled database(names_db.h). Table slots hold only the key and a name
+ * pointer, and the names themselves are packed into a few large arena chunks
+ * instead of being allocated one by one.
+ */
+struct name_entry {
+	uint32_t key;
+	const char *name;	/* NULL for an empty slot */
 };
 
-struct genericstrtable {
-        struct genericstrtable *next;
-        unsigned int num;
-        char name[1];
+struct name_table {
+	struct name_entry *entries;
+	unsigned int size;	/* always a power of two */
+	unsigned int count;
 };
 
+/* usb.ids has about 2.5k vendors and 20k products. Start from a size that rarely needs growing */
+#define INITSZ_VENDORS		4096
+#define INITSZ_PRODUCTS		32768
+#define INITSZ_CLASSES		64
+#define INITSZ_SUBCLASSES	256
+#define INITSZ_PROTOCOLS	512
 
-#define HASH1  0x10
-#define HASH2  0x02
-#define HASHSZ 16
+static struct name_table vendors, products, classes, subclasses, protocols;
 
-static unsigned int hashnum(unsigned int num)
+static unsigned int hashnum(uint32_t num, unsigned int size)
 {
-	unsigned int mask1 = HASH1 << 27, mask2 = HASH2 << 27;
+	uint32_t h = num * 0x9E3779B1u;
 
-	for (; mask1 >= HASH1; mask1 >>= 1, mask2 >>= 1)
-		if (num & mask1)
-			num ^= mask2;
-	return num & (HASHSZ-1);
+	/* multiplicative hashing spreads the packed vendor/product keys well */
+	return (h ^ (h >> 16)) & (size - 1);
 }
 
+static const char *table_lookup(const struct name_table *tbl, uint32_t key)
+{
+	unsigned int h;
+
+	if (tbl->entries == NULL)
+		return NULL;
 
-static struct vendor *vendors[HASHSZ] = { NULL, };
-static struct product *products[HASHSZ] = { NULL, };
-static struct class *classes[HASHSZ] = { NULL, };
-static struct subclass *subclasses[HASHSZ] = { NULL, };
-static struct protocol *protocols[HASHSZ] = { NULL, };
+	for (h = hashnum(key, tbl->size); tbl->entries[h].name != NULL; h = (h + 1) & (tbl->size - 1))
+		if (tbl->entries[h].key == key)
+			return tbl->entries[h].name;
+	return NULL;
+}
 
 const char *names_vendor(uint16_t vendorid)
 {
-	struct vendor *v;
-
-	v = vendors[hashnum(vendorid)];
-	for (; v; v = v->next)
-		if (v->vendorid == vendorid)
-			return v->name;
-	return NULL;
+	if (names_db_opened())
+		return names_db_lookup(NAMES_DB_VENDOR, NAMES_DB_KEY_VENDOR(vendorid));
+	return table_lookup(&vendors, NAMES_DB_KEY_VENDOR(vendorid));
 }
 
 const char *names_product(uint16_t vendorid, uint16_t productid)
 {
-	struct product *p;
-
-	p = products[hashnum((vendorid << 16) | productid)];
-	for (; p; p = p->next)
-		if (p->vendorid == vendorid && p->productid == productid)
-			return p->name;
-	return NULL;
+	if (names_db_opened())
+		return names_db_lookup(NAMES_DB_PRODUCT, NAMES_DB_KEY_PRODUCT(vendorid, productid));
+	return table_lookup(&products, NAMES_DB_KEY_PRODUCT(vendorid, productid));
 }
 
 const char *names_class(uint8_t classid)
 {
-	struct class *c;
-
-	c = classes[hashnum(classid)];
-	for (; c; c = c->next)
-		if (c->classid == classid)
-			return c->name;
-	return NULL;
+	if (names_db_opened())
+		return names_db_lookup(NAMES_DB_CLASS, NAMES_DB_KEY_CLASS(classid));
+	return table_lookup(&classes, NAMES_DB_KEY_CLASS(classid));
 }
 
 const char *names_subclass(uint8_t classid, uint8_t subclassid)
 {
-	struct subclass *s;
-
-	s = subclasses[hashnum((classid << 8) | subclassid)];
-	for (; s; s = s->next)
-		if (s->classid == classid && s->subclassid == subclassid)
-			return s->name;
-	return NULL;
+	if (names_db_opened())
+		return names_db_lookup(NAMES_DB_SUBCLASS, NAMES_DB_KEY_SUBCLASS(classid, subclassid));
+	return table_lookup(&subclasses, NAMES_DB_KEY_SUBCLASS(classid, subclassid));
 }
 
 const char *names_protocol(uint8_t classid, uint8_t subclassid, uint8_t protocolid)
 {
-	struct protocol *p;
-
-	p = protocols[hashnum((classid << 16) | (subclassid << 8) | protocolid)];
-	for (; p; p = p->next)
-		if (p->classid == classid && p->subclassid == subclassid && p->protocolid == protocolid)
-			return p->name;
-	return NULL;
+	if (names_db_opened())
+		return names_db_lookup(NAMES_DB_PROTOCOL, NAMES_DB_KEY_PROTOCOL(classid, subclassid, protocolid));
+	return table_lookup(&protocols, NAMES_DB_KEY_PROTOCOL(classid, subclassid, protocolid));
 }
 
 /* add a cleanup function by takahiro */
 
-struct pool {
-	struct pool *next;
-	void *mem;
+#define ARENA_CHUNKSZ	(64 * 1024)
+
+struct arena {
+	struct arena *next;
+	size_t used, size;
+	char mem[1];
 };
 
-static struct pool *pool_head;
+static struct arena *arena_head;
 
-static void *my_malloc(size_t size)
+static char *arena_strdup(const char *str)
 {
-	struct pool *p;
-
-	p = calloc(1, sizeof(struct pool));
-	if (!p) {
-		free(p);
-		return NULL;
+	struct arena *a = arena_head;
+	size_t len = strlen(str) + 1;
+	char *p;
+
+	if (a == NULL || a->size - a->used < len) {
+		size_t size = len > ARENA_CHUNKSZ ? len : ARENA_CHUNKSZ;
+
+		a = malloc(sizeof(struct arena) + size);
+		if (!a)
+			return NULL;
+		a->used = 0;
+		a->size = size;
+		a->next = arena_head;
+		arena_head = a;
 	}
+	p = a->mem + a->used;
+	memcpy(p, str, len);
+	a->used += len;
+	return p;
+}
 
-	p->mem = calloc(1, size);
-	if (!p->mem)
-		return NULL;
-
-	p->next = pool_head;
-	pool_head = p;
-
-	return p->mem;
+static void table_free(struct name_table *tbl)
+{
+	free(tbl->entries);
+	tbl->entries = NULL;
+	tbl->size = 0;
+	tbl->count = 0;
 }
 
 void names_free(void)
 {
-	struct pool *pool;
+	struct arena *a;
 
-	if (!pool_head)
-		return;
+	names_db_close();
 
-	for (pool = pool_head; pool != NULL; ) {
-		struct pool *tmp;
+	for (a = arena_head; a != NULL; ) {
+		struct arena *tmp;
 
-		if (pool->mem)
-			free(pool->mem);
-
-		tmp = pool;
-		pool = pool->next;
+		tmp = a;
+		a = a->next;
 		free(tmp);
 	}
+	arena_head = NULL;
+
+	table_free(&vendors);
+	table_free(&products);
+	table_free(&classes);
+	table_free(&subclasses);
+	table_free(&protocols);
 }
 
-static int new_vendor(const char *name, uint16_t vendorid)
+static int table_grow(struct name_table *tbl, unsigned int initsz)
 {
-	struct vendor *v;
-	unsigned int h = hashnum(vendorid);
-	size_t	namelen;
+	struct name_entry *entries;
+	unsigned int size, i;
 
-	v = vendors[h];
-	for (; v; v = v->next)
-		if (v->vendorid == vendorid)
-			return -1;
-	namelen = strlen(name);
-	v = my_malloc(sizeof(struct vendor) + namelen);
-	if (!v)
+	size = tbl->size ? tbl->size * 2 : initsz;
+	entries = calloc(size, sizeof(struct name_entry));
+	if (!entries)
 		return -1;
-	strcpy_s(v->name, namelen + 1, name);
-	v->vendorid = vendorid;
-	v->next = vendors[h];
-	vendors[h] = v;
+
+	for (i = 0; i < tbl->size; i++) {
+		unsigned int h;
+
+		if (tbl->entries[i].name == NULL)
+			continue;
+		for (h = hashnum(tbl->entries[i].key, size); entries[h].name != NULL; h = (h + 1) & (size - 1));
+		entries[h] = tbl->entries[i];
+	}
+	free(tbl->entries);
+	tbl->entries = entries;
+	tbl->size = size;
 	return 0;
 }
 
-static int new_product(const char *name, uint16_t vendorid, uint16_t productid)
+static int table_insert(struct name_table *tbl, unsigned int initsz, uint32_t key, const char *name)
 {
-	struct product *p;
-	unsigned int h = hashnum((vendorid << 16) | productid);
-	size_t	namelen;
+	unsigned int h;
+
+	/* keep load factor under 1/2 so that probe sequences stay short */
+	if ((tbl->count + 1) * 2 > tbl->size) {
+		if (table_grow(tbl, initsz) < 0)
+			return -1;
+	}
 
-	p = products[h];
-	for (; p; p = p->next)
-		if (p->vendorid == vendorid && p->productid == productid)
+	for (h = hashnum(key, tbl->size); tbl->entries[h].name != NULL; h = (h + 1) & (tbl->size - 1))
+		if (tbl->entries[h].key == key)
 			return -1;
-	namelen = strlen(name);
-	p = my_malloc(sizeof(struct product) + namelen);
-	if (!p)
+
+	tbl->entries[h].name = arena_strdup(name);
+	if (!tbl->entries[h].name)
 		return -1;
-	strcpy_s(p->name, namelen + 1, name);
-	p->vendorid = vendorid;
-	p->productid = productid;
-	p->next = products[h];
-	products[h] = p;
+	tbl->entries[h].key = key;
+	tbl->count++;
 	return 0;
 }
 
-static int new_class(const char *name, uint8_t classid)
+static int new_vendor(const char *name, uint16_t vendorid)
 {
-	struct class *c;
-	unsigned int h = hashnum(classid);
-	size_t	namelen;
+	return table_insert(&vendors, INITSZ_VENDORS, NAMES_DB_KEY_VENDOR(vendorid), name);
+}
 
-	c = classes[h];
-	for (; c; c = c->next)
-		if (c->classid == classid)
-			return -1;
-	namelen = strlen(name);
-	c = my_malloc(sizeof(struct class) + namelen);
-	if (!c)
-		return -1;
-	strcpy_s(c->name, namelen + 1, name);
-	c->classid = classid;
-	c->next = classes[h];
-	classes[h] = c;
-	return 0;
+static int new_product(const char *name, uint16_t vendorid, uint16_t productid)
+{
+	return table_insert(&products, INITSZ_PRODUCTS, NAMES_DB_KEY_PRODUCT(vendorid, productid), name);
 }
 
-static int new_subclass(const char *name, uint8_t classid, uint8_t subclassid)
+static int new_class(const char *name, uint8_t classid)
 {
-	struct subclass *s;
-	unsigned int h = hashnum((classid << 8) | subclassid);
-	size_t	namelen;
+	return table_insert(&classes, INITSZ_CLASSES, NAMES_DB_KEY_CLASS(classid), name);
+}
 
-	s = subclasses[h];
-	for (; s; s = s->next)
-		if (s->classid == classid && s->subclassid == subclassid)
-			return -1;
-	namelen = strlen(name);
-	s = my_malloc(sizeof(struct subclass) + namelen);
-	if (!s)
-		return -1;
-	strcpy_s(s->name, namelen + 1, name);
-	s->classid = classid;
-	s->subclassid = subclassid;
-	s->next = subclasses[h];
-	subclasses[h] = s;
-	return 0;
+static int new_subclass(const char *name, uint8_t classid, uint8_t subclassid)
+{
+	return table_insert(&subclasses, INITSZ_SUBCLASSES, NAMES_DB_KEY_SUBCLASS(classid, subclassid), name);
 }
 
 static int new_protocol(const char *name, uint8_t classid, uint8_t subclassid, uint8_t protocolid)
 {
-	struct protocol *p;
-	unsigned int h = hashnum((classid << 16) | (subclassid << 8) | protocolid);
-	size_t	namelen;
-
-	p = protocols[h];
-	for (; p; p = p->next)
-		if (p->classid == classid && p->subclassid == subclassid && p->protocolid == protocolid)
-			return -1;
-	namelen = strlen(name);
-	p = my_malloc(sizeof(struct protocol) + namelen);
-	if (!p)
-		return -1;
-	strcpy_s(p->name, namelen + 1, name);
-	p->classid = classid;
-	p->subclassid = subclassid;
-	p->protocolid = protocolid;
-	p->next = protocols[h];
-	protocols[h] = p;
-	return 0;
+	return table_insert(&protocols, INITSZ_PROTOCOLS, NAMES_DB_KEY_PROTOCOL(classid, subclassid, protocolid), name);
 }
 
 static void parse(FILE *f)
@@ -505,3 +448,49 @@ int names_init(const char *path)
 	fclose(f);
 	return 0;
 }
+
+int names_init_db(const char *path)
+{
+	return names_db_open(path);
+}
+
+/* collect all entries of the text tables and write a precompiled database */
+int names_save_db(const char *path)
+{
+	struct name_table *tables[NAMES_DB_N_TABLES];
+	names_db_rec_t	*recs[NAMES_DB_N_TABLES];
+	unsigned	counts[NAMES_DB_N_TABLES];
+	int	i, ret;
+
+	tables[NAMES_DB_VENDOR] = &vendors;
+	tables[NAMES_DB_PRODUCT] = &products;
+	tables[NAMES_DB_CLASS] = &classes;
+	tables[NAMES_DB_SUBCLASS] = &subclasses;
+	tables[NAMES_DB_PROTOCOL] = &protocols;
+
+	for (i = 0; i < NAMES_DB_N_TABLES; i++) {
+		struct name_table *tbl = tables[i];
+		unsigned int h;
+
+		recs[i] = (names_db_rec_t *)malloc(sizeof(names_db_rec_t) * (tbl->count + 1));
+		if (recs[i] == NULL) {
+			while (--i >= 0)
+				free(recs[i]);
+			return ERR_GENERAL;
+		}
+		counts[i] = 0;
+		for (h = 0; h < tbl->size; h++) {
+			if (tbl->entries[h].name == NULL)
+				continue;
+			recs[i][counts[i]].key = tbl->entries[h].key;
+			recs[i][counts[i]].name = tbl->entries[h].name;
+			counts[i]++;
+		}
+	}
+
+	ret = names_db_write(path, recs, counts);
+
+	for (i = 0; i < NAMES_DB_N_TABLES; i++)
+		free(recs[i]);
+	return ret;
+}
@@ -42,6 +42,8 @@ extern const char *names_subclass(uint8_t classid, uint8_t subclassid);
 extern const char *names_protocol(uint8_t classid, uint8_t subclassid, uint8_t protocolid);
 
 extern int  names_init(const char *path);
+extern int  names_init_db(const char *path);
+extern int  names_save_db(const char *path);
 extern void names_free(void);
 
 #endif /* _NAMES_H */
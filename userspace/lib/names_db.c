@@ -0,0 +1,230 @@
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names_db.h"
+#include "usbip_common.h"
+
+static HANDLE	hfile_db = INVALID_HANDLE_VALUE;
+static HANDLE	hmap_db;
+static const char	*db;
+
+static int
+check_db(const char *base, DWORD size)
+{
+	const names_db_hdr_t	*hdr = (const names_db_hdr_t *)base;
+	int	i;
+
+	if (size < sizeof(names_db_hdr_t)) {
+		dbg("too small usb id database: %lu", size);
+		return -1;
+	}
+	if (memcmp(hdr->magic, NAMES_DB_MAGIC, sizeof(hdr->magic)) != 0) {
+		dbg("invalid usb id database magic");
+		return -1;
+	}
+	if (hdr->version != NAMES_DB_VERSION) {
+		dbg("unsupported usb id database version: %u", hdr->version);
+		return -1;
+	}
+	if (hdr->size != size) {
+		dbg("usb id database size mismatch: %u != %lu", hdr->size, size);
+		return -1;
+	}
+	for (i = 0; i < NAMES_DB_N_TABLES; i++) {
+		const names_db_table_t	*tbl = &hdr->tables[i];
+
+		if (tbl->offset > size || tbl->count > (size - tbl->offset) / sizeof(names_db_entry_t)) {
+			dbg("invalid usb id database table: %d", i);
+			return -1;
+		}
+	}
+	if (hdr->off_strs > size || hdr->len_strs > size - hdr->off_strs) {
+		dbg("invalid usb id database string pool");
+		return -1;
+	}
+	/* string pool should be terminated so that any lookup result is a valid C string */
+	if (hdr->len_strs == 0 || base[hdr->off_strs + hdr->len_strs - 1] != '\0') {
+		dbg("unterminated usb id database string pool");
+		return -1;
+	}
+	return 0;
+}
+
+int
+names_db_open(const char *path)
+{
+	const char	*base;
+	DWORD	size;
+
+	names_db_close();
+
+	hfile_db = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hfile_db == INVALID_HANDLE_VALUE)
+		return ERR_NOTEXIST;
+
+	size = GetFileSize(hfile_db, NULL);
+	if (size == INVALID_FILE_SIZE || size == 0) {
+		CloseHandle(hfile_db);
+		hfile_db = INVALID_HANDLE_VALUE;
+		return ERR_GENERAL;
+	}
+
+	hmap_db = CreateFileMapping(hfile_db, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hmap_db == NULL) {
+		dbg("failed to create file mapping: 0x%lx", GetLastError());
+		CloseHandle(hfile_db);
+		hfile_db = INVALID_HANDLE_VALUE;
+		return ERR_GENERAL;
+	}
+
+	base = (const char *)MapViewOfFile(hmap_db, FILE_MAP_READ, 0, 0, 0);
+	if (base == NULL) {
+		dbg("failed to map usb id database: 0x%lx", GetLastError());
+		CloseHandle(hmap_db);
+		CloseHandle(hfile_db);
+		hmap_db = NULL;
+		hfile_db = INVALID_HANDLE_VALUE;
+		return ERR_GENERAL;
+	}
+
+	if (check_db(base, size) < 0) {
+		UnmapViewOfFile(base);
+		CloseHandle(hmap_db);
+		CloseHandle(hfile_db);
+		hmap_db = NULL;
+		hfile_db = INVALID_HANDLE_VALUE;
+		return ERR_VERSION;
+	}
+
+	db = base;
+	return 0;
+}
+
+void
+names_db_close(void)
+{
+	if (db != NULL) {
+		UnmapViewOfFile(db);
+		db = NULL;
+	}
+	if (hmap_db != NULL) {
+		CloseHandle(hmap_db);
+		hmap_db = NULL;
+	}
+	if (hfile_db != INVALID_HANDLE_VALUE) {
+		CloseHandle(hfile_db);
+		hfile_db = INVALID_HANDLE_VALUE;
+	}
+}
+
+int
+names_db_opened(void)
+{
+	return db != NULL;
+}
+
+const char *
+names_db_lookup(int table, uint32_t key)
+{
+	const names_db_hdr_t	*hdr = (const names_db_hdr_t *)db;
+	const names_db_entry_t	*entries;
+	uint32_t	lo, hi;
+
+	if (db == NULL)
+		return NULL;
+
+	entries = (const names_db_entry_t *)(db + hdr->tables[table].offset);
+	lo = 0;
+	hi = hdr->tables[table].count;
+	while (lo < hi) {
+		uint32_t	mid = lo + (hi - lo) / 2;
+
+		if (entries[mid].key == key) {
+			if (entries[mid].off_name >= hdr->len_strs)
+				return NULL;
+			return db + hdr->off_strs + entries[mid].off_name;
+		}
+		if (entries[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static int
+compare_rec(const void *a, const void *b)
+{
+	const names_db_rec_t	*ra = (const names_db_rec_t *)a;
+	const names_db_rec_t	*rb = (const names_db_rec_t *)b;
+
+	if (ra->key < rb->key)
+		return -1;
+	if (ra->key > rb->key)
+		return 1;
+	return 0;
+}
+
+int
+names_db_write(const char *path, names_db_rec_t *recs[NAMES_DB_N_TABLES], unsigned counts[NAMES_DB_N_TABLES])
+{
+	names_db_hdr_t	hdr;
+	FILE	*f;
+	uint32_t	off, off_name;
+	int	i;
+	unsigned	j;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, NAMES_DB_MAGIC, sizeof(hdr.magic));
+	hdr.version = NAMES_DB_VERSION;
+
+	off = sizeof(hdr);
+	for (i = 0; i < NAMES_DB_N_TABLES; i++) {
+		qsort(recs[i], counts[i], sizeof(names_db_rec_t), compare_rec);
+		hdr.tables[i].offset = off;
+		hdr.tables[i].count = counts[i];
+		off += counts[i] * sizeof(names_db_entry_t);
+	}
+	hdr.off_strs = off;
+	/* leading empty string keeps the pool non-empty and terminated */
+	hdr.len_strs = 1;
+	for (i = 0; i < NAMES_DB_N_TABLES; i++) {
+		for (j = 0; j < counts[i]; j++)
+			hdr.len_strs += (uint32_t)strlen(recs[i][j].name) + 1;
+	}
+	hdr.size = hdr.off_strs + hdr.len_strs;
+
+	if (fopen_s(&f, path, "wb") != 0) {
+		dbg("failed to create: %s", path);
+		return ERR_ACCESS;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	off_name = 1;
+	for (i = 0; i < NAMES_DB_N_TABLES; i++) {
+		for (j = 0; j < counts[i]; j++) {
+			names_db_entry_t	entry;
+
+			entry.key = recs[i][j].key;
+			entry.off_name = off_name;
+			fwrite(&entry, sizeof(entry), 1, f);
+			off_name += (uint32_t)strlen(recs[i][j].name) + 1;
+		}
+	}
+
+	fputc('\0', f);
+	for (i = 0; i < NAMES_DB_N_TABLES; i++) {
+		for (j = 0; j < counts[i]; j++)
+			fwrite(recs[i][j].name, strlen(recs[i][j].name) + 1, 1, f);
+	}
+
+	if (ferror(f)) {
+		dbg("failed to write: %s", path);
+		fclose(f);
+		return ERR_GENERAL;
+	}
+	fclose(f);
+	return 0;
+}
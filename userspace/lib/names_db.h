@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Precompiled usb.ids database.
+ *
+ * The file consists of a header, one sorted (key, name offset) array per
+ * table and a string pool. It is mapped read-only as is and looked up with
+ * a binary search, so no parsing or allocation happens at startup.
+ * All integers are little-endian.
+ */
+
+#define NAMES_DB_MAGIC		"USBIPIDS"
+#define NAMES_DB_VERSION	1
+
+#define NAMES_DB_VENDOR		0
+#define NAMES_DB_PRODUCT	1
+#define NAMES_DB_CLASS		2
+#define NAMES_DB_SUBCLASS	3
+#define NAMES_DB_PROTOCOL	4
+#define NAMES_DB_N_TABLES	5
+
+#define NAMES_DB_KEY_VENDOR(v)			((uint32_t)(v))
+#define NAMES_DB_KEY_PRODUCT(v, p)		(((uint32_t)(v) << 16) | (p))
+#define NAMES_DB_KEY_CLASS(c)			((uint32_t)(c))
+#define NAMES_DB_KEY_SUBCLASS(c, s)		(((uint32_t)(c) << 8) | (s))
+#define NAMES_DB_KEY_PROTOCOL(c, s, p)		(((uint32_t)(c) << 16) | ((uint32_t)(s) << 8) | (p))
+
+#pragma pack(push, 1)
+
+typedef struct {
+	uint32_t	offset;		/* offset of names_db_entry_t array from file start */
+	uint32_t	count;
+} names_db_table_t;
+
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	size;		/* total file size */
+	names_db_table_t	tables[NAMES_DB_N_TABLES];
+	uint32_t	off_strs;	/* string pool offset from file start */
+	uint32_t	len_strs;
+} names_db_hdr_t;
+
+typedef struct {
+	uint32_t	key;
+	uint32_t	off_name;	/* offset into string pool */
+} names_db_entry_t;
+
+#pragma pack(pop)
+
+/* a record handed to the writer */
+typedef struct {
+	uint32_t	key;
+	const char	*name;
+} names_db_rec_t;
+
+int names_db_open(const char *path);
+void names_db_close(void);
+int names_db_opened(void);
+const char *names_db_lookup(int table, uint32_t key);
+
+int names_db_write(const char *path, names_db_rec_t *recs[NAMES_DB_N_TABLES], unsigned counts[NAMES_DB_N_TABLES]);
@@ -0,0 +1,338 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_capture.h"
+#include "usbip_pcap.h"
+
+#define CAPTURE_RING_MB_DEFAULT	16
+#define CAPTURE_MAX_STREAMS	256
+/* writer thread drains the ring at least every CAPTURE_DRAIN_MS */
+#define CAPTURE_DRAIN_MS	10
+
+#define CAPREC_FREE	0
+#define CAPREC_READY	1
+#define CAPREC_PAD	2
+
+/* record header in the ring. Records are aligned to CAPREC_ALIGN */
+typedef struct {
+	volatile LONG	state;
+	ULONG	size;		/* record size including this header */
+	ULONG	len;		/* PDU length */
+	USHORT	stream;
+	UCHAR	is_req;
+	/* generation of a stream slot, see write_record() */
+	UCHAR	gen;
+	LONGLONG	ts_us;		/* unix time in microseconds */
+} caprec_t;
+
+#define CAPREC_ALIGN	32
+#define CAPREC_SIZE(len)	((sizeof(caprec_t) + (len) + CAPREC_ALIGN - 1) & ~((ULONG)CAPREC_ALIGN - 1))
+
+typedef struct {
+	char	*buf;
+	LONGLONG	size;
+	volatile LONGLONG	head;	/* reserved by producers */
+	volatile LONGLONG	tail;	/* consumed by the writer */
+	volatile LONG	n_dropped;
+} capring_t;
+
+static capring_t	ring;
+static usbip_pcap_stream_t	streams[CAPTURE_MAX_STREAMS];
+/*
+ * A slot of a stream is taken by a connection until it is closed, and its
+ * generation goes up each time it is taken. Records of a former user may be
+ * still in the ring, so the writer resets a stream when a generation changes.
+ */
+static BOOL	streams_used[CAPTURE_MAX_STREAMS];
+static UCHAR	streams_gen[CAPTURE_MAX_STREAMS];
+static int	idx_stream_next;
+static SRWLOCK	lock_streams = SRWLOCK_INIT;
+/* only the writer touches these */
+static UCHAR	streams_gen_written[CAPTURE_MAX_STREAMS];
+static unsigned	streams_n_conns[CAPTURE_MAX_STREAMS];
+static FILE	*fp_cap;
+static HANDLE	hthread_writer, hevt_stop;
+static volatile BOOL	capturing;
+/* usbipd runs a forwarder per device, all of which share a capture */
+static LONG	refcnt;
+static SRWLOCK	lock_start = SRWLOCK_INIT;
+
+static LONGLONG
+get_unix_time_us(void)
+{
+	FILETIME	ft;
+	ULONGLONG	t;
+
+	GetSystemTimePreciseAsFileTime(&ft);
+	t = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	/* FILETIME counts 100ns from 1601-01-01 */
+	return (LONGLONG)((t - 116444736000000000ULL) / 10);
+}
+
+char *
+usbip_capture_reserve(int stream, BOOL is_req, unsigned long len)
+{
+	caprec_t	*rec;
+	LONGLONG	head, pos, size_pad;
+	ULONG	size;
+
+	if (!capturing)
+		return NULL;
+
+	size = CAPREC_SIZE(len);
+	if (size > ring.size / 4) {
+		InterlockedIncrement(&ring.n_dropped);
+		return NULL;
+	}
+
+	for (;;) {
+		head = ring.head;
+		pos = head & (ring.size - 1);
+		/* a record never wraps around. Fill up the end of ring with padding */
+		size_pad = (pos + size > ring.size) ? ring.size - pos : 0;
+		if (head + size_pad + size - ring.tail > ring.size) {
+			InterlockedIncrement(&ring.n_dropped);
+			return NULL;
+		}
+		if (InterlockedCompareExchange64(&ring.head, head + size_pad + size, head) == head)
+			break;
+	}
+
+	if (size_pad > 0) {
+		caprec_t	*pad = (caprec_t *)(ring.buf + pos);
+
+		pad->size = (ULONG)size_pad;
+		InterlockedExchange(&pad->state, CAPREC_PAD);
+		pos = 0;
+	}
+
+	rec = (caprec_t *)(ring.buf + pos);
+	rec->size = size;
+	rec->len = len;
+	rec->stream = (USHORT)stream;
+	rec->is_req = (UCHAR)is_req;
+	rec->gen = streams_gen[stream];
+	rec->ts_us = get_unix_time_us();
+	return (char *)(rec + 1);
+}
+
+void
+usbip_capture_commit(char *buf)
+{
+	caprec_t	*rec = (caprec_t *)buf - 1;
+
+	InterlockedExchange(&rec->state, CAPREC_READY);
+}
+
+int
+usbip_capture_open_stream(void)
+{
+	int	stream = -1;
+	int	i;
+
+	AcquireSRWLockExclusive(&lock_streams);
+	for (i = 0; i < CAPTURE_MAX_STREAMS; i++) {
+		int	idx = (idx_stream_next + i) % CAPTURE_MAX_STREAMS;
+
+		if (!streams_used[idx]) {
+			stream = idx;
+			streams_used[idx] = TRUE;
+			streams_gen[idx]++;
+			idx_stream_next = (idx + 1) % CAPTURE_MAX_STREAMS;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_streams);
+
+	if (stream < 0)
+		dbg("capture: no stream available");
+	return stream;
+}
+
+void
+usbip_capture_close_stream(int stream)
+{
+	AcquireSRWLockExclusive(&lock_streams);
+	streams_used[stream] = FALSE;
+	ReleaseSRWLockExclusive(&lock_streams);
+}
+
+/* a connection taking a slot again is written with another client port */
+static void
+write_record(const caprec_t *rec)
+{
+	if (streams_gen_written[rec->stream] != rec->gen) {
+		streams_gen_written[rec->stream] = rec->gen;
+		usbip_pcap_init_stream(&streams[rec->stream], rec->stream + streams_n_conns[rec->stream] * CAPTURE_MAX_STREAMS);
+		streams_n_conns[rec->stream]++;
+	}
+	usbip_pcap_write_pdu(fp_cap, &streams[rec->stream], rec->is_req, rec->ts_us, (const char *)(rec + 1), rec->len);
+}
+
+/*
+ * A later record header may be placed at any aligned offset of a consumed
+ * region. Its state should read as free until the producer commits it.
+ */
+static void
+clear_states(char *buf, ULONG size)
+{
+	ULONG	off;
+
+	for (off = 0; off < size; off += CAPREC_ALIGN)
+		((caprec_t *)(buf + off))->state = CAPREC_FREE;
+}
+
+static void
+drain_ring(void)
+{
+	while (ring.tail != ring.head) {
+		caprec_t	*rec = (caprec_t *)(ring.buf + (ring.tail & (ring.size - 1)));
+		LONG	state = rec->state;
+		ULONG	size;
+
+		if (state == CAPREC_FREE) {
+			/* reserved but not yet committed */
+			break;
+		}
+		MemoryBarrier();
+		size = rec->size;
+		if (state == CAPREC_READY)
+			write_record(rec);
+		clear_states((char *)rec, size);
+		MemoryBarrier();
+		ring.tail += size;
+	}
+}
+
+static DWORD WINAPI
+capture_writer(LPVOID ctx)
+{
+	UNREFERENCED_PARAMETER(ctx);
+
+	while (WaitForSingleObject(hevt_stop, CAPTURE_DRAIN_MS) == WAIT_TIMEOUT)
+		drain_ring();
+	drain_ring();
+	return 0;
+}
+
+static BOOL
+get_capture_env(char *path, size_t size, LONGLONG *pring_size)
+{
+	char	env_ring[32];
+	size_t	reqsize;
+	unsigned	mb;
+
+	if (getenv_s(&reqsize, path, size, "USBIP_CAPTURE") != 0 || reqsize == 0)
+		return FALSE;
+
+	mb = CAPTURE_RING_MB_DEFAULT;
+	if (getenv_s(&reqsize, env_ring, sizeof(env_ring), "USBIP_CAPTURE_RING") == 0 && reqsize > 0) {
+		if (sscanf_s(env_ring, "%u", &mb) != 1 || mb == 0)
+			mb = CAPTURE_RING_MB_DEFAULT;
+	}
+	*pring_size = 1024 * 1024;
+	/* ring size should be a power of 2 */
+	while (*pring_size < (LONGLONG)mb * 1024 * 1024 && *pring_size < (1LL << 30))
+		*pring_size <<= 1;
+	return TRUE;
+}
+
+static BOOL
+open_capture(const char *path)
+{
+	if (fopen_s(&fp_cap, path, "wb") != 0) {
+		dbg("failed to open capture file: %s", path);
+		return FALSE;
+	}
+	setvbuf(fp_cap, NULL, _IOFBF, 1024 * 1024);
+
+	if (!usbip_pcap_write_header(fp_cap)) {
+		fclose(fp_cap);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL
+usbip_capture_start(void)
+{
+	char	path[MAX_PATH];
+	LONGLONG	ring_size;
+	BOOL	res = FALSE;
+
+	AcquireSRWLockExclusive(&lock_start);
+
+	if (refcnt > 0) {
+		refcnt++;
+		res = TRUE;
+		goto out;
+	}
+
+	if (!get_capture_env(path, sizeof(path), &ring_size))
+		goto out;
+
+	ring.buf = (char *)calloc(1, (size_t)ring_size);
+	if (ring.buf == NULL) {
+		dbg("out of memory: capture ring");
+		goto out;
+	}
+	ring.size = ring_size;
+	ring.head = ring.tail = 0;
+	ring.n_dropped = 0;
+	/* streams are closed while a capture is stopped */
+	memset(streams_gen_written, 0, sizeof(streams_gen_written));
+	memset(streams_gen, 0, sizeof(streams_gen));
+	memset(streams_n_conns, 0, sizeof(streams_n_conns));
+
+	if (!open_capture(path)) {
+		free(ring.buf);
+		goto out;
+	}
+
+	hevt_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	hthread_writer = CreateThread(NULL, 0, capture_writer, NULL, 0, NULL);
+	if (hevt_stop == NULL || hthread_writer == NULL) {
+		dbg("failed to create capture writer");
+		if (hevt_stop != NULL)
+			CloseHandle(hevt_stop);
+		fclose(fp_cap);
+		free(ring.buf);
+		goto out;
+	}
+
+	capturing = TRUE;
+	refcnt = 1;
+	res = TRUE;
+	info("capturing PDUs to %s", path);
+out:
+	ReleaseSRWLockExclusive(&lock_start);
+	return res;
+}
+
+void
+usbip_capture_stop(void)
+{
+	AcquireSRWLockExclusive(&lock_start);
+
+	if (refcnt == 0 || --refcnt > 0) {
+		ReleaseSRWLockExclusive(&lock_start);
+		return;
+	}
+
+	capturing = FALSE;
+	SetEvent(hevt_stop);
+	WaitForSingleObject(hthread_writer, INFINITE);
+	CloseHandle(hthread_writer);
+	CloseHandle(hevt_stop);
+
+	if (ring.n_dropped > 0)
+		info("capture: %ld PDUs dropped", ring.n_dropped);
+
+	fclose(fp_cap);
+	free(ring.buf);
+	ring.buf = NULL;
+
+	ReleaseSRWLockExclusive(&lock_start);
+}
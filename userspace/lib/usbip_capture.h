@@ -0,0 +1,26 @@
+#pragma once
+
+#include <windows.h>
+
+/*
+ * PDU capture into a pcap file.
+ *
+ * Capture is enabled at runtime by setting USBIP_CAPTURE to a file path.
+ * USBIP_CAPTURE_RING optionally sets the ring size in MB(default: 16).
+ *
+ * Forwarders copy whole PDUs(header, payload and ISO descriptors) into a
+ * lock-free ring, and a background thread writes them out. A full ring drops
+ * PDUs instead of blocking the forwarder.
+ * Each forwarder connection is written as a TCP stream(see usbip_pcap.h).
+ */
+
+BOOL usbip_capture_start(void);
+void usbip_capture_stop(void);
+
+/* -1 if all streams are taken. A stream is closed before a capture is stopped */
+int usbip_capture_open_stream(void);
+void usbip_capture_close_stream(int stream);
+
+/* is_req: CMD_SUBMIT/CMD_UNLINK(client to server) or not */
+char *usbip_capture_reserve(int stream, BOOL is_req, unsigned long len);
+void usbip_capture_commit(char *buf);
@@ -114,23 +114,49 @@ void dump_usb_device(struct usbip_usb_device *udev)
 	DBG_UDEV_INTEGER(devnum);
 }
 
+/*
+ * The names database is shared by all users in a process (e.g. qtgui keeps it
+ * loaded while listing ports), so it is loaded once and reference counted.
+ */
+static int	names_refcnt;
+
 int usbip_names_init(void)
 {
 	char	*fpath_db, *fpath_mod;
 	int	ret;
 
+	if (names_refcnt > 0) {
+		names_refcnt++;
+		return 0;
+	}
+
 	fpath_mod = get_module_dir();
+
+	/* precompiled database is mapped as is. Fall back to parsing usb.ids */
+	asprintf(&fpath_db, "%s\\usb.ids.bin", fpath_mod);
+	ret = names_init_db(fpath_db);
+	free(fpath_db);
+	if (ret == 0) {
+		free(fpath_mod);
+		names_refcnt = 1;
+		return 0;
+	}
+
 	asprintf(&fpath_db, "%s\\usb.ids", fpath_mod);
 	free(fpath_mod);
 
 	ret = names_init(fpath_db);
 	free(fpath_db);
+	if (ret == 0)
+		names_refcnt = 1;
 
 	return ret;
 }
 
 void usbip_names_free()
 {
+	if (names_refcnt > 0 && --names_refcnt > 0)
+		return;
 	names_free();
 }
 
@@ -0,0 +1,240 @@
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "usbip_compact.h"
+
+#define FLAG_DIR_IN		0x04
+#define DEVID_MODE_SHIFT	3
+#define DEVID_MODE_MASK		0x18
+#define FLAG_SETUP		0x20
+#define FLAG_ZIP		0x40
+
+static char *
+put_varint(char *p, UINT32 val)
+{
+	while (val >= 0x80) {
+		*p++ = (char)(val | 0x80);
+		val >>= 7;
+	}
+	*p++ = (char)val;
+	return p;
+}
+
+static char *
+put_zigzag(char *p, INT32 val)
+{
+	return put_varint(p, ((UINT32)val << 1) ^ (UINT32)(val >> 31));
+}
+
+static BOOL
+get_varint(const char **pp, const char *end, UINT32 *pval)
+{
+	const unsigned char	*p = (const unsigned char *)*pp;
+	UINT32	val = 0;
+	int	shift;
+
+	for (shift = 0; shift < 35; shift += 7) {
+		if (p == (const unsigned char *)end)
+			return FALSE;
+		val |= (UINT32)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pp = (const char *)p;
+			*pval = val;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static BOOL
+get_zigzag(const char **pp, const char *end, INT32 *pval)
+{
+	UINT32	val;
+
+	if (!get_varint(pp, end, &val))
+		return FALSE;
+	*pval = (INT32)(val >> 1) ^ -(INT32)(val & 1);
+	return TRUE;
+}
+
+static BOOL
+is_setup_zero(const UINT8 *setup)
+{
+	int	i;
+
+	for (i = 0; i < 8; i++) {
+		if (setup[i] != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+int
+usbip_compact_pack(UINT32 devid, const struct usbip_header *hdr, unsigned long len_zip, char *buf)
+{
+	const struct usbip_header_basic	*base = &hdr->base;
+	char	*p = buf + 2;
+	UINT8	flags;
+
+	flags = (UINT8)((base->command - 1) & 0x03);
+	if (base->direction == USBIP_DIR_IN)
+		flags |= FLAG_DIR_IN;
+	if (base->devid == devid)
+		flags |= USBIP_COMPACT_DEVID_CONN << DEVID_MODE_SHIFT;
+	else if (base->devid != 0)
+		flags |= USBIP_COMPACT_DEVID_EXPLICIT << DEVID_MODE_SHIFT;
+
+	p = put_varint(p, base->ep);
+	p = put_varint(p, base->seqnum);
+	if (base->devid != devid && base->devid != 0)
+		p = put_varint(p, base->devid);
+
+	switch (base->command) {
+	case USBIP_CMD_SUBMIT:
+		p = put_varint(p, hdr->u.cmd_submit.transfer_flags);
+		p = put_varint(p, hdr->u.cmd_submit.transfer_buffer_length);
+		p = put_zigzag(p, hdr->u.cmd_submit.start_frame);
+		p = put_zigzag(p, hdr->u.cmd_submit.number_of_packets);
+		p = put_varint(p, hdr->u.cmd_submit.interval);
+		if (!is_setup_zero(hdr->u.cmd_submit.setup)) {
+			flags |= FLAG_SETUP;
+			memcpy(p, hdr->u.cmd_submit.setup, 8);
+			p += 8;
+		}
+		break;
+	case USBIP_RET_SUBMIT:
+		p = put_zigzag(p, hdr->u.ret_submit.status);
+		p = put_varint(p, hdr->u.ret_submit.actual_length);
+		p = put_zigzag(p, hdr->u.ret_submit.start_frame);
+		p = put_zigzag(p, hdr->u.ret_submit.number_of_packets);
+		p = put_varint(p, hdr->u.ret_submit.error_count);
+		break;
+	case USBIP_CMD_UNLINK:
+		p = put_varint(p, hdr->u.cmd_unlink.seqnum);
+		break;
+	case USBIP_RET_UNLINK:
+		p = put_zigzag(p, hdr->u.ret_unlink.status);
+		break;
+	default:
+		/* NOTREACHED */
+		dbg("unknown command in pdu header: %d", base->command);
+		break;
+	}
+	if (len_zip > 0) {
+		flags |= FLAG_ZIP;
+		p = put_varint(p, len_zip);
+	}
+
+	/* a header of only zero fields is still as long as USBIP_COMPACT_HDR_MIN */
+	while (p < buf + USBIP_COMPACT_HDR_MIN)
+		*p++ = 0;
+
+	buf[0] = (char)(p - buf);
+	buf[1] = (char)flags;
+	return (int)(p - buf);
+}
+
+int
+usbip_compact_unpack(UINT32 devid, const char *buf, int len, struct usbip_header *hdr, unsigned long *plen_zip)
+{
+	struct usbip_header_basic	*base = &hdr->base;
+	const char	*p = buf + 2, *end = buf + len;
+	UINT8	flags;
+	BOOL	ok;
+
+	if (len < USBIP_COMPACT_HDR_MIN || (UINT8)buf[0] != len)
+		return -1;
+	flags = (UINT8)buf[1];
+
+	memset(hdr, 0, sizeof(struct usbip_header));
+	base->command = (flags & 0x03) + 1;
+	base->direction = (flags & FLAG_DIR_IN) ? USBIP_DIR_IN : USBIP_DIR_OUT;
+	if (!get_varint(&p, end, &base->ep) || !get_varint(&p, end, &base->seqnum))
+		return -1;
+	switch ((flags & DEVID_MODE_MASK) >> DEVID_MODE_SHIFT) {
+	case USBIP_COMPACT_DEVID_ZERO:
+		break;
+	case USBIP_COMPACT_DEVID_CONN:
+		base->devid = devid;
+		break;
+	case USBIP_COMPACT_DEVID_EXPLICIT:
+		if (!get_varint(&p, end, &base->devid))
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	switch (base->command) {
+	case USBIP_CMD_SUBMIT:
+		ok = get_varint(&p, end, &hdr->u.cmd_submit.transfer_flags) &&
+			get_varint(&p, end, (UINT32 *)&hdr->u.cmd_submit.transfer_buffer_length) &&
+			get_zigzag(&p, end, &hdr->u.cmd_submit.start_frame) &&
+			get_zigzag(&p, end, &hdr->u.cmd_submit.number_of_packets) &&
+			get_varint(&p, end, (UINT32 *)&hdr->u.cmd_submit.interval);
+		if (ok && (flags & FLAG_SETUP)) {
+			if (end - p < 8)
+				return -1;
+			memcpy(hdr->u.cmd_submit.setup, p, 8);
+			p += 8;
+		}
+		break;
+	case USBIP_RET_SUBMIT:
+		ok = get_zigzag(&p, end, &hdr->u.ret_submit.status) &&
+			get_varint(&p, end, (UINT32 *)&hdr->u.ret_submit.actual_length) &&
+			get_zigzag(&p, end, &hdr->u.ret_submit.start_frame) &&
+			get_zigzag(&p, end, &hdr->u.ret_submit.number_of_packets) &&
+			get_varint(&p, end, (UINT32 *)&hdr->u.ret_submit.error_count);
+		break;
+	case USBIP_CMD_UNLINK:
+		ok = get_varint(&p, end, &hdr->u.cmd_unlink.seqnum);
+		break;
+	default:
+		ok = get_zigzag(&p, end, &hdr->u.ret_unlink.status);
+		break;
+	}
+	if (!ok)
+		return -1;
+
+	if (plen_zip != NULL)
+		*plen_zip = 0;
+	if (flags & FLAG_ZIP) {
+		UINT32	len_zip;
+
+		if (plen_zip == NULL || !get_varint(&p, end, &len_zip) || len_zip == 0)
+			return -1;
+		*plen_zip = len_zip;
+	}
+	return 0;
+}
+
+int
+usbip_compact_send_header(SOCKET sockfd, UINT32 devid, const struct usbip_header *hdr)
+{
+	char	buf[USBIP_COMPACT_HDR_MAX];
+
+	return usbip_net_send(sockfd, buf, usbip_compact_pack(devid, hdr, 0, buf));
+}
+
+int
+usbip_compact_recv_header(SOCKET sockfd, UINT32 devid, struct usbip_header *hdr)
+{
+	char	buf[USBIP_COMPACT_HDR_MAX];
+	int	len;
+
+	if (usbip_net_recv(sockfd, buf, USBIP_COMPACT_HDR_MIN) < 0)
+		return -1;
+	len = (UINT8)buf[0];
+	if (len < USBIP_COMPACT_HDR_MIN || len > USBIP_COMPACT_HDR_MAX) {
+		dbg("invalid compact header length: %d", len);
+		return -1;
+	}
+	if (len > USBIP_COMPACT_HDR_MIN && usbip_net_recv(sockfd, buf + USBIP_COMPACT_HDR_MIN, len - USBIP_COMPACT_HDR_MIN) < 0)
+		return -1;
+	if (usbip_compact_unpack(devid, buf, len, hdr, NULL) < 0) {
+		dbg("malformed compact header");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <winsock2.h>
+
+#include "usbip_proto.h"
+
+/*
+ * Compact usbip header, which replaces struct usbip_header on the wire
+ * between usbip-win peers:
+ *
+ *  byte 0: length of a header including this byte
+ *  byte 1: bit 0-1: command - 1, bit 2: direction, bit 3-4: devid mode,
+ *          bit 5: setup is present, bit 6: payload is compressed
+ *  varint: ep, seqnum, devid if explicit
+ *  varint: fields of a command in order of usbip_proto.h, followed by
+ *          8 bytes of setup. status, start_frame and number_of_packets
+ *          are in zigzag encoding, which keeps small negatives short.
+ *  varint: length of a compressed payload if compressed(see usbip_zip.h)
+ *
+ * Varints are little endian base 128. Payloads and ISO descriptors follow
+ * in host byte order, which is little endian on every usbip-win host.
+ */
+#define USBIP_COMPACT_HDR_MIN	5
+#define USBIP_COMPACT_HDR_MAX	64
+
+/* devid of a header is zero, the imported device or given explicitly */
+#define USBIP_COMPACT_DEVID_ZERO	0
+#define USBIP_COMPACT_DEVID_CONN	1
+#define USBIP_COMPACT_DEVID_EXPLICIT	2
+
+/* returns the length of a compact header written into buf. len_zip is 0 for an uncompressed payload */
+int usbip_compact_pack(UINT32 devid, const struct usbip_header *hdr, unsigned long len_zip, char *buf);
+/*
+ * returns 0 if buf has a valid compact header of len bytes, otherwise -1.
+ * a compressed payload is not valid if plen_zip is NULL.
+ */
+int usbip_compact_unpack(UINT32 devid, const char *buf, int len, struct usbip_header *hdr, unsigned long *plen_zip);
+
+int usbip_compact_send_header(SOCKET sockfd, UINT32 devid, const struct usbip_header *hdr);
+int usbip_compact_recv_header(SOCKET sockfd, UINT32 devid, struct usbip_header *hdr);
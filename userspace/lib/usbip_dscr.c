@@ -2,34 +2,56 @@
 
 #include "usbip_proto.h"
 #include "usbip_network.h"
+#include "usbip_compact.h"
+#include "usbip_dscr.h"
 
 /* sufficient large enough seq used to avoid conflict with normal vhci operation */
 static unsigned	seqnum = 0x7ffffff;
 
 static int
-fetch_descriptor(SOCKET sockfd, UINT8 dscr_type, unsigned devid, char *dscr, unsigned short dscr_size)
+send_header(SOCKET sockfd, unsigned devid, UINT32 features, struct usbip_header *uhdr)
+{
+	if (features & USBIP_EXT_COMPACT)
+		return usbip_compact_send_header(sockfd, devid, uhdr);
+	usbip_net_pack_usbip_header(1, uhdr);
+	return usbip_net_send(sockfd, uhdr, sizeof(*uhdr));
+}
+
+static int
+recv_header(SOCKET sockfd, unsigned devid, UINT32 features, struct usbip_header *uhdr)
+{
+	if (features & USBIP_EXT_COMPACT)
+		return usbip_compact_recv_header(sockfd, devid, uhdr);
+	if (usbip_net_recv(sockfd, uhdr, sizeof(*uhdr)) < 0)
+		return -1;
+	usbip_net_pack_usbip_header(0, uhdr);
+	return 0;
+}
+
+static int
+fetch_descriptor(SOCKET sockfd, UINT8 dscr_type, unsigned devid, UINT32 features, char *dscr, unsigned short dscr_size)
 {
 	struct usbip_header	uhdr;
 	unsigned	alen;
 
 	memset(&uhdr, 0, sizeof(uhdr));
 
-	uhdr.base.command = htonl(USBIP_CMD_SUBMIT);
+	uhdr.base.command = USBIP_CMD_SUBMIT;
 	uhdr.base.seqnum = seqnum++;
-	uhdr.base.direction = htonl(USBIP_DIR_IN);
-	uhdr.base.devid = htonl(devid);
+	uhdr.base.direction = USBIP_DIR_IN;
+	uhdr.base.devid = devid;
 
-	uhdr.u.cmd_submit.transfer_buffer_length = htonl(dscr_size);
+	uhdr.u.cmd_submit.transfer_buffer_length = dscr_size;
 	uhdr.u.cmd_submit.setup[0] = 0x80;	/* IN/control port */
 	uhdr.u.cmd_submit.setup[1] = 6;		/* GetDescriptor */
 	*(unsigned short *)(uhdr.u.cmd_submit.setup + 6) = (unsigned short)dscr_size;	/* Length */
 	uhdr.u.cmd_submit.setup[3] = dscr_type;
 
-	if (usbip_net_send(sockfd, &uhdr, sizeof(uhdr)) < 0) {
+	if (send_header(sockfd, devid, features, &uhdr) < 0) {
 		dbg("fetch_descriptor: failed to send usbip header\n");
 		return -1;
 	}
-	if (usbip_net_recv(sockfd, &uhdr, sizeof(uhdr)) < 0) {
+	if (recv_header(sockfd, devid, features, &uhdr) < 0) {
 		dbg("fetch_descriptor: failed to recv usbip header\n");
 		return -1;
 	}
@@ -37,7 +59,7 @@ fetch_descriptor(SOCKET sockfd, UINT8 dscr_type, unsigned devid, char *dscr, uns
 		dbg("fetch_descriptor: command submit error: %d\n", uhdr.u.ret_submit.status);
 		return -1;
 	}
-	alen = ntohl(uhdr.u.ret_submit.actual_length);
+	alen = uhdr.u.ret_submit.actual_length;
 	if (alen < dscr_size) {
 		err("fetch_descriptor: too short response: actual length: %d\n", alen);
 		return -1;
@@ -51,18 +73,18 @@ fetch_descriptor(SOCKET sockfd, UINT8 dscr_type, unsigned devid, char *dscr, uns
 
 /* assume the length of a device descriptor is 18 */
 int
-fetch_device_descriptor(SOCKET sockfd, unsigned devid, char *dscr)
+fetch_device_descriptor(SOCKET sockfd, unsigned devid, UINT32 features, char *dscr)
 {
-	return fetch_descriptor(sockfd, 1, devid, dscr, 18);
+	return fetch_descriptor(sockfd, 1, devid, features, dscr, 18);
 }
 
 int
-fetch_conf_descriptor(SOCKET sockfd, unsigned devid, char *dscr, unsigned short *plen)
+fetch_conf_descriptor(SOCKET sockfd, unsigned devid, UINT32 features, char *dscr, unsigned short *plen)
 {
 	char	buf[9];
 	unsigned short	alen;
 
-	if (fetch_descriptor(sockfd, 2, devid, buf, 9) < 0)
+	if (fetch_descriptor(sockfd, 2, devid, features, buf, 9) < 0)
 		return -1;
 	alen = *((unsigned short *)buf + 1);
 	if (dscr == NULL) {
@@ -74,5 +96,5 @@ fetch_conf_descriptor(SOCKET sockfd, unsigned devid, char *dscr, unsigned short
 		return -1;
 	}
 	*plen = alen;
-	return fetch_descriptor(sockfd, 2, devid, dscr, alen);
+	return fetch_descriptor(sockfd, 2, devid, features, dscr, alen);
 }
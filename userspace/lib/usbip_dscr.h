@@ -3,9 +3,10 @@
 
 #include <WinSock2.h>
 
+/* features: USBIP_EXT_* agreed on at import */
 extern int
-fetch_device_descriptor(SOCKET sockfd, unsigned devid, char *dscr);
+fetch_device_descriptor(SOCKET sockfd, unsigned devid, UINT32 features, char *dscr);
 extern int
-fetch_conf_descriptor(SOCKET sockfd, unsigned devid, char *dscr, unsigned short *plen);
+fetch_conf_descriptor(SOCKET sockfd, unsigned devid, UINT32 features, char *dscr, unsigned short *plen);
 
 #endif /* _USBIP_DSCR_H_ */
@@ -0,0 +1,409 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_vhci_api.h"
+#include "usbip_dscr_hash.h"
+#include "usbip_dscr_cache.h"
+
+#define DSCR_CACHE_MAGIC	"UDC1"
+#define DSCR_CACHE_MAX_KEY	1024
+
+#define REQTYPE_STANDARD_IN_DEVICE	0x80
+#define REQTYPE_STANDARD_IN_INTERFACE	0x81
+#define REQ_GET_DESCRIPTOR	6
+
+#define DSCR_TYPE_DEVICE	0x01
+#define DSCR_TYPE_CONF		0x02
+#define DSCR_TYPE_STRING	0x03
+#define DSCR_TYPE_BOS		0x0f
+#define DSCR_TYPE_HID_REPORT	0x22
+
+/* GET_DESCRIPTORs which are in flight at once */
+#define COLLECT_N_PENDINGS	16
+
+typedef struct {
+	BOOL	used;
+	UINT32	seqnum;
+	UINT8	reqtype;
+	UINT16	wValue, wIndex;
+} pending_t;
+
+static usbip_dscr_set_t	*set_collected;
+static pending_t	pendings[COLLECT_N_PENDINGS];
+static unsigned	idx_pending;
+
+void
+usbip_dscr_set_init(usbip_dscr_set_t *set)
+{
+	set->records = NULL;
+	set->len = 0;
+	set->cap = 0;
+	set->dirty = FALSE;
+}
+
+void
+usbip_dscr_set_cleanup(usbip_dscr_set_t *set)
+{
+	free(set->records);
+	usbip_dscr_set_init(set);
+}
+
+static vhci_pluginfo_dscr_t *
+find_record(usbip_dscr_set_t *set, UINT8 reqtype, UINT16 wValue, UINT16 wIndex)
+{
+	unsigned long	off = 0;
+
+	while (off + sizeof(vhci_pluginfo_dscr_t) <= set->len) {
+		vhci_pluginfo_dscr_t	*rec = (vhci_pluginfo_dscr_t *)(set->records + off);
+
+		if (rec->reqtype == reqtype && rec->wValue == wValue && rec->wIndex == wIndex)
+			return rec;
+		off += sizeof(vhci_pluginfo_dscr_t) + rec->len;
+	}
+	return NULL;
+}
+
+static void
+remove_record(usbip_dscr_set_t *set, vhci_pluginfo_dscr_t *rec)
+{
+	unsigned long	off = (unsigned long)((unsigned char *)rec - set->records);
+	unsigned long	len = sizeof(vhci_pluginfo_dscr_t) + rec->len;
+
+	memmove(set->records + off, set->records + off + len, set->len - off - len);
+	set->len -= len;
+}
+
+void
+usbip_dscr_set_add(usbip_dscr_set_t *set, UINT8 reqtype, UINT16 wValue, UINT16 wIndex, const void *dscr, UINT16 len)
+{
+	vhci_pluginfo_dscr_t	*rec;
+	unsigned long	len_rec = sizeof(vhci_pluginfo_dscr_t) + len;
+
+	rec = find_record(set, reqtype, wValue, wIndex);
+	if (rec != NULL) {
+		if (rec->len >= len)
+			return;
+		remove_record(set, rec);
+	}
+	if (set->len + len_rec > USBIP_DSCR_SET_MAX_LEN)
+		return;
+	if (set->len + len_rec > set->cap) {
+		unsigned long	cap = set->cap ? set->cap * 2 : 1024;
+		unsigned char	*records;
+
+		while (cap < set->len + len_rec)
+			cap *= 2;
+		records = (unsigned char *)realloc(set->records, cap);
+		if (records == NULL) {
+			dbg("out of memory");
+			return;
+		}
+		set->records = records;
+		set->cap = cap;
+	}
+	rec = (vhci_pluginfo_dscr_t *)(set->records + set->len);
+	rec->reqtype = reqtype;
+	rec->wValue = wValue;
+	rec->wIndex = wIndex;
+	rec->len = len;
+	memcpy(rec + 1, dscr, len);
+	set->len += len_rec;
+	set->dirty = TRUE;
+}
+
+const unsigned char *
+usbip_dscr_set_find(usbip_dscr_set_t *set, UINT8 reqtype, UINT16 wValue, UINT16 wIndex, UINT16 *plen)
+{
+	vhci_pluginfo_dscr_t	*rec;
+
+	rec = find_record(set, reqtype, wValue, wIndex);
+	if (rec == NULL)
+		return NULL;
+	*plen = rec->len;
+	return (const unsigned char *)(rec + 1);
+}
+
+static BOOL
+is_pluginfo_dscr(const vhci_pluginfo_dscr_t *rec)
+{
+	return rec->reqtype == REQTYPE_STANDARD_IN_DEVICE && rec->wIndex == 0 &&
+		(rec->wValue == DSCR_TYPE_DEVICE << 8 || rec->wValue == DSCR_TYPE_CONF << 8);
+}
+
+unsigned long
+usbip_dscr_set_copy_extras(usbip_dscr_set_t *set, unsigned char *buf)
+{
+	unsigned long	off = 0, len_extras = 0;
+
+	while (off + sizeof(vhci_pluginfo_dscr_t) <= set->len) {
+		vhci_pluginfo_dscr_t	*rec = (vhci_pluginfo_dscr_t *)(set->records + off);
+		unsigned long	len_rec = sizeof(vhci_pluginfo_dscr_t) + rec->len;
+
+		if (!is_pluginfo_dscr(rec)) {
+			if (buf != NULL)
+				memcpy(buf + len_extras, rec, len_rec);
+			len_extras += len_rec;
+		}
+		off += len_rec;
+	}
+	return len_extras;
+}
+
+void
+usbip_dscr_set_add_dev_conf(usbip_dscr_set_t *set, const void *dscr_dev, const void *dscr_conf, UINT16 len_conf)
+{
+	usbip_dscr_set_add(set, REQTYPE_STANDARD_IN_DEVICE, DSCR_TYPE_DEVICE << 8, 0, dscr_dev, 18);
+	usbip_dscr_set_add(set, REQTYPE_STANDARD_IN_DEVICE, DSCR_TYPE_CONF << 8, 0, dscr_conf, len_conf);
+}
+
+BOOL
+usbip_dscr_set_get_dev_conf(usbip_dscr_set_t *set, const unsigned char **pdscr_dev, const unsigned char **pdscr_conf, UINT16 *plen_conf)
+{
+	UINT16	len_dev;
+
+	*pdscr_dev = usbip_dscr_set_find(set, REQTYPE_STANDARD_IN_DEVICE, DSCR_TYPE_DEVICE << 8, 0, &len_dev);
+	*pdscr_conf = usbip_dscr_set_find(set, REQTYPE_STANDARD_IN_DEVICE, DSCR_TYPE_CONF << 8, 0, plen_conf);
+	if (*pdscr_dev == NULL || *pdscr_conf == NULL || len_dev != 18 || *plen_conf < 9)
+		return FALSE;
+	/* a partial configuration descriptor is neither what a server hashes nor what pluginfo needs */
+	return *plen_conf == ((*pdscr_conf)[2] | ((*pdscr_conf)[3] << 8));
+}
+
+UINT32
+usbip_dscr_set_hash(usbip_dscr_set_t *set)
+{
+	const unsigned char	*dscr_dev, *dscr_conf;
+	UINT16	len_conf;
+
+	if (!usbip_dscr_set_get_dev_conf(set, &dscr_dev, &dscr_conf, &len_conf))
+		return USBIP_DSCR_HASH_NONE;
+	return usbip_dscr_hash(dscr_dev, dscr_conf, len_conf);
+}
+
+char *
+usbip_dscr_cache_key(const char *host, const struct usbip_usb_device *udev)
+{
+	char	*key;
+
+	key = (char *)malloc(DSCR_CACHE_MAX_KEY);
+	if (key == NULL)
+		return NULL;
+	/* a device path of usbip-win has an instance id, which has a serial if any */
+	snprintf(key, DSCR_CACHE_MAX_KEY, "%s|%.*s|%04x:%04x|%04x|%.*s", host,
+		 (int)sizeof(udev->busid), udev->busid, udev->idVendor, udev->idProduct, udev->bcdDevice,
+		 (int)sizeof(udev->path), udev->path);
+	return key;
+}
+
+static BOOL
+get_cache_path(const char *key, BOOL create, char *path, DWORD size)
+{
+	char	dir[MAX_PATH];
+	DWORD	len;
+
+	len = GetEnvironmentVariableA("LOCALAPPDATA", dir, sizeof(dir));
+	if (len == 0 || len >= sizeof(dir)) {
+		dbg("LOCALAPPDATA is not available");
+		return FALSE;
+	}
+	if (strcat_s(dir, sizeof(dir), "\\usbip") != 0)
+		return FALSE;
+	if (create)
+		CreateDirectoryA(dir, NULL);
+	if (strcat_s(dir, sizeof(dir), "\\dscr") != 0)
+		return FALSE;
+	if (create)
+		CreateDirectoryA(dir, NULL);
+	snprintf(path, size, "%s\\%08x.bin", dir, usbip_dscr_hash_update(2166136261u, key, (unsigned)strlen(key)));
+	return TRUE;
+}
+
+static BOOL
+read_file(FILE *fp, void *buf, size_t len)
+{
+	return fread(buf, 1, len, fp) == len;
+}
+
+/* records are checked to be well-formed while being added */
+static BOOL
+load_records(FILE *fp, usbip_dscr_set_t *set)
+{
+	vhci_pluginfo_dscr_t	rec;
+	unsigned char	*dscr;
+
+	dscr = (unsigned char *)malloc(0x10000);
+	if (dscr == NULL)
+		return FALSE;
+	while (read_file(fp, &rec, sizeof(rec))) {
+		if (!read_file(fp, dscr, rec.len)) {
+			free(dscr);
+			return FALSE;
+		}
+		usbip_dscr_set_add(set, rec.reqtype, rec.wValue, rec.wIndex, dscr, rec.len);
+	}
+	free(dscr);
+	return TRUE;
+}
+
+BOOL
+usbip_dscr_cache_load(const char *key, UINT32 hash, usbip_dscr_set_t *set)
+{
+	char	path[MAX_PATH];
+	char	magic[4], key_stored[DSCR_CACHE_MAX_KEY];
+	UINT32	len_key;
+	FILE	*fp;
+
+	if (!get_cache_path(key, FALSE, path, sizeof(path)))
+		return FALSE;
+	if (fopen_s(&fp, path, "rb") != 0)
+		return FALSE;
+	if (!read_file(fp, magic, sizeof(magic)) || memcmp(magic, DSCR_CACHE_MAGIC, sizeof(magic)) != 0 ||
+		!read_file(fp, &len_key, sizeof(len_key)) || len_key >= sizeof(key_stored) ||
+		!read_file(fp, key_stored, len_key)) {
+		dbg("invalid descriptor cache: %s", path);
+		fclose(fp);
+		return FALSE;
+	}
+	key_stored[len_key] = '\0';
+	/* another device whose key collides in a file name */
+	if (strcmp(key, key_stored) != 0) {
+		fclose(fp);
+		return FALSE;
+	}
+	usbip_dscr_set_cleanup(set);
+	if (!load_records(fp, set)) {
+		dbg("truncated descriptor cache: %s", path);
+		fclose(fp);
+		usbip_dscr_set_cleanup(set);
+		return FALSE;
+	}
+	fclose(fp);
+
+	if (usbip_dscr_set_hash(set) != hash) {
+		dbg("stale descriptor cache: %s", path);
+		usbip_dscr_set_cleanup(set);
+		return FALSE;
+	}
+	set->dirty = FALSE;
+	return TRUE;
+}
+
+BOOL
+usbip_dscr_cache_save(const char *key, usbip_dscr_set_t *set)
+{
+	char	path[MAX_PATH], path_tmp[MAX_PATH];
+	UINT32	len_key = (UINT32)strlen(key);
+	FILE	*fp;
+	BOOL	res;
+
+	if (!get_cache_path(key, TRUE, path, sizeof(path)))
+		return FALSE;
+	snprintf(path_tmp, sizeof(path_tmp), "%s.%lu", path, GetCurrentProcessId());
+	if (fopen_s(&fp, path_tmp, "wb") != 0) {
+		dbg("failed to create descriptor cache: %s", path_tmp);
+		return FALSE;
+	}
+	res = fwrite(DSCR_CACHE_MAGIC, 1, 4, fp) == 4 &&
+		fwrite(&len_key, sizeof(len_key), 1, fp) == 1 &&
+		fwrite(key, 1, len_key, fp) == len_key &&
+		fwrite(set->records, 1, set->len, fp) == set->len;
+	if (fclose(fp) != 0)
+		res = FALSE;
+	/* a reader sees either an old or a new file */
+	if (!res || !MoveFileExA(path_tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+		dbg("failed to write descriptor cache: %s", path);
+		DeleteFileA(path_tmp);
+		return FALSE;
+	}
+	set->dirty = FALSE;
+	return TRUE;
+}
+
+static BOOL
+is_collectable(UINT8 reqtype, UINT8 type)
+{
+	switch (reqtype) {
+	case REQTYPE_STANDARD_IN_DEVICE:
+		return type == DSCR_TYPE_DEVICE || type == DSCR_TYPE_CONF || type == DSCR_TYPE_STRING || type == DSCR_TYPE_BOS;
+	case REQTYPE_STANDARD_IN_INTERFACE:
+		return type == DSCR_TYPE_HID_REPORT;
+	default:
+		return FALSE;
+	}
+}
+
+void
+usbip_dscr_collect_start(usbip_dscr_set_t *set)
+{
+	memset(pendings, 0, sizeof(pendings));
+	idx_pending = 0;
+	set_collected = set;
+}
+
+void
+usbip_dscr_collect_stop(void)
+{
+	set_collected = NULL;
+}
+
+BOOL
+usbip_dscr_collecting(void)
+{
+	return set_collected != NULL;
+}
+
+static void
+collect_cmd(struct usbip_header *hdr)
+{
+	const UINT8	*setup = hdr->u.cmd_submit.setup;
+	pending_t	*pending;
+
+	if (hdr->base.ep != 0 || setup[1] != REQ_GET_DESCRIPTOR || !is_collectable(setup[0], setup[3]))
+		return;
+	/* the oldest is overwritten, whose reply is already lost if any */
+	pending = &pendings[idx_pending++ % COLLECT_N_PENDINGS];
+	pending->used = TRUE;
+	pending->seqnum = hdr->base.seqnum;
+	pending->reqtype = setup[0];
+	pending->wValue = (UINT16)(setup[2] | (setup[3] << 8));
+	pending->wIndex = (UINT16)(setup[4] | (setup[5] << 8));
+}
+
+static void
+collect_ret(struct usbip_header *hdr, const char *data, unsigned long xfer_len)
+{
+	unsigned	i;
+
+	for (i = 0; i < COLLECT_N_PENDINGS; i++) {
+		pending_t	*pending = &pendings[i];
+		UINT8	type;
+
+		if (!pending->used || pending->seqnum != hdr->base.seqnum)
+			continue;
+		pending->used = FALSE;
+		if (hdr->u.ret_submit.status != 0 || xfer_len == 0 || xfer_len > 0xffff)
+			return;
+		type = (UINT8)(pending->wValue >> 8);
+		if (type != DSCR_TYPE_HID_REPORT && (xfer_len < 2 || (UINT8)data[1] != type))
+			return;
+		usbip_dscr_set_add(set_collected, pending->reqtype, pending->wValue, pending->wIndex, data, (UINT16)xfer_len);
+		return;
+	}
+}
+
+void
+usbip_dscr_collect_pdu(struct usbip_header *hdr, const char *data, unsigned long xfer_len)
+{
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		collect_cmd(hdr);
+		break;
+	case USBIP_RET_SUBMIT:
+		collect_ret(hdr, data, xfer_len);
+		break;
+	default:
+		break;
+	}
+}
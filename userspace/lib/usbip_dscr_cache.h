@@ -0,0 +1,54 @@
+#pragma once
+
+#include <windows.h>
+
+#include "usbip_proto.h"
+
+struct usbip_usb_device;
+
+/*
+ * Descriptors of a device persisted across attaches.
+ *
+ * A set keeps replies to GET_DESCRIPTOR in vhci_pluginfo_dscr_t records,
+ * which vhci takes after a configuration descriptor of pluginfo. Only the
+ * longest reply to a setup is kept.
+ * A set is stored per device identity under %LOCALAPPDATA%\usbip\dscr, and
+ * is valid only if a hash of its device and configuration descriptors is
+ * that reported by a server(see usbip_dscr_hash.h).
+ */
+#define USBIP_DSCR_SET_MAX_LEN	(64 * 1024)
+
+typedef struct {
+	unsigned char	*records;
+	unsigned long	len, cap;
+	/* changed since loaded */
+	BOOL	dirty;
+} usbip_dscr_set_t;
+
+void usbip_dscr_set_init(usbip_dscr_set_t *set);
+void usbip_dscr_set_cleanup(usbip_dscr_set_t *set);
+
+void usbip_dscr_set_add(usbip_dscr_set_t *set, UINT8 reqtype, UINT16 wValue, UINT16 wIndex, const void *dscr, UINT16 len);
+const unsigned char *usbip_dscr_set_find(usbip_dscr_set_t *set, UINT8 reqtype, UINT16 wValue, UINT16 wIndex, UINT16 *plen);
+/* device and configuration descriptors of index 0, which pluginfo has */
+void usbip_dscr_set_add_dev_conf(usbip_dscr_set_t *set, const void *dscr_dev, const void *dscr_conf, UINT16 len_conf);
+BOOL usbip_dscr_set_get_dev_conf(usbip_dscr_set_t *set, const unsigned char **pdscr_dev, const unsigned char **pdscr_conf, UINT16 *plen_conf);
+/* records other than device and configuration descriptors. Returns a length, which buf NULL asks for */
+unsigned long usbip_dscr_set_copy_extras(usbip_dscr_set_t *set, unsigned char *buf);
+/* USBIP_DSCR_HASH_NONE if a set lacks device or configuration descriptors */
+UINT32 usbip_dscr_set_hash(usbip_dscr_set_t *set);
+
+/* (server, busid, VID, PID, bcdDevice, serial). The caller frees it */
+char *usbip_dscr_cache_key(const char *host, const struct usbip_usb_device *udev);
+/* fails on no stored set or a set with a different hash */
+BOOL usbip_dscr_cache_load(const char *key, UINT32 hash, usbip_dscr_set_t *set);
+BOOL usbip_dscr_cache_save(const char *key, usbip_dscr_set_t *set);
+
+/*
+ * An attacher collects successful replies to GET_DESCRIPTOR into a set while
+ * forwarding. Only a single set is collected in a process.
+ */
+void usbip_dscr_collect_start(usbip_dscr_set_t *set);
+void usbip_dscr_collect_stop(void);
+BOOL usbip_dscr_collecting(void);
+void usbip_dscr_collect_pdu(struct usbip_header *hdr, const char *data, unsigned long xfer_len);
@@ -5,6 +5,13 @@
 
 #include "usbip_proto.h"
 #include "usbip_network.h"
+#include "usbip_compact.h"
+#include "usbip_zip.h"
+#include "usbip_capture.h"
+#include "usbip_stats.h"
+#include "usbip_dscr_cache.h"
+#include "usbip_session.h"
+#include "usbip_forward.h"
 
 #define BUFREAD_P(devbuf)	((devbuf)->offp - (devbuf)->offhdr)
 #define BUFREADMAX_P(devbuf)	((devbuf)->bufmaxp - (devbuf)->offp)
@@ -13,33 +20,92 @@
 #define BUFCUR_P(devbuf)	((devbuf)->bufp + (devbuf)->offp)
 #define BUFCUR_C(devbuf)	((devbuf)->bufc + (devbuf)->offc)
 
+/* ECONNRESET of linux, which an unlinked URB completes with */
+#define RET_ST_CONNRESET	(-104)
+
+/* endpoints are indexed as in usbip_stats */
+#define EP_INDEX(ep, direction)	(((ep) & 0x0f) | ((direction) == USBIP_DIR_IN ? 0x10 : 0))
+
+#define N_SEGS_SHAPED	64
+
+/* PDUs of a class in a consumer, see push_seg_shaped() */
+typedef struct {
+	DWORD	len;
+	BOOL	prio;
+} seg_shaped_t;
+
 typedef struct _devbuf {
 	const char	*desc;
 	BOOL	is_req, swap_req;
 	BOOL	invalid;
+	/* reading or writing failed, which a resumable session recovers from */
+	BOOL	broken;
 	/* asynchronous read is in progress */
 	BOOL	in_reading;
 	/* asynchronous write is in progress */
 	BOOL	in_writing;
 	/* step 1: reading header, 2: reading data */
 	int	step_reading;
+	/* socket of usbip-win peers, which takes compact headers */
+	BOOL	compact;
+	UINT32	devid;
+	/* length of a header in a buffer, which is shorter than usbip_header if compact */
+	DWORD	len_hdr;
+	/* transfer and ISO descriptor length of a PDU being read */
+	unsigned long	xfer_len, iso_len;
+	/* host byte order header of a PDU whose header in a buffer is compact */
+	struct usbip_header	hdr;
+	/* shared by both devbuf's if payloads may be compressed, otherwise NULL */
+	usbip_zip_t	*zip;
+	/* compressed length of a payload being read, 0 if not compressed */
+	unsigned long	len_zip;
+	/* shared by both devbuf's, NULL if counters are not available */
+	usbip_stats_t	*stats;
+	/* shared by devbuf's of a forwarder, see hdrs_cache_insert() */
+	struct usbip_cached_hdr	*hdrs_cache;
 	HANDLE	hdev;
 	char	*bufp, *bufc;	/* bufp: producer, bufc: consumer */
 	DWORD	offhdr;		/* header offset for producer */
 	DWORD	offp, offc;	/* offp: producer offset, offc: consumer offset */
 	DWORD	bufmaxp, bufmaxc;
-	struct _devbuf	*peer;
+	/* a devbuf whose consumer is being written */
+	struct _devbuf	*writing;
+	/* ISO PDUs read go into its producer instead if an ISO channel is open */
+	struct _devbuf	*iso_out;
+	/* reads an ISO channel */
+	BOOL	iso_chan;
 	OVERLAPPED	ovs[2];
-	/* completion event for read or write */
+	/* completion event for read or write, shared by devbuf's of a forwarder */
 	HANDLE	hEvent;
+	/* pcap stream id, -1 if not capturing */
+	int	capture_stream;
+	/* replies to GET_DESCRIPTOR go into a persisted set of an attacher */
+	BOOL	collect_dscr;
+	/* shared by both devbuf's if a session is resumable, otherwise NULL */
+	usbip_session_t	*session;
+	/* shapes PDUs of a consumer written into a socket, NULL if not shaped */
+	usbip_shaper_dev_t	*shaper;
+	seg_shaped_t	segs[N_SEGS_SHAPED];
+	int	idx_seg, n_segs;
+	/* bytes of a consumer which a shaper has let through and are not written yet */
+	DWORD	len_admitted;
+	/* microseconds until held bulk PDUs are asked for again, 0 if none is held */
+	unsigned long	wait_shaped;
+	/* EP_INDEX bits of endpoints which CMD_SUBMIT's with an interval have been read for */
+	UINT32	eps_periodic;
 } devbuf_t;
 
 /*
- * Two devbuf's are shared via hEvent, which indicates read or write completion.
- * Such a global variable does not pose a severe limitation.
- * Because userspace binaries(usbip.exe, usbipd.exe) have only a single usbip_forward().
+ * usbipd runs a usbip_forward() per device in a process, each of which waits
+ * for its own event. SIGINT is told to all of them by hevt_interrupted, which
+ * is never reset.
  */
-static HANDLE	hEvent;
+static volatile BOOL	interrupted;
+static HANDLE	hevt_interrupted;
+static LONG	n_forwarders;
+/* a handler of a caller, which is restored after the last forwarder */
+static void	(*sighandler_prev)(int);
+static SRWLOCK	lock_forwarders = SRWLOCK_INIT;
 
 #ifdef DEBUG_PDU
 #undef USING_STDOUT
@@ -82,7 +148,7 @@ dbg_usbip_hdr_cmd(unsigned int cmd)
 }
 
 static void
-dump_iso_pkts(struct usbip_header *hdr)
+dump_iso_pkts(struct usbip_header *hdr, char *data)
 {
 	struct usbip_iso_packet_descriptor	*iso_desc;
 	int	n_pkts;
@@ -92,16 +158,16 @@ dump_iso_pkts(struct usbip_header *hdr)
 	case USBIP_CMD_SUBMIT:
 		n_pkts = hdr->u.cmd_submit.number_of_packets;
 		if (hdr->base.direction)
-			iso_desc = (struct usbip_iso_packet_descriptor *)(hdr + 1);
+			iso_desc = (struct usbip_iso_packet_descriptor *)data;
 		else
-			iso_desc = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + hdr->u.cmd_submit.transfer_buffer_length);
+			iso_desc = (struct usbip_iso_packet_descriptor *)(data + hdr->u.cmd_submit.transfer_buffer_length);
 		break;
 	case USBIP_RET_SUBMIT:
 		n_pkts = hdr->u.ret_submit.number_of_packets;
 		if (hdr->base.direction)
-			iso_desc = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + hdr->u.ret_submit.actual_length);
+			iso_desc = (struct usbip_iso_packet_descriptor *)(data + hdr->u.ret_submit.actual_length);
 		else
-			iso_desc = (struct usbip_iso_packet_descriptor *)(hdr + 1);
+			iso_desc = (struct usbip_iso_packet_descriptor *)data;
 		break;
 	default:
 		return;
@@ -114,7 +180,7 @@ dump_iso_pkts(struct usbip_header *hdr)
 }
 
 static void
-dump_usbip_header(struct usbip_header *hdr)
+dump_usbip_header(struct usbip_header *hdr, char *data)
 {
 	dbg_to_file("DUMP: %s,seq:%u,devid:%x,dir:%s,ep:%x\n",
 		dbg_usbip_hdr_cmd(hdr->base.command), hdr->base.seqnum, hdr->base.devid, hdr->base.direction ? "in": "out", hdr->base.ep);
@@ -131,7 +197,7 @@ dump_usbip_header(struct usbip_header *hdr)
 			hdr->u.cmd_submit.setup[0], hdr->u.cmd_submit.setup[1], hdr->u.cmd_submit.setup[2],
 			hdr->u.cmd_submit.setup[3], hdr->u.cmd_submit.setup[4], hdr->u.cmd_submit.setup[5],
 			hdr->u.cmd_submit.setup[6], hdr->u.cmd_submit.setup[7]);
-		dump_iso_pkts(hdr);
+		dump_iso_pkts(hdr, data);
 		break;
 	case USBIP_CMD_UNLINK:
 		dbg_to_file("  seq:%x\n", hdr->u.cmd_unlink.seqnum);
@@ -143,7 +209,7 @@ dump_usbip_header(struct usbip_header *hdr)
 			hdr->u.ret_submit.start_frame,
 			hdr->u.cmd_submit.number_of_packets,
 			hdr->u.ret_submit.error_count);
-		dump_iso_pkts(hdr);
+		dump_iso_pkts(hdr, data);
 		break;
 	case USBIP_RET_UNLINK:
 		dbg_to_file(" st:%d\n", hdr->u.ret_unlink.status);
@@ -156,112 +222,15 @@ dump_usbip_header(struct usbip_header *hdr)
 }
 
 #define DBGF(fmt, ...)		dbg_to_file(fmt, ## __VA_ARGS__)
-#define DBG_USBIP_HEADER(hdr)	dump_usbip_header(hdr)
+#define DBG_USBIP_HEADER(hdr, data)	dump_usbip_header(hdr, data)
 
 #else
 
 #define DBGF(fmt, ...)
-#define DBG_USBIP_HEADER(hdr)
+#define DBG_USBIP_HEADER(hdr, data)
 
 #endif
 
-static void
-swap_usbip_header_base_endian(struct usbip_header_basic *base)
-{
-	base->command	= htonl(base->command);
-	base->seqnum	= htonl(base->seqnum);
-	base->devid	= htonl(base->devid);
-	base->direction	= htonl(base->direction);
-	base->ep	= htonl(base->ep);
-}
-
-static void
-swap_cmd_submit_endian(struct usbip_header_cmd_submit *pdu)
-{
-	pdu->transfer_flags	= ntohl(pdu->transfer_flags);
-	pdu->transfer_buffer_length = ntohl(pdu->transfer_buffer_length);
-	pdu->start_frame = ntohl(pdu->start_frame);
-	pdu->number_of_packets = ntohl(pdu->number_of_packets);
-	pdu->interval = ntohl(pdu->interval);
-}
-
-static void
-swap_ret_submit_endian(struct usbip_header_ret_submit *pdu)
-{
-	pdu->status = ntohl(pdu->status);
-	pdu->actual_length = ntohl(pdu->actual_length);
-	pdu->start_frame = ntohl(pdu->start_frame);
-	pdu->number_of_packets = ntohl(pdu->number_of_packets);
-	pdu->error_count = ntohl(pdu->error_count);
-}
-
-static void
-swap_cmd_unlink_endian(struct usbip_header_cmd_unlink *pdu)
-{
-	pdu->seqnum = ntohl(pdu->seqnum);
-}
-
-static void
-swap_ret_unlink_endian(struct usbip_header_ret_unlink *pdu)
-{
-	pdu->status = ntohl(pdu->status);
-}
-
-static void
-swap_usbip_header_cmd(unsigned int cmd, struct usbip_header *hdr)
-{
-	switch (cmd) {
-	case USBIP_CMD_SUBMIT:
-		swap_cmd_submit_endian(&hdr->u.cmd_submit);
-		break;
-	case USBIP_RET_SUBMIT:
-		swap_ret_submit_endian(&hdr->u.ret_submit);
-		break;
-	case USBIP_CMD_UNLINK:
-		swap_cmd_unlink_endian(&hdr->u.cmd_unlink);
-		break;
-	case USBIP_RET_UNLINK:
-		swap_ret_unlink_endian(&hdr->u.ret_unlink);
-		break;
-	default:
-		/* NOTREACHED */
-		dbg("unknown command in pdu header: %d", cmd);
-		break;
-	}
-}
-
-static void
-swap_usbip_header_endian(struct usbip_header *hdr, BOOL from_swapped)
-{
-	unsigned int	cmd;
-
-	if (from_swapped) {
-		swap_usbip_header_base_endian(&hdr->base);
-		cmd = hdr->base.command;
-	}
-	else {
-		cmd = hdr->base.command;
-		swap_usbip_header_base_endian(&hdr->base);
-	}
-	swap_usbip_header_cmd(cmd, hdr);
-}
-
-static void
-swap_iso_descs_endian(char *buf, int num)
-{
-	struct usbip_iso_packet_descriptor	*ip_desc;
-	int i;
-
-	ip_desc = (struct usbip_iso_packet_descriptor *)buf;
-	for (i = 0; i < num; i++) {
-		ip_desc->offset = ntohl(ip_desc->offset);
-		ip_desc->status = ntohl(ip_desc->status);
-		ip_desc->length = ntohl(ip_desc->length);
-		ip_desc->actual_length = ntohl(ip_desc->actual_length);
-		ip_desc++;
-	}
-}
-
 /*
  * This is a 'usbip_header_basic' cache to hold transfer direction of all
  * OUT CMD_SUBMIT packets. Cache info is used when RET_SUBMIT packets with the
@@ -276,6 +245,9 @@ swap_iso_descs_endian(char *buf, int num)
  * data buffer size. However the return RET_SUBMIT packet of the same OUT transfer
  * contain only ISO descriptor and the 'actual_size' is set to the sent size value.
  *
+ * A cache belongs to a forwarder, since usbipd runs one for each device in a
+ * process and their sequence numbers overlap.
+ *
  * Each cache entry may be written or read many times, however the sequence
  * number of a cache entry location is kept until current sequence number of
  * packets increases its value for the number of all cache entries.
@@ -284,23 +256,50 @@ struct usbip_cached_hdr {
 	UINT32 seqnum;
 	// UINT32 devid;
 	UINT32 direction;
-	// UINT32 ep;
+	UINT32 ep;
+	/* an ISO CMD_SUBMIT, or a CMD_UNLINK of one */
+	BOOL iso;
 };
 
 #define HDRS_CACHE_SIZE 1024
-static struct usbip_cached_hdr hdrs_cache[HDRS_CACHE_SIZE];
 
 static inline void
-hdrs_cache_insert(struct usbip_header *usbip_hdr)
+hdrs_cache_insert(struct usbip_cached_hdr *hdrs_cache, struct usbip_header *usbip_hdr)
+{
+	int	idx = usbip_hdr->base.seqnum % HDRS_CACHE_SIZE;
+
+	hdrs_cache[idx].seqnum = usbip_hdr->base.seqnum;
+	hdrs_cache[idx].direction = usbip_hdr->base.direction;
+	hdrs_cache[idx].ep = usbip_hdr->base.ep;
+	hdrs_cache[idx].iso = usbip_hdr->u.cmd_submit.number_of_packets > 0;
+}
+
+static inline BOOL
+hdrs_cache_iso(struct usbip_cached_hdr *hdrs_cache, UINT32 seqnum)
+{
+	int	idx = seqnum % HDRS_CACHE_SIZE;
+
+	return hdrs_cache[idx].seqnum == seqnum && hdrs_cache[idx].iso;
+}
+
+/*
+ * An unlink goes through the same channel as what it unlinks. One read from
+ * an ISO channel is replied to through it even if what it unlinks has left a cache.
+ */
+static inline void
+hdrs_cache_insert_unlink(struct usbip_cached_hdr *hdrs_cache, struct usbip_header *usbip_hdr, BOOL iso_chan)
 {
 	int	idx = usbip_hdr->base.seqnum % HDRS_CACHE_SIZE;
+	BOOL	iso = iso_chan || hdrs_cache_iso(hdrs_cache, usbip_hdr->u.cmd_unlink.seqnum);
 
 	hdrs_cache[idx].seqnum = usbip_hdr->base.seqnum;
 	hdrs_cache[idx].direction = usbip_hdr->base.direction;
+	hdrs_cache[idx].ep = usbip_hdr->base.ep;
+	hdrs_cache[idx].iso = iso;
 }
 
 static inline UINT32
-hdrs_cache_direction(struct usbip_header *usbip_hdr)
+hdrs_cache_direction(struct usbip_cached_hdr *hdrs_cache, struct usbip_header *usbip_hdr)
 {
 	int	idx = usbip_hdr->base.seqnum % HDRS_CACHE_SIZE;
 
@@ -315,13 +314,25 @@ hdrs_cache_direction(struct usbip_header *usbip_hdr)
 	return usbip_hdr->base.direction;
 }
 
+static inline UINT32
+hdrs_cache_ep(struct usbip_cached_hdr *hdrs_cache, struct usbip_header *usbip_hdr)
+{
+	int	idx = usbip_hdr->base.seqnum % HDRS_CACHE_SIZE;
+
+	if (usbip_hdr->base.seqnum == hdrs_cache[idx].seqnum)
+		return hdrs_cache[idx].ep;
+	return usbip_hdr->base.ep;
+}
+
 static int
-get_xfer_len(BOOL is_req, struct usbip_header *hdr)
+get_xfer_len(devbuf_t *rbuff, struct usbip_header *hdr)
 {
-	if (is_req) {
-		if (hdr->base.command == USBIP_CMD_UNLINK)
+	if (rbuff->is_req) {
+		if (hdr->base.command == USBIP_CMD_UNLINK) {
+			hdrs_cache_insert_unlink(rbuff->hdrs_cache, hdr, rbuff->iso_chan);
 			return 0;
-		hdrs_cache_insert(hdr);
+		}
+		hdrs_cache_insert(rbuff->hdrs_cache, hdr);
 		if (hdr->base.direction)
 			return 0;
 		return hdr->u.cmd_submit.transfer_buffer_length;
@@ -329,7 +340,7 @@ get_xfer_len(BOOL is_req, struct usbip_header *hdr)
 	else {
 		if (hdr->base.command == USBIP_RET_UNLINK)
 			return 0;
-		if (hdrs_cache_direction(hdr) == USBIP_DIR_OUT)
+		if (hdrs_cache_direction(rbuff->hdrs_cache, hdr) == USBIP_DIR_OUT)
 			return 0;
 		return hdr->u.ret_submit.actual_length;
 	}
@@ -350,6 +361,43 @@ get_iso_len(BOOL is_req, struct usbip_header *hdr)
 	}
 }
 
+/* PDUs which go through an ISO channel. hdr should be in host byte order */
+static BOOL
+is_iso_pdu(devbuf_t *rbuff, struct usbip_header *hdr)
+{
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		return hdr->u.cmd_submit.number_of_packets > 0;
+	case USBIP_CMD_UNLINK:
+		return hdrs_cache_iso(rbuff->hdrs_cache, hdr->u.cmd_unlink.seqnum);
+	case USBIP_RET_SUBMIT:
+		return hdrs_cache_iso(rbuff->hdrs_cache, hdr->base.seqnum) || hdr->u.ret_submit.number_of_packets > 0;
+	default:
+		return hdrs_cache_iso(rbuff->hdrs_cache, hdr->base.seqnum);
+	}
+}
+
+/*
+ * PDU should be in host byte order. Captured PDUs are kept as they are on the wire
+ * of linux peers, even if usbip-win peers use compact headers.
+ */
+static void
+capture_pdu(devbuf_t *rbuff, struct usbip_header *hdr, char *data, unsigned long xfer_len, unsigned long iso_len)
+{
+	char	*buf;
+	unsigned long	len = sizeof(struct usbip_header) + xfer_len + iso_len;
+
+	buf = usbip_capture_reserve(rbuff->capture_stream, rbuff->is_req, len);
+	if (buf == NULL)
+		return;
+	memcpy(buf, hdr, sizeof(struct usbip_header));
+	memcpy(buf + sizeof(struct usbip_header), data, xfer_len + iso_len);
+	if (iso_len > 0)
+		usbip_net_pack_iso_descs(1, (struct usbip_iso_packet_descriptor *)(buf + sizeof(struct usbip_header) + xfer_len), hdr->u.ret_submit.number_of_packets);
+	usbip_net_pack_usbip_header(1, (struct usbip_header *)buf);
+	usbip_capture_commit(buf);
+}
+
 static BOOL
 setup_rw_overlapped(devbuf_t *buff)
 {
@@ -363,7 +411,7 @@ setup_rw_overlapped(devbuf_t *buff)
 }
 
 static BOOL
-init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, HANDLE hdev, HANDLE hEvent)
+init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, BOOL compact, UINT32 devid, HANDLE hdev, HANDLE hEvent)
 {
 	buff->bufp = (char *)malloc(1024);
 	if (buff->bufp == NULL)
@@ -375,7 +423,15 @@ init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, HANDLE
 	buff->in_reading = FALSE;
 	buff->in_writing = FALSE;
 	buff->invalid = FALSE;
+	buff->broken = FALSE;
 	buff->step_reading = 0;
+	buff->compact = compact;
+	buff->devid = devid;
+	buff->len_hdr = 0;
+	buff->zip = NULL;
+	buff->len_zip = 0;
+	buff->stats = NULL;
+	buff->hdrs_cache = NULL;
 	buff->offhdr = 0;
 	buff->offp = 0;
 	buff->offc = 0;
@@ -383,6 +439,18 @@ init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, HANDLE
 	buff->bufmaxc = 0;
 	buff->hdev = hdev;
 	buff->hEvent = hEvent;
+	buff->capture_stream = -1;
+	buff->collect_dscr = FALSE;
+	buff->session = NULL;
+	buff->writing = NULL;
+	buff->iso_out = NULL;
+	buff->iso_chan = FALSE;
+	buff->shaper = NULL;
+	buff->idx_seg = 0;
+	buff->n_segs = 0;
+	buff->len_admitted = 0;
+	buff->wait_shaped = 0;
+	buff->eps_periodic = 0;
 	if (!setup_rw_overlapped(buff)) {
 		free(buff->bufp);
 		return FALSE;
@@ -416,8 +484,9 @@ read_completion(DWORD errcode, DWORD nread, LPOVERLAPPED lpOverlapped)
 	SetEvent(rbuff->hEvent);
 }
 
+/* makes room for nreq bytes after what has been read */
 static BOOL
-read_devbuf(devbuf_t *rbuff, DWORD nreq)
+reserve_devbuf(devbuf_t *rbuff, DWORD nreq)
 {
 	if (BUFREADMAX_P(rbuff) < nreq) {
 		char	*bufnew;
@@ -452,6 +521,14 @@ read_devbuf(devbuf_t *rbuff, DWORD nreq)
 			rbuff->bufmaxp = nreq + nexist;
 		}
 	}
+	return TRUE;
+}
+
+static BOOL
+read_devbuf(devbuf_t *rbuff, DWORD nreq)
+{
+	if (!reserve_devbuf(rbuff, nreq))
+		return FALSE;
 
 	if (!rbuff->in_reading) {
 		if (!ReadFileEx(rbuff->hdev, BUFCUR_P(rbuff), nreq, &rbuff->ovs[0], read_completion)) {
@@ -460,6 +537,7 @@ read_devbuf(devbuf_t *rbuff, DWORD nreq)
 			if (error == ERROR_NETNAME_DELETED) {
 				dbg("could the client have dropped the connection?");
 			}
+			rbuff->broken = TRUE;
 			return FALSE;
 		}
 		rbuff->in_reading = TRUE;
@@ -484,8 +562,56 @@ write_completion(DWORD errcode, DWORD nwrite, LPOVERLAPPED lpOverlapped)
 		wbuff->invalid = TRUE;
 		return;
 	}
-	rbuff = wbuff->peer;
+	rbuff = wbuff->writing;
 	rbuff->offc += nwrite;
+	if (rbuff->shaper != NULL)
+		rbuff->len_admitted -= nwrite;
+}
+
+/*
+ * Lengths of PDUs queued in a consumer by class, which a shaper lets through
+ * in order. Adjacent ones of a class are merged. If there's no room, a PDU
+ * goes into the last one as bulk, which only delays priority ones.
+ */
+static void
+push_seg_shaped(devbuf_t *rbuff, DWORD len, BOOL prio)
+{
+	seg_shaped_t	*seg;
+
+	if (rbuff->n_segs > 0) {
+		seg = &rbuff->segs[(rbuff->idx_seg + rbuff->n_segs - 1) % N_SEGS_SHAPED];
+		if (seg->prio == prio || rbuff->n_segs == N_SEGS_SHAPED) {
+			seg->len += len;
+			seg->prio = seg->prio && prio;
+			return;
+		}
+	}
+	seg = &rbuff->segs[(rbuff->idx_seg + rbuff->n_segs) % N_SEGS_SHAPED];
+	seg->len = len;
+	seg->prio = prio;
+	rbuff->n_segs++;
+}
+
+/* bytes of a consumer which may be written now. Priority PDUs are never held */
+static DWORD
+get_len_shaped(devbuf_t *rbuff)
+{
+	rbuff->wait_shaped = 0;
+	while (rbuff->n_segs > 0) {
+		seg_shaped_t	*seg = &rbuff->segs[rbuff->idx_seg];
+
+		if (seg->prio)
+			usbip_shaper_charge(rbuff->shaper, seg->len);
+		else {
+			rbuff->wait_shaped = usbip_shaper_admit(rbuff->shaper, seg->len);
+			if (rbuff->wait_shaped > 0)
+				break;
+		}
+		rbuff->len_admitted += seg->len;
+		rbuff->idx_seg = (rbuff->idx_seg + 1) % N_SEGS_SHAPED;
+		rbuff->n_segs--;
+	}
+	return rbuff->len_admitted;
 }
 
 static BOOL
@@ -498,8 +624,20 @@ write_devbuf(devbuf_t *wbuff, devbuf_t *rbuff)
 		rbuff->bufmaxc = rbuff->offhdr;
 	}
 	if (!wbuff->in_writing && BUFREMAIN_C(rbuff) > 0) {
-		if (!WriteFileEx(wbuff->hdev, BUFCUR_C(rbuff), BUFREMAIN_C(rbuff), &wbuff->ovs[1], write_completion)) {
+		DWORD	len = BUFREMAIN_C(rbuff);
+
+		if (rbuff->shaper != NULL) {
+			DWORD	len_shaped = get_len_shaped(rbuff);
+
+			if (len_shaped == 0)
+				return TRUE;
+			if (len_shaped < len)
+				len = len_shaped;
+		}
+		wbuff->writing = rbuff;
+		if (!WriteFileEx(wbuff->hdev, BUFCUR_C(rbuff), len, &wbuff->ovs[1], write_completion)) {
 			dbg("failed to write sock: err: 0x%lx", GetLastError());
+			wbuff->broken = TRUE;
 			return FALSE;
 		}
 		wbuff->in_writing = TRUE;
@@ -509,49 +647,231 @@ write_devbuf(devbuf_t *wbuff, devbuf_t *rbuff)
 }
 
 static int
-read_dev(devbuf_t *rbuff, BOOL swap_req_write)
+read_hdr(devbuf_t *rbuff)
 {
-	struct usbip_header	*hdr;
-	unsigned long	xfer_len, iso_len, len_data;
-
 	if (BUFREAD_P(rbuff) < sizeof(struct usbip_header)) {
 		rbuff->step_reading = 1;
 		if (!read_devbuf(rbuff, sizeof(struct usbip_header) - BUFREAD_P(rbuff)))
 			return -1;
 		return 0;
 	}
+	if (rbuff->swap_req)
+		usbip_net_pack_usbip_header(0, (struct usbip_header *)BUFHDR_P(rbuff));
+	return 1;
+}
 
-	hdr = (struct usbip_header *)BUFHDR_P(rbuff);
-	if (rbuff->step_reading == 1) {
-		if (rbuff->swap_req)
-			swap_usbip_header_endian(hdr, TRUE);
-		rbuff->step_reading = 2;
+/* a compact header is expanded in place into usbip_header, which a driver takes */
+static int
+read_hdr_compact(devbuf_t *rbuff)
+{
+	struct usbip_header	hdr;
+	DWORD	len_hdr = USBIP_COMPACT_HDR_MIN;
+
+	if (BUFREAD_P(rbuff) >= USBIP_COMPACT_HDR_MIN) {
+		len_hdr = (UCHAR)*BUFHDR_P(rbuff);
+		if (len_hdr < USBIP_COMPACT_HDR_MIN || len_hdr > USBIP_COMPACT_HDR_MAX) {
+			dbg("invalid compact header length: %lu", len_hdr);
+			return -1;
+		}
+	}
+	if (BUFREAD_P(rbuff) < len_hdr) {
+		rbuff->step_reading = 1;
+		if (!read_devbuf(rbuff, len_hdr - BUFREAD_P(rbuff)))
+			return -1;
+		return 0;
 	}
 
-	xfer_len = get_xfer_len(rbuff->is_req, hdr);
-	iso_len = get_iso_len(rbuff->is_req, hdr);
+	if (usbip_compact_unpack(rbuff->devid, BUFHDR_P(rbuff), len_hdr, &hdr, rbuff->zip ? &rbuff->len_zip : NULL) < 0) {
+		dbg("malformed compact header: %s", rbuff->desc);
+		return -1;
+	}
+	if (len_hdr < sizeof(struct usbip_header) && !reserve_devbuf(rbuff, sizeof(struct usbip_header) - len_hdr))
+		return -1;
+	memcpy(BUFHDR_P(rbuff), &hdr, sizeof(struct usbip_header));
+	rbuff->offp = rbuff->offhdr + sizeof(struct usbip_header);
+	return 1;
+}
 
-	len_data = xfer_len + iso_len;
-	if (BUFREAD_P(rbuff) < len_data + sizeof(struct usbip_header)) {
-		DWORD	nmore = (DWORD)(len_data + sizeof(struct usbip_header)) - BUFREAD_P(rbuff);
+/* a header from a driver is shrunk before its data are read behind it */
+static BOOL
+pack_hdr_compact(devbuf_t *rbuff, UINT32 devid)
+{
+	char	buf[USBIP_COMPACT_HDR_MAX];
+	int	len_hdr;
+
+	memcpy(&rbuff->hdr, BUFHDR_P(rbuff), sizeof(struct usbip_header));
+	len_hdr = usbip_compact_pack(devid, &rbuff->hdr, 0, buf);
+	if (len_hdr > sizeof(struct usbip_header) && !reserve_devbuf(rbuff, len_hdr - sizeof(struct usbip_header)))
+		return FALSE;
+	memcpy(BUFHDR_P(rbuff), buf, len_hdr);
+	rbuff->offp = rbuff->offhdr + len_hdr;
+	rbuff->len_hdr = len_hdr;
+	return TRUE;
+}
+
+/* a compressed payload is replaced with what it is decompressed to */
+static BOOL
+unzip_data(devbuf_t *rbuff)
+{
+	if (!usbip_zip_decompress(rbuff->zip, BUFHDR_P(rbuff) + rbuff->len_hdr, rbuff->len_zip, rbuff->xfer_len)) {
+		dbg("malformed compressed payload: %s", rbuff->desc);
+		return FALSE;
+	}
+	if (!reserve_devbuf(rbuff, rbuff->xfer_len - rbuff->len_zip))
+		return FALSE;
+	memcpy(BUFHDR_P(rbuff) + rbuff->len_hdr, rbuff->zip->buf, rbuff->xfer_len);
+	rbuff->offp = rbuff->offhdr + rbuff->len_hdr + rbuff->xfer_len;
+	rbuff->len_zip = 0;
+	return TRUE;
+}
+
+/*
+ * A payload is compressed behind a compact header packed again. Both are shorter
+ * than what they replace. Returns the length of a payload in a buffer.
+ */
+static unsigned long
+zip_data(devbuf_t *rbuff, devbuf_t *wbuff, UINT32 ep)
+{
+	char	buf[USBIP_COMPACT_HDR_MAX];
+	unsigned long	len_zip;
+	int	len_hdr;
+
+	len_zip = usbip_zip_compress(wbuff->zip, ep, rbuff->hdr.base.direction, BUFHDR_P(rbuff) + rbuff->len_hdr, rbuff->xfer_len);
+	if (len_zip == 0)
+		return rbuff->xfer_len;
+
+	len_hdr = usbip_compact_pack(wbuff->devid, &rbuff->hdr, len_zip, buf);
+	memcpy(BUFHDR_P(rbuff), buf, len_hdr);
+	memcpy(BUFHDR_P(rbuff) + len_hdr, wbuff->zip->buf, len_zip);
+	rbuff->len_hdr = len_hdr;
+	rbuff->offp = rbuff->offhdr + len_hdr + len_zip;
+	return len_zip;
+}
+
+/* control, interrupt and ISO PDUs go ahead of bulk ones. hdr should be in host byte order */
+static BOOL
+is_prio_pdu(devbuf_t *rbuff, struct usbip_header *hdr, UINT32 ep)
+{
+	if ((ep & 0x0f) == 0 || rbuff->iso_len > 0)
+		return TRUE;
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		return hdr->u.cmd_submit.interval > 0;
+	case USBIP_RET_SUBMIT:
+		return (rbuff->eps_periodic & (1 << EP_INDEX(ep, hdr->base.direction))) != 0;
+	default:
+		/* unlinks */
+		return TRUE;
+	}
+}
+
+/* a PDU just read is moved behind those in a producer of qbuff */
+static BOOL
+move_pdu(devbuf_t *rbuff, devbuf_t *qbuff, DWORD len)
+{
+	if (!reserve_devbuf(qbuff, len))
+		return FALSE;
+	memcpy(BUFCUR_P(qbuff), BUFHDR_P(rbuff), len);
+	qbuff->offp += len;
+	qbuff->offhdr = qbuff->offp;
+	if (qbuff->bufp == qbuff->bufc)
+		qbuff->bufmaxc = qbuff->offp;
+
+	rbuff->offp = rbuff->offhdr;
+	rbuff->step_reading = 0;
+	return TRUE;
+}
+
+static int
+read_dev(devbuf_t *rbuff, devbuf_t *wbuff)
+{
+	struct usbip_header	*hdr;
+	char	*data;
+	unsigned long	len_data;
+	UINT32	ep, seqnum;
+	BOOL	iso, prio = FALSE;
+	int	res;
+
+	if (rbuff->step_reading != 2) {
+		res = rbuff->compact ? read_hdr_compact(rbuff) : read_hdr(rbuff);
+		if (res <= 0)
+			return res;
+
+		hdr = (struct usbip_header *)BUFHDR_P(rbuff);
+		rbuff->xfer_len = get_xfer_len(rbuff, hdr);
+		rbuff->iso_len = get_iso_len(rbuff->is_req, hdr);
+		if (rbuff->len_zip > 0 && (rbuff->len_zip >= rbuff->xfer_len || rbuff->iso_len > 0)) {
+			dbg("unexpected compressed payload: %s", rbuff->desc);
+			return -1;
+		}
+		rbuff->len_hdr = sizeof(struct usbip_header);
+		if (wbuff->compact && !pack_hdr_compact(rbuff, wbuff->devid))
+			return -1;
+		rbuff->step_reading = 2;
+	}
+
+	len_data = (rbuff->len_zip > 0 ? rbuff->len_zip : rbuff->xfer_len) + rbuff->iso_len;
+	if (BUFREAD_P(rbuff) < rbuff->len_hdr + len_data) {
+		DWORD	nmore = (DWORD)(rbuff->len_hdr + len_data) - BUFREAD_P(rbuff);
 
 		if (!read_devbuf(rbuff, nmore))
 			return -1;
 		return 0;
 	}
+	if (rbuff->len_zip > 0 && !unzip_data(rbuff))
+		return -1;
+	len_data = rbuff->xfer_len + rbuff->iso_len;
+
+	hdr = wbuff->compact ? &rbuff->hdr : (struct usbip_header *)BUFHDR_P(rbuff);
+	data = BUFHDR_P(rbuff) + rbuff->len_hdr;
+
+	if (rbuff->swap_req && rbuff->iso_len > 0)
+		usbip_net_pack_iso_descs(0, (struct usbip_iso_packet_descriptor *)(data + rbuff->xfer_len), hdr->u.ret_submit.number_of_packets);
+
+	DBG_USBIP_HEADER(hdr, data);
+
+	ep = rbuff->is_req ? hdr->base.ep : hdrs_cache_ep(rbuff->hdrs_cache, hdr);
+	if (rbuff->zip != NULL)
+		usbip_zip_snoop(rbuff->zip, hdr, ep, data, rbuff->xfer_len);
+	if (rbuff->stats != NULL)
+		usbip_stats_pdu(rbuff->stats, hdr, ep, rbuff->xfer_len);
+	if (rbuff->collect_dscr)
+		usbip_dscr_collect_pdu(hdr, data, rbuff->xfer_len);
+	/* interrupt or ISO endpoints are told by intervals of CMD_SUBMIT's, which RET_SUBMIT's do not have */
+	if (wbuff->shaper != NULL && rbuff->is_req && hdr->base.command == USBIP_CMD_SUBMIT && hdr->u.cmd_submit.interval > 0)
+		wbuff->eps_periodic |= 1 << EP_INDEX(ep, hdr->base.direction);
+	if (rbuff->shaper != NULL)
+		prio = is_prio_pdu(rbuff, hdr, ep);
+	seqnum = hdr->base.seqnum;
+	iso = rbuff->iso_out != NULL && is_iso_pdu(rbuff, hdr);
+	if (rbuff->session != NULL)
+		usbip_session_pdu(rbuff->session, hdr);
+
+	if (rbuff->capture_stream >= 0)
+		capture_pdu(rbuff, hdr, data, rbuff->xfer_len, rbuff->iso_len);
+
+	if (wbuff->swap_req) {
+		if (rbuff->iso_len > 0)
+			usbip_net_pack_iso_descs(1, (struct usbip_iso_packet_descriptor *)(data + rbuff->xfer_len), hdr->u.ret_submit.number_of_packets);
+		usbip_net_pack_usbip_header(1, hdr);
+	}
 
-	if (rbuff->swap_req && iso_len > 0)
-		swap_iso_descs_endian((char *)(hdr + 1) + xfer_len, hdr->u.ret_submit.number_of_packets);
+	if (wbuff->compact && wbuff->zip != NULL && rbuff->xfer_len > 0 && rbuff->iso_len == 0)
+		len_data = zip_data(rbuff, wbuff, ep);
 
-	DBG_USBIP_HEADER(hdr);
+	/* a RET is logged as it is sent */
+	if (rbuff->session != NULL && !rbuff->is_req)
+		usbip_session_log_ret(rbuff->session, seqnum, BUFHDR_P(rbuff), rbuff->len_hdr + len_data);
 
-	if (swap_req_write) {
-		if (iso_len > 0)
-			swap_iso_descs_endian((char *)(hdr + 1) + xfer_len, hdr->u.ret_submit.number_of_packets);
-		swap_usbip_header_endian(hdr, FALSE);
+	if (iso) {
+		if (rbuff->shaper != NULL)
+			usbip_shaper_charge(rbuff->shaper, rbuff->len_hdr + len_data);
+		return move_pdu(rbuff, rbuff->iso_out, rbuff->len_hdr + len_data) ? 1 : -1;
 	}
 
-	rbuff->offhdr += (sizeof(struct usbip_header) + len_data);
+	if (rbuff->shaper != NULL)
+		push_seg_shaped(rbuff, rbuff->len_hdr + len_data, prio);
+	rbuff->offhdr += rbuff->len_hdr + len_data;
 	if (rbuff->bufp == rbuff->bufc)
 		rbuff->bufmaxc = rbuff->offp;
 	rbuff->step_reading = 0;
@@ -559,13 +879,35 @@ read_dev(devbuf_t *rbuff, BOOL swap_req_write)
 	return 1;
 }
 
+static unsigned long
+get_len_bufs(devbuf_t *buff)
+{
+	return buff->bufmaxp + (buff->bufc != buff->bufp ? buff->bufmaxc : 0);
+}
+
+/* PDUs in a consumer buffer, and those in a producer buffer if consumer has its own */
+static unsigned long
+get_len_queued(devbuf_t *buff)
+{
+	return BUFREMAIN_C(buff) + (buff->bufc != buff->bufp ? buff->offhdr : 0);
+}
+
+static void
+update_stats_bufs(devbuf_t *buff_src, devbuf_t *buff_dst)
+{
+	if (buff_src->stats == NULL)
+		return;
+	usbip_stats_bufs(buff_src->stats, get_len_bufs(buff_src) + get_len_bufs(buff_dst),
+		get_len_queued(buff_src) + get_len_queued(buff_dst));
+}
+
 static BOOL
 read_write_dev(devbuf_t *rbuff, devbuf_t *wbuff)
 {
 	int	res;
 
 	if (!rbuff->in_reading) {
-		if ((res = read_dev(rbuff, wbuff->swap_req)) < 0)
+		if ((res = read_dev(rbuff, wbuff)) < 0)
 			return FALSE;
 		if (res == 0)
 			return TRUE;
@@ -573,92 +915,332 @@ read_write_dev(devbuf_t *rbuff, devbuf_t *wbuff)
 	return write_devbuf(wbuff, rbuff);
 }
 
-static volatile BOOL	interrupted;
+/* a CMD which a server does not know of is failed as if it were unlinked */
+static BOOL
+inject_ret(devbuf_t *rbuff, UINT32 seqnum, UINT32 command)
+{
+	struct usbip_header	*hdr;
+
+	if (!reserve_devbuf(rbuff, sizeof(struct usbip_header)))
+		return FALSE;
+	hdr = (struct usbip_header *)BUFHDR_P(rbuff);
+	memset(hdr, 0, sizeof(struct usbip_header));
+	hdr->base.seqnum = seqnum;
+	hdr->base.devid = rbuff->devid;
+	if (command == USBIP_CMD_UNLINK) {
+		hdr->base.command = USBIP_RET_UNLINK;
+		hdr->u.ret_unlink.status = RET_ST_CONNRESET;
+	}
+	else {
+		hdr->base.command = USBIP_RET_SUBMIT;
+		hdr->u.ret_submit.status = RET_ST_CONNRESET;
+	}
+	rbuff->offhdr += sizeof(struct usbip_header);
+	rbuff->offp = rbuff->offhdr;
+	if (rbuff->bufp == rbuff->bufc)
+		rbuff->bufmaxc = rbuff->offp;
+	return TRUE;
+}
+
+/* PDUs not completely sent are dropped */
+static void
+drop_queued_devbuf(devbuf_t *buff)
+{
+	if (buff->bufp != buff->bufc) {
+		free(buff->bufc);
+		buff->bufc = buff->bufp;
+	}
+	buff->offc = buff->offhdr;
+	buff->bufmaxc = buff->offhdr;
+	buff->n_segs = 0;
+	buff->len_admitted = 0;
+	buff->wait_shaped = 0;
+}
+
+/*
+ * A PDU being read from a lost connection and those to be written into it are dropped.
+ * A peer knows of them by seqnums in flight.
+ */
+static BOOL
+resume_forward(usbip_session_t *sess, devbuf_t *buff_sock, devbuf_t *buff_dev)
+{
+	UINT32	seqnum, command;
+
+	if (buff_sock->in_reading)
+		CancelIoEx(buff_sock->hdev, &buff_sock->ovs[0]);
+	if (buff_sock->in_writing)
+		CancelIoEx(buff_sock->hdev, &buff_sock->ovs[1]);
+	/* an event stays set, and completion routines set it again in an alertable wait */
+	while (buff_sock->in_reading || buff_sock->in_writing) {
+		ResetEvent(buff_sock->hEvent);
+		WaitForSingleObjectEx(buff_sock->hEvent, INFINITE, TRUE);
+	}
+
+	if (!usbip_session_resume(sess))
+		return FALSE;
+
+	buff_sock->hdev = (HANDLE)sess->sockfd;
+	buff_sock->invalid = FALSE;
+	buff_sock->broken = FALSE;
+	buff_sock->offp = buff_sock->offhdr;
+	buff_sock->step_reading = 0;
+	buff_sock->len_zip = 0;
+	drop_queued_devbuf(buff_dev);
+
+	while (usbip_session_pop_lost(sess, &seqnum, &command)) {
+		if (!inject_ret(buff_sock, seqnum, command))
+			return FALSE;
+	}
+	return TRUE;
+}
 
 static void
 signalhandler(int signal)
 {
 	interrupted = TRUE;
-	SetEvent(hEvent);
+	SetEvent(hevt_interrupted);
+}
+
+/* SIGINT is caught while any forwarder runs */
+static BOOL
+hold_signal(void)
+{
+	BOOL	res = TRUE;
+
+	AcquireSRWLockExclusive(&lock_forwarders);
+	if (hevt_interrupted == NULL) {
+		hevt_interrupted = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (hevt_interrupted == NULL)
+			res = FALSE;
+	}
+	if (res && n_forwarders++ == 0)
+		sighandler_prev = signal(SIGINT, signalhandler);
+	ReleaseSRWLockExclusive(&lock_forwarders);
+	return res;
+}
+
+static void
+release_signal(void)
+{
+	AcquireSRWLockExclusive(&lock_forwarders);
+	if (--n_forwarders == 0)
+		signal(SIGINT, sighandler_prev == SIG_ERR ? SIG_DFL : sighandler_prev);
+	ReleaseSRWLockExclusive(&lock_forwarders);
+}
+
+/* nothing is read from rbuff or written from it into wbuff until a completion or a shaper lets it */
+static BOOL
+is_idle(devbuf_t *rbuff, devbuf_t *wbuff)
+{
+	return rbuff->in_reading && (wbuff->in_writing || BUFREMAIN_C(rbuff) == 0 || rbuff->wait_shaped > 0);
+}
+
+/* milliseconds until a shaper is asked again for held PDUs */
+static DWORD
+get_wait_shaped(devbuf_t *buff_src, devbuf_t *buff_dst)
+{
+	unsigned long	wait = buff_src->wait_shaped;
+
+	if (buff_dst->wait_shaped > 0 && (wait == 0 || buff_dst->wait_shaped < wait))
+		wait = buff_dst->wait_shaped;
+	if (wait == 0)
+		return INFINITE;
+	return (wait + 999) / 1000;
+}
+
+/*
+ * buff_iso reads an ISO channel, and writes what buff_dev queues for it.
+ * ISO PDUs go ahead of others into a device.
+ */
+static void
+forward_devbufs(devbuf_t *buff_src, devbuf_t *buff_dst, devbuf_t *buff_iso, devbuf_t *buff_dev)
+{
+	HANDLE	hevts[2] = { buff_src->hEvent, hevt_interrupted };
+
+	while (!interrupted) {
+		if (buff_iso != NULL) {
+			if (!read_write_dev(buff_iso, buff_dev))
+				break;
+			if (!write_devbuf(buff_iso, buff_dev->iso_out))
+				break;
+			if (buff_iso->invalid)
+				break;
+		}
+		if (!read_write_dev(buff_src, buff_dst))
+			break;
+		if (!read_write_dev(buff_dst, buff_src))
+			break;
+
+		if (buff_src->invalid || buff_dst->invalid)
+			break;
+		update_stats_bufs(buff_src, buff_dst);
+		if (is_idle(buff_src, buff_dst) && is_idle(buff_dst, buff_src) &&
+			(buff_iso == NULL || (is_idle(buff_iso, buff_dev) &&
+			(buff_iso->in_writing || BUFREMAIN_C(buff_dev->iso_out) == 0)))) {
+			WaitForMultipleObjectsEx(2, hevts, FALSE, get_wait_shaped(buff_src, buff_dst), TRUE);
+			ResetEvent(buff_src->hEvent);
+		}
+	}
 }
 
 void
-usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound)
+usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound, UINT32 features, UINT32 devid, usbip_session_t *sess,
+	      HANDLE hsock_iso, usbip_shaper_dev_t *shaper)
 {
 	devbuf_t	buff_src, buff_dst;
+	devbuf_t	buff_iso_in, buff_iso_out;
+	devbuf_t	*buff_sock, *buff_dev, *buff_iso = NULL;
 	const char* desc_src, * desc_dst;
-	BOOL	is_req_src;
 	BOOL	swap_req_src, swap_req_dst;
+	BOOL	compact_src, compact_dst;
+	/* compression works only with compact headers */
+	BOOL	use_zip = (features & USBIP_EXT_COMPACT) && (features & USBIP_EXT_COMPRESS);
+	usbip_zip_t	zip;
+	struct usbip_cached_hdr	*hdrs_cache;
+	HANDLE	hEvent;
 
 	if (inbound) {
 		desc_src = "socket";
 		desc_dst = "stub";
-		is_req_src = TRUE;
-		swap_req_src = TRUE;
+		compact_src = (features & USBIP_EXT_COMPACT) != 0;
+		compact_dst = FALSE;
+		swap_req_src = !compact_src;
 		swap_req_dst = FALSE;
 	}
 	else {
 		desc_src = "vhci";
 		desc_dst = "socket";
-		is_req_src = FALSE;
+		compact_src = FALSE;
+		compact_dst = (features & USBIP_EXT_COMPACT) != 0;
 		swap_req_src = FALSE;
-		swap_req_dst = TRUE;
+		swap_req_dst = !compact_dst;
+	}
+
+	hdrs_cache = (struct usbip_cached_hdr *)calloc(HDRS_CACHE_SIZE, sizeof(struct usbip_cached_hdr));
+	if (hdrs_cache == NULL) {
+		dbg("out of memory");
+		return;
 	}
 
+	if (!hold_signal()) {
+		dbg("failed to create event");
+		free(hdrs_cache);
+		return;
+	}
 	hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	if (hEvent == NULL) {
 		dbg("failed to create event");
+		release_signal();
+		free(hdrs_cache);
 		return;
 	}
 
-	if (!init_devbuf(&buff_src, desc_src, TRUE, swap_req_src, hdev_src, hEvent)) {
+	if (!init_devbuf(&buff_src, desc_src, TRUE, swap_req_src, compact_src, devid, hdev_src, hEvent)) {
 		CloseHandle(hEvent);
+		release_signal();
+		free(hdrs_cache);
 		dbg("failed to initialize %s buffer", desc_src);
 		return;
 	}
-	if (!init_devbuf(&buff_dst, desc_dst, FALSE, swap_req_dst, hdev_dst, hEvent)) {
+	if (!init_devbuf(&buff_dst, desc_dst, FALSE, swap_req_dst, compact_dst, devid, hdev_dst, hEvent)) {
 		CloseHandle(hEvent);
+		release_signal();
+		free(hdrs_cache);
 		dbg("failed to initialize %s buffer", desc_dst);
 		cleanup_devbuf(&buff_src);
 		return;
 	}
 
-	buff_src.peer = &buff_dst;
-	buff_dst.peer = &buff_src;
+	if (use_zip) {
+		usbip_zip_init(&zip);
+		buff_src.zip = &zip;
+		buff_dst.zip = &zip;
+	}
 
-	signal(SIGINT, signalhandler);
+	buff_src.stats = usbip_stats_open(inbound ? "stub" : "vhci", devid);
+	buff_dst.stats = buff_src.stats;
 
-	while (!interrupted) {
-		if (!read_write_dev(&buff_src, &buff_dst))
+	buff_src.hdrs_cache = hdrs_cache;
+	buff_dst.hdrs_cache = hdrs_cache;
+
+	buff_src.collect_dscr = !inbound && usbip_dscr_collecting();
+	buff_dst.collect_dscr = buff_src.collect_dscr;
+
+	if (usbip_capture_start()) {
+		buff_src.capture_stream = usbip_capture_open_stream();
+		buff_dst.capture_stream = buff_src.capture_stream;
+		if (buff_src.capture_stream < 0)
+			usbip_capture_stop();
+	}
+
+	buff_sock = inbound ? &buff_src : &buff_dst;
+	buff_dev = inbound ? &buff_dst : &buff_src;
+	buff_src.session = sess;
+	buff_dst.session = sess;
+	buff_dev->shaper = shaper;
+
+	/* an ISO channel takes the same headers as a socket */
+	if (hsock_iso != INVALID_HANDLE_VALUE) {
+		if (init_devbuf(&buff_iso_in, "iso socket", inbound, buff_sock->swap_req, buff_sock->compact, devid, hsock_iso, hEvent)) {
+			if (init_devbuf(&buff_iso_out, "iso queue", !inbound, FALSE, FALSE, devid, INVALID_HANDLE_VALUE, hEvent)) {
+				buff_iso = &buff_iso_in;
+				buff_iso->iso_chan = TRUE;
+				buff_iso->zip = buff_sock->zip;
+				buff_iso->stats = buff_sock->stats;
+				buff_iso->hdrs_cache = hdrs_cache;
+				buff_iso->capture_stream = buff_sock->capture_stream;
+				buff_dev->iso_out = &buff_iso_out;
+			}
+			else
+				cleanup_devbuf(&buff_iso_in);
+		}
+		if (buff_iso == NULL)
+			dbg("failed to initialize iso channel buffers, iso transfers go through a socket");
+	}
+
+	for (;;) {
+		forward_devbufs(&buff_src, &buff_dst, buff_iso, buff_dev);
+		if (interrupted || sess == NULL || buff_dev->invalid || buff_dev->broken)
 			break;
-		if (!read_write_dev(&buff_dst, &buff_src))
+		if (!usbip_session_resumable(sess, buff_sock->broken))
 			break;
-
-		if (buff_src.invalid || buff_dst.invalid)
+		if (!resume_forward(sess, buff_sock, buff_dev))
 			break;
-		if (buff_src.in_reading && buff_dst.in_reading &&
-			(buff_src.in_writing || BUFREMAIN_C(&buff_dst) == 0) &&
-			(buff_dst.in_writing || BUFREMAIN_C(&buff_src) == 0)) {
-			WaitForSingleObjectEx(hEvent, INFINITE, TRUE);
-			ResetEvent(hEvent);
-		}
 	}
 
 	if (interrupted) {
 		info("CTRL-C received\n");
 	}
-	signal(SIGINT, SIG_DFL);
 
 	if (buff_src.in_reading)
-		CancelIoEx(hdev_src, &buff_src.ovs[0]);
+		CancelIoEx(buff_src.hdev, &buff_src.ovs[0]);
 	if (buff_dst.in_reading)
-		CancelIoEx(hdev_dst, &buff_dst.ovs[0]);
+		CancelIoEx(buff_dst.hdev, &buff_dst.ovs[0]);
+	if (buff_iso != NULL && buff_iso->in_reading)
+		CancelIoEx(buff_iso->hdev, &buff_iso->ovs[0]);
 
-	while (buff_src.in_reading || buff_dst.in_reading || buff_src.in_writing || buff_dst.in_writing) {
+	while (buff_src.in_reading || buff_dst.in_reading || buff_src.in_writing || buff_dst.in_writing ||
+	       (buff_iso != NULL && (buff_iso->in_reading || buff_iso->in_writing))) {
+		ResetEvent(hEvent);
 		WaitForSingleObjectEx(hEvent, INFINITE, TRUE);
 	}
 
+	if (buff_src.capture_stream >= 0) {
+		usbip_capture_close_stream(buff_src.capture_stream);
+		usbip_capture_stop();
+	}
+
+	if (buff_src.stats != NULL)
+		usbip_stats_close(buff_src.stats);
 	cleanup_devbuf(&buff_src);
 	cleanup_devbuf(&buff_dst);
+	if (buff_iso != NULL) {
+		cleanup_devbuf(&buff_iso_in);
+		cleanup_devbuf(&buff_iso_out);
+	}
+	if (use_zip)
+		usbip_zip_cleanup(&zip);
+	free(hdrs_cache);
 	CloseHandle(hEvent);
+	release_signal();
 }
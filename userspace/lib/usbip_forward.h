@@ -2,4 +2,15 @@
 
 #include <winsock2.h>
 
-void usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound);
\ No newline at end of file
+#include "usbip_session.h"
+#include "usbip_shaper.h"
+
+/*
+ * features: USBIP_EXT_* agreed on at import, devid: devid of an imported device,
+ * sess: NULL unless USBIP_EXT_RESUME is agreed on, see usbip_session.h
+ * hsock_iso: a connection of OP_REQ_ISO_CHANNEL, INVALID_HANDLE_VALUE if not open.
+ * ISO transfers and their unlinks go through it, which a session does not cover.
+ * shaper: shapes PDUs written into a socket, NULL if not shaped. See usbip_shaper.h
+ */
+void usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound, UINT32 features, UINT32 devid, usbip_session_t *sess,
+		   HANDLE hsock_iso, usbip_shaper_dev_t *shaper);
@@ -0,0 +1,183 @@
+#include "usbip_windows.h"
+
+#include "usbip_lz.h"
+
+#define HASH_LOG	12
+#define MIN_MATCH	4
+#define MAX_OFFSET	65535
+/* a block ends with literals, and the last match starts MFLIMIT bytes before the end */
+#define LAST_LITERALS	5
+#define MFLIMIT		12
+/* a step of searching grows after every 2^SKIP_TRIGGER failures */
+#define SKIP_TRIGGER	6
+
+static __inline UINT32
+read32(const UCHAR *p)
+{
+	UINT32	val;
+
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static __inline unsigned
+hash32(UINT32 val)
+{
+	return (val * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static UCHAR *
+put_len(UCHAR *op, unsigned long len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (UCHAR)len;
+	return op;
+}
+
+/* a token with literals. match length is or'ed into the token by a caller */
+static UCHAR *
+put_literals(UCHAR *op, const UCHAR *lits, unsigned long len)
+{
+	UCHAR	*token = op++;
+
+	if (len >= 15) {
+		*token = 15 << 4;
+		op = put_len(op, len - 15);
+	}
+	else {
+		*token = (UCHAR)(len << 4);
+	}
+	memcpy(op, lits, len);
+	return op + len;
+}
+
+int
+usbip_lz_compress(const char *src, int len, char *dst, int cap)
+{
+	UINT32	table[1 << HASH_LOG];
+	const UCHAR	*base = (const UCHAR *)src, *ip = base, *anchor = base;
+	const UCHAR	*iend = base + len, *mflimit = iend - MFLIMIT, *mlimit = iend - LAST_LITERALS;
+	UCHAR	*op = (UCHAR *)dst, *oend = (UCHAR *)dst + cap;
+	unsigned	n_fails = 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (len > MFLIMIT) {
+		ip++;
+		while (ip < mflimit) {
+			const UCHAR	*ref, *mp;
+			UCHAR	*token;
+			unsigned	h = hash32(read32(ip));
+			unsigned long	len_lits, len_match;
+
+			ref = base + table[h];
+			table[h] = (UINT32)(ip - base);
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+				ip += 1 + (n_fails++ >> SKIP_TRIGGER);
+				continue;
+			}
+			n_fails = 0;
+
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			for (mp = ip + MIN_MATCH; mp < mlimit && *mp == ref[mp - ip]; mp++);
+
+			len_lits = (unsigned long)(ip - anchor);
+			len_match = (unsigned long)(mp - ip) - MIN_MATCH;
+			/* token, literals, offset and both length extensions */
+			if (oend - op < (long)(len_lits + len_lits / 255 + len_match / 255 + 5))
+				return 0;
+
+			token = op;
+			op = put_literals(op, anchor, len_lits);
+			*op++ = (UCHAR)(ip - ref);
+			*op++ = (UCHAR)((ip - ref) >> 8);
+			if (len_match >= 15) {
+				*token |= 15;
+				op = put_len(op, len_match - 15);
+			}
+			else {
+				*token |= (UCHAR)len_match;
+			}
+
+			ip = anchor = mp;
+			if (ip < mflimit)
+				table[hash32(read32(ip - 2))] = (UINT32)(ip - 2 - base);
+		}
+	}
+
+	if (oend - op < (long)((iend - anchor) + (iend - anchor) / 255 + 2))
+		return 0;
+	op = put_literals(op, anchor, (unsigned long)(iend - anchor));
+	return (int)(op - (UCHAR *)dst);
+}
+
+static BOOL
+get_len(const UCHAR **pip, const UCHAR *iend, unsigned long *plen)
+{
+	const UCHAR	*ip = *pip;
+	UCHAR	b;
+
+	do {
+		if (ip == iend)
+			return FALSE;
+		b = *ip++;
+		*plen += b;
+	} while (b == 255);
+	*pip = ip;
+	return TRUE;
+}
+
+int
+usbip_lz_decompress(const char *src, int len, char *dst, int cap)
+{
+	const UCHAR	*ip = (const UCHAR *)src, *iend = ip + len;
+	UCHAR	*op = (UCHAR *)dst, *oend = op + cap;
+
+	while (ip < iend) {
+		UCHAR	token = *ip++;
+		unsigned long	len_lits = token >> 4, len_match = token & 15, offset;
+
+		if (len_lits == 15 && !get_len(&ip, iend, &len_lits))
+			return -1;
+		if (len_lits > (unsigned long)(iend - ip) || len_lits > (unsigned long)(oend - op))
+			return -1;
+		memcpy(op, ip, len_lits);
+		op += len_lits;
+		ip += len_lits;
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (unsigned long)(op - (UCHAR *)dst))
+			return -1;
+		if (len_match == 15 && !get_len(&ip, iend, &len_match))
+			return -1;
+		len_match += MIN_MATCH;
+		if (len_match > (unsigned long)(oend - op))
+			return -1;
+
+		if (offset == 1) {
+			memset(op, op[-1], len_match);
+			op += len_match;
+		}
+		else {
+			/* an overlapping match repeats the last offset bytes */
+			while (len_match > 0) {
+				unsigned long	n = len_match < offset ? len_match : offset;
+
+				memcpy(op, op - offset, n);
+				op += n;
+				len_match -= n;
+			}
+		}
+	}
+	return (int)(op - (UCHAR *)dst);
+}
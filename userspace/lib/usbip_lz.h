@@ -0,0 +1,12 @@
+#pragma once
+
+/*
+ * LZ77 block codec in LZ4 block format: sequences of a token, literals,
+ * a 16 bit offset and a match length. It trades ratio for speed, and skips
+ * faster over data which does not compress.
+ */
+
+/* returns a compressed length, or 0 if src does not fit into cap bytes */
+int usbip_lz_compress(const char *src, int len, char *dst, int cap);
+/* returns a decompressed length, or -1 if src is malformed or overflows cap */
+int usbip_lz_decompress(const char *src, int len, char *dst, int cap);
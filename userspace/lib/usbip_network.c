@@ -7,6 +7,8 @@
 #include <mstcpip.h>
 
 #include "usbip_common.h"
+#include "usbip_proto.h"
+#include "usbip_swap.h"
 #include "usbip_network.h"
 #include "dbgcode.h"
 
@@ -81,6 +83,18 @@ void usbip_net_pack_usb_interface(int pack, struct usbip_usb_interface *udev)
 	/* uint8_t members need nothing */
 }
 
+void usbip_net_pack_usbip_header(int pack, struct usbip_header *hdr)
+{
+	usbip_swap_header(hdr, pack ? hdr->base.command : ntohl(hdr->base.command));
+}
+
+void usbip_net_pack_iso_descs(int pack, struct usbip_iso_packet_descriptor *iso_descs, int n_pkts)
+{
+	UNREFERENCED_PARAMETER(pack);
+
+	usbip_swap_iso_descs(iso_descs, n_pkts);
+}
+
 static int usbip_net_xmit(SOCKET sockfd, void *buff, size_t bufflen, int sending)
 {
 	int total = 0;
@@ -74,6 +74,101 @@ struct op_import_reply {
 	usbip_net_pack_usb_device(pack, &(reply)->udev);\
 } while (0)
 
+/* ---------------------------------------------------------------------- */
+/*
+ * Import a remote USB device with protocol extensions of usbip-win.
+ * A reply has features which are accepted by a server.
+ */
+#define OP_IMPORT_EXT	0x71
+#define OP_REQ_IMPORT_EXT	(OP_REQUEST | OP_IMPORT_EXT)
+#define OP_REP_IMPORT_EXT	(OP_REPLY   | OP_IMPORT_EXT)
+
+/* little endian usbip headers with varint fields, see usbip_compact.h */
+#define USBIP_EXT_COMPACT	0x00000001
+/* compressed bulk payloads, only with USBIP_EXT_COMPACT, see usbip_zip.h */
+#define USBIP_EXT_COMPRESS	0x00000002
+/* a uint32 hash of descriptors follows features in a reply, see usbip_dscr_hash.h */
+#define USBIP_EXT_DSCR_HASH	0x00000004
+/* a uint32 token of OP_REQ_RESUME follows a hash or features in a reply, see usbip_session.h */
+#define USBIP_EXT_RESUME	0x00000008
+/*
+ * a uint32 token of OP_REQ_ISO_CHANNEL follows what precedes it in a reply.
+ * Not accepted with USBIP_EXT_RESUME.
+ */
+#define USBIP_EXT_ISO_CHANNEL	0x00000010
+
+struct op_import_ext_request {
+	char busid[USBIP_BUS_ID_SIZE];
+	uint32_t features;
+};
+
+struct op_import_ext_reply {
+	struct usbip_usb_device udev;
+	uint32_t features;
+};
+
+#define PACK_OP_IMPORT_EXT_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->features);\
+} while (0)
+
+#define PACK_OP_IMPORT_EXT_REPLY(pack, reply)  do {\
+	usbip_net_pack_usb_device(pack, &(reply)->udev);\
+	usbip_net_pack_uint32_t(pack, &(reply)->features);\
+} while (0)
+
+/* ---------------------------------------------------------------------- */
+/*
+ * Resume a session imported with USBIP_EXT_RESUME after its connection is lost.
+ * A request is followed by uint32 seqnums in flight, and a reply by a uint8
+ * state of each. RETs to be replayed follow those ahead of any other PDU.
+ */
+#define OP_RESUME	0x72
+#define OP_REQ_RESUME	(OP_REQUEST | OP_RESUME)
+#define OP_REP_RESUME	(OP_REPLY   | OP_RESUME)
+
+/* a client fails a CMD */
+#define USBIP_RESUME_UNKNOWN	0
+/* a stub has not returned a CMD yet */
+#define USBIP_RESUME_PENDING	1
+/* a RET is sent again */
+#define USBIP_RESUME_REPLAY	2
+
+struct op_resume_request {
+	uint32_t token;
+	uint32_t n_seqnums;
+};
+
+struct op_resume_reply {
+	uint32_t n_seqnums;
+};
+
+#define PACK_OP_RESUME_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->token);\
+	usbip_net_pack_uint32_t(pack, &(request)->n_seqnums);\
+} while (0)
+
+#define PACK_OP_RESUME_REPLY(pack, reply)  do {\
+	usbip_net_pack_uint32_t(pack, &(reply)->n_seqnums);\
+} while (0)
+
+/* ---------------------------------------------------------------------- */
+/*
+ * Open a second connection for ISO transfers of a device imported with
+ * USBIP_EXT_ISO_CHANNEL, so that they are not held behind bulk ones.
+ * PDUs follow a reply of ST_OK, which takes no data.
+ */
+#define OP_ISO_CHANNEL	0x73
+#define OP_REQ_ISO_CHANNEL	(OP_REQUEST | OP_ISO_CHANNEL)
+#define OP_REP_ISO_CHANNEL	(OP_REPLY   | OP_ISO_CHANNEL)
+
+struct op_iso_channel_request {
+	uint32_t token;
+};
+
+#define PACK_OP_ISO_CHANNEL_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->token);\
+} while (0)
+
 /* ---------------------------------------------------------------------- */
 /* Export a USB device to a remote host. */
 #define OP_EXPORT	0x06
@@ -168,6 +263,13 @@ void usbip_net_pack_uint16_t(int pack, uint16_t *num);
 void usbip_net_pack_usb_device(int pack, struct usbip_usb_device *udev);
 void usbip_net_pack_usb_interface(int pack, struct usbip_usb_interface *uinf);
 
+struct usbip_header;
+struct usbip_iso_packet_descriptor;
+
+/* pack: host to network byte order, otherwise network to host */
+void usbip_net_pack_usbip_header(int pack, struct usbip_header *hdr);
+void usbip_net_pack_iso_descs(int pack, struct usbip_iso_packet_descriptor *iso_descs, int n_pkts);
+
 int usbip_net_recv(SOCKET sockfd, void *buff, size_t bufflen);
 int usbip_net_send(SOCKET sockfd, void *buff, size_t bufflen);
 int usbip_net_send_op_common(SOCKET sockfd, uint32_t code, uint32_t status);
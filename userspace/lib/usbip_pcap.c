@@ -0,0 +1,227 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "usbip_pcap.h"
+
+#define PCAP_MAGIC_US	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d
+
+#define PCAP_ADDR_CLIENT	0x0a000001	/* 10.0.0.1 */
+#define PCAP_ADDR_SERVER	0x0a000002	/* 10.0.0.2 */
+#define PCAP_PORT_CLIENT	49152
+/* ephemeral ports, which client ports of streams wrap around in */
+#define PCAP_N_PORTS_CLIENT	16384
+
+#pragma pack(push, 1)
+
+typedef struct {
+	UINT32	magic;
+	USHORT	version_major, version_minor;
+	INT32	thiszone;
+	UINT32	sigfigs;
+	UINT32	snaplen;
+	UINT32	linktype;
+} pcap_hdr_t;
+
+typedef struct {
+	UINT32	ts_sec, ts_usec;
+	UINT32	incl_len, orig_len;
+} pcaprec_hdr_t;
+
+typedef struct {
+	UCHAR	ver_ihl, tos;
+	USHORT	tot_len, id, frag_off;
+	UCHAR	ttl, protocol;
+	USHORT	check;
+	UINT32	saddr, daddr;
+} pcap_iphdr_t;
+
+typedef struct {
+	USHORT	sport, dport;
+	UINT32	seq, ack;
+	UCHAR	doff, flags;
+	USHORT	window, check, urg_ptr;
+} pcap_tcphdr_t;
+
+#pragma pack(pop)
+
+BOOL
+usbip_pcap_write_header(FILE *fp)
+{
+	pcap_hdr_t	hdr;
+
+	hdr.magic = PCAP_MAGIC_US;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.thiszone = 0;
+	hdr.sigfigs = 0;
+	hdr.snaplen = 65535;
+	hdr.linktype = LINKTYPE_IPV4;
+	return fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+}
+
+void
+usbip_pcap_init_stream(usbip_pcap_stream_t *stream, int id)
+{
+	stream->port_client = (USHORT)(PCAP_PORT_CLIENT + id % PCAP_N_PORTS_CLIENT);
+	stream->seq[0] = 1;
+	stream->seq[1] = 1;
+}
+
+static void
+write_segment(FILE *fp, usbip_pcap_stream_t *stream, BOOL is_req, LONGLONG ts_us, const char *data, ULONG len)
+{
+	pcaprec_hdr_t	phdr;
+	pcap_iphdr_t	iph;
+	pcap_tcphdr_t	tcph;
+	int	side = is_req ? 0 : 1;
+
+	phdr.ts_sec = (UINT32)(ts_us / 1000000);
+	phdr.ts_usec = (UINT32)(ts_us % 1000000);
+	phdr.incl_len = phdr.orig_len = (UINT32)(sizeof(iph) + sizeof(tcph) + len);
+
+	memset(&iph, 0, sizeof(iph));
+	iph.ver_ihl = 0x45;
+	iph.tot_len = htons((USHORT)phdr.incl_len);
+	iph.ttl = 64;
+	iph.protocol = IPPROTO_TCP;
+	iph.saddr = htonl(is_req ? PCAP_ADDR_CLIENT : PCAP_ADDR_SERVER);
+	iph.daddr = htonl(is_req ? PCAP_ADDR_SERVER : PCAP_ADDR_CLIENT);
+
+	memset(&tcph, 0, sizeof(tcph));
+	tcph.sport = htons(is_req ? stream->port_client : (USHORT)usbip_port);
+	tcph.dport = htons(is_req ? (USHORT)usbip_port : stream->port_client);
+	tcph.seq = htonl(stream->seq[side]);
+	tcph.ack = htonl(stream->seq[!side]);
+	tcph.doff = (sizeof(tcph) / 4) << 4;
+	tcph.flags = 0x18;	/* PSH, ACK */
+	tcph.window = htons(0xffff);
+
+	stream->seq[side] += len;
+
+	fwrite(&phdr, sizeof(phdr), 1, fp);
+	fwrite(&iph, sizeof(iph), 1, fp);
+	fwrite(&tcph, sizeof(tcph), 1, fp);
+	fwrite(data, len, 1, fp);
+}
+
+void
+usbip_pcap_write_pdu(FILE *fp, usbip_pcap_stream_t *stream, BOOL is_req, LONGLONG ts_us, const char *pdu, ULONG len)
+{
+	while (len > 0) {
+		ULONG	len_seg = len > USBIP_PCAP_MAX_SEG ? USBIP_PCAP_MAX_SEG : len;
+
+		write_segment(fp, stream, is_req, ts_us, pdu, len_seg);
+		pdu += len_seg;
+		len -= len_seg;
+	}
+}
+
+BOOL
+usbip_pcap_open_reader(usbip_pcap_reader_t *rd, FILE *fp)
+{
+	pcap_hdr_t	hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		return FALSE;
+	switch (hdr.magic) {
+	case PCAP_MAGIC_US:
+		rd->nsec = FALSE;
+		break;
+	case PCAP_MAGIC_NS:
+		rd->nsec = TRUE;
+		break;
+	default:
+		/* big-endian captures are not supported */
+		dbg("invalid pcap magic: %x", hdr.magic);
+		return FALSE;
+	}
+	switch (hdr.linktype) {
+	case LINKTYPE_ETHERNET:
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+		break;
+	default:
+		dbg("unsupported pcap link type: %u", hdr.linktype);
+		return FALSE;
+	}
+	rd->fp = fp;
+	rd->linktype = hdr.linktype;
+	return TRUE;
+}
+
+/* returns TRUE if a packet is a TCP segment over IPv4 */
+static BOOL
+parse_packet(usbip_pcap_reader_t *rd, ULONG len, usbip_pcap_seg_t *seg)
+{
+	const char	*pkt = rd->buf;
+	const pcap_iphdr_t	*iph;
+	const pcap_tcphdr_t	*tcph;
+	ULONG	len_iph, len_tcph, len_ip;
+
+	if (rd->linktype == LINKTYPE_ETHERNET) {
+		/* skip ethernet header. VLAN tags are not supported */
+		if (len < 14 || (UCHAR)pkt[12] != 0x08 || pkt[13] != 0x00)
+			return FALSE;
+		pkt += 14;
+		len -= 14;
+	}
+
+	if (len < sizeof(pcap_iphdr_t))
+		return FALSE;
+	iph = (const pcap_iphdr_t *)pkt;
+	len_iph = (iph->ver_ihl & 0x0f) * 4;
+	if ((iph->ver_ihl >> 4) != 4 || iph->protocol != IPPROTO_TCP || len_iph < sizeof(pcap_iphdr_t))
+		return FALSE;
+	/* IP header length is trusted over captured length, which may be padded */
+	len_ip = ntohs(iph->tot_len);
+	if (len_ip == 0 || len_ip > len) {
+		/* TCP segmentation offloaded packets have no valid length */
+		len_ip = len;
+	}
+	if (len_ip < len_iph + sizeof(pcap_tcphdr_t))
+		return FALSE;
+
+	tcph = (const pcap_tcphdr_t *)(pkt + len_iph);
+	len_tcph = (tcph->doff >> 4) * 4;
+	if (len_tcph < sizeof(pcap_tcphdr_t) || len_iph + len_tcph > len_ip)
+		return FALSE;
+
+	seg->sport = ntohs(tcph->sport);
+	seg->dport = ntohs(tcph->dport);
+	seg->seq = ntohl(tcph->seq);
+	seg->data = pkt + len_iph + len_tcph;
+	seg->len = len_ip - len_iph - len_tcph;
+	return TRUE;
+}
+
+int
+usbip_pcap_read_seg(usbip_pcap_reader_t *rd, usbip_pcap_seg_t *seg)
+{
+	pcaprec_hdr_t	phdr;
+
+	for (;;) {
+		if (fread(&phdr, sizeof(phdr), 1, rd->fp) != 1)
+			return 0;
+		if (phdr.incl_len > sizeof(rd->buf)) {
+			dbg("too large pcap packet: %u", phdr.incl_len);
+			return -1;
+		}
+		if (fread(rd->buf, phdr.incl_len, 1, rd->fp) != 1) {
+			dbg("truncated pcap packet");
+			return -1;
+		}
+		if (phdr.incl_len < phdr.orig_len) {
+			/* a truncated packet cannot be reassembled */
+			dbg("pcap packet is truncated by snaplen: %u < %u", phdr.incl_len, phdr.orig_len);
+			return -1;
+		}
+		if (!parse_packet(rd, phdr.incl_len, seg))
+			continue;
+		seg->ts_us = (LONGLONG)phdr.ts_sec * 1000000 + (rd->nsec ? phdr.ts_usec / 1000 : phdr.ts_usec);
+		return 1;
+	}
+}
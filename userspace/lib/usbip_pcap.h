@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+#include <windows.h>
+
+/*
+ * pcap files of USB/IP traffic, written by PDU capture and read by replay.
+ *
+ * There's no pcap link type for USB/IP. PDUs are written as payload of
+ * synthesized IPv4/TCP packets(client 10.0.0.1, server 10.0.0.2), which is
+ * what Wireshark's USB/IP dissector expects. Reading also accepts ethernet
+ * and raw IP captures, e.g. taken by tcpdump on a linux server.
+ */
+
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_IPV4		228
+
+/* TCP payload per packet */
+#define USBIP_PCAP_MAX_SEG	(65535 - 20 - 20)
+
+/* a synthesized TCP connection */
+typedef struct {
+	USHORT	port_client;
+	/* next TCP sequence number of client and server side */
+	UINT32	seq[2];
+} usbip_pcap_stream_t;
+
+/* a TCP segment read from a pcap file */
+typedef struct {
+	LONGLONG	ts_us;
+	USHORT	sport, dport;
+	UINT32	seq;
+	ULONG	len;
+	const char	*data;
+} usbip_pcap_seg_t;
+
+BOOL usbip_pcap_write_header(FILE *fp);
+void usbip_pcap_init_stream(usbip_pcap_stream_t *stream, int id);
+void usbip_pcap_write_pdu(FILE *fp, usbip_pcap_stream_t *stream, BOOL is_req, LONGLONG ts_us, const char *pdu, ULONG len);
+
+typedef struct {
+	FILE	*fp;
+	UINT32	linktype;
+	BOOL	nsec;	/* timestamps in nanoseconds */
+	char	buf[262144];
+} usbip_pcap_reader_t;
+
+BOOL usbip_pcap_open_reader(usbip_pcap_reader_t *rd, FILE *fp);
+/* returns 1 for a TCP segment, 0 at the end of file, -1 on error. seg->data is valid until next read */
+int usbip_pcap_read_seg(usbip_pcap_reader_t *rd, usbip_pcap_seg_t *seg);
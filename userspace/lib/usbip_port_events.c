@@ -0,0 +1,81 @@
+#include "usbip_port_events.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbip_common.h"
+
+int
+usbip_port_events_init(usbip_port_events_t *pevs, usbip_port_event_src_t *src, unsigned int n_max)
+{
+	int	rc;
+
+	if (n_max == 0)
+		return ERR_INVARG;
+
+	pevs->src = src;
+	pevs->seq = 0;
+	pevs->lost = 0;
+	pevs->len = (unsigned int)VHCI_PORT_EVENTS_SIZE(n_max);
+	pevs->evs = (ioctl_usbip_vhci_port_events *)malloc(pevs->len);
+	if (pevs->evs == NULL) {
+		dbg("out of memory");
+		return ERR_GENERAL;
+	}
+
+	/* where changes from now on start */
+	memset(pevs->evs, 0, VHCI_PORT_EVENTS_SIZE(0));
+	rc = src->fetch(src, 0, pevs->evs, (unsigned int)VHCI_PORT_EVENTS_SIZE(0));
+	if (rc < 0) {
+		usbip_port_events_cleanup(pevs);
+		return rc;
+	}
+	pevs->seq = pevs->evs->seq_next;
+	return 0;
+}
+
+void
+usbip_port_events_cleanup(usbip_port_events_t *pevs)
+{
+	free(pevs->evs);
+	pevs->evs = NULL;
+}
+
+int
+usbip_port_events_wait(usbip_port_events_t *pevs, usbip_port_event_cb_t cb, void *data)
+{
+	ioctl_usbip_vhci_port_events	*evs = pevs->evs;
+	unsigned int	i;
+	int	rc;
+
+	memset(evs, 0, VHCI_PORT_EVENTS_SIZE(0));
+	rc = pevs->src->fetch(pevs->src, pevs->seq, evs, pevs->len);
+	if (rc < 0)
+		return rc;
+	if (evs->size != VHCI_PORT_EVENTS_SIZE(evs->n_events) || evs->size > pevs->len) {
+		dbg("invalid port events: size: %u, n_events: %u", evs->size, evs->n_events);
+		return ERR_PROTOCOL;
+	}
+
+	pevs->lost = (evs->flags & VHCI_PORT_EVENTS_LOST) ? 1 : 0;
+	for (i = 0; i < evs->n_events; i++)
+		cb(&evs->events[i], data);
+	pevs->seq = evs->seq_next;
+
+	return (int)evs->n_events;
+}
+
+const char *
+usbip_port_event_string(unsigned short type)
+{
+	switch (type) {
+	case VHCI_PORT_EV_PLUGGED:
+		return "plugged";
+	case VHCI_PORT_EV_UNPLUGGED:
+		return "unplugged";
+	case VHCI_PORT_EV_REMOVED:
+		return "removed";
+	default:
+		return "unknown";
+	}
+}
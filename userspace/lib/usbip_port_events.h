@@ -0,0 +1,48 @@
+#pragma once
+
+#include "usbip_vhci_event.h"
+
+/*
+ * A consumer of port changes, which replaces polling of imported devices.
+ *
+ * Replies of IOCTL_USBIP_VHCI_GET_PORT_EVENTS come from a source, so that
+ * a consumer has no dependency on Windows and a mock source can stand in for
+ * vhci. See usbip_vhci_port_event_src() for a source of vhci.
+ */
+typedef struct _usbip_port_event_src {
+	/*
+	 * changes from seq go to evs of len bytes, waiting until there's any.
+	 * If len is VHCI_PORT_EVENTS_SIZE(0), only seq_next is filled at once.
+	 * Returns 0 or ERR_*.
+	 */
+	int (*fetch)(struct _usbip_port_event_src *src, unsigned int seq, ioctl_usbip_vhci_port_events *evs, unsigned int len);
+	void	*ctx;
+} usbip_port_event_src_t;
+
+typedef void (*usbip_port_event_cb_t)(const vhci_port_event_t *ev, void *data);
+
+typedef struct {
+	usbip_port_event_src_t	*src;
+	/* changes to ask for next */
+	unsigned int	seq;
+	/* set by a wait if changes before reported ones were lost */
+	int	lost;
+	ioctl_usbip_vhci_port_events	*evs;
+	unsigned int	len;
+} usbip_port_events_t;
+
+/*
+ * A reply can hold n_max changes. Changes after init are reported, so a caller
+ * gets imported devices after init without missing any change.
+ */
+int usbip_port_events_init(usbip_port_events_t *pevs, usbip_port_event_src_t *src, unsigned int n_max);
+void usbip_port_events_cleanup(usbip_port_events_t *pevs);
+
+/*
+ * waits for changes, and calls cb for each of them in order. Returns how many
+ * changes are reported, or ERR_*. If pevs->lost is set, a caller should get
+ * imported devices again since some changes are missing.
+ */
+int usbip_port_events_wait(usbip_port_events_t *pevs, usbip_port_event_cb_t cb, void *data);
+
+const char *usbip_port_event_string(unsigned short type);
@@ -0,0 +1,527 @@
+#define _CRT_RAND_S
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "usbip_session.h"
+
+UINT32
+usbip_session_gen_token(void)
+{
+	unsigned int	token;
+
+	if (rand_s(&token) != 0)
+		token = GetTickCount() ^ (GetCurrentProcessId() << 16);
+	/* 0 is not a token */
+	return token != 0 ? token : 1;
+}
+
+static void
+init_session(usbip_session_t *sess, BOOL server, SOCKET sockfd, UINT32 token)
+{
+	memset(sess, 0, sizeof(usbip_session_t));
+	sess->server = server;
+	sess->token = token;
+	sess->sockfd = sockfd;
+	sess->sockfd_resume = INVALID_SOCKET;
+}
+
+BOOL
+usbip_session_init_server(usbip_session_t *sess, SOCKET sockfd)
+{
+	init_session(sess, TRUE, sockfd, usbip_session_gen_token());
+	sess->hEventResume = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (sess->hEventResume == NULL) {
+		dbg("failed to create event: 0x%lx", GetLastError());
+		return FALSE;
+	}
+	InitializeCriticalSection(&sess->lock);
+	return TRUE;
+}
+
+void
+usbip_session_init_client(usbip_session_t *sess, SOCKET sockfd, UINT32 token, usbip_session_connect_t connect, void *ctx)
+{
+	init_session(sess, FALSE, sockfd, token);
+	sess->connect = connect;
+	sess->ctx = ctx;
+}
+
+static void
+free_inflights(session_inflight_t *entry)
+{
+	while (entry != NULL) {
+		session_inflight_t	*next = entry->next;
+
+		free(entry);
+		entry = next;
+	}
+}
+
+void
+usbip_session_cleanup(usbip_session_t *sess)
+{
+	int	i;
+
+	for (i = 0; i < USBIP_SESSION_N_BUCKETS; i++)
+		free_inflights(sess->buckets[i]);
+	free_inflights(sess->free_list);
+	free_inflights(sess->lost);
+
+	while (sess->log_head != NULL) {
+		session_log_t	*log = sess->log_head;
+
+		sess->log_head = log->next;
+		free(log);
+	}
+
+	if (sess->server) {
+		if (sess->sockfd_resume != INVALID_SOCKET)
+			closesocket(sess->sockfd_resume);
+		free(sess->seqnums_resume);
+		CloseHandle(sess->hEventResume);
+		DeleteCriticalSection(&sess->lock);
+	}
+}
+
+static session_inflight_t **
+find_inflight(usbip_session_t *sess, UINT32 seqnum)
+{
+	session_inflight_t	**pentry = &sess->buckets[seqnum % USBIP_SESSION_N_BUCKETS];
+
+	while (*pentry != NULL && (*pentry)->seqnum != seqnum)
+		pentry = &(*pentry)->next;
+	return pentry;
+}
+
+static void
+add_inflight(usbip_session_t *sess, UINT32 seqnum, UINT32 command, UINT32 seqnum_unlink)
+{
+	session_inflight_t	*entry;
+	UINT32	idx = seqnum % USBIP_SESSION_N_BUCKETS;
+
+	if (sess->overflow)
+		return;
+	if (sess->n_inflight >= USBIP_SESSION_MAX_INFLIGHT) {
+		dbg("too many in flight, session cannot be resumed");
+		sess->overflow = TRUE;
+		return;
+	}
+	if (sess->free_list != NULL) {
+		entry = sess->free_list;
+		sess->free_list = entry->next;
+	}
+	else {
+		entry = (session_inflight_t *)malloc(sizeof(session_inflight_t));
+		if (entry == NULL) {
+			dbg("out of memory");
+			sess->overflow = TRUE;
+			return;
+		}
+	}
+	entry->seqnum = seqnum;
+	entry->command = command;
+	entry->seqnum_unlink = seqnum_unlink;
+	entry->next = sess->buckets[idx];
+	sess->buckets[idx] = entry;
+	sess->n_inflight++;
+}
+
+/* unlinked entry is returned, which goes to a free list or a lost list */
+static session_inflight_t *
+take_inflight(usbip_session_t *sess, UINT32 seqnum)
+{
+	session_inflight_t	**pentry = find_inflight(sess, seqnum);
+	session_inflight_t	*entry = *pentry;
+
+	if (entry != NULL) {
+		*pentry = entry->next;
+		sess->n_inflight--;
+	}
+	return entry;
+}
+
+static void
+drop_inflight(usbip_session_t *sess, UINT32 seqnum, UINT32 *pseqnum_unlink)
+{
+	session_inflight_t	*entry = take_inflight(sess, seqnum);
+
+	if (entry == NULL)
+		return;
+	if (pseqnum_unlink != NULL)
+		*pseqnum_unlink = entry->seqnum_unlink;
+	entry->next = sess->free_list;
+	sess->free_list = entry;
+}
+
+void
+usbip_session_pdu(usbip_session_t *sess, const struct usbip_header *hdr)
+{
+	UINT32	seqnum_unlink = 0;
+
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		add_inflight(sess, hdr->base.seqnum, USBIP_CMD_SUBMIT, 0);
+		break;
+	case USBIP_CMD_UNLINK:
+		add_inflight(sess, hdr->base.seqnum, USBIP_CMD_UNLINK, hdr->u.cmd_unlink.seqnum);
+		break;
+	case USBIP_RET_SUBMIT:
+		drop_inflight(sess, hdr->base.seqnum, NULL);
+		break;
+	case USBIP_RET_UNLINK:
+		/* an unlinked CMD may have no RET_SUBMIT */
+		drop_inflight(sess, hdr->base.seqnum, &seqnum_unlink);
+		if (seqnum_unlink != 0)
+			drop_inflight(sess, seqnum_unlink, NULL);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+usbip_session_log_ret(usbip_session_t *sess, UINT32 seqnum, const char *pdu, unsigned long len)
+{
+	session_log_t	*log;
+
+	if (!sess->server || len > USBIP_SESSION_LOG_MAX_PDU)
+		return;
+
+	while (sess->log_head != NULL && sess->len_log + len > USBIP_SESSION_LOG_MAX_LEN) {
+		log = sess->log_head;
+		sess->log_head = log->next;
+		if (sess->log_head == NULL)
+			sess->log_tail = NULL;
+		sess->len_log -= log->len;
+		free(log);
+	}
+
+	log = (session_log_t *)malloc(sizeof(session_log_t) + len);
+	if (log == NULL)
+		return;
+	log->seqnum = seqnum;
+	log->len = len;
+	log->next = NULL;
+	memcpy(log->pdu, pdu, len);
+
+	if (sess->log_tail != NULL)
+		sess->log_tail->next = log;
+	else
+		sess->log_head = log;
+	sess->log_tail = log;
+	sess->len_log += len;
+}
+
+static session_log_t *
+find_log(usbip_session_t *sess, UINT32 seqnum)
+{
+	session_log_t	*log;
+
+	for (log = sess->log_head; log != NULL; log = log->next) {
+		if (log->seqnum == seqnum)
+			return log;
+	}
+	return NULL;
+}
+
+static BOOL
+send_states(SOCKET sockfd, UINT8 *states, UINT32 n_seqnums)
+{
+	struct op_resume_reply	reply;
+
+	if (usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_OK) < 0)
+		return FALSE;
+	reply.n_seqnums = n_seqnums;
+	PACK_OP_RESUME_REPLY(1, &reply);
+	if (usbip_net_send(sockfd, &reply, sizeof(reply)) < 0)
+		return FALSE;
+	if (n_seqnums > 0 && usbip_net_send(sockfd, states, n_seqnums) < 0)
+		return FALSE;
+	return TRUE;
+}
+
+static BOOL
+is_requested(UINT32 seqnum, const UINT32 *seqnums, UINT32 n_seqnums)
+{
+	UINT32	i;
+
+	for (i = 0; i < n_seqnums; i++) {
+		if (seqnums[i] == seqnum)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* logged RETs are sent again in the order they were sent */
+static BOOL
+resume_server(usbip_session_t *sess, SOCKET sockfd, UINT32 *seqnums, UINT32 n_seqnums)
+{
+	session_log_t	*log;
+	UINT8	*states;
+	UINT32	i;
+	BOOL	res = FALSE;
+
+	states = (UINT8 *)malloc(n_seqnums + 1);
+	if (states == NULL) {
+		dbg("out of memory");
+		return FALSE;
+	}
+	for (i = 0; i < n_seqnums; i++) {
+		if (find_log(sess, seqnums[i]) != NULL)
+			states[i] = USBIP_RESUME_REPLAY;
+		else if (*find_inflight(sess, seqnums[i]) != NULL)
+			states[i] = USBIP_RESUME_PENDING;
+		else
+			states[i] = USBIP_RESUME_UNKNOWN;
+	}
+	if (!send_states(sockfd, states, n_seqnums)) {
+		dbg("failed to send resume reply");
+		goto out;
+	}
+	for (log = sess->log_head; log != NULL; log = log->next) {
+		if (!is_requested(log->seqnum, seqnums, n_seqnums))
+			continue;
+		if (usbip_net_send(sockfd, log->pdu, log->len) < 0) {
+			dbg("failed to replay seqnum: %u", log->seqnum);
+			goto out;
+		}
+	}
+	res = TRUE;
+out:
+	free(states);
+	return res;
+}
+
+static UINT32 *
+get_inflight_seqnums(usbip_session_t *sess)
+{
+	UINT32	*seqnums;
+	UINT32	n = 0;
+	int	i;
+
+	seqnums = (UINT32 *)malloc(sizeof(UINT32) * (sess->n_inflight + 1));
+	if (seqnums == NULL)
+		return NULL;
+	for (i = 0; i < USBIP_SESSION_N_BUCKETS; i++) {
+		session_inflight_t	*entry;
+
+		for (entry = sess->buckets[i]; entry != NULL; entry = entry->next)
+			seqnums[n++] = entry->seqnum;
+	}
+	return seqnums;
+}
+
+static int
+recv_states(SOCKET sockfd, UINT8 *states, UINT32 n_seqnums)
+{
+	struct op_resume_reply	reply;
+	uint16_t	code = OP_REP_RESUME;
+	int	status;
+	int	rc;
+
+	rc = usbip_net_recv_op_common(sockfd, &code, &status);
+	if (rc < 0) {
+		/* a server does not know a session any more */
+		return rc == ERR_STATUS ? -1 : 0;
+	}
+	if (usbip_net_recv(sockfd, &reply, sizeof(reply)) < 0)
+		return 0;
+	PACK_OP_RESUME_REPLY(0, &reply);
+	if (reply.n_seqnums != n_seqnums) {
+		dbg("resume reply has %u seqnums for %u", reply.n_seqnums, n_seqnums);
+		return -1;
+	}
+	if (n_seqnums > 0 && usbip_net_recv(sockfd, states, n_seqnums) < 0)
+		return 0;
+	return 1;
+}
+
+/* returns 1 if resumed, 0 if a retry may succeed, -1 if a session is gone */
+static int
+resume_client(usbip_session_t *sess, SOCKET sockfd)
+{
+	struct op_resume_request	req;
+	UINT32	*seqnums;
+	UINT8	*states = NULL;
+	UINT32	n_seqnums = sess->n_inflight;
+	UINT32	i;
+	int	res = 0;
+
+	seqnums = get_inflight_seqnums(sess);
+	if (seqnums == NULL) {
+		dbg("out of memory");
+		return -1;
+	}
+	states = (UINT8 *)malloc(n_seqnums + 1);
+	if (states == NULL) {
+		dbg("out of memory");
+		res = -1;
+		goto out;
+	}
+
+	if (usbip_net_send_op_common(sockfd, OP_REQ_RESUME, 0) < 0)
+		goto out;
+	req.token = sess->token;
+	req.n_seqnums = n_seqnums;
+	PACK_OP_RESUME_REQUEST(1, &req);
+	if (usbip_net_send(sockfd, &req, sizeof(req)) < 0)
+		goto out;
+	for (i = 0; i < n_seqnums; i++)
+		usbip_net_pack_uint32_t(1, &seqnums[i]);
+	if (n_seqnums > 0 && usbip_net_send(sockfd, seqnums, sizeof(UINT32) * n_seqnums) < 0)
+		goto out;
+	for (i = 0; i < n_seqnums; i++)
+		usbip_net_pack_uint32_t(0, &seqnums[i]);
+
+	res = recv_states(sockfd, states, n_seqnums);
+	if (res <= 0)
+		goto out;
+
+	for (i = 0; i < n_seqnums; i++) {
+		session_inflight_t	*entry;
+
+		if (states[i] != USBIP_RESUME_UNKNOWN)
+			continue;
+		entry = take_inflight(sess, seqnums[i]);
+		entry->next = sess->lost;
+		sess->lost = entry;
+	}
+out:
+	free(states);
+	free(seqnums);
+	return res;
+}
+
+/* returns a connection with seqnums which usbip_session_hand_over() passed */
+static SOCKET
+wait_hand_over(usbip_session_t *sess, DWORD timeout_ms, UINT32 **pseqnums, UINT32 *pn_seqnums)
+{
+	SOCKET	sockfd;
+
+	if (WaitForSingleObject(sess->hEventResume, timeout_ms) != WAIT_OBJECT_0)
+		return INVALID_SOCKET;
+
+	EnterCriticalSection(&sess->lock);
+	sockfd = sess->sockfd_resume;
+	*pseqnums = sess->seqnums_resume;
+	*pn_seqnums = sess->n_resume;
+	sess->sockfd_resume = INVALID_SOCKET;
+	sess->seqnums_resume = NULL;
+	LeaveCriticalSection(&sess->lock);
+
+	return sockfd;
+}
+
+BOOL
+usbip_session_resumable(usbip_session_t *sess, BOOL broken)
+{
+	BOOL	handed_over = FALSE;
+
+	if (sess->overflow)
+		return FALSE;
+	if (sess->server) {
+		EnterCriticalSection(&sess->lock);
+		handed_over = sess->sockfd_resume != INVALID_SOCKET;
+		LeaveCriticalSection(&sess->lock);
+	}
+	return broken || handed_over;
+}
+
+BOOL
+usbip_session_resume(usbip_session_t *sess)
+{
+	ULONGLONG	deadline;
+
+	if (sess->server)
+		EnterCriticalSection(&sess->lock);
+	closesocket(sess->sockfd);
+	sess->sockfd = INVALID_SOCKET;
+	if (sess->server)
+		LeaveCriticalSection(&sess->lock);
+
+	info("connection lost, resuming a session");
+
+	deadline = GetTickCount64() + (sess->server ? USBIP_SESSION_GRACE_SERVER_MS : USBIP_SESSION_GRACE_MS);
+	for (;;) {
+		ULONGLONG	now = GetTickCount64();
+		SOCKET	sockfd;
+		int	res;
+
+		if (now >= deadline)
+			break;
+		if (sess->server) {
+			UINT32	*seqnums = NULL;
+			UINT32	n_seqnums = 0;
+
+			sockfd = wait_hand_over(sess, (DWORD)(deadline - now), &seqnums, &n_seqnums);
+			if (sockfd == INVALID_SOCKET)
+				break;
+			res = resume_server(sess, sockfd, seqnums, n_seqnums) ? 1 : 0;
+			free(seqnums);
+		}
+		else {
+			sockfd = sess->connect(sess, (DWORD)(deadline - now));
+			if (sockfd == INVALID_SOCKET)
+				break;
+			res = resume_client(sess, sockfd);
+		}
+		if (res > 0) {
+			if (sess->server)
+				EnterCriticalSection(&sess->lock);
+			sess->sockfd = sockfd;
+			if (sess->server)
+				LeaveCriticalSection(&sess->lock);
+			info("session resumed");
+			return TRUE;
+		}
+		closesocket(sockfd);
+		if (res < 0)
+			break;
+	}
+
+	if (sess->server) {
+		EnterCriticalSection(&sess->lock);
+		sess->closed = TRUE;
+		LeaveCriticalSection(&sess->lock);
+	}
+	info("session not resumed");
+	return FALSE;
+}
+
+BOOL
+usbip_session_pop_lost(usbip_session_t *sess, UINT32 *pseqnum, UINT32 *pcommand)
+{
+	session_inflight_t	*entry = sess->lost;
+
+	if (entry == NULL)
+		return FALSE;
+	sess->lost = entry->next;
+	*pseqnum = entry->seqnum;
+	*pcommand = entry->command;
+	entry->next = sess->free_list;
+	sess->free_list = entry;
+	return TRUE;
+}
+
+BOOL
+usbip_session_hand_over(usbip_session_t *sess, SOCKET sockfd, UINT32 *seqnums, UINT32 n_seqnums)
+{
+	EnterCriticalSection(&sess->lock);
+	if (sess->closed || sess->sockfd_resume != INVALID_SOCKET) {
+		LeaveCriticalSection(&sess->lock);
+		return FALSE;
+	}
+	sess->sockfd_resume = sockfd;
+	sess->seqnums_resume = seqnums;
+	sess->n_resume = n_seqnums;
+	/* a forwarder may not have noticed that a client is gone */
+	if (sess->sockfd != INVALID_SOCKET)
+		shutdown(sess->sockfd, SD_BOTH);
+	SetEvent(sess->hEventResume);
+	LeaveCriticalSection(&sess->lock);
+
+	return TRUE;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "usbip_proto.h"
+
+/*
+ * Resumption of a forwarding session after its connection is lost.
+ *
+ * Both peers keep seqnums of CMDs whose RET has not passed through them yet.
+ * A server also logs recent RETs as they are sent on the wire. A client
+ * reconnects with a token from OP_REP_IMPORT_EXT and sends seqnums in flight.
+ * A server answers a state of each: a logged RET is replayed, a pending one
+ * will be returned by a stub, and others are failed by a client.
+ * PDUs which have not been completely sent are dropped on both sides.
+ */
+#define USBIP_SESSION_GRACE_MS		15000
+/* a server waits longer so that a client gives up first */
+#define USBIP_SESSION_GRACE_SERVER_MS	(USBIP_SESSION_GRACE_MS + 5000)
+#define USBIP_SESSION_RETRY_MS		500
+
+#define USBIP_SESSION_MAX_INFLIGHT	4096
+#define USBIP_SESSION_N_BUCKETS		256
+/* RETs longer than this are not logged, and fail after reconnection */
+#define USBIP_SESSION_LOG_MAX_PDU	(256 * 1024)
+#define USBIP_SESSION_LOG_MAX_LEN	(2 * 1024 * 1024)
+
+typedef struct _usbip_session usbip_session_t;
+
+/* returns a connection to a server, or INVALID_SOCKET if timeout_ms passed */
+typedef SOCKET (*usbip_session_connect_t)(usbip_session_t *sess, DWORD timeout_ms);
+
+typedef struct _session_inflight {
+	UINT32	seqnum, command;
+	/* CMD_SUBMIT which a CMD_UNLINK targets */
+	UINT32	seqnum_unlink;
+	struct _session_inflight	*next;
+} session_inflight_t;
+
+typedef struct _session_log {
+	UINT32	seqnum;
+	unsigned long	len;
+	struct _session_log	*next;
+	char	pdu[1];
+} session_log_t;
+
+struct _usbip_session {
+	BOOL	server;
+	UINT32	token;
+	/* current connection, which a session owner closes */
+	SOCKET	sockfd;
+	usbip_session_connect_t	connect;
+	void	*ctx;
+
+	session_inflight_t	*buckets[USBIP_SESSION_N_BUCKETS];
+	session_inflight_t	*free_list;
+	unsigned	n_inflight;
+	/* too many in flight to be tracked, which a session cannot be resumed with */
+	BOOL	overflow;
+
+	/* server: RETs in the order sent */
+	session_log_t	*log_head, *log_tail;
+	unsigned long	len_log;
+
+	/* server: a connection handed over by usbip_session_hand_over() */
+	CRITICAL_SECTION	lock;
+	HANDLE	hEventResume;
+	SOCKET	sockfd_resume;
+	UINT32	*seqnums_resume;
+	UINT32	n_resume;
+	BOOL	closed;
+
+	/* client: CMDs unknown to a server, which are failed */
+	session_inflight_t	*lost;
+};
+
+/* a random non-zero token, which a later connection of an import presents */
+UINT32 usbip_session_gen_token(void);
+
+BOOL usbip_session_init_server(usbip_session_t *sess, SOCKET sockfd);
+void usbip_session_init_client(usbip_session_t *sess, SOCKET sockfd, UINT32 token, usbip_session_connect_t connect, void *ctx);
+void usbip_session_cleanup(usbip_session_t *sess);
+
+/* host byte order header of a PDU completely read */
+void usbip_session_pdu(usbip_session_t *sess, const struct usbip_header *hdr);
+/* server: a RET as it is sent on the wire */
+void usbip_session_log_ret(usbip_session_t *sess, UINT32 seqnum, const char *pdu, unsigned long len);
+
+/*
+ * a connection which failed is resumed, but not one closed by a peer unless
+ * a server has a new connection handed over
+ */
+BOOL usbip_session_resumable(usbip_session_t *sess, BOOL broken);
+/*
+ * closes a lost connection and reconnects within a grace period.
+ * A server returns replayed RETs on a new connection before returning.
+ */
+BOOL usbip_session_resume(usbip_session_t *sess);
+/* client: a CMD which should be failed, after resumed */
+BOOL usbip_session_pop_lost(usbip_session_t *sess, UINT32 *pseqnum, UINT32 *pcommand);
+
+/*
+ * server: passes a connection of OP_REQ_RESUME, whose seqnums are taken.
+ * The previous connection is shut down if it still seems alive.
+ */
+BOOL usbip_session_hand_over(usbip_session_t *sess, SOCKET sockfd, UINT32 *seqnums, UINT32 n_seqnums);
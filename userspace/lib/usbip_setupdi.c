@@ -47,6 +47,12 @@ get_id_hw(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data)
 	return get_dev_property(dev_info, pdev_info_data, SPDRP_HARDWAREID);
 }
 
+char *
+get_id_compat(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data)
+{
+	return get_dev_property(dev_info, pdev_info_data, SPDRP_COMPATIBLEIDS);
+}
+
 char *
 get_upper_filters(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data)
 {
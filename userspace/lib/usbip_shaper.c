@@ -0,0 +1,256 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_shaper.h"
+
+/* buckets hold this long of their rates at most, which covers a coarse timer of a forwarder */
+#define BURST_US	50000
+/* a device which has not asked for bulk admission for this long gives up its share */
+#define ACTIVE_US	200000
+/* how long a device waits for one behind in a share */
+#define YIELD_US	1000
+
+static usbip_shaper_dev_t	*shaper_devs;
+static SRWLOCK	lock_shaper = SRWLOCK_INIT;
+static BOOL	shaping;
+static unsigned long long	rate_link;
+static double	tokens_link;
+static LONGLONG	ts_link;
+static LONGLONG	ticks_per_sec;
+
+static LONGLONG
+get_ts_us(void)
+{
+	LARGE_INTEGER	now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart / ticks_per_sec * 1000000 + now.QuadPart % ticks_per_sec * 1000000 / ticks_per_sec;
+}
+
+static void
+refill(double *ptokens, unsigned long long rate, LONGLONG elapsed)
+{
+	double	burst = (double)rate * BURST_US / 1000000;
+
+	*ptokens += (double)rate * elapsed / 1000000;
+	if (*ptokens > burst)
+		*ptokens = burst;
+}
+
+static void
+refill_link(LONGLONG now)
+{
+	if (rate_link == 0)
+		return;
+	refill(&tokens_link, rate_link, now - ts_link);
+	ts_link = now;
+}
+
+static void
+refill_dev(usbip_shaper_dev_t *sdev, LONGLONG now)
+{
+	if (sdev->rate_max == 0)
+		return;
+	refill(&sdev->tokens, sdev->rate_max, now - sdev->ts_refill);
+	sdev->ts_refill = now;
+}
+
+static BOOL
+is_active(usbip_shaper_dev_t *sdev, LONGLONG now)
+{
+	return sdev->ts_active != 0 && now - sdev->ts_active < ACTIVE_US;
+}
+
+/*
+ * A share of a link is kept by weighted fair queueing. A device coming back
+ * is not credited for its idle time.
+ */
+static void
+catch_up_vtime(usbip_shaper_dev_t *sdev, LONGLONG now)
+{
+	usbip_shaper_dev_t	*p;
+	BOOL	found = FALSE;
+	double	vmin = 0;
+
+	for (p = shaper_devs; p != NULL; p = p->next) {
+		if (p == sdev || !is_active(p, now))
+			continue;
+		if (!found || p->vtime < vmin) {
+			vmin = p->vtime;
+			found = TRUE;
+		}
+	}
+	if (found && sdev->vtime < vmin)
+		sdev->vtime = vmin;
+}
+
+/* a held device behind sdev in a share, which could take the link now */
+static BOOL
+has_dev_behind(usbip_shaper_dev_t *sdev, LONGLONG now)
+{
+	usbip_shaper_dev_t	*p;
+
+	for (p = shaper_devs; p != NULL; p = p->next) {
+		if (p == sdev || p->ts_held == 0 || !is_active(p, now))
+			continue;
+		if (p->rate_max > 0 && p->tokens + (double)p->rate_max * (now - p->ts_refill) / 1000000 < 0)
+			continue;
+		if (p->vtime < sdev->vtime)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+charge_at(usbip_shaper_dev_t *sdev, unsigned long len, LONGLONG now)
+{
+	refill_link(now);
+	if (rate_link > 0) {
+		double	burst = (double)rate_link * BURST_US / 1000000;
+
+		/* bulk waits for a burst at most after priority PDUs */
+		tokens_link -= len;
+		if (tokens_link < -burst)
+			tokens_link = -burst;
+	}
+	refill_dev(sdev, now);
+	if (sdev->rate_max > 0)
+		sdev->tokens -= len;
+	sdev->n_bytes_prio += len;
+}
+
+static unsigned long
+admit_at(usbip_shaper_dev_t *sdev, unsigned long len, LONGLONG now)
+{
+	double	wait = 0;
+
+	refill_link(now);
+	refill_dev(sdev, now);
+	if (!is_active(sdev, now))
+		catch_up_vtime(sdev, now);
+	sdev->ts_active = now;
+
+	if (rate_link > 0 && tokens_link < 0)
+		wait = -tokens_link * 1000000 / rate_link;
+	if (sdev->rate_max > 0 && sdev->tokens < 0 && -sdev->tokens * 1000000 / sdev->rate_max > wait)
+		wait = -sdev->tokens * 1000000 / sdev->rate_max;
+	if (wait == 0 && rate_link > 0 && has_dev_behind(sdev, now))
+		wait = YIELD_US;
+
+	if (wait > 0) {
+		if (sdev->ts_held == 0) {
+			sdev->ts_held = now;
+			sdev->n_throttles++;
+		}
+		return wait < 1 ? 1 : (unsigned long)wait;
+	}
+
+	if (rate_link > 0)
+		tokens_link -= len;
+	if (sdev->rate_max > 0)
+		sdev->tokens -= len;
+	sdev->vtime += (double)len / sdev->weight;
+	sdev->n_bytes_bulk += len;
+	if (sdev->ts_held != 0) {
+		sdev->us_throttled += now - sdev->ts_held;
+		sdev->ts_held = 0;
+	}
+	return 0;
+}
+
+void
+usbip_shaper_setup(unsigned long long rate)
+{
+	LARGE_INTEGER	freq;
+
+	QueryPerformanceFrequency(&freq);
+	ticks_per_sec = freq.QuadPart;
+
+	AcquireSRWLockExclusive(&lock_shaper);
+	rate_link = rate;
+	tokens_link = 0;
+	ts_link = get_ts_us();
+	shaping = TRUE;
+	ReleaseSRWLockExclusive(&lock_shaper);
+}
+
+usbip_shaper_dev_t *
+usbip_shaper_open(UINT32 devid, unsigned weight, unsigned long long rate_max)
+{
+	usbip_shaper_dev_t	*sdev;
+
+	if (!shaping)
+		return NULL;
+
+	sdev = (usbip_shaper_dev_t *)calloc(1, sizeof(usbip_shaper_dev_t));
+	if (sdev == NULL) {
+		dbg("out of memory");
+		return NULL;
+	}
+	sdev->devid = devid;
+	sdev->weight = weight > 0 ? weight : 1;
+	sdev->rate_max = rate_max;
+	sdev->ts_refill = get_ts_us();
+
+	AcquireSRWLockExclusive(&lock_shaper);
+	sdev->next = shaper_devs;
+	shaper_devs = sdev;
+	ReleaseSRWLockExclusive(&lock_shaper);
+	return sdev;
+}
+
+void
+usbip_shaper_close(usbip_shaper_dev_t *sdev)
+{
+	usbip_shaper_dev_t	**pnext;
+
+	AcquireSRWLockExclusive(&lock_shaper);
+	for (pnext = &shaper_devs; *pnext != NULL; pnext = &(*pnext)->next) {
+		if (*pnext == sdev) {
+			*pnext = sdev->next;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_shaper);
+	free(sdev);
+}
+
+void
+usbip_shaper_charge(usbip_shaper_dev_t *sdev, unsigned long len)
+{
+	AcquireSRWLockExclusive(&lock_shaper);
+	charge_at(sdev, len, get_ts_us());
+	ReleaseSRWLockExclusive(&lock_shaper);
+}
+
+unsigned long
+usbip_shaper_admit(usbip_shaper_dev_t *sdev, unsigned long len)
+{
+	unsigned long	wait;
+
+	AcquireSRWLockExclusive(&lock_shaper);
+	wait = admit_at(sdev, len, get_ts_us());
+	ReleaseSRWLockExclusive(&lock_shaper);
+	return wait;
+}
+
+unsigned long long
+usbip_shaper_us_throttled(const usbip_shaper_dev_t *sdev)
+{
+	if (sdev->ts_held == 0)
+		return sdev->us_throttled;
+	return sdev->us_throttled + (get_ts_us() - sdev->ts_held);
+}
+
+void
+usbip_shaper_walk(usbip_shaper_walker_t walker, void *ctx)
+{
+	usbip_shaper_dev_t	*sdev;
+
+	AcquireSRWLockShared(&lock_shaper);
+	for (sdev = shaper_devs; sdev != NULL; sdev = sdev->next)
+		walker(sdev, ctx);
+	ReleaseSRWLockShared(&lock_shaper);
+}
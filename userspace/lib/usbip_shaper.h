@@ -0,0 +1,52 @@
+#pragma once
+
+#include <windows.h>
+
+/*
+ * An egress scheduler shared by forwarders of a process, which shapes PDUs
+ * written into sockets so that a device saturating an uplink does not hold
+ * back interactive ones.
+ *
+ * Bulk PDUs of all devices share a link rate in proportion to weights of
+ * devices which have sent recently, and a device may be capped at a rate of
+ * its own. Control, interrupt and ISO PDUs(priority) are never held, but are
+ * charged so that bulk ones back off for them.
+ * A bucket may go below zero by a PDU, which is sent while it is not negative,
+ * so that a PDU of any size gets through at an average rate.
+ */
+
+/* rates are bytes per second. 0 is unlimited */
+typedef struct _usbip_shaper_dev {
+	struct _usbip_shaper_dev	*next;
+	UINT32	devid;
+	unsigned	weight;
+	unsigned long long	rate_max;
+	/* bytes which may be sent by a cap */
+	double	tokens;
+	/* bulk bytes sent divided by a weight, which a share of a link is kept by */
+	double	vtime;
+	/* microseconds of a refill, of a latest bulk admission asked for, and of a PDU first held(0 if not held) */
+	LONGLONG	ts_refill, ts_active, ts_held;
+	unsigned long long	n_bytes_bulk, n_bytes_prio;
+	/* times and microseconds bulk PDUs have been held */
+	unsigned long long	n_throttles, us_throttled;
+} usbip_shaper_dev_t;
+
+/* shaping is on after this is called. A link rate of 0 leaves caps of devices only */
+void usbip_shaper_setup(unsigned long long rate_link);
+
+/* a weight is 1 or more. NULL if shaping is off */
+usbip_shaper_dev_t *usbip_shaper_open(UINT32 devid, unsigned weight, unsigned long long rate_max);
+void usbip_shaper_close(usbip_shaper_dev_t *sdev);
+
+/* priority bytes, which have been sent or are sent at once */
+void usbip_shaper_charge(usbip_shaper_dev_t *sdev, unsigned long len);
+/* microseconds until bulk bytes may be sent, or 0 if they are charged and may be sent now */
+unsigned long usbip_shaper_admit(usbip_shaper_dev_t *sdev, unsigned long len);
+
+/* microseconds bulk PDUs have been held, including those being held now */
+unsigned long long usbip_shaper_us_throttled(const usbip_shaper_dev_t *sdev);
+
+/* walks devices of a process while they are locked */
+typedef void (*usbip_shaper_walker_t)(usbip_shaper_dev_t *sdev, void *ctx);
+void usbip_shaper_walk(usbip_shaper_walker_t walker, void *ctx);
@@ -0,0 +1,415 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <sddl.h>
+
+#include "usbip_common.h"
+#include "usbip_util.h"
+#include "usbip_stats.h"
+
+#define EP_INDEX(ep, direction)	(((ep) & 0x0f) | ((direction) == USBIP_DIR_IN ? 0x10 : 0))
+
+#define STATS_DUMP_INIT		4096
+
+static usbip_stats_t	*stats_list;
+static SRWLOCK	lock_stats = SRWLOCK_INIT;
+static HANDLE	hthread_server;
+static LONGLONG	ticks_per_sec;
+
+static LONGLONG
+get_ts(void)
+{
+	LARGE_INTEGER	now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static unsigned
+get_bucket(unsigned long long us)
+{
+	unsigned	shift = 0;
+
+	if (us >= (1ULL << USBIP_STATS_LAT_BITS))
+		return USBIP_STATS_N_BUCKETS - 1;
+	while (us >= (2 << USBIP_STATS_SUB_BITS)) {
+		us >>= 1;
+		shift++;
+	}
+	/* us is in [2^SUB_BITS, 2^(SUB_BITS + 1)) unless shift is 0 */
+	return (shift << USBIP_STATS_SUB_BITS) + (unsigned)us;
+}
+
+static unsigned long
+get_bucket_max(unsigned idx)
+{
+	unsigned	shift, sub;
+
+	if (idx < (2 << USBIP_STATS_SUB_BITS))
+		return idx;
+	shift = (idx >> USBIP_STATS_SUB_BITS) - 1;
+	sub = (idx & ((1 << USBIP_STATS_SUB_BITS) - 1)) + (1 << USBIP_STATS_SUB_BITS);
+	return ((sub + 1UL) << shift) - 1;
+}
+
+unsigned long
+usbip_stats_percentile(const usbip_stats_ep_t *sep, double percentile)
+{
+	unsigned long long	n_total = 0, n_sum = 0, n_rank;
+	unsigned	i;
+
+	for (i = 0; i < USBIP_STATS_N_BUCKETS; i++)
+		n_total += sep->hist[i];
+	if (n_total == 0)
+		return 0;
+	n_rank = (unsigned long long)(n_total * percentile / 100);
+	if (n_rank == 0)
+		n_rank = 1;
+	for (i = 0; i < USBIP_STATS_N_BUCKETS; i++) {
+		n_sum += sep->hist[i];
+		if (n_sum >= n_rank)
+			break;
+	}
+	if (i == USBIP_STATS_N_BUCKETS - 1 || get_bucket_max(i) > sep->lat_max)
+		return sep->lat_max;
+	return get_bucket_max(i);
+}
+
+void
+usbip_stats_rates(const usbip_stats_ep_t *sep, double *ppdus_per_sec, double *pbytes_per_sec)
+{
+	if (get_ts() - sep->ts_window > 2 * ticks_per_sec) {
+		*ppdus_per_sec = 0;
+		*pbytes_per_sec = 0;
+		return;
+	}
+	*ppdus_per_sec = sep->pdus_per_sec;
+	*pbytes_per_sec = sep->bytes_per_sec;
+}
+
+static void
+update_rates(usbip_stats_ep_t *sep, LONGLONG ts)
+{
+	LONGLONG	elapsed = ts - sep->ts_window;
+	unsigned long long	n_pdus = sep->n_cmds + sep->n_rets;
+
+	if (elapsed < ticks_per_sec)
+		return;
+	/* an endpoint idle over a window starts a new one */
+	if (elapsed > 2 * ticks_per_sec) {
+		sep->pdus_per_sec = 0;
+		sep->bytes_per_sec = 0;
+	}
+	else {
+		sep->pdus_per_sec = (double)(n_pdus - sep->n_pdus_window) * ticks_per_sec / elapsed;
+		sep->bytes_per_sec = (double)(sep->n_bytes - sep->n_bytes_window) * ticks_per_sec / elapsed;
+	}
+	sep->ts_window = ts;
+	sep->n_pdus_window = n_pdus;
+	sep->n_bytes_window = sep->n_bytes;
+}
+
+static void
+add_latency(usbip_stats_ep_t *sep, LONGLONG ticks)
+{
+	unsigned long long	us = (unsigned long long)ticks * 1000000 / ticks_per_sec;
+
+	sep->hist[get_bucket(us)]++;
+	if (us > sep->lat_max)
+		sep->lat_max = us > ULONG_MAX ? ULONG_MAX : (unsigned long)us;
+}
+
+/* a URB which is not replied to is dropped when its slot is taken */
+static usbip_stats_pending_t *
+take_pending(usbip_stats_t *stats, UINT32 seqnum)
+{
+	usbip_stats_pending_t	*pending = &stats->pendings[seqnum % USBIP_STATS_N_PENDINGS];
+
+	if (pending->ts != 0 && !pending->is_unlink)
+		stats->eps[pending->idx].outstanding--;
+	pending->seqnum = seqnum;
+	return pending;
+}
+
+static usbip_stats_pending_t *
+find_pending(usbip_stats_t *stats, UINT32 seqnum)
+{
+	usbip_stats_pending_t	*pending = &stats->pendings[seqnum % USBIP_STATS_N_PENDINGS];
+
+	if (pending->ts == 0 || pending->seqnum != seqnum)
+		return NULL;
+	return pending;
+}
+
+static void
+submit_cmd(usbip_stats_t *stats, const struct usbip_header *hdr, UINT32 ep, unsigned long xfer_len, LONGLONG ts)
+{
+	unsigned	idx = EP_INDEX(ep, hdr->base.direction);
+	usbip_stats_ep_t	*sep = &stats->eps[idx];
+	usbip_stats_pending_t	*pending;
+
+	sep->n_cmds++;
+	sep->n_bytes += xfer_len;
+	pending = take_pending(stats, hdr->base.seqnum);
+	pending->idx = idx;
+	pending->is_unlink = FALSE;
+	pending->ts = ts;
+	if (++sep->outstanding > sep->outstanding_max)
+		sep->outstanding_max = sep->outstanding;
+	update_rates(sep, ts);
+}
+
+static void
+submit_ret(usbip_stats_t *stats, const struct usbip_header *hdr, UINT32 ep, unsigned long xfer_len, LONGLONG ts)
+{
+	usbip_stats_pending_t	*pending = find_pending(stats, hdr->base.seqnum);
+	usbip_stats_ep_t	*sep;
+
+	/* direction of RET_SUBMIT from linux is not reliable */
+	if (pending != NULL && !pending->is_unlink)
+		sep = &stats->eps[pending->idx];
+	else
+		sep = &stats->eps[EP_INDEX(ep, hdr->base.direction)];
+
+	sep->n_rets++;
+	sep->n_bytes += xfer_len;
+	if (hdr->u.ret_submit.status != 0)
+		sep->n_errors++;
+	if (pending != NULL && !pending->is_unlink) {
+		add_latency(sep, ts - pending->ts);
+		sep->outstanding--;
+		pending->ts = 0;
+	}
+	update_rates(sep, ts);
+}
+
+static void
+unlink_cmd(usbip_stats_t *stats, const struct usbip_header *hdr, LONGLONG ts)
+{
+	usbip_stats_pending_t	*target = find_pending(stats, hdr->u.cmd_unlink.seqnum), *pending;
+
+	if (target == NULL || target->is_unlink)
+		return;
+	stats->eps[target->idx].n_unlinks++;
+	pending = take_pending(stats, hdr->base.seqnum);
+	pending->idx = hdr->u.cmd_unlink.seqnum;
+	pending->is_unlink = TRUE;
+	pending->ts = ts;
+}
+
+/* an unlinked URB has no RET_SUBMIT */
+static void
+unlink_ret(usbip_stats_t *stats, const struct usbip_header *hdr)
+{
+	usbip_stats_pending_t	*pending = find_pending(stats, hdr->base.seqnum), *target;
+
+	if (pending == NULL || !pending->is_unlink)
+		return;
+	pending->ts = 0;
+	if (hdr->u.ret_unlink.status == 0)
+		return;
+	target = find_pending(stats, pending->idx);
+	if (target != NULL && !target->is_unlink) {
+		stats->eps[target->idx].outstanding--;
+		target->ts = 0;
+	}
+}
+
+void
+usbip_stats_bufs(usbip_stats_t *stats, unsigned long len_bufs, unsigned long len_queued)
+{
+	stats->len_bufs = len_bufs;
+	stats->len_queued = len_queued;
+}
+
+void
+usbip_stats_pdu(usbip_stats_t *stats, const struct usbip_header *hdr, UINT32 ep, unsigned long xfer_len)
+{
+	LONGLONG	ts = get_ts();
+
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		submit_cmd(stats, hdr, ep, xfer_len, ts);
+		break;
+	case USBIP_RET_SUBMIT:
+		submit_ret(stats, hdr, ep, xfer_len, ts);
+		break;
+	case USBIP_CMD_UNLINK:
+		unlink_cmd(stats, hdr, ts);
+		break;
+	case USBIP_RET_UNLINK:
+		unlink_ret(stats, hdr);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+usbip_stats_walk(usbip_stats_walker_t walker, void *ctx)
+{
+	usbip_stats_t	*stats;
+
+	AcquireSRWLockShared(&lock_stats);
+	for (stats = stats_list; stats != NULL; stats = stats->next)
+		walker(stats, ctx);
+	ReleaseSRWLockShared(&lock_stats);
+}
+
+static void
+dump_stats(usbip_stats_t *stats, void *ctx)
+{
+	strbuf_t	*dump = (strbuf_t *)ctx;
+	double	pdus_per_sec, bytes_per_sec;
+	unsigned	i;
+
+	strbuf_printf(dump, "devid %08x: %s, up %llds, buffers %lu bytes, queued %lu bytes\n", stats->devid, stats->desc,
+		(get_ts() - stats->ts_start) / ticks_per_sec, stats->len_bufs, stats->len_queued);
+	strbuf_printf(dump, "  %-6s %10s %10s %8s %8s %9s %9s %12s %8s %8s %8s %8s\n",
+		"ep", "cmds", "rets", "errors", "unlinks", "pending", "PDUs/s", "bytes/s", "p50(us)", "p90", "p99", "max");
+	for (i = 0; i < USBIP_STATS_N_EPS; i++) {
+		usbip_stats_ep_t	*sep = &stats->eps[i];
+		char	pending[16];
+
+		if (sep->n_cmds == 0 && sep->n_rets == 0)
+			continue;
+		usbip_stats_rates(sep, &pdus_per_sec, &bytes_per_sec);
+		snprintf(pending, sizeof(pending), "%ld/%ld", sep->outstanding, sep->outstanding_max);
+		strbuf_printf(dump, "  %2u%-4s %10llu %10llu %8llu %8llu %9s %9.0f %12.0f %8lu %8lu %8lu %8lu\n",
+			i & 0x0f, (i & 0x10) ? "in" : "out", sep->n_cmds, sep->n_rets, sep->n_errors, sep->n_unlinks,
+			pending, pdus_per_sec, bytes_per_sec,
+			usbip_stats_percentile(sep, 50), usbip_stats_percentile(sep, 90), usbip_stats_percentile(sep, 99), sep->lat_max);
+	}
+}
+
+/* a client gets a dump and an end of a pipe */
+static BOOL
+serve_client(HANDLE hpipe)
+{
+	strbuf_t	dump = { NULL, 0, 0, STATS_DUMP_INIT };
+	DWORD	nwritten;
+	BOOL	res;
+
+	strbuf_printf(&dump, "pid %lu\n", GetCurrentProcessId());
+	usbip_stats_walk(dump_stats, &dump);
+	if (dump.buf == NULL)
+		return FALSE;
+	res = WriteFile(hpipe, dump.buf, dump.len, &nwritten, NULL);
+	free(dump.buf);
+	if (res)
+		FlushFileBuffers(hpipe);
+	return res;
+}
+
+/*
+ * stats tell which devices are in use and how, so a pipe is only for the user
+ * running a process, administrators and SYSTEM
+ */
+static BOOL
+build_pipe_sa(SECURITY_ATTRIBUTES *psa)
+{
+	union {
+		TOKEN_USER	tu;
+		char	buf[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+	} user;
+	HANDLE	htoken;
+	DWORD	len;
+	char	*sid, sddl[256];
+	BOOL	res;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &htoken))
+		return FALSE;
+	res = GetTokenInformation(htoken, TokenUser, &user, sizeof(user), &len);
+	CloseHandle(htoken);
+	if (!res || !ConvertSidToStringSidA(user.tu.User.Sid, &sid))
+		return FALSE;
+	snprintf(sddl, sizeof(sddl), "D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;%s)", sid);
+	LocalFree(sid);
+
+	psa->nLength = sizeof(SECURITY_ATTRIBUTES);
+	psa->bInheritHandle = FALSE;
+	return ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl, SDDL_REVISION_1, &psa->lpSecurityDescriptor, NULL);
+}
+
+static DWORD WINAPI
+stats_server(LPVOID ctx)
+{
+	SECURITY_ATTRIBUTES	sa;
+	char	name[64];
+
+	if (!build_pipe_sa(&sa)) {
+		dbg("failed to build a security descriptor of stats pipe: err: 0x%lx", GetLastError());
+		return 1;
+	}
+	snprintf(name, sizeof(name), USBIP_STATS_PIPE_PREFIX "%lu", GetCurrentProcessId());
+	for (;;) {
+		HANDLE	hpipe;
+
+		/* one instance at a time. A pipe created by others ahead of it is not used */
+		hpipe = CreateNamedPipeA(name, PIPE_ACCESS_OUTBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, STATS_DUMP_INIT, 0, 0, &sa);
+		if (hpipe == INVALID_HANDLE_VALUE) {
+			dbg("failed to create stats pipe: err: 0x%lx", GetLastError());
+			LocalFree(sa.lpSecurityDescriptor);
+			return 1;
+		}
+		if (ConnectNamedPipe(hpipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) {
+			if (!serve_client(hpipe))
+				dbg("failed to serve stats: err: 0x%lx", GetLastError());
+			DisconnectNamedPipe(hpipe);
+		}
+		CloseHandle(hpipe);
+	}
+	return 0;
+}
+
+usbip_stats_t *
+usbip_stats_open(const char *desc, UINT32 devid)
+{
+	usbip_stats_t	*stats;
+
+	stats = (usbip_stats_t *)calloc(1, sizeof(usbip_stats_t));
+	if (stats == NULL) {
+		dbg("failed to allocate stats");
+		return NULL;
+	}
+	stats->desc = desc;
+	stats->devid = devid;
+
+	AcquireSRWLockExclusive(&lock_stats);
+	if (ticks_per_sec == 0) {
+		LARGE_INTEGER	freq;
+
+		QueryPerformanceFrequency(&freq);
+		ticks_per_sec = freq.QuadPart;
+	}
+	/* the server lives as long as a process */
+	if (hthread_server == NULL) {
+		hthread_server = CreateThread(NULL, 0, stats_server, NULL, 0, NULL);
+		if (hthread_server == NULL)
+			dbg("failed to start stats server: err: 0x%lx", GetLastError());
+	}
+	stats->ts_start = get_ts();
+	stats->next = stats_list;
+	stats_list = stats;
+	ReleaseSRWLockExclusive(&lock_stats);
+
+	return stats;
+}
+
+void
+usbip_stats_close(usbip_stats_t *stats)
+{
+	usbip_stats_t	**pstats;
+
+	AcquireSRWLockExclusive(&lock_stats);
+	for (pstats = &stats_list; *pstats != NULL; pstats = &(*pstats)->next) {
+		if (*pstats == stats) {
+			*pstats = stats->next;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_stats);
+	free(stats);
+}
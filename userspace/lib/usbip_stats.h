@@ -0,0 +1,86 @@
+#pragma once
+
+#include <windows.h>
+
+#include "usbip_proto.h"
+
+/*
+ * Counters of a forwarder per endpoint and direction, which are always on.
+ *
+ * Latency of a URB is from a CMD_SUBMIT to its RET_SUBMIT, both of which a
+ * forwarder reads. A forwarder of usbipd measures a stub and a device, and
+ * that of an attacher adds a network and usbipd to them.
+ * Latencies go into log linear histograms with 8 sub-buckets per power of 2,
+ * whose error is at most 1/8 of a value.
+ *
+ * Every process with forwarders serves their counters in text from a named
+ * pipe, USBIP_STATS_PIPE_PREFIX followed by a process id.
+ */
+#define USBIP_STATS_PIPE_PREFIX	"\\\\.\\pipe\\usbip-stats-"
+
+/* endpoints are indexed by an ep number, plus 16 for IN */
+#define USBIP_STATS_N_EPS	32
+#define USBIP_STATS_SUB_BITS	3
+/* microseconds below 2^LAT_BITS, beyond which latencies go into the last bucket */
+#define USBIP_STATS_LAT_BITS	27
+#define USBIP_STATS_N_BUCKETS	((USBIP_STATS_LAT_BITS - USBIP_STATS_SUB_BITS + 1) << USBIP_STATS_SUB_BITS)
+#define USBIP_STATS_N_PENDINGS	1024
+
+typedef struct {
+	unsigned long long	n_cmds, n_rets;
+	/* payload bytes, which are of CMD_SUBMIT for OUT and of RET_SUBMIT for IN */
+	unsigned long long	n_bytes;
+	/* RET_SUBMIT's with non zero status */
+	unsigned long long	n_errors;
+	unsigned long long	n_unlinks;
+	/* URB's without RET_SUBMIT */
+	LONG	outstanding, outstanding_max;
+	unsigned long	hist[USBIP_STATS_N_BUCKETS];
+	unsigned long	lat_max;
+	/* PDUs and bytes per second over the last window of a second or more */
+	LONGLONG	ts_window;
+	unsigned long long	n_pdus_window, n_bytes_window;
+	double	pdus_per_sec, bytes_per_sec;
+} usbip_stats_ep_t;
+
+typedef struct {
+	UINT32	seqnum;
+	/* ep index of CMD_SUBMIT, or seqnum of a URB to be unlinked */
+	UINT32	idx;
+	BOOL	is_unlink;
+	LONGLONG	ts;
+} usbip_stats_pending_t;
+
+typedef struct _usbip_stats {
+	struct _usbip_stats	*next;
+	/* "stub" or "vhci", which a forwarder is at */
+	const char	*desc;
+	UINT32	devid;
+	LONGLONG	ts_start;
+	/* bytes allocated for buffers of a forwarder, and those read but not written yet */
+	unsigned long	len_bufs, len_queued;
+	usbip_stats_ep_t	eps[USBIP_STATS_N_EPS];
+	usbip_stats_pending_t	pendings[USBIP_STATS_N_PENDINGS];
+} usbip_stats_t;
+
+/* registers counters of a forwarder, and starts serving them if not yet */
+usbip_stats_t *usbip_stats_open(const char *desc, UINT32 devid);
+void usbip_stats_close(usbip_stats_t *stats);
+
+/* buffer usage of a forwarder, which is updated at every turn of it */
+void usbip_stats_bufs(usbip_stats_t *stats, unsigned long len_bufs, unsigned long len_queued);
+
+/* accounts a host byte order PDU of xfer_len payload bytes */
+void usbip_stats_pdu(usbip_stats_t *stats, const struct usbip_header *hdr, UINT32 ep, unsigned long xfer_len);
+
+/*
+ * walks counters of all forwarders in a process while they are locked.
+ * Counters are read without a forwarder stopped, and may be torn on 32bit hosts.
+ */
+typedef void (*usbip_stats_walker_t)(usbip_stats_t *stats, void *ctx);
+void usbip_stats_walk(usbip_stats_walker_t walker, void *ctx);
+
+/* microseconds of a latency at a percentile, which is an upper bound of a bucket */
+unsigned long usbip_stats_percentile(const usbip_stats_ep_t *sep, double percentile);
+/* rates are 0 if an endpoint has been idle for longer than 2 windows */
+void usbip_stats_rates(const usbip_stats_ep_t *sep, double *ppdus_per_sec, double *pbytes_per_sec);
@@ -3,6 +3,8 @@
 #include <stdarg.h>
 #include <stdlib.h>
 
+#include "usbip_util.h"
+
 wchar_t *
 utf8_to_wchar(const char *str)
 {
@@ -84,4 +86,41 @@ get_module_dir(void)
 			return path_mod;
 		}
 	}
-}
\ No newline at end of file
+}
+
+static BOOL
+grow_strbuf(strbuf_t *sbuf)
+{
+	int	cap = sbuf->cap > 0 ? sbuf->cap * 2 : sbuf->cap_init;
+	char	*bufnew;
+
+	bufnew = (char *)realloc(sbuf->buf, cap);
+	if (bufnew == NULL)
+		return FALSE;
+	sbuf->buf = bufnew;
+	sbuf->cap = cap;
+	return TRUE;
+}
+
+void
+strbuf_printf(strbuf_t *sbuf, const char *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	for (;;) {
+		if (sbuf->cap - sbuf->len > 1) {
+			va_start(ap, fmt);
+			len = vsnprintf(sbuf->buf + sbuf->len, sbuf->cap - sbuf->len, fmt, ap);
+			va_end(ap);
+			if (len < 0)
+				return;
+			if (len < sbuf->cap - sbuf->len) {
+				sbuf->len += len;
+				return;
+			}
+		}
+		if (!grow_strbuf(sbuf))
+			return;
+	}
+}
@@ -1,7 +1,19 @@
+#pragma once
+
 #include <stdarg.h>
 
 wchar_t *utf8_to_wchar(const char *str);
 
 int vasprintf(char **strp, const char *fmt, va_list ap);
 int asprintf(char **strp, const char *fmt, ...);
-char *get_module_dir(void);
\ No newline at end of file
+char *get_module_dir(void);
+
+/* a string which grows as it's printed into. buf is NULL if nothing could be allocated */
+typedef struct {
+	char	*buf;
+	int	len, cap;
+	/* capacity of a first allocation */
+	int	cap_init;
+} strbuf_t;
+
+void strbuf_printf(strbuf_t *sbuf, const char *fmt, ...);
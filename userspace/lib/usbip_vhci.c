@@ -7,6 +7,7 @@
 
 #include "usbip_setupdi.h"
 #include "usbip_vhci_api.h"
+#include "usbip_port_events.h"
 
 #include "dbgcode.h"
 
@@ -83,12 +84,48 @@ usbip_vhci_get_ports_status(HANDLE hdev, ioctl_usbip_vhci_get_ports_status* st)
 	return ERR_GENERAL;
 }
 
+/* NULL if vhci is older than IOCTL_USBIP_VHCI_GET_PORTS_STATUS_EX */
+static ioctl_usbip_vhci_get_ports_status_ex *
+get_ports_status_ex(HANDLE hdev)
+{
+	ioctl_usbip_vhci_get_ports_status_ex	*st;
+	unsigned long	size = (unsigned long)VHCI_PORTS_STATUS_EX_SIZE(128);
+	unsigned long	len;
+
+	for (;;) {
+		st = (ioctl_usbip_vhci_get_ports_status_ex *)malloc(size);
+		if (st == NULL) {
+			dbg("out of memory");
+			return NULL;
+		}
+		if (DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_PORTS_STATUS_EX,
+			NULL, 0, st, size, &len, NULL))
+			return st;
+		if (GetLastError() != ERROR_MORE_DATA || len < VHCI_PORTS_STATUS_EX_SIZE(0) || st->size <= size) {
+			dbg("failed to get ports status: 0x%lx", GetLastError());
+			free(st);
+			return NULL;
+		}
+		/* a buffer big enough for all the ports */
+		size = st->size;
+		free(st);
+	}
+}
+
 int
 usbip_vhci_get_free_port(HANDLE hdev)
 {
+	ioctl_usbip_vhci_get_ports_status_ex	*st_ex;
 	ioctl_usbip_vhci_get_ports_status	status;
 	int	i;
 
+	st_ex = get_ports_status_ex(hdev);
+	if (st_ex != NULL) {
+		i = (int)st_ex->free_port;
+		free(st_ex);
+		return i;
+	}
+
 	if (usbip_vhci_get_ports_status(hdev, &status))
 		return -1;
 	for (i = 0; i < status.n_max_ports; i++) {
@@ -98,15 +135,26 @@ usbip_vhci_get_free_port(HANDLE hdev)
 	return -1;
 }
 
+/* *plegacy is set if vhci has only IOCTL_USBIP_VHCI_GET_PORTS_STATUS */
 static int
-get_n_max_ports(HANDLE hdev)
+get_n_max_ports(HANDLE hdev, BOOL *plegacy)
 {
+	ioctl_usbip_vhci_get_ports_status_ex	*st_ex;
 	ioctl_usbip_vhci_get_ports_status	status;
 	int	res;
 
+	st_ex = get_ports_status_ex(hdev);
+	if (st_ex != NULL) {
+		res = (int)st_ex->n_max_ports;
+		free(st_ex);
+		*plegacy = FALSE;
+		return res;
+	}
+
 	res = usbip_vhci_get_ports_status(hdev, &status);
 	if (res < 0)
 		return res;
+	*plegacy = TRUE;
 	return status.n_max_ports;
 }
 
@@ -114,10 +162,11 @@ int
 usbip_vhci_get_imported_devs(HANDLE hdev, pioctl_usbip_vhci_imported_dev_t *pidevs)
 {
 	ioctl_usbip_vhci_imported_dev	*idevs;
-	int	n_max_ports;
+	int	n_max_ports, i;
+	BOOL	legacy;
 	unsigned long	len_out, len_returned;
 
-	n_max_ports = get_n_max_ports(hdev);
+	n_max_ports = get_n_max_ports(hdev, &legacy);
 	if (n_max_ports < 0) {
 		dbg("failed to get the number of used ports: %s", dbg_errcode(n_max_ports));
 		return ERR_GENERAL;
@@ -132,6 +181,12 @@ usbip_vhci_get_imported_devs(HANDLE hdev, pioctl_usbip_vhci_imported_dev_t *pide
 
 	if (DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES,
 		NULL, 0, idevs, len_out, &len_returned, NULL)) {
+		/* an older vhci fills only the first byte of a port */
+		for (i = 0; legacy && i < n_max_ports; i++) {
+			idevs[i].port = (signed char)(idevs[i].port & 0xff);
+			if (idevs[i].port < 0)
+				break;
+		}
 		*pidevs = idevs;
 		return 0;
 	}
@@ -143,33 +198,80 @@ usbip_vhci_get_imported_devs(HANDLE hdev, pioctl_usbip_vhci_imported_dev_t *pide
 	return ERR_GENERAL;
 }
 
-int
-usbip_vhci_attach_device(HANDLE hdev, pvhci_pluginfo_t pluginfo)
+static int
+plugin_hardware(HANDLE hdev, pvhci_pluginfo_t pluginfo)
 {
-	unsigned long	unused;
+	unsigned long	port = 0, len = 0;
 
 	if (!DeviceIoControl(hdev, IOCTL_USBIP_VHCI_PLUGIN_HARDWARE,
-		pluginfo, pluginfo->size, NULL, 0, &unused, NULL)) {
+		pluginfo, pluginfo->size, &port, sizeof(port), &len, NULL)) {
 		dbg("usbip_vhci_attach_device: DeviceIoControl failed: err: 0x%lx", GetLastError());
 		return -1;
 	}
+	if (pluginfo->port >= 0)
+		return pluginfo->port;
+	if (len < sizeof(port)) {
+		dbg("vhci returned no port");
+		return -1;
+	}
+	return (int)port;
+}
 
-	return 0;
+/* vhci assigns a free port. Returns an attached port */
+int
+usbip_vhci_attach_device(HANDLE hdev, pvhci_pluginfo_t pluginfo)
+{
+	ioctl_usbip_vhci_get_ports_status_ex	*st_ex;
+	int	port;
+
+	pluginfo->port = -1;
+	port = plugin_hardware(hdev, pluginfo);
+	if (port >= 0)
+		return port;
+
+	st_ex = get_ports_status_ex(hdev);
+	if (st_ex != NULL) {
+		port = st_ex->n_used_ports == st_ex->n_max_ports ? ERR_PORTFULL: -1;
+		free(st_ex);
+		return port;
+	}
+
+	/* an older vhci takes only a given port */
+	port = usbip_vhci_get_free_port(hdev);
+	if (port < 0) {
+		dbg("no free port");
+		return ERR_PORTFULL;
+	}
+	dbg("got free port: %d", port);
+
+	pluginfo->port = (signed char)port;
+	return plugin_hardware(hdev, pluginfo);
 }
 
 int
 usbip_vhci_detach_device(HANDLE hdev, int port)
 {
+	ioctl_usbip_vhci_unplug_ex	unplug_ex;
 	ioctl_usbip_vhci_unplug  unplug;
 	unsigned long	unused;
 	DWORD	err;
 
-	unplug.addr = (char)port;
+	unplug_ex.size = sizeof(unplug_ex);
+	unplug_ex.port = port;
 	if (DeviceIoControl(hdev, IOCTL_USBIP_VHCI_UNPLUG_HARDWARE,
-		&unplug, sizeof(unplug), NULL, 0, &unused, NULL))
+		&unplug_ex, sizeof(unplug_ex), NULL, 0, &unused, NULL))
 		return 0;
 
 	err = GetLastError();
+	/* an older vhci takes only a port below 128 */
+	if ((err == ERROR_INVALID_FUNCTION || err == ERROR_INVALID_PARAMETER) && port < 128) {
+		memset(&unplug, 0, sizeof(unplug));
+		unplug.addr = (char)port;
+		if (DeviceIoControl(hdev, IOCTL_USBIP_VHCI_UNPLUG_HARDWARE,
+			&unplug, sizeof(unplug), NULL, 0, &unused, NULL))
+			return 0;
+		err = GetLastError();
+	}
 	dbg("unplug error: 0x%lx", err);
 
 	switch (err) {
@@ -181,3 +283,46 @@ usbip_vhci_detach_device(HANDLE hdev, int port)
 		return ERR_GENERAL;
 	}
 }
+
+static int
+fetch_port_events(usbip_port_event_src_t *src, unsigned int seq, ioctl_usbip_vhci_port_events *evs, unsigned int len)
+{
+	HANDLE	hdev = (HANDLE)src->ctx;
+	ioctl_usbip_vhci_get_port_events	req;
+	OVERLAPPED	ov;
+	unsigned long	outlen;
+	DWORD	err = 0;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ov.hEvent == NULL) {
+		dbg("failed to create event: 0x%lx", GetLastError());
+		return ERR_GENERAL;
+	}
+
+	req.seq = seq;
+	/* vhci pends a request until ports change */
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_PORT_EVENTS, &req, sizeof(req), evs, len, &outlen, &ov)) {
+		err = GetLastError();
+		if (err == ERROR_IO_PENDING)
+			err = GetOverlappedResult(hdev, &ov, &outlen, TRUE) ? 0 : GetLastError();
+	}
+	CloseHandle(ov.hEvent);
+
+	if (err != 0) {
+		dbg("failed to get port events: 0x%lx", err);
+		return err == ERROR_INVALID_FUNCTION ? ERR_VERSION : ERR_GENERAL;
+	}
+	if (outlen < VHCI_PORT_EVENTS_SIZE(0)) {
+		dbg("too short port events: %lu", outlen);
+		return ERR_PROTOCOL;
+	}
+	return 0;
+}
+
+void
+usbip_vhci_port_event_src(HANDLE hdev, usbip_port_event_src_t *src)
+{
+	src->fetch = fetch_port_events;
+	src->ctx = hdev;
+}
@@ -4,6 +4,7 @@
 #pragma
 
 #include "usbip_vhci_api.h"
+#include "usbip_port_events.h"
 
 HANDLE usbip_vhci_driver_open(void);
 void usbip_vhci_driver_close(HANDLE hdev);
@@ -11,5 +12,7 @@ int usbip_vhci_get_free_port(HANDLE hdev);
 int usbip_vhci_get_imported_devs(HANDLE hdev, pioctl_usbip_vhci_imported_dev_t *pidevs);
 int usbip_vhci_attach_device(HANDLE hdev, pvhci_pluginfo_t pluginfo);
 int usbip_vhci_detach_device(HANDLE hdev, int port);
+/* ERR_VERSION from a fetch if vhci has no port events */
+void usbip_vhci_port_event_src(HANDLE hdev, usbip_port_event_src_t *src);
 
 #endif /* __VHCI_DRIVER_H */
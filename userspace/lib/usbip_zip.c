@@ -0,0 +1,185 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_lz.h"
+#include "usbip_zip.h"
+
+/* compressed PDUs of an endpoint which are evaluated at once */
+#define ZIP_WINDOW		16
+#define ZIP_BACKOFF_MIN		64
+#define ZIP_BACKOFF_MAX		4096
+/* a compressed payload should make up for a longer compact header */
+#define ZIP_MIN_GAIN		8
+
+#define DSCR_TYPE_ENDPOINT	5
+#define EP_ATTR_BULK		2
+
+#define EP_INDEX(ep, direction)	(((ep) & 0x0f) | ((direction) == USBIP_DIR_IN ? 0x10 : 0))
+
+static LONGLONG
+get_ts(void)
+{
+	LARGE_INTEGER	now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+void
+usbip_zip_init(usbip_zip_t *zip)
+{
+	LARGE_INTEGER	freq;
+	int	i;
+
+	memset(zip, 0, sizeof(usbip_zip_t));
+	for (i = 0; i < USBIP_ZIP_N_EPS; i++)
+		zip->eps[i].backoff = ZIP_BACKOFF_MIN;
+	QueryPerformanceFrequency(&freq);
+	zip->ticks_per_sec = freq.QuadPart;
+}
+
+void
+usbip_zip_cleanup(usbip_zip_t *zip)
+{
+	free(zip->buf);
+	zip->buf = NULL;
+	zip->len_buf = 0;
+}
+
+static BOOL
+reserve_buf(usbip_zip_t *zip, unsigned long len)
+{
+	char	*bufnew;
+
+	if (zip->len_buf >= len)
+		return TRUE;
+	bufnew = (char *)realloc(zip->buf, len);
+	if (bufnew == NULL) {
+		dbg("failed to allocate compression buffer: %lu", len);
+		return FALSE;
+	}
+	zip->buf = bufnew;
+	zip->len_buf = len;
+	return TRUE;
+}
+
+/* an endpoint number which is bulk in some alternate setting and not in another is never compressed */
+static void
+parse_conf(usbip_zip_t *zip, const UCHAR *dscr, unsigned long len)
+{
+	const UCHAR	*end = dscr + len;
+
+	while (end - dscr >= 2) {
+		UCHAR	bLength = dscr[0];
+
+		if (bLength < 2 || bLength > end - dscr)
+			break;
+		if (dscr[1] == DSCR_TYPE_ENDPOINT && bLength >= 7) {
+			usbip_zip_ep_t	*zep = &zip->eps[EP_INDEX(dscr[2], (dscr[2] & 0x80) ? USBIP_DIR_IN : USBIP_DIR_OUT)];
+			UCHAR	type = (dscr[3] & 0x03) == EP_ATTR_BULK ? USBIP_ZIP_EP_BULK : USBIP_ZIP_EP_OTHER;
+
+			if (!zep->type_dscr || zep->type == USBIP_ZIP_EP_BULK)
+				zep->type = type;
+			zep->type_dscr = TRUE;
+		}
+		dscr += bLength;
+	}
+}
+
+void
+usbip_zip_snoop(usbip_zip_t *zip, const struct usbip_header *hdr, UINT32 ep, const char *data, unsigned long len)
+{
+	usbip_zip_ep_t	*zep;
+
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		if (ep == 0) {
+			const UINT8	*setup = hdr->u.cmd_submit.setup;
+
+			/* standard GET_DESCRIPTOR of a configuration */
+			if (setup[0] == 0x80 && setup[1] == 6 && setup[3] == 2) {
+				zip->seqnum_conf = hdr->base.seqnum;
+				zip->conf_pending = TRUE;
+			}
+			break;
+		}
+		zep = &zip->eps[EP_INDEX(ep, hdr->base.direction)];
+		if (!zep->type_dscr) {
+			if (hdr->u.cmd_submit.number_of_packets > 0 || hdr->u.cmd_submit.interval != 0)
+				zep->type = USBIP_ZIP_EP_OTHER;
+			else
+				zep->type = USBIP_ZIP_EP_BULK;
+		}
+		break;
+	case USBIP_RET_SUBMIT:
+		if (zip->conf_pending && hdr->base.seqnum == zip->seqnum_conf) {
+			zip->conf_pending = FALSE;
+			if (hdr->u.ret_submit.status == 0)
+				parse_conf(zip, (const UCHAR *)data, len);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+evaluate_window(usbip_zip_t *zip, usbip_zip_ep_t *zep, unsigned idx)
+{
+	BOOL	poor_ratio, slow;
+
+	poor_ratio = zep->bytes_out * 8 > zep->bytes_in * 7;
+	slow = zep->bytes_in * zip->ticks_per_sec < (unsigned long long)zep->ticks * USBIP_ZIP_MIN_RATE * 1024 * 1024;
+	if (poor_ratio || slow) {
+		dbg("ep %u%s: compression off for %u PDUs: %llu to %llu bytes",
+			idx & 0x0f, (idx & 0x10) ? "in" : "out", zep->backoff, zep->bytes_in, zep->bytes_out);
+		zep->n_skips = zep->backoff;
+		if (zep->backoff < ZIP_BACKOFF_MAX)
+			zep->backoff *= 2;
+	}
+	else {
+		zep->backoff = ZIP_BACKOFF_MIN;
+	}
+	zep->n_pdus = 0;
+	zep->bytes_in = 0;
+	zep->bytes_out = 0;
+	zep->ticks = 0;
+}
+
+unsigned long
+usbip_zip_compress(usbip_zip_t *zip, UINT32 ep, UINT32 direction, const char *data, unsigned long len)
+{
+	unsigned	idx = EP_INDEX(ep, direction);
+	usbip_zip_ep_t	*zep = &zip->eps[idx];
+	LONGLONG	ts;
+	int	len_zip;
+
+	if (len < USBIP_ZIP_MIN_LEN || zep->type != USBIP_ZIP_EP_BULK)
+		return 0;
+	if (zep->n_skips > 0) {
+		zep->n_skips--;
+		return 0;
+	}
+	if (!reserve_buf(zip, len))
+		return 0;
+
+	ts = get_ts();
+	len_zip = usbip_lz_compress(data, (int)len, zip->buf, (int)len - ZIP_MIN_GAIN);
+	zep->ticks += get_ts() - ts;
+	zep->bytes_in += len;
+	zep->bytes_out += len_zip > 0 ? len_zip : len;
+	if (++zep->n_pdus == ZIP_WINDOW)
+		evaluate_window(zip, zep, idx);
+
+	return len_zip > 0 ? len_zip : 0;
+}
+
+BOOL
+usbip_zip_decompress(usbip_zip_t *zip, const char *data, unsigned long len_zip, unsigned long len)
+{
+	if (!reserve_buf(zip, len))
+		return FALSE;
+	return usbip_lz_decompress(data, (int)len_zip, zip->buf, (int)len) == (int)len;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <windows.h>
+
+#include "usbip_proto.h"
+
+/*
+ * Adaptive compression of bulk payloads between usbip-win peers.
+ *
+ * Endpoint types are learned from configuration descriptors which pass
+ * through a forwarder. Until a descriptor is seen, CMD_SUBMIT's with a zero
+ * interval are taken as bulk. Control, interrupt and ISO payloads are never
+ * compressed.
+ * Every bulk endpoint evaluates a window of compressed PDUs. It stops
+ * compressing if the window saved less than 1/8 of its bytes or compressed
+ * slower than USBIP_ZIP_MIN_RATE, and retries after a growing backoff.
+ */
+#define USBIP_ZIP_MIN_LEN	256
+/* MB/s of input, at which a CPU still keeps up with a 500Mbps link */
+#define USBIP_ZIP_MIN_RATE	64
+
+/* endpoints are indexed by an ep number, plus 16 for IN */
+#define USBIP_ZIP_N_EPS		32
+
+#define USBIP_ZIP_EP_UNKNOWN	0
+#define USBIP_ZIP_EP_BULK	1
+/* control, interrupt or ISO */
+#define USBIP_ZIP_EP_OTHER	2
+
+typedef struct {
+	/* USBIP_ZIP_EP_* */
+	UCHAR	type;
+	/* type is from a configuration descriptor */
+	BOOL	type_dscr;
+	unsigned	n_pdus;
+	unsigned long long	bytes_in, bytes_out;
+	LONGLONG	ticks;
+	/* bulk PDUs to be sent as they are before compression is retried */
+	unsigned	n_skips, backoff;
+} usbip_zip_ep_t;
+
+typedef struct {
+	usbip_zip_ep_t	eps[USBIP_ZIP_N_EPS];
+	/* seqnum of GET_DESCRIPTOR(CONFIGURATION) in flight */
+	UINT32	seqnum_conf;
+	BOOL	conf_pending;
+	LONGLONG	ticks_per_sec;
+	/* compressed or decompressed payload */
+	char	*buf;
+	unsigned long	len_buf;
+} usbip_zip_t;
+
+void usbip_zip_init(usbip_zip_t *zip);
+void usbip_zip_cleanup(usbip_zip_t *zip);
+
+/*
+ * learns endpoint types from a host byte order PDU. ep is the one of a CMD_SUBMIT
+ * even for RET_SUBMIT, whose header may not have it.
+ */
+void usbip_zip_snoop(usbip_zip_t *zip, const struct usbip_header *hdr, UINT32 ep, const char *data, unsigned long len);
+
+/* returns the length of a payload compressed into zip->buf, or 0 if it is sent as it is */
+unsigned long usbip_zip_compress(usbip_zip_t *zip, UINT32 ep, UINT32 direction, const char *data, unsigned long len);
+/* decompresses into zip->buf a payload of len bytes */
+BOOL usbip_zip_decompress(usbip_zip_t *zip, const char *data, unsigned long len_zip, unsigned long len);
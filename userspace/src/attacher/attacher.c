@@ -1,41 +1,174 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+#include <stdlib.h>
+
+#include "usbip_windows.h"
+#include "usbip_network.h"
 #include "usbip_forward.h"
+#include "usbip_dscr_cache.h"
+#include "usbip_session.h"
 
-static HANDLE
-read_handle_value(HANDLE hStdin)
+/* where a lost connection is resumed */
+typedef struct {
+	char	*host, *port;
+} resume_ctx_t;
+
+static BOOL
+read_value(HANDLE hStdin, LPVOID value, DWORD len)
 {
-	HANDLE	handle;
-	LPBYTE	buf = (LPBYTE)&handle;
-	DWORD	buflen = sizeof(HANDLE);
+	LPBYTE	buf = (LPBYTE)value;
+	DWORD	buflen = len;
 
 	while (buflen > 0) {
 		DWORD	nread;
 
-		if (!ReadFile(hStdin, buf + sizeof(HANDLE) - buflen, buflen, &nread, NULL)) {
-			return INVALID_HANDLE_VALUE;
+		if (!ReadFile(hStdin, buf + len - buflen, buflen, &nread, NULL)) {
+			return FALSE;
 		}
 		if (nread == 0)
-			return INVALID_HANDLE_VALUE;
+			return FALSE;
 		buflen -= nread;
 	}
+	return TRUE;
+}
+
+static HANDLE
+read_handle_value(HANDLE hStdin)
+{
+	HANDLE	handle;
+
+	if (!read_value(hStdin, &handle, sizeof(HANDLE)))
+		return INVALID_HANDLE_VALUE;
 	return handle;
 }
 
+static char *
+read_string(HANDLE hStdin, UINT32 len)
+{
+	char	*str;
+
+	str = (char *)malloc(len + 1);
+	if (str == NULL)
+		return NULL;
+	if (!read_value(hStdin, str, len)) {
+		free(str);
+		return NULL;
+	}
+	str[len] = '\0';
+	return str;
+}
+
+/* a key of persisted descriptors and their hash, which only usbip attach -d passes */
+static char *
+read_dscr_cache_key(HANDLE hStdin, UINT32 *pdscr_hash)
+{
+	UINT32	values[2];
+	char	*key;
+
+	if (!read_value(hStdin, values, sizeof(values)) || values[1] == 0)
+		return NULL;
+	key = read_string(hStdin, values[1]);
+	if (key == NULL)
+		return NULL;
+	*pdscr_hash = values[0];
+	return key;
+}
+
+/* a session token with a server address, which only usbip attach -R passes */
+static UINT32
+read_resume(HANDLE hStdin, resume_ctx_t *ctx)
+{
+	UINT32	values[3];
+
+	if (!read_value(hStdin, values, sizeof(values)))
+		return 0;
+	/* an address follows even without a token */
+	ctx->host = read_string(hStdin, values[1]);
+	ctx->port = read_string(hStdin, values[2]);
+	if (ctx->host == NULL || ctx->port == NULL)
+		return 0;
+	return values[0];
+}
+
+static SOCKET
+connect_server(usbip_session_t *sess, DWORD timeout_ms)
+{
+	resume_ctx_t	*ctx = (resume_ctx_t *)sess->ctx;
+	ULONGLONG	deadline = GetTickCount64() + timeout_ms;
+
+	for (;;) {
+		SOCKET	sockfd = usbip_net_tcp_connect(ctx->host, ctx->port);
+
+		if (sockfd != INVALID_SOCKET) {
+			usbip_net_set_keepalive(sockfd);
+			usbip_net_set_nodelay(sockfd);
+			return sockfd;
+		}
+		if (GetTickCount64() + USBIP_SESSION_RETRY_MS >= deadline)
+			return INVALID_SOCKET;
+		Sleep(USBIP_SESSION_RETRY_MS);
+	}
+}
+
 static BOOL
 setup_forwarder(void)
 {
-	HANDLE	hdev, sockfd;
+	HANDLE	hdev, sockfd, sockfd_iso;
 	HANDLE	hStdin, hStdout;
+	/* protocol extensions and devid, which an older usbip.exe does not pass */
+	UINT32	values[2] = { 0, 0 };
+	usbip_dscr_set_t	dscr_set;
+	char	*dscr_key;
+	UINT32	dscr_hash = 0;
+	resume_ctx_t	resume_ctx = { NULL, NULL };
+	usbip_session_t	*sess = NULL;
+	UINT32	token;
 
 	hStdin = GetStdHandle(STD_INPUT_HANDLE);
 	hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
 
 	hdev = read_handle_value(hStdin);
 	sockfd = read_handle_value(hStdin);
+	if (!read_value(hStdin, values, sizeof(values))) {
+		values[0] = 0;
+		values[1] = 0;
+	}
+	dscr_key = read_dscr_cache_key(hStdin, &dscr_hash);
+	token = read_resume(hStdin, &resume_ctx);
+	/* INVALID_HANDLE_VALUE unless an ISO channel is opened */
+	sockfd_iso = read_handle_value(hStdin);
+
+	/* the vhci port stays plugged while a session is resumed */
+	if (token != 0 && init_socket() == 0) {
+		sess = (usbip_session_t *)malloc(sizeof(usbip_session_t));
+		if (sess != NULL)
+			usbip_session_init_client(sess, (SOCKET)sockfd, token, connect_server, &resume_ctx);
+	}
+
+	/* descriptors read during enumeration are persisted when a device is detached */
+	usbip_dscr_set_init(&dscr_set);
+	if (dscr_key != NULL) {
+		usbip_dscr_cache_load(dscr_key, dscr_hash, &dscr_set);
+		usbip_dscr_collect_start(&dscr_set);
+	}
+
+	usbip_forward(hdev, sockfd, FALSE, values[0], values[1], sess, sockfd_iso, NULL);
 
-	usbip_forward(hdev, sockfd, FALSE);
+	if (sess != NULL) {
+		usbip_session_cleanup(sess);
+		free(sess);
+	}
+	free(resume_ctx.host);
+	free(resume_ctx.port);
+
+	if (dscr_key != NULL) {
+		usbip_dscr_collect_stop();
+		if (dscr_set.dirty && usbip_dscr_set_hash(&dscr_set) == dscr_hash)
+			usbip_dscr_cache_save(dscr_key, &dscr_set);
+		free(dscr_key);
+	}
+	usbip_dscr_set_cleanup(&dscr_set);
 
 	CloseHandle(hStdin);
 	CloseHandle(hStdout);
@@ -0,0 +1,319 @@
+/*
+ * devemu: a USB/IP server exporting synthetic devices for load testing
+ *
+ * Emulated devices answer URBs from memory, so that a client can be
+ * benchmarked without any USB hardware or a stub driver. Each imported
+ * device is served by its own thread.
+ */
+
+#include <stdlib.h>
+
+#include "devemu.h"
+
+#include <ws2tcpip.h>
+
+#include "usbip_windows.h"
+#include "usbip_network.h"
+
+/* listening sockets of usbipd are reused */
+extern SOCKET *get_listen_sockfds(int family);
+
+static const char devemu_help_string[] =
+	"usage: devemu [options]\n"
+	"\n"
+	"	-e, --device <type>[,pkt=N][,interval=ms][,lat=us][,err=percent]\n"
+	"		Add an emulated device. It can be repeated.\n"
+	"		Devices are exported as 1-1, 1-2, ... in the order of options.\n"
+	"		loop: bulk OUT data is returned by bulk IN\n"
+	"		sink: bulk OUT data is consumed\n"
+	"		source: bulk IN is filled with a pattern\n"
+	"		hid: boot mouse reporting every interval(default: 10ms)\n"
+	"		iso: isochronous IN of pkt bytes(default: 1024) per microframe\n"
+	"		lat adds a delay to every completion. err fails given percent\n"
+	"		of URBs with a stall, or an ISO packet with a protocol error.\n"
+	"		Default is a loop device.\n"
+	"\n"
+	"	-4, --ipv4\n"
+	"		Bind to IPv4. Default is both.\n"
+	"\n"
+	"	-6, --ipv6\n"
+	"		Bind to IPv6. Default is both.\n"
+	"\n"
+	"	-tPORT, --tcp-port PORT\n"
+	"		Listen on TCP/IP port PORT.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+typedef struct {
+	devemu_dev_t	*dev;
+	SOCKET	sockfd;
+} devemu_ctx_t;
+
+static void
+devemu_help(void)
+{
+	printf("%s\n", devemu_help_string);
+}
+
+static VOID CALLBACK
+serve_dev(PTP_CALLBACK_INSTANCE inst, PVOID ctx, PTP_WORK work)
+{
+	devemu_ctx_t	*pctx = (devemu_ctx_t *)ctx;
+	devemu_dev_t	*dev = pctx->dev;
+
+	info("%s: attached", dev->busid);
+
+	devemu_run(dev, pctx->sockfd);
+
+	closesocket(pctx->sockfd);
+	free(pctx);
+	InterlockedExchange(&dev->attached, 0);
+
+	CloseThreadpoolWork(work);
+
+	info("%s: detached", dev->busid);
+}
+
+static int
+send_reply_devlist(SOCKET sockfd)
+{
+	struct op_devlist_reply	reply;
+	int	i;
+
+	reply.ndev = 0;
+	for (i = 0; i < devemu_n_devs; i++) {
+		if (!devemu_devs[i].attached)
+			reply.ndev++;
+	}
+
+	if (usbip_net_send_op_common(sockfd, OP_REP_DEVLIST, ST_OK) < 0)
+		return -1;
+	PACK_OP_DEVLIST_REPLY(1, &reply);
+	if (usbip_net_send(sockfd, &reply, sizeof(reply)) < 0)
+		return -1;
+
+	for (i = 0; i < devemu_n_devs; i++) {
+		struct usbip_usb_device	udev;
+		struct usbip_usb_interface	uinf;
+
+		if (devemu_devs[i].attached)
+			continue;
+		devemu_build_udev(&devemu_devs[i], &udev);
+		usbip_net_pack_usb_device(1, &udev);
+		devemu_build_uinf(&devemu_devs[i], &uinf);
+		if (usbip_net_send(sockfd, &udev, sizeof(udev)) < 0 ||
+			usbip_net_send(sockfd, &uinf, sizeof(uinf)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+recv_request_import(SOCKET sockfd)
+{
+	struct op_import_request	req;
+	struct usbip_usb_device	udev;
+	devemu_dev_t	*dev;
+	devemu_ctx_t	*pctx;
+	PTP_WORK	work;
+
+	memset(&req, 0, sizeof(req));
+	if (usbip_net_recv(sockfd, &req, sizeof(req)) < 0) {
+		dbg("usbip_net_recv failed: import request");
+		return -1;
+	}
+	PACK_OP_IMPORT_REQUEST(0, &req);
+	req.busid[USBIP_BUS_ID_SIZE - 1] = '\0';
+
+	dev = devemu_find_dev(req.busid);
+	if (dev == NULL) {
+		dbg("invalid bus id: %s", req.busid);
+		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NODEV);
+		return -1;
+	}
+	if (InterlockedCompareExchange(&dev->attached, 1, 0) != 0) {
+		dbg("already attached: %s", req.busid);
+		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_DEV_BUSY);
+		return -1;
+	}
+
+	pctx = (devemu_ctx_t *)malloc(sizeof(devemu_ctx_t));
+	if (pctx == NULL) {
+		dbg("out of memory");
+		InterlockedExchange(&dev->attached, 0);
+		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NA);
+		return -1;
+	}
+	pctx->dev = dev;
+	pctx->sockfd = sockfd;
+
+	usbip_net_set_keepalive(sockfd);
+	usbip_net_set_nodelay(sockfd);
+
+	devemu_build_udev(dev, &udev);
+	usbip_net_pack_usb_device(1, &udev);
+	if (usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_OK) < 0 ||
+		usbip_net_send(sockfd, &udev, sizeof(udev)) < 0) {
+		dbg("failed to send import reply: %s", req.busid);
+		InterlockedExchange(&dev->attached, 0);
+		free(pctx);
+		return -1;
+	}
+
+	work = CreateThreadpoolWork(serve_dev, pctx, NULL);
+	if (work == NULL) {
+		dbg("failed to create thread pool work: error: %lx", GetLastError());
+		InterlockedExchange(&dev->attached, 0);
+		free(pctx);
+		return -1;
+	}
+	SubmitThreadpoolWork(work);
+	return 0;
+}
+
+static void
+process_request(SOCKET listenfd)
+{
+	SOCKET	connfd;
+	uint16_t	code = OP_UNSPEC;
+	int	status;
+
+	connfd = accept(listenfd, NULL, NULL);
+	if (connfd == INVALID_SOCKET) {
+		err("failed to accept connection");
+		return;
+	}
+
+	if (usbip_net_recv_op_common(connfd, &code, &status) < 0) {
+		dbg("could not receive opcode: %#0x", code);
+		closesocket(connfd);
+		return;
+	}
+
+	switch (code) {
+	case OP_REQ_DEVLIST:
+		send_reply_devlist(connfd);
+		break;
+	case OP_REQ_IMPORT:
+		/* an imported socket is closed by a serving thread */
+		if (recv_request_import(connfd) == 0)
+			return;
+		break;
+	default:
+		dbg("received an unknown opcode: %#0x", code);
+		break;
+	}
+	closesocket(connfd);
+}
+
+static int
+serve(int family)
+{
+	SOCKET	*sockfds;
+	int	i;
+
+	sockfds = get_listen_sockfds(family);
+	if (sockfds == NULL) {
+		err("failed to open a listening socket");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < devemu_n_devs; i++)
+		info("%s: %s", devemu_devs[i].busid, devemu_type_name(devemu_devs[i].type));
+
+	for (;;) {
+		fd_set	fds;
+		SOCKET	maxfd = 0;
+
+		FD_ZERO(&fds);
+		for (i = 0; sockfds[i] != INVALID_SOCKET; i++) {
+			FD_SET(sockfds[i], &fds);
+			if (sockfds[i] > maxfd)
+				maxfd = sockfds[i];
+		}
+		if (select((int)maxfd + 1, &fds, NULL, NULL, NULL) == SOCKET_ERROR) {
+			err("failed to select: err: %d", WSAGetLastError());
+			break;
+		}
+		for (i = 0; sockfds[i] != INVALID_SOCKET; i++) {
+			if (FD_ISSET(sockfds[i], &fds))
+				process_request(sockfds[i]);
+		}
+	}
+
+	for (i = 0; sockfds[i] != INVALID_SOCKET; i++)
+		closesocket(sockfds[i]);
+	free(sockfds);
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "device",   required_argument, NULL, 'e' },
+		{ "ipv4",     no_argument,       NULL, '4' },
+		{ "ipv6",     no_argument,       NULL, '6' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "debug",    no_argument,       NULL, 'd' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL,       0,                 NULL,  0 }
+	};
+	BOOL	ipv4 = FALSE, ipv6 = FALSE;
+	int	family = AF_UNSPEC;
+	int	ret;
+
+	usbip_progname = "devemu";
+	usbip_use_stderr = 1;
+
+	for (;;) {
+		int	opt;
+
+		opt = getopt_long(argc, argv, "e:46t:dh", opts, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'e':
+			if (!devemu_add_dev(optarg))
+				return EXIT_FAILURE;
+			break;
+		case '4':
+			ipv4 = TRUE;
+			break;
+		case '6':
+			ipv6 = TRUE;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+			devemu_help();
+			return EXIT_SUCCESS;
+		default:
+			devemu_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (ipv4 && !ipv6)
+		family = AF_INET;
+	else if (!ipv4 && ipv6)
+		family = AF_INET6;
+
+	if (devemu_n_devs == 0)
+		devemu_add_dev("loop");
+
+	init_socket();
+	ret = serve(family);
+	cleanup_socket();
+
+	return ret;
+}
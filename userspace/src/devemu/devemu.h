@@ -0,0 +1,57 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "usbip_common.h"
+#include "usbip_proto.h"
+
+#define DEVEMU_MAX_DEVS	32
+
+/* linux errno values which are used as URB status on the wire */
+#define URB_ST_STALL	(-32)	/* EPIPE */
+#define URB_ST_PROTO	(-71)	/* EPROTO */
+#define URB_ST_CONNRESET	(-104)	/* ECONNRESET */
+
+typedef enum {
+	DEVEMU_LOOP,
+	DEVEMU_SINK,
+	DEVEMU_SOURCE,
+	DEVEMU_HID,
+	DEVEMU_ISO,
+} devemu_type_t;
+
+/* an emulated device, which is exported as a busid of 1-<devnum> */
+typedef struct {
+	devemu_type_t	type;
+	char	busid[USBIP_BUS_ID_SIZE];
+	unsigned	devnum;
+	/* ISO packet size or HID report interval in ms */
+	unsigned	len_pkt;
+	unsigned	interval;
+	/* delay added to every completion */
+	unsigned	latency_us;
+	/* ratio of failing URBs */
+	double	err_ratio;
+	volatile LONG	attached;
+} devemu_dev_t;
+
+/* configuration state of an attached device */
+typedef struct {
+	UCHAR	config;
+	UCHAR	altsetting;
+} devemu_state_t;
+
+extern devemu_dev_t	devemu_devs[DEVEMU_MAX_DEVS];
+extern int	devemu_n_devs;
+
+extern BOOL devemu_add_dev(const char *spec);
+extern devemu_dev_t *devemu_find_dev(const char *busid);
+extern void devemu_build_udev(devemu_dev_t *dev, struct usbip_usb_device *udev);
+extern void devemu_build_uinf(devemu_dev_t *dev, struct usbip_usb_interface *uinf);
+extern const char *devemu_type_name(devemu_type_t type);
+
+/* returns a URB status. *plen has a buffer size and is set to a data length */
+extern int devemu_control(devemu_dev_t *dev, devemu_state_t *state, const UCHAR setup[8], char *buf, UINT32 *plen);
+
+extern void devemu_run(devemu_dev_t *dev, SOCKET sockfd);
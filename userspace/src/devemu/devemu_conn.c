@@ -0,0 +1,567 @@
+#include "devemu.h"
+
+#include <stdlib.h>
+
+#include "usbip_network.h"
+#include "list.h"
+
+#define MAX_LEN_XFER	(16 * 1024 * 1024)
+#define MAX_ISO_PKTS	1024
+#define LEN_LOOP_BUF	MAX_LEN_XFER
+
+#define USECS_PER_UFRAME	125
+
+typedef struct {
+	struct list_head	list;
+	struct usbip_header	hdr;	/* CMD_SUBMIT in host byte order */
+	char	*data;
+	UINT32	len;
+	int	n_pkts;
+	struct usbip_iso_packet_descriptor	*isos;
+	INT32	status;
+	UINT32	actual_length;
+	INT32	start_frame;
+	INT32	error_count;
+	ULONGLONG	due_us;
+} urb_t;
+
+typedef struct {
+	devemu_dev_t	*dev;
+	devemu_state_t	state;
+	SOCKET	sockfd;
+	/* URBs to be completed, sorted by due time */
+	struct list_head	scheduled;
+	/* loop URBs waiting for data or room */
+	struct list_head	pending;
+	char	*loop_buf;
+	UINT32	loop_head, loop_len;
+	/* next free ISO microframe or HID report time */
+	ULONGLONG	next_frame_us;
+	unsigned	n_reports;
+	UINT32	rand;
+	LARGE_INTEGER	freq;
+	char	*sendbuf;
+	UINT32	len_sendbuf;
+} conn_t;
+
+static ULONGLONG
+get_now_us(conn_t *conn)
+{
+	LARGE_INTEGER	cnt;
+
+	QueryPerformanceCounter(&cnt);
+	return (ULONGLONG)(cnt.QuadPart / conn->freq.QuadPart) * 1000000 +
+		(ULONGLONG)(cnt.QuadPart % conn->freq.QuadPart) * 1000000 / conn->freq.QuadPart;
+}
+
+static BOOL
+inject_err(conn_t *conn)
+{
+	if (conn->dev->err_ratio <= 0)
+		return FALSE;
+
+	/* xorshift32 gives the same error sequence for every run */
+	conn->rand ^= conn->rand << 13;
+	conn->rand ^= conn->rand >> 17;
+	conn->rand ^= conn->rand << 5;
+	return conn->rand < conn->dev->err_ratio * 4294967296.0;
+}
+
+static void
+fill_pattern(char *buf, UINT32 len)
+{
+	UINT32	i;
+
+	/* same as mod63 pattern of linux gadget zero */
+	for (i = 0; i < len; i++)
+		buf[i] = (char)(i % 63);
+}
+
+static void
+free_urb(urb_t *urb)
+{
+	free(urb->data);
+	free(urb->isos);
+	free(urb);
+}
+
+static void
+free_urbs(struct list_head *head)
+{
+	struct list_head	*p, *n;
+
+	list_for_each_safe(p, n, head) {
+		urb_t	*urb = list_entry(p, urb_t, list);
+
+		list_del(&urb->list);
+		free_urb(urb);
+	}
+}
+
+static void
+schedule_urb(conn_t *conn, urb_t *urb, ULONGLONG due_us)
+{
+	struct list_head	*p;
+
+	urb->due_us = due_us + conn->dev->latency_us;
+	for (p = conn->scheduled.prev; p != &conn->scheduled; p = p->prev) {
+		if (list_entry(p, urb_t, list)->due_us <= urb->due_us)
+			break;
+	}
+	list_add(&urb->list, p);
+}
+
+static void
+set_result(urb_t *urb, INT32 status, UINT32 actual_length)
+{
+	urb->status = status;
+	urb->actual_length = actual_length;
+}
+
+static void
+process_control(conn_t *conn, urb_t *urb)
+{
+	UINT32	len = urb->len;
+	int	status;
+
+	status = devemu_control(conn->dev, &conn->state, urb->hdr.u.cmd_submit.setup, urb->data, &len);
+	if (urb->hdr.base.direction == USBIP_DIR_OUT)
+		len = urb->len;
+	set_result(urb, status, status == 0 ? len : 0);
+}
+
+static void
+copy_loop_data(conn_t *conn, char *buf, UINT32 len, BOOL to_loop)
+{
+	while (len > 0) {
+		UINT32	pos, len_copy;
+
+		if (to_loop)
+			pos = (conn->loop_head + conn->loop_len) % LEN_LOOP_BUF;
+		else
+			pos = conn->loop_head;
+		len_copy = LEN_LOOP_BUF - pos;
+		if (len_copy > len)
+			len_copy = len;
+		if (to_loop) {
+			memcpy(conn->loop_buf + pos, buf, len_copy);
+			conn->loop_len += len_copy;
+		}
+		else {
+			memcpy(buf, conn->loop_buf + pos, len_copy);
+			conn->loop_head = (pos + len_copy) % LEN_LOOP_BUF;
+			conn->loop_len -= len_copy;
+		}
+		buf += len_copy;
+		len -= len_copy;
+	}
+}
+
+/* returns FALSE if a URB should wait for loop data or room */
+static BOOL
+process_loop(conn_t *conn, urb_t *urb)
+{
+	UINT32	len = urb->len;
+
+	if (urb->hdr.base.direction == USBIP_DIR_OUT) {
+		if (conn->loop_len + len > LEN_LOOP_BUF)
+			return FALSE;
+		copy_loop_data(conn, urb->data, len, TRUE);
+	}
+	else {
+		if (conn->loop_len == 0 && len > 0)
+			return FALSE;
+		if (len > conn->loop_len)
+			len = conn->loop_len;
+		copy_loop_data(conn, urb->data, len, FALSE);
+	}
+	set_result(urb, 0, len);
+	return TRUE;
+}
+
+static ULONGLONG
+process_hid(conn_t *conn, urb_t *urb, ULONGLONG now)
+{
+	static const CHAR	moves[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+	const CHAR	*move;
+	CHAR	report[4];
+	UINT32	len = urb->len < sizeof(report) ? urb->len : sizeof(report);
+
+	if (conn->next_frame_us < now)
+		conn->next_frame_us = now;
+	conn->next_frame_us += conn->dev->interval * 1000;
+
+	/* a pointer draws a square */
+	move = moves[(conn->n_reports++ / 32) % 4];
+	report[0] = 0;
+	report[1] = move[0];
+	report[2] = move[1];
+	report[3] = 0;
+	memcpy(urb->data, report, len);
+	set_result(urb, 0, len);
+	return conn->next_frame_us;
+}
+
+static ULONGLONG
+process_iso(conn_t *conn, urb_t *urb, ULONGLONG now)
+{
+	ULONGLONG	start_us;
+	UINT32	offset = 0;
+	int	err_pkt = -1;
+	int	i;
+
+	/* a stream which has been idle restarts at the current frame */
+	start_us = conn->next_frame_us < now ? now : conn->next_frame_us;
+	conn->next_frame_us = start_us + (ULONGLONG)urb->n_pkts * USECS_PER_UFRAME;
+
+	if (inject_err(conn))
+		err_pkt = (int)(conn->rand % (UINT32)urb->n_pkts);
+
+	for (i = 0; i < urb->n_pkts; i++) {
+		struct usbip_iso_packet_descriptor	*iso = &urb->isos[i];
+		UINT32	len = iso->length < conn->dev->len_pkt ? iso->length : conn->dev->len_pkt;
+
+		if (len > urb->len - offset)
+			len = urb->len - offset;
+		if (i == err_pkt) {
+			iso->status = (UINT32)URB_ST_PROTO;
+			iso->actual_length = 0;
+			continue;
+		}
+		/* IN packets are packed without gaps on the wire */
+		fill_pattern(urb->data + offset, len);
+		iso->status = 0;
+		iso->actual_length = len;
+		offset += len;
+	}
+	set_result(urb, 0, offset);
+	urb->start_frame = (INT32)((start_us / 1000) & 0x7ff);
+	urb->error_count = err_pkt >= 0 ? 1 : 0;
+	return conn->next_frame_us;
+}
+
+/* returns FALSE if a URB is pending */
+static BOOL
+process_urb(conn_t *conn, urb_t *urb)
+{
+	devemu_dev_t	*dev = conn->dev;
+	BOOL	is_in = urb->hdr.base.direction == USBIP_DIR_IN;
+	ULONGLONG	now = get_now_us(conn);
+	ULONGLONG	due_us = now;
+
+	if (urb->hdr.base.ep == 0) {
+		process_control(conn, urb);
+	}
+	else if (urb->hdr.base.ep != 1 || conn->state.config == 0) {
+		set_result(urb, URB_ST_STALL, 0);
+	}
+	else if (dev->type == DEVEMU_ISO) {
+		if (is_in && conn->state.altsetting == 1 && urb->n_pkts > 0)
+			due_us = process_iso(conn, urb, now);
+		else
+			set_result(urb, URB_ST_STALL, 0);
+	}
+	else if (inject_err(conn)) {
+		set_result(urb, URB_ST_STALL, 0);
+	}
+	else {
+		switch (dev->type) {
+		case DEVEMU_LOOP:
+			if (!process_loop(conn, urb))
+				return FALSE;
+			break;
+		case DEVEMU_SINK:
+			set_result(urb, is_in ? URB_ST_STALL : 0, is_in ? 0 : urb->len);
+			break;
+		case DEVEMU_SOURCE:
+			if (is_in)
+				fill_pattern(urb->data, urb->len);
+			set_result(urb, is_in ? 0 : URB_ST_STALL, is_in ? urb->len : 0);
+			break;
+		case DEVEMU_HID:
+			if (is_in)
+				due_us = process_hid(conn, urb, now);
+			else
+				set_result(urb, URB_ST_STALL, 0);
+			break;
+		default:
+			break;
+		}
+	}
+	schedule_urb(conn, urb, due_us);
+	return TRUE;
+}
+
+static void
+process_pending(conn_t *conn)
+{
+	struct list_head	*p, *n;
+	BOOL	progress;
+
+	/* loop OUT makes room for IN and vice versa */
+	do {
+		BOOL	blocked[2] = { FALSE, FALSE };
+
+		progress = FALSE;
+		list_for_each_safe(p, n, &conn->pending) {
+			urb_t	*urb = list_entry(p, urb_t, list);
+			UINT32	dir = urb->hdr.base.direction ? 1 : 0;
+
+			/* URBs of a direction are never reordered */
+			if (blocked[dir])
+				continue;
+			list_del(&urb->list);
+			if (process_urb(conn, urb)) {
+				progress = TRUE;
+			}
+			else {
+				list_add(&urb->list, n->prev);
+				blocked[dir] = TRUE;
+			}
+		}
+	} while (progress);
+}
+
+static BOOL
+recv_submit(conn_t *conn, struct usbip_header *hdr)
+{
+	urb_t	*urb;
+	INT32	len = hdr->u.cmd_submit.transfer_buffer_length;
+	INT32	n_pkts = hdr->u.cmd_submit.number_of_packets;
+
+	if (len < 0 || len > MAX_LEN_XFER || n_pkts > MAX_ISO_PKTS) {
+		err("invalid submit: seq: %u, len: %d, n_pkts: %d", hdr->base.seqnum, len, n_pkts);
+		return FALSE;
+	}
+	if (n_pkts < 0)
+		n_pkts = 0;
+
+	urb = (urb_t *)calloc(1, sizeof(urb_t));
+	if (urb == NULL) {
+		dbg("out of memory");
+		return FALSE;
+	}
+	urb->hdr = *hdr;
+	urb->len = len;
+	urb->n_pkts = n_pkts;
+	urb->data = (char *)malloc(len > 0 ? len : 1);
+	if (n_pkts > 0)
+		urb->isos = (struct usbip_iso_packet_descriptor *)malloc(n_pkts * sizeof(struct usbip_iso_packet_descriptor));
+	if (urb->data == NULL || (n_pkts > 0 && urb->isos == NULL)) {
+		dbg("out of memory");
+		free_urb(urb);
+		return FALSE;
+	}
+
+	if (hdr->base.direction == USBIP_DIR_OUT && len > 0) {
+		if (usbip_net_recv(conn->sockfd, urb->data, len) < 0) {
+			free_urb(urb);
+			return FALSE;
+		}
+	}
+	if (n_pkts > 0) {
+		if (usbip_net_recv(conn->sockfd, urb->isos, n_pkts * sizeof(struct usbip_iso_packet_descriptor)) < 0) {
+			free_urb(urb);
+			return FALSE;
+		}
+		usbip_net_pack_iso_descs(0, urb->isos, n_pkts);
+	}
+
+	/* loop URBs may wait for data or room */
+	if (conn->dev->type == DEVEMU_LOOP && urb->hdr.base.ep != 0) {
+		list_add(&urb->list, conn->pending.prev);
+		process_pending(conn);
+	}
+	else {
+		process_urb(conn, urb);
+	}
+	return TRUE;
+}
+
+static BOOL
+send_ret_unlink(conn_t *conn, UINT32 seqnum, INT32 status)
+{
+	struct usbip_header	hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_RET_UNLINK;
+	hdr.base.seqnum = seqnum;
+	hdr.u.ret_unlink.status = status;
+	usbip_net_pack_usbip_header(1, &hdr);
+
+	return usbip_net_send(conn->sockfd, &hdr, sizeof(hdr)) >= 0;
+}
+
+static urb_t *
+find_urb(struct list_head *head, UINT32 seqnum)
+{
+	struct list_head	*p;
+
+	list_for_each(p, head) {
+		urb_t	*urb = list_entry(p, urb_t, list);
+
+		if (urb->hdr.base.seqnum == seqnum)
+			return urb;
+	}
+	return NULL;
+}
+
+static BOOL
+process_unlink(conn_t *conn, struct usbip_header *hdr)
+{
+	urb_t	*urb;
+
+	urb = find_urb(&conn->scheduled, hdr->u.cmd_unlink.seqnum);
+	if (urb == NULL)
+		urb = find_urb(&conn->pending, hdr->u.cmd_unlink.seqnum);
+
+	/* same as stub: an unlinked URB has no RET_SUBMIT */
+	if (urb == NULL)
+		return send_ret_unlink(conn, hdr->base.seqnum, -1);
+
+	list_del(&urb->list);
+	free_urb(urb);
+	if (conn->dev->type == DEVEMU_LOOP)
+		process_pending(conn);
+	return send_ret_unlink(conn, hdr->base.seqnum, 0);
+}
+
+static BOOL
+send_ret_submit(conn_t *conn, urb_t *urb)
+{
+	struct usbip_header	*hdr;
+	UINT32	len_data, len_isos, len;
+
+	len_data = urb->hdr.base.direction == USBIP_DIR_IN ? urb->actual_length : 0;
+	len_isos = urb->n_pkts * sizeof(struct usbip_iso_packet_descriptor);
+	len = sizeof(struct usbip_header) + len_data + len_isos;
+	if (len > conn->len_sendbuf) {
+		char	*sendbuf;
+
+		sendbuf = (char *)realloc(conn->sendbuf, len);
+		if (sendbuf == NULL) {
+			dbg("out of memory");
+			return FALSE;
+		}
+		conn->sendbuf = sendbuf;
+		conn->len_sendbuf = len;
+	}
+
+	hdr = (struct usbip_header *)conn->sendbuf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->base.command = USBIP_RET_SUBMIT;
+	hdr->base.seqnum = urb->hdr.base.seqnum;
+	hdr->u.ret_submit.status = urb->status;
+	hdr->u.ret_submit.actual_length = urb->actual_length;
+	hdr->u.ret_submit.start_frame = urb->start_frame;
+	hdr->u.ret_submit.number_of_packets = urb->n_pkts;
+	hdr->u.ret_submit.error_count = urb->error_count;
+	usbip_net_pack_usbip_header(1, hdr);
+
+	memcpy(hdr + 1, urb->data, len_data);
+	if (len_isos > 0) {
+		struct usbip_iso_packet_descriptor	*isos;
+
+		isos = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + len_data);
+		memcpy(isos, urb->isos, len_isos);
+		usbip_net_pack_iso_descs(1, isos, urb->n_pkts);
+	}
+
+	return usbip_net_send(conn->sockfd, conn->sendbuf, len) >= 0;
+}
+
+/* returns microseconds until the next completion or -1 if nothing is scheduled */
+static LONGLONG
+complete_urbs(conn_t *conn, BOOL *perror)
+{
+	ULONGLONG	now = get_now_us(conn);
+
+	while (conn->scheduled.next != &conn->scheduled) {
+		urb_t	*urb = list_entry(conn->scheduled.next, urb_t, list);
+
+		if (urb->due_us > now)
+			return (LONGLONG)(urb->due_us - now);
+		list_del(&urb->list);
+		if (!send_ret_submit(conn, urb)) {
+			free_urb(urb);
+			*perror = TRUE;
+			return -1;
+		}
+		free_urb(urb);
+	}
+	return -1;
+}
+
+static BOOL
+recv_cmd(conn_t *conn)
+{
+	struct usbip_header	hdr;
+
+	if (usbip_net_recv(conn->sockfd, &hdr, sizeof(hdr)) < 0) {
+		dbg("%s: connection closed", conn->dev->busid);
+		return FALSE;
+	}
+	usbip_net_pack_usbip_header(0, &hdr);
+
+	switch (hdr.base.command) {
+	case USBIP_CMD_SUBMIT:
+		return recv_submit(conn, &hdr);
+	case USBIP_CMD_UNLINK:
+		return process_unlink(conn, &hdr);
+	default:
+		err("%s: invalid command: %x", conn->dev->busid, hdr.base.command);
+		return FALSE;
+	}
+}
+
+void
+devemu_run(devemu_dev_t *dev, SOCKET sockfd)
+{
+	conn_t	conn;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.dev = dev;
+	conn.sockfd = sockfd;
+	INIT_LIST_HEAD(&conn.scheduled);
+	INIT_LIST_HEAD(&conn.pending);
+	conn.rand = 0x9e3779b9 * dev->devnum;
+	QueryPerformanceFrequency(&conn.freq);
+	if (dev->type == DEVEMU_LOOP) {
+		conn.loop_buf = (char *)malloc(LEN_LOOP_BUF);
+		if (conn.loop_buf == NULL) {
+			dbg("out of memory");
+			return;
+		}
+	}
+
+	for (;;) {
+		fd_set	fds;
+		struct timeval	tv;
+		LONGLONG	wait_us;
+		BOOL	error = FALSE;
+		int	rc;
+
+		wait_us = complete_urbs(&conn, &error);
+		if (error)
+			break;
+
+		FD_ZERO(&fds);
+		FD_SET(sockfd, &fds);
+		if (wait_us >= 0) {
+			tv.tv_sec = (long)(wait_us / 1000000);
+			tv.tv_usec = (long)(wait_us % 1000000);
+		}
+		rc = select((int)sockfd + 1, &fds, NULL, NULL, wait_us >= 0 ? &tv : NULL);
+		if (rc == SOCKET_ERROR) {
+			dbg("failed to select: err: %d", WSAGetLastError());
+			break;
+		}
+		if (rc > 0 && !recv_cmd(&conn))
+			break;
+	}
+
+	free_urbs(&conn.scheduled);
+	free_urbs(&conn.pending);
+	free(conn.loop_buf);
+	free(conn.sendbuf);
+}
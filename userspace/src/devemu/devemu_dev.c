@@ -0,0 +1,455 @@
+#include "devemu.h"
+
+#include <stdlib.h>
+
+#define DEVEMU_VID	0x1209	/* pid.codes test vendor */
+#define DEVEMU_PID_BASE	0xee00
+
+#define MAX_LEN_ISO_PKT	3072
+
+devemu_dev_t	devemu_devs[DEVEMU_MAX_DEVS];
+int	devemu_n_devs;
+
+static const char	*type_names[] = { "loop", "sink", "source", "hid", "iso" };
+
+/* boot protocol mouse with a wheel: buttons, x, y, wheel */
+static const UCHAR	hid_report_desc[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+	0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+	0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38,
+	0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+	0xc0, 0xc0
+};
+
+#define LEN_HID_REPORT	4
+
+const char *
+devemu_type_name(devemu_type_t type)
+{
+	return type_names[type];
+}
+
+static BOOL
+parse_type(const char *name, size_t len, devemu_type_t *ptype)
+{
+	int	i;
+
+	for (i = 0; i < sizeof(type_names) / sizeof(type_names[0]); i++) {
+		if (strlen(type_names[i]) == len && strncmp(type_names[i], name, len) == 0) {
+			*ptype = (devemu_type_t)i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static BOOL
+parse_param(devemu_dev_t *dev, const char *param)
+{
+	const char	*val;
+	char	*end;
+
+	val = strchr(param, '=');
+	if (val == NULL)
+		return FALSE;
+	val++;
+
+	if (strncmp(param, "pkt=", 4) == 0) {
+		dev->len_pkt = strtoul(val, &end, 10);
+		if (dev->len_pkt == 0 || dev->len_pkt > MAX_LEN_ISO_PKT)
+			return FALSE;
+	}
+	else if (strncmp(param, "interval=", 9) == 0) {
+		dev->interval = strtoul(val, &end, 10);
+		if (dev->interval == 0 || dev->interval > 255)
+			return FALSE;
+	}
+	else if (strncmp(param, "lat=", 4) == 0) {
+		dev->latency_us = strtoul(val, &end, 10);
+	}
+	else if (strncmp(param, "err=", 4) == 0) {
+		dev->err_ratio = strtod(val, &end) / 100;
+		if (dev->err_ratio < 0 || dev->err_ratio > 1)
+			return FALSE;
+	}
+	else
+		return FALSE;
+	return *end == '\0' || *end == ',';
+}
+
+/* spec: type[,pkt=N][,interval=ms][,lat=us][,err=percent] */
+BOOL
+devemu_add_dev(const char *spec)
+{
+	devemu_dev_t	*dev;
+	const char	*p;
+
+	if (devemu_n_devs == DEVEMU_MAX_DEVS) {
+		err("too many devices: max %d", DEVEMU_MAX_DEVS);
+		return FALSE;
+	}
+	dev = &devemu_devs[devemu_n_devs];
+	memset(dev, 0, sizeof(*dev));
+
+	p = strchr(spec, ',');
+	if (!parse_type(spec, p ? (size_t)(p - spec) : strlen(spec), &dev->type)) {
+		err("invalid device type: %s", spec);
+		return FALSE;
+	}
+	dev->len_pkt = 1024;
+	dev->interval = 10;
+	for (; p != NULL; p = strchr(p + 1, ',')) {
+		if (!parse_param(dev, p + 1)) {
+			err("invalid device parameter: %s", p + 1);
+			return FALSE;
+		}
+	}
+
+	dev->devnum = devemu_n_devs + 1;
+	snprintf(dev->busid, USBIP_BUS_ID_SIZE, "1-%u", dev->devnum);
+	devemu_n_devs++;
+	return TRUE;
+}
+
+devemu_dev_t *
+devemu_find_dev(const char *busid)
+{
+	int	i;
+
+	for (i = 0; i < devemu_n_devs; i++) {
+		if (strncmp(devemu_devs[i].busid, busid, USBIP_BUS_ID_SIZE) == 0)
+			return &devemu_devs[i];
+	}
+	return NULL;
+}
+
+static BOOL
+is_highspeed(devemu_dev_t *dev)
+{
+	return dev->type != DEVEMU_HID;
+}
+
+void
+devemu_build_udev(devemu_dev_t *dev, struct usbip_usb_device *udev)
+{
+	memset(udev, 0, sizeof(*udev));
+
+	snprintf(udev->path, USBIP_DEV_PATH_MAX, "/devemu/%s", dev->busid);
+	strcpy_s(udev->busid, USBIP_BUS_ID_SIZE, dev->busid);
+	udev->busnum = 1;
+	udev->devnum = dev->devnum;
+	udev->speed = is_highspeed(dev) ? USB_SPEED_HIGH : USB_SPEED_FULL;
+	udev->idVendor = DEVEMU_VID;
+	udev->idProduct = (uint16_t)(DEVEMU_PID_BASE + dev->type);
+	udev->bcdDevice = 0x0100;
+	udev->bConfigurationValue = 1;
+	udev->bNumConfigurations = 1;
+	udev->bNumInterfaces = 1;
+}
+
+void
+devemu_build_uinf(devemu_dev_t *dev, struct usbip_usb_interface *uinf)
+{
+	memset(uinf, 0, sizeof(*uinf));
+
+	if (dev->type == DEVEMU_HID) {
+		uinf->bInterfaceClass = 0x03;
+		uinf->bInterfaceSubClass = 0x01;
+		uinf->bInterfaceProtocol = 0x02;
+	}
+	else {
+		uinf->bInterfaceClass = 0xff;
+	}
+}
+
+static UINT32
+get_dsc_dev(devemu_dev_t *dev, UCHAR *dsc)
+{
+	USHORT	pid = (USHORT)(DEVEMU_PID_BASE + dev->type);
+
+	dsc[0] = 18;
+	dsc[1] = 0x01;
+	dsc[2] = 0x00;
+	dsc[3] = 0x02;		/* bcdUSB 2.0 */
+	dsc[4] = dsc[5] = dsc[6] = 0;	/* class per interface */
+	dsc[7] = 64;
+	dsc[8] = DEVEMU_VID & 0xff;
+	dsc[9] = DEVEMU_VID >> 8;
+	dsc[10] = pid & 0xff;
+	dsc[11] = pid >> 8;
+	dsc[12] = 0x00;
+	dsc[13] = 0x01;		/* bcdDevice 1.0 */
+	dsc[14] = 1;
+	dsc[15] = 2;
+	dsc[16] = 3;
+	dsc[17] = 1;
+	return 18;
+}
+
+static UCHAR *
+add_dsc_intf(UCHAR *dsc, UCHAR altsetting, UCHAR n_eps, UCHAR class, UCHAR subclass, UCHAR proto)
+{
+	dsc[0] = 9;
+	dsc[1] = 0x04;
+	dsc[2] = 0;
+	dsc[3] = altsetting;
+	dsc[4] = n_eps;
+	dsc[5] = class;
+	dsc[6] = subclass;
+	dsc[7] = proto;
+	dsc[8] = 0;
+	return dsc + 9;
+}
+
+static UCHAR *
+add_dsc_ep(UCHAR *dsc, UCHAR addr, UCHAR attrs, USHORT maxpkt, UCHAR interval)
+{
+	dsc[0] = 7;
+	dsc[1] = 0x05;
+	dsc[2] = addr;
+	dsc[3] = attrs;
+	dsc[4] = maxpkt & 0xff;
+	dsc[5] = maxpkt >> 8;
+	dsc[6] = interval;
+	return dsc + 7;
+}
+
+static USHORT
+get_iso_maxpkt(unsigned len_pkt)
+{
+	unsigned	mult = (len_pkt + 1023) / 1024;
+
+	/* high bandwidth endpoint has additional transactions in bits 11..12 */
+	return (USHORT)(((mult - 1) << 11) | ((len_pkt + mult - 1) / mult));
+}
+
+static UINT32
+get_dsc_conf(devemu_dev_t *dev, UCHAR *dsc)
+{
+	UCHAR	*p = dsc + 9;
+	UINT32	len;
+
+	switch (dev->type) {
+	case DEVEMU_HID:
+		p = add_dsc_intf(p, 0, 1, 0x03, 0x01, 0x02);
+		p[0] = 9;
+		p[1] = 0x21;
+		p[2] = 0x11;
+		p[3] = 0x01;	/* bcdHID 1.11 */
+		p[4] = 0;
+		p[5] = 1;
+		p[6] = 0x22;
+		p[7] = sizeof(hid_report_desc);
+		p[8] = 0;
+		p += 9;
+		p = add_dsc_ep(p, 0x81, 0x03, LEN_HID_REPORT, (UCHAR)dev->interval);
+		break;
+	case DEVEMU_ISO:
+		/* ISO bandwidth is allocated only in altsetting 1 */
+		p = add_dsc_intf(p, 0, 0, 0xff, 0, 0);
+		p = add_dsc_intf(p, 1, 1, 0xff, 0, 0);
+		p = add_dsc_ep(p, 0x81, 0x05, get_iso_maxpkt(dev->len_pkt), 1);
+		break;
+	default:
+		p = add_dsc_intf(p, 0, 2, 0xff, 0, 0);
+		p = add_dsc_ep(p, 0x81, 0x02, 512, 0);
+		p = add_dsc_ep(p, 0x01, 0x02, 512, 0);
+		break;
+	}
+
+	len = (UINT32)(p - dsc);
+	dsc[0] = 9;
+	dsc[1] = 0x02;
+	dsc[2] = (UCHAR)(len & 0xff);
+	dsc[3] = (UCHAR)(len >> 8);
+	dsc[4] = 1;
+	dsc[5] = 1;
+	dsc[6] = 0;
+	dsc[7] = 0x80;
+	dsc[8] = 50;	/* 100mA */
+	return len;
+}
+
+static UINT32
+get_dsc_str(devemu_dev_t *dev, UCHAR idx, UCHAR *dsc)
+{
+	char	str[64];
+	UINT32	len, i;
+
+	switch (idx) {
+	case 0:
+		dsc[0] = 4;
+		dsc[1] = 0x03;
+		dsc[2] = 0x09;
+		dsc[3] = 0x04;	/* en-US */
+		return 4;
+	case 1:
+		strcpy_s(str, sizeof(str), "usbip-win");
+		break;
+	case 2:
+		snprintf(str, sizeof(str), "devemu %s", devemu_type_name(dev->type));
+		break;
+	case 3:
+		strcpy_s(str, sizeof(str), dev->busid);
+		break;
+	default:
+		return 0;
+	}
+
+	len = (UINT32)strlen(str);
+	dsc[0] = (UCHAR)(2 + len * 2);
+	dsc[1] = 0x03;
+	for (i = 0; i < len; i++) {
+		dsc[2 + i * 2] = str[i];
+		dsc[3 + i * 2] = 0;
+	}
+	return 2 + len * 2;
+}
+
+static UINT32
+get_dsc_qualifier(devemu_dev_t *dev, UCHAR *dsc)
+{
+	if (!is_highspeed(dev))
+		return 0;
+	dsc[0] = 10;
+	dsc[1] = 0x06;
+	dsc[2] = 0x00;
+	dsc[3] = 0x02;
+	dsc[4] = dsc[5] = dsc[6] = 0;
+	dsc[7] = 64;
+	dsc[8] = 1;
+	dsc[9] = 0;
+	return 10;
+}
+
+static UINT32
+get_dsc(devemu_dev_t *dev, UCHAR type, UCHAR idx, UCHAR *dsc)
+{
+	switch (type) {
+	case 0x01:
+		return get_dsc_dev(dev, dsc);
+	case 0x02:
+		return idx == 0 ? get_dsc_conf(dev, dsc) : 0;
+	case 0x03:
+		return get_dsc_str(dev, idx, dsc);
+	case 0x06:
+		return get_dsc_qualifier(dev, dsc);
+	case 0x21:
+		if (dev->type != DEVEMU_HID)
+			return 0;
+		get_dsc_conf(dev, dsc);
+		memmove(dsc, dsc + 18, 9);
+		return 9;
+	case 0x22:
+		if (dev->type != DEVEMU_HID)
+			return 0;
+		memcpy(dsc, hid_report_desc, sizeof(hid_report_desc));
+		return sizeof(hid_report_desc);
+	default:
+		return 0;
+	}
+}
+
+static int
+reply_data(const void *data, UINT32 len, char *buf, UINT32 *plen)
+{
+	if (len > *plen)
+		len = *plen;
+	memcpy(buf, data, len);
+	*plen = len;
+	return 0;
+}
+
+static int
+control_std(devemu_dev_t *dev, devemu_state_t *state, UCHAR reqtype, UCHAR req, USHORT value, USHORT index, char *buf, UINT32 *plen)
+{
+	UCHAR	dsc[256];
+	UCHAR	status[2] = { 0, 0 };
+	UINT32	len;
+
+	switch (req) {
+	case 0x00:	/* GET_STATUS */
+		return reply_data(status, 2, buf, plen);
+	case 0x01:	/* CLEAR_FEATURE */
+	case 0x03:	/* SET_FEATURE */
+		*plen = 0;
+		return 0;
+	case 0x06:	/* GET_DESCRIPTOR */
+		len = get_dsc(dev, (UCHAR)(value >> 8), (UCHAR)(value & 0xff), dsc);
+		if (len == 0)
+			break;
+		return reply_data(dsc, len, buf, plen);
+	case 0x08:	/* GET_CONFIGURATION */
+		return reply_data(&state->config, 1, buf, plen);
+	case 0x09:	/* SET_CONFIGURATION */
+		if (value > 1)
+			break;
+		state->config = (UCHAR)value;
+		state->altsetting = 0;
+		*plen = 0;
+		return 0;
+	case 0x0a:	/* GET_INTERFACE */
+		if (state->config == 0 || index != 0)
+			break;
+		return reply_data(&state->altsetting, 1, buf, plen);
+	case 0x0b:	/* SET_INTERFACE */
+		if (state->config == 0 || index != 0)
+			break;
+		if (value > (dev->type == DEVEMU_ISO ? 1u : 0u))
+			break;
+		state->altsetting = (UCHAR)value;
+		*plen = 0;
+		return 0;
+	default:
+		break;
+	}
+	dbg("stall standard request: %02x %02x %04x %04x", reqtype, req, value, index);
+	return URB_ST_STALL;
+}
+
+static int
+control_hid(UCHAR req, char *buf, UINT32 *plen)
+{
+	UCHAR	report[LEN_HID_REPORT] = { 0, };
+	UCHAR	val = 0;
+
+	switch (req) {
+	case 0x01:	/* GET_REPORT */
+		return reply_data(report, LEN_HID_REPORT, buf, plen);
+	case 0x02:	/* GET_IDLE */
+	case 0x03:	/* GET_PROTOCOL */
+		return reply_data(&val, 1, buf, plen);
+	case 0x0a:	/* SET_IDLE */
+	case 0x0b:	/* SET_PROTOCOL */
+		*plen = 0;
+		return 0;
+	default:
+		return URB_ST_STALL;
+	}
+}
+
+int
+devemu_control(devemu_dev_t *dev, devemu_state_t *state, const UCHAR setup[8], char *buf, UINT32 *plen)
+{
+	UCHAR	reqtype = setup[0], req = setup[1];
+	USHORT	value = setup[2] | (setup[3] << 8);
+	USHORT	index = setup[4] | (setup[5] << 8);
+	USHORT	length = setup[6] | (setup[7] << 8);
+
+	if (length < *plen)
+		*plen = length;
+
+	switch (reqtype & 0x60) {
+	case 0x00:
+		return control_std(dev, state, reqtype, req, value, index, buf, plen);
+	case 0x20:
+		if (dev->type == DEVEMU_HID && (reqtype & 0x1f) == 0x01)
+			return control_hid(req, buf, plen);
+		break;
+	default:
+		break;
+	}
+	dbg("stall request: %02x %02x %04x %04x", reqtype, req, value, index);
+	return URB_ST_STALL;
+}
@@ -0,0 +1,344 @@
+/*
+ * loadgen: drive CMD_SUBMIT workloads against a USB/IP server
+ *
+ * Every busid is imported over its own connection, which keeps a fixed
+ * number of URBs in flight until a given time passes. Throughput and
+ * completion latency are reported per connection and for all of them.
+ */
+
+#include <stdlib.h>
+
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "loadgen.h"
+
+#define MAX_ISO_PKTS	1024
+
+static const char loadgen_help_string[] =
+	"usage: loadgen [options] <host>\n"
+	"\n"
+	"	-b, --busid <busid>\n"
+	"		Import a device over a connection. It can be repeated.\n"
+	"		Default is all exported devices of a host.\n"
+	"\n"
+	"	-q, --depth <n>\n"
+	"		URBs in flight per connection. Default is 8.\n"
+	"\n"
+	"	-s, --size <bytes>\n"
+	"		Transfer buffer length of a URB. Default is 16384.\n"
+	"\n"
+	"	-D, --direction <in|out|loop>\n"
+	"		loop submits OUT and IN in turn. Default is loop.\n"
+	"\n"
+	"	-T, --type <bulk|int|iso>\n"
+	"		Endpoint type. Default is bulk.\n"
+	"\n"
+	"	-e, --ep <n>\n"
+	"		Endpoint number. Default is 1.\n"
+	"\n"
+	"	-p, --packets <n>\n"
+	"		ISO packets of a URB. Default is 8.\n"
+	"\n"
+	"	-u, --unlink <percent>\n"
+	"		Unlink given percent of URBs right after submission.\n"
+	"\n"
+	"	-n, --seconds <n>\n"
+	"		Duration of a workload. Default is 10.\n"
+	"\n"
+	"	-tPORT, --tcp-port PORT\n"
+	"		Connect to TCP/IP port PORT.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+static void
+loadgen_help(void)
+{
+	printf("%s\n", loadgen_help_string);
+}
+
+static double
+ts_to_us(LONGLONG ts)
+{
+	LARGE_INTEGER	freq;
+
+	QueryPerformanceFrequency(&freq);
+	return (double)ts * 1000000.0 / (double)freq.QuadPart;
+}
+
+static int
+compare_ts(const void *a, const void *b)
+{
+	LONGLONG	ta = *(const LONGLONG *)a, tb = *(const LONGLONG *)b;
+
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+static void
+print_stats(const char *label, LONGLONG elapsed, unsigned n_urbs, unsigned long long n_bytes,
+	LONGLONG *lats, unsigned n_lats, unsigned n_errors, unsigned n_unlinked)
+{
+	double	secs = ts_to_us(elapsed) / 1000000.0;
+
+	if (n_lats == 0) {
+		printf("%8s %10s\n", label, "no URB completed");
+		return;
+	}
+	qsort(lats, n_lats, sizeof(LONGLONG), compare_ts);
+	printf("%8s %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %8u %8u\n", label,
+		n_urbs / secs,
+		n_bytes / secs / (1024 * 1024),
+		ts_to_us(lats[n_lats / 2]),
+		ts_to_us(lats[(unsigned)((n_lats - 1) * 0.99)]),
+		ts_to_us(lats[(unsigned)((n_lats - 1) * 0.999)]),
+		ts_to_us(lats[n_lats - 1]),
+		n_errors, n_unlinked);
+}
+
+static int
+report(loadgen_conn_t *conns, int n_conns)
+{
+	LONGLONG	*lats, elapsed = 0;
+	unsigned	n_lats = 0, n_urbs = 0, n_errors = 0, n_unlinked = 0;
+	unsigned long long	n_bytes = 0;
+	int	n_failed = 0;
+	int	i;
+
+	for (i = 0; i < n_conns; i++)
+		n_lats += conns[i].n_lats;
+	lats = (LONGLONG *)malloc(sizeof(LONGLONG) * (n_lats + 1));
+	if (lats == NULL) {
+		dbg("out of memory");
+		return -1;
+	}
+
+	printf("%8s %10s %9s %9s %9s %9s %9s %8s %8s\n", "busid", "URBs/s", "MB/s",
+		"p50(us)", "p99(us)", "p999(us)", "max(us)", "errors", "unlinked");
+	n_lats = 0;
+	for (i = 0; i < n_conns; i++) {
+		loadgen_conn_t	*conn = &conns[i];
+		LONGLONG	elapsed_conn = conn->ts_end - conn->ts_start;
+
+		if (conn->failed) {
+			printf("%8s %10s\n", conn->busid, "failed");
+			n_failed++;
+			continue;
+		}
+		/* connections run concurrently, so the longest one is taken */
+		if (elapsed_conn > elapsed)
+			elapsed = elapsed_conn;
+		memcpy(lats + n_lats, conn->lats, sizeof(LONGLONG) * conn->n_lats);
+		n_lats += conn->n_lats;
+		n_urbs += conn->n_urbs;
+		n_bytes += conn->n_bytes;
+		n_errors += conn->n_errors;
+		n_unlinked += conn->n_unlinked;
+		print_stats(conn->busid, elapsed_conn, conn->n_urbs, conn->n_bytes, conn->lats, conn->n_lats,
+			conn->n_errors, conn->n_unlinked);
+	}
+	if (n_conns > 1 && n_failed < n_conns)
+		print_stats("all", elapsed, n_urbs, n_bytes, lats, n_lats, n_errors, n_unlinked);
+	free(lats);
+
+	return n_failed == 0 ? 0 : -1;
+}
+
+static int
+run(loadgen_opts_t *opts, char busids[][USBIP_BUS_ID_SIZE], int n_busids)
+{
+	loadgen_conn_t	*conns;
+	int	n_conns = 0;
+	int	ret, i;
+
+	conns = (loadgen_conn_t *)calloc(n_busids, sizeof(loadgen_conn_t));
+	if (conns == NULL) {
+		dbg("out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < n_busids; i++) {
+		loadgen_conn_t	*conn = &conns[n_conns];
+
+		strcpy_s(conn->busid, USBIP_BUS_ID_SIZE, busids[i]);
+		conn->opts = opts;
+		conn->sockfd = INVALID_SOCKET;
+		if (!loadgen_start(conn))
+			break;
+		n_conns++;
+	}
+
+	for (i = 0; i < n_conns; i++) {
+		WaitForSingleObject(conns[i].hthread, INFINITE);
+		CloseHandle(conns[i].hthread);
+	}
+
+	ret = n_conns == n_busids ? report(conns, n_conns) : -1;
+
+	for (i = 0; i < n_conns; i++)
+		free(conns[i].lats);
+	free(conns);
+	return ret;
+}
+
+static BOOL
+parse_uint(const char *arg, unsigned *pval, unsigned min, unsigned max)
+{
+	if (sscanf_s(arg, "%u", pval) != 1 || *pval < min || *pval > max) {
+		err("invalid number: %s", arg);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts_long[] = {
+		{ "busid",     required_argument, NULL, 'b' },
+		{ "depth",     required_argument, NULL, 'q' },
+		{ "size",      required_argument, NULL, 's' },
+		{ "direction", required_argument, NULL, 'D' },
+		{ "type",      required_argument, NULL, 'T' },
+		{ "ep",        required_argument, NULL, 'e' },
+		{ "packets",   required_argument, NULL, 'p' },
+		{ "unlink",    required_argument, NULL, 'u' },
+		{ "seconds",   required_argument, NULL, 'n' },
+		{ "tcp-port",  required_argument, NULL, 't' },
+		{ "debug",     no_argument,       NULL, 'd' },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ NULL,        0,                 NULL,  0 }
+	};
+	static char	busids[LOADGEN_MAX_CONNS][USBIP_BUS_ID_SIZE];
+	loadgen_opts_t	opts;
+	int	n_busids = 0;
+	double	unlink_pct;
+	int	ret;
+
+	usbip_progname = "loadgen";
+	usbip_use_stderr = 1;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.depth = 8;
+	opts.len_xfer = 16384;
+	opts.dir = LOADGEN_LOOP;
+	opts.type = LOADGEN_BULK;
+	opts.ep = 1;
+	opts.n_pkts = 8;
+	opts.secs = 10;
+
+	for (;;) {
+		int	opt;
+
+		opt = getopt_long(argc, argv, "b:q:s:D:T:e:p:u:n:t:dh", opts_long, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'b':
+			if (n_busids == LOADGEN_MAX_CONNS) {
+				err("too many busids: max %d", LOADGEN_MAX_CONNS);
+				return EXIT_FAILURE;
+			}
+			strcpy_s(busids[n_busids++], USBIP_BUS_ID_SIZE, optarg);
+			break;
+		case 'q':
+			if (!parse_uint(optarg, &opts.depth, 1, 1024))
+				return EXIT_FAILURE;
+			break;
+		case 's':
+			if (!parse_uint(optarg, &opts.len_xfer, 1, 16 * 1024 * 1024))
+				return EXIT_FAILURE;
+			break;
+		case 'D':
+			if (strcmp(optarg, "in") == 0)
+				opts.dir = LOADGEN_IN;
+			else if (strcmp(optarg, "out") == 0)
+				opts.dir = LOADGEN_OUT;
+			else if (strcmp(optarg, "loop") == 0)
+				opts.dir = LOADGEN_LOOP;
+			else {
+				err("invalid direction: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			if (strcmp(optarg, "bulk") == 0)
+				opts.type = LOADGEN_BULK;
+			else if (strcmp(optarg, "int") == 0)
+				opts.type = LOADGEN_INTR;
+			else if (strcmp(optarg, "iso") == 0)
+				opts.type = LOADGEN_ISO;
+			else {
+				err("invalid endpoint type: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e':
+			if (!parse_uint(optarg, &opts.ep, 1, 15))
+				return EXIT_FAILURE;
+			break;
+		case 'p':
+			if (!parse_uint(optarg, &opts.n_pkts, 1, MAX_ISO_PKTS))
+				return EXIT_FAILURE;
+			break;
+		case 'u':
+			if (sscanf_s(optarg, "%lf", &unlink_pct) != 1 || unlink_pct < 0 || unlink_pct > 100) {
+				err("invalid unlink percent: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			opts.unlink_rate = (unsigned)(unlink_pct * 10);
+			break;
+		case 'n':
+			if (!parse_uint(optarg, &opts.secs, 1, 86400))
+				return EXIT_FAILURE;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+			loadgen_help();
+			return EXIT_SUCCESS;
+		default:
+			loadgen_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 1) {
+		loadgen_help();
+		return EXIT_FAILURE;
+	}
+	opts.host = argv[optind];
+	if (opts.type != LOADGEN_ISO)
+		opts.n_pkts = 0;
+	else if (opts.len_xfer < opts.n_pkts) {
+		err("too small transfer for %u packets", opts.n_pkts);
+		return EXIT_FAILURE;
+	}
+
+	init_socket();
+
+	if (n_busids == 0) {
+		n_busids = loadgen_get_busids(opts.host, busids, LOADGEN_MAX_CONNS);
+		if (n_busids <= 0) {
+			if (n_busids == 0)
+				err("no exportable devices found on %s", opts.host);
+			cleanup_socket();
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = run(&opts, busids, n_busids);
+
+	cleanup_socket();
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "usbip_common.h"
+#include "usbip_proto.h"
+
+#define LOADGEN_MAX_CONNS	64
+
+typedef enum {
+	LOADGEN_IN,
+	LOADGEN_OUT,
+	/* OUT and IN in turn, which suits a loopback device */
+	LOADGEN_LOOP,
+} loadgen_dir_t;
+
+typedef enum {
+	LOADGEN_BULK,
+	LOADGEN_INTR,
+	LOADGEN_ISO,
+} loadgen_type_t;
+
+/* workload shared by all connections */
+typedef struct {
+	const char	*host;
+	unsigned	depth;
+	unsigned	len_xfer;
+	loadgen_dir_t	dir;
+	loadgen_type_t	type;
+	unsigned	ep;
+	unsigned	n_pkts;
+	/* per mille of URBs which are unlinked right after submission */
+	unsigned	unlink_rate;
+	unsigned	secs;
+} loadgen_opts_t;
+
+typedef struct {
+	char	busid[USBIP_BUS_ID_SIZE];
+	const loadgen_opts_t	*opts;
+	SOCKET	sockfd;
+	unsigned	devid;
+	HANDLE	hthread;
+	LONGLONG	ts_start, ts_end;
+	unsigned	n_urbs, n_errors, n_unlinked;
+	unsigned long long	n_bytes;
+	/* completion latencies in performance counter ticks */
+	LONGLONG	*lats;
+	unsigned	n_lats, max_lats;
+	BOOL	failed;
+} loadgen_conn_t;
+
+extern int loadgen_get_busids(const char *host, char busids[][USBIP_BUS_ID_SIZE], int max_busids);
+extern BOOL loadgen_start(loadgen_conn_t *conn);
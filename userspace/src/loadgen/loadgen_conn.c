@@ -0,0 +1,496 @@
+#include "loadgen.h"
+
+#include <stdlib.h>
+
+#include "usbip_network.h"
+#include "dbgcode.h"
+
+#define URB_ISO_ASAP	0x0002
+#define URB_DIR_IN	0x0200
+
+/* a slot is busy until both RET_SUBMIT and RET_UNLINK have arrived */
+typedef struct {
+	UINT32	seqnum;
+	UINT32	seqnum_unlink;
+	BOOL	is_in;
+	BOOL	completed;
+	LONGLONG	ts;
+} slot_t;
+
+typedef struct {
+	loadgen_conn_t	*conn;
+	const loadgen_opts_t	*opts;
+	slot_t	*slots;
+	unsigned	n_busy;
+	UINT32	seqnum;
+	BOOL	next_in;
+	UINT32	rand;
+	char	*sendbuf, *recvbuf;
+} worker_t;
+
+static LONGLONG
+get_ts(void)
+{
+	LARGE_INTEGER	cnt;
+
+	QueryPerformanceCounter(&cnt);
+	return cnt.QuadPart;
+}
+
+int
+loadgen_get_busids(const char *host, char busids[][USBIP_BUS_ID_SIZE], int max_busids)
+{
+	struct op_devlist_reply	reply;
+	SOCKET	sockfd;
+	uint16_t	code = OP_REP_DEVLIST;
+	int	status, n_busids = 0;
+	unsigned	i;
+
+	sockfd = usbip_net_tcp_connect(host, usbip_port_string);
+	if (sockfd == INVALID_SOCKET) {
+		err("failed to connect a remote host: %s", host);
+		return -1;
+	}
+	if (usbip_net_send_op_common(sockfd, OP_REQ_DEVLIST, 0) < 0 ||
+		usbip_net_recv_op_common(sockfd, &code, &status) < 0 ||
+		usbip_net_recv(sockfd, &reply, sizeof(reply)) < 0) {
+		err("failed to get device list from %s", host);
+		closesocket(sockfd);
+		return -1;
+	}
+	PACK_OP_DEVLIST_REPLY(0, &reply);
+
+	for (i = 0; i < reply.ndev; i++) {
+		struct usbip_usb_device	udev;
+		struct usbip_usb_interface	uinf;
+		int	j;
+
+		if (usbip_net_recv(sockfd, &udev, sizeof(udev)) < 0) {
+			closesocket(sockfd);
+			return -1;
+		}
+		usbip_net_pack_usb_device(0, &udev);
+		for (j = 0; j < udev.bNumInterfaces; j++) {
+			if (usbip_net_recv(sockfd, &uinf, sizeof(uinf)) < 0) {
+				closesocket(sockfd);
+				return -1;
+			}
+		}
+		if (n_busids < max_busids) {
+			strcpy_s(busids[n_busids], USBIP_BUS_ID_SIZE, udev.busid);
+			n_busids++;
+		}
+	}
+	closesocket(sockfd);
+	return n_busids;
+}
+
+static int
+import_dev(loadgen_conn_t *conn)
+{
+	struct op_import_request	req;
+	struct op_import_reply	reply;
+	uint16_t	code = OP_REP_IMPORT;
+	int	status;
+	int	rc;
+
+	conn->sockfd = usbip_net_tcp_connect(conn->opts->host, usbip_port_string);
+	if (conn->sockfd == INVALID_SOCKET) {
+		err("failed to connect a remote host: %s", conn->opts->host);
+		return ERR_NETWORK;
+	}
+
+	memset(&req, 0, sizeof(req));
+	strcpy_s(req.busid, USBIP_BUS_ID_SIZE, conn->busid);
+	PACK_OP_IMPORT_REQUEST(0, &req);
+	if (usbip_net_send_op_common(conn->sockfd, OP_REQ_IMPORT, 0) < 0 ||
+		usbip_net_send(conn->sockfd, &req, sizeof(req)) < 0)
+		return ERR_NETWORK;
+
+	rc = usbip_net_recv_op_common(conn->sockfd, &code, &status);
+	if (rc < 0) {
+		dbg("failed to recv common header: %s", dbg_errcode(rc));
+		return rc;
+	}
+	if (usbip_net_recv(conn->sockfd, &reply, sizeof(reply)) < 0)
+		return ERR_NETWORK;
+	PACK_OP_IMPORT_REPLY(0, &reply);
+
+	conn->devid = (reply.udev.busnum << 16) | reply.udev.devnum;
+	return 0;
+}
+
+static BOOL
+send_pdu(worker_t *w, struct usbip_header *hdr, UINT32 len_data, struct usbip_iso_packet_descriptor *isos, int n_pkts)
+{
+	UINT32	len = sizeof(*hdr) + len_data;
+
+	memcpy(w->sendbuf, hdr, sizeof(*hdr));
+	usbip_net_pack_usbip_header(1, (struct usbip_header *)w->sendbuf);
+	/* OUT data stays as it is filled at startup */
+	if (n_pkts > 0) {
+		memcpy(w->sendbuf + len, isos, n_pkts * sizeof(*isos));
+		usbip_net_pack_iso_descs(1, (struct usbip_iso_packet_descriptor *)(w->sendbuf + len), n_pkts);
+		len += n_pkts * sizeof(*isos);
+	}
+	return usbip_net_send(w->conn->sockfd, w->sendbuf, len) >= 0;
+}
+
+static void
+build_submit(worker_t *w, struct usbip_header *hdr, UINT32 ep, BOOL is_in, UINT32 len)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->base.command = USBIP_CMD_SUBMIT;
+	hdr->base.seqnum = ++w->seqnum;
+	hdr->base.devid = w->conn->devid;
+	hdr->base.direction = is_in ? USBIP_DIR_IN : USBIP_DIR_OUT;
+	hdr->base.ep = ep;
+	hdr->u.cmd_submit.transfer_flags = is_in ? URB_DIR_IN : 0;
+	hdr->u.cmd_submit.transfer_buffer_length = len;
+}
+
+/* configuration is done before workers start and needs no slot */
+static int
+control_out(worker_t *w, UCHAR req, USHORT value, USHORT index)
+{
+	struct usbip_header	hdr;
+
+	build_submit(w, &hdr, 0, FALSE, 0);
+	hdr.u.cmd_submit.setup[0] = req == 0x0b ? 0x01 : 0x00;
+	hdr.u.cmd_submit.setup[1] = req;
+	hdr.u.cmd_submit.setup[2] = value & 0xff;
+	hdr.u.cmd_submit.setup[3] = value >> 8;
+	hdr.u.cmd_submit.setup[4] = index & 0xff;
+	hdr.u.cmd_submit.setup[5] = index >> 8;
+	if (!send_pdu(w, &hdr, 0, NULL, 0))
+		return ERR_NETWORK;
+	if (usbip_net_recv(w->conn->sockfd, &hdr, sizeof(hdr)) < 0)
+		return ERR_NETWORK;
+	usbip_net_pack_usbip_header(0, &hdr);
+	if (hdr.base.command != USBIP_RET_SUBMIT || hdr.base.seqnum != w->seqnum)
+		return ERR_GENERAL;
+	return hdr.u.ret_submit.status;
+}
+
+static BOOL
+submit_urb(worker_t *w, slot_t *slot)
+{
+	const loadgen_opts_t	*opts = w->opts;
+	struct usbip_header	hdr;
+	struct usbip_iso_packet_descriptor	isos[1024];
+	BOOL	is_in;
+	int	n_pkts = 0;
+
+	switch (opts->dir) {
+	case LOADGEN_IN:
+		is_in = TRUE;
+		break;
+	case LOADGEN_OUT:
+		is_in = FALSE;
+		break;
+	default:
+		is_in = w->next_in;
+		w->next_in = !w->next_in;
+		break;
+	}
+
+	build_submit(w, &hdr, opts->ep, is_in, opts->len_xfer);
+	switch (opts->type) {
+	case LOADGEN_ISO: {
+		UINT32	len_pkt = opts->len_xfer / opts->n_pkts;
+		int	i;
+
+		n_pkts = opts->n_pkts;
+		for (i = 0; i < n_pkts; i++) {
+			isos[i].offset = i * len_pkt;
+			isos[i].length = len_pkt;
+			isos[i].actual_length = 0;
+			isos[i].status = 0;
+		}
+		hdr.u.cmd_submit.transfer_flags |= URB_ISO_ASAP;
+		hdr.u.cmd_submit.number_of_packets = n_pkts;
+		hdr.u.cmd_submit.interval = 1;
+		break;
+	}
+	case LOADGEN_INTR:
+		hdr.u.cmd_submit.interval = 1;
+		break;
+	default:
+		break;
+	}
+
+	slot->seqnum = hdr.base.seqnum;
+	slot->seqnum_unlink = 0;
+	slot->is_in = is_in;
+	slot->completed = FALSE;
+	slot->ts = get_ts();
+	w->n_busy++;
+
+	return send_pdu(w, &hdr, is_in ? 0 : opts->len_xfer, isos, n_pkts);
+}
+
+static BOOL
+unlink_urb(worker_t *w, slot_t *slot)
+{
+	struct usbip_header	hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_CMD_UNLINK;
+	hdr.base.seqnum = ++w->seqnum;
+	hdr.base.devid = w->conn->devid;
+	hdr.u.cmd_unlink.seqnum = slot->seqnum;
+	slot->seqnum_unlink = hdr.base.seqnum;
+
+	return send_pdu(w, &hdr, 0, NULL, 0);
+}
+
+static BOOL
+need_unlink(worker_t *w)
+{
+	if (w->opts->unlink_rate == 0)
+		return FALSE;
+	w->rand = w->rand * 1103515245 + 12345;
+	return (w->rand >> 16) % 1000 < w->opts->unlink_rate;
+}
+
+static slot_t *
+find_slot(worker_t *w, UINT32 seqnum, BOOL unlink)
+{
+	unsigned	i;
+
+	for (i = 0; i < w->opts->depth; i++) {
+		slot_t	*slot = &w->slots[i];
+
+		if (slot->seqnum != 0 && (unlink ? slot->seqnum_unlink : slot->seqnum) == seqnum)
+			return slot;
+	}
+	return NULL;
+}
+
+static void
+free_slot(worker_t *w, slot_t *slot)
+{
+	slot->seqnum = 0;
+	w->n_busy--;
+}
+
+static BOOL
+add_lat(loadgen_conn_t *conn, LONGLONG lat)
+{
+	if (conn->n_lats == conn->max_lats) {
+		unsigned	max_lats = conn->max_lats ? conn->max_lats * 2 : 65536;
+		LONGLONG	*lats;
+
+		lats = (LONGLONG *)realloc(conn->lats, sizeof(LONGLONG) * max_lats);
+		if (lats == NULL) {
+			dbg("out of memory");
+			return FALSE;
+		}
+		conn->lats = lats;
+		conn->max_lats = max_lats;
+	}
+	conn->lats[conn->n_lats++] = lat;
+	return TRUE;
+}
+
+static BOOL
+recv_ret(worker_t *w)
+{
+	loadgen_conn_t	*conn = w->conn;
+	struct usbip_header	hdr;
+	slot_t	*slot;
+	UINT32	len;
+
+	if (usbip_net_recv(conn->sockfd, &hdr, sizeof(hdr)) < 0) {
+		err("%s: connection closed", conn->busid);
+		return FALSE;
+	}
+	usbip_net_pack_usbip_header(0, &hdr);
+
+	if (hdr.base.command == USBIP_RET_UNLINK) {
+		slot = find_slot(w, hdr.base.seqnum, TRUE);
+		if (slot == NULL) {
+			err("%s: unknown unlink seqnum: %u", conn->busid, hdr.base.seqnum);
+			return FALSE;
+		}
+		/* RET_SUBMIT always precedes RET_UNLINK if a URB was not unlinked */
+		if (!slot->completed)
+			conn->n_unlinked++;
+		free_slot(w, slot);
+		return TRUE;
+	}
+	if (hdr.base.command != USBIP_RET_SUBMIT) {
+		err("%s: invalid command: %x", conn->busid, hdr.base.command);
+		return FALSE;
+	}
+
+	slot = find_slot(w, hdr.base.seqnum, FALSE);
+	if (slot == NULL || slot->completed) {
+		err("%s: unknown seqnum: %u", conn->busid, hdr.base.seqnum);
+		return FALSE;
+	}
+	if (hdr.u.ret_submit.actual_length < 0 || (UINT32)hdr.u.ret_submit.actual_length > w->opts->len_xfer ||
+		hdr.u.ret_submit.number_of_packets < 0 || (UINT32)hdr.u.ret_submit.number_of_packets > w->opts->n_pkts) {
+		err("%s: invalid RET_SUBMIT: seq: %u", conn->busid, hdr.base.seqnum);
+		return FALSE;
+	}
+	len = slot->is_in ? hdr.u.ret_submit.actual_length : 0;
+	len += hdr.u.ret_submit.number_of_packets * sizeof(struct usbip_iso_packet_descriptor);
+	if (usbip_net_recv(conn->sockfd, w->recvbuf, len) < 0) {
+		err("%s: connection closed", conn->busid);
+		return FALSE;
+	}
+
+	if (!add_lat(conn, get_ts() - slot->ts))
+		return FALSE;
+	conn->n_urbs++;
+	conn->n_bytes += hdr.u.ret_submit.actual_length;
+	/* an ISO URB succeeds with packet errors */
+	if (hdr.u.ret_submit.status != 0 || hdr.u.ret_submit.error_count != 0)
+		conn->n_errors++;
+
+	slot->completed = TRUE;
+	if (slot->seqnum_unlink == 0)
+		free_slot(w, slot);
+	return TRUE;
+}
+
+static BOOL
+wait_ret(worker_t *w, LONGLONG ticks)
+{
+	LARGE_INTEGER	freq;
+	struct timeval	tv;
+	fd_set	fds;
+
+	if (ticks < 0)
+		ticks = 0;
+	QueryPerformanceFrequency(&freq);
+	tv.tv_sec = (long)(ticks / freq.QuadPart);
+	tv.tv_usec = (long)((ticks % freq.QuadPart) * 1000000 / freq.QuadPart);
+
+	FD_ZERO(&fds);
+	FD_SET(w->conn->sockfd, &fds);
+	return select((int)w->conn->sockfd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+static BOOL
+run_workload(worker_t *w)
+{
+	loadgen_conn_t	*conn = w->conn;
+	LARGE_INTEGER	freq;
+	LONGLONG	ts_due;
+	BOOL	stopped = FALSE;
+	unsigned	i;
+
+	QueryPerformanceFrequency(&freq);
+	conn->ts_start = get_ts();
+	ts_due = conn->ts_start + freq.QuadPart * w->opts->secs;
+
+	for (;;) {
+		if (!stopped) {
+			for (i = 0; i < w->opts->depth; i++) {
+				slot_t	*slot = &w->slots[i];
+
+				if (slot->seqnum != 0)
+					continue;
+				/* completions are taken first not to block a server which is sending */
+				while (wait_ret(w, 0)) {
+					if (!recv_ret(w))
+						return FALSE;
+				}
+				if (slot->seqnum != 0)
+					continue;
+				if (!submit_urb(w, slot))
+					return FALSE;
+				if (need_unlink(w) && !unlink_urb(w, slot))
+					return FALSE;
+			}
+		}
+		if (!stopped && get_ts() >= ts_due) {
+			/* pending URBs are unlinked not to wait for them forever */
+			stopped = TRUE;
+			conn->ts_end = get_ts();
+			for (i = 0; i < w->opts->depth; i++) {
+				slot_t	*slot = &w->slots[i];
+
+				if (slot->seqnum != 0 && !slot->completed && slot->seqnum_unlink == 0) {
+					if (!unlink_urb(w, slot))
+						return FALSE;
+				}
+			}
+		}
+		if (stopped && w->n_busy == 0)
+			break;
+		if (!stopped && !wait_ret(w, ts_due - get_ts()))
+			continue;
+		if (!recv_ret(w))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static DWORD WINAPI
+worker(LPVOID ctx)
+{
+	loadgen_conn_t	*conn = (loadgen_conn_t *)ctx;
+	const loadgen_opts_t	*opts = conn->opts;
+	worker_t	w;
+	unsigned	i;
+
+	memset(&w, 0, sizeof(w));
+	w.conn = conn;
+	w.opts = opts;
+	w.rand = conn->devid;
+	w.slots = (slot_t *)calloc(opts->depth, sizeof(slot_t));
+	w.sendbuf = (char *)malloc(sizeof(struct usbip_header) + opts->len_xfer + opts->n_pkts * sizeof(struct usbip_iso_packet_descriptor));
+	w.recvbuf = (char *)malloc(opts->len_xfer + opts->n_pkts * sizeof(struct usbip_iso_packet_descriptor) + 1);
+	if (w.slots == NULL || w.sendbuf == NULL || w.recvbuf == NULL) {
+		dbg("out of memory");
+		conn->failed = TRUE;
+	}
+	else {
+		for (i = 0; i < opts->len_xfer; i++)
+			w.sendbuf[sizeof(struct usbip_header) + i] = (char)(i % 63);
+
+		if (control_out(&w, 0x09, 1, 0) != 0) {
+			err("%s: failed to set configuration", conn->busid);
+			conn->failed = TRUE;
+		}
+		/* ISO bandwidth of emulated devices is allocated in altsetting 1 */
+		else if (opts->type == LOADGEN_ISO && control_out(&w, 0x0b, 1, 0) != 0) {
+			err("%s: failed to set interface", conn->busid);
+			conn->failed = TRUE;
+		}
+		else if (!run_workload(&w)) {
+			conn->failed = TRUE;
+		}
+	}
+
+	closesocket(conn->sockfd);
+	free(w.slots);
+	free(w.sendbuf);
+	free(w.recvbuf);
+	return 0;
+}
+
+BOOL
+loadgen_start(loadgen_conn_t *conn)
+{
+	int	rc;
+
+	rc = import_dev(conn);
+	if (rc < 0) {
+		err("%s: failed to import: %s", conn->busid, dbg_errcode(rc));
+		if (conn->sockfd != INVALID_SOCKET)
+			closesocket(conn->sockfd);
+		return FALSE;
+	}
+
+	conn->hthread = CreateThread(NULL, 0, worker, conn, 0, NULL);
+	if (conn->hthread == NULL) {
+		dbg("failed to create a thread: error: %lx", GetLastError());
+		closesocket(conn->sockfd);
+		return FALSE;
+	}
+	return TRUE;
+}
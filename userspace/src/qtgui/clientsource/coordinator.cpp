@@ -5,6 +5,9 @@
 #include <QMapIterator>
 #include <QJsonObject>
 #include <QNetworkDatagram>
+#include <QRunnable>
+#include <QTimer>
+#include <mutex>
 
 extern "C" {
     #include "names.h"
@@ -12,11 +15,175 @@ extern "C" {
     #include "../kcommon.h"
 }
 
+namespace {
+
+class UsbipTask : public QRunnable
+{
+public:
+    explicit UsbipTask(std::function<void()> fn) : fn(std::move(fn)) {}
+    void run() override { fn(); }
+private:
+    std::function<void()> fn;
+};
+
+// names are looked up from workers and the event loop, so the database is loaded once by whichever comes first
+std::once_flag namesOnce;
+bool namesLoaded {false};
+
+void loadNames()
+{
+    std::call_once(namesOnce, []() { namesLoaded = (usbip_names_init() == 0); });
+}
+
+QVariantMap listImported()
+{
+    QVariantList devices;
+    loadNames();
+    usbip_devices* linked_device = usbip_list_imported();
+    usbip_devices* current_device = nullptr;
+    while(linked_device != nullptr) {
+        devices.push_back(QVariantMap({
+            {"port", linked_device->port},
+            {"product_name", linked_device->product_name}
+        }));
+        current_device = linked_device;
+        linked_device = linked_device->next;
+        usbip_devices_free(current_device);
+    }
+    return QVariantMap({{"devices", devices}});
+}
+
+QVariantMap listRemote(const QString &host)
+{
+    QVariantList devices;
+    auto hostStr(host.toStdString());
+    loadNames();
+    usbip_external_list* linked_device = usbip_list_remote((char*)hostStr.c_str());
+    usbip_external_list* current_device = nullptr;
+    while(linked_device != nullptr) {
+        QVariantList interfaces;
+        for(int i = 0; i < linked_device->num_interfaces; i++) {
+            interfaces.push_back(linked_device->interfaces[i]);
+        }
+        devices.push_back(QVariantMap({
+            {"product_name", linked_device->product_name},
+            {"busid", linked_device->busid},
+            {"path", linked_device->path},
+            {"interfaces", interfaces}
+        }));
+        current_device = linked_device;
+        linked_device = linked_device->next;
+        usbip_external_list_free(current_device);
+    }
+    return QVariantMap({
+        {"devices", devices},
+        {"host", host}
+    });
+}
+
+}
+
 Coordinator::Coordinator(WebBridge *bridge, QObject *parent) : QObject(parent), bridge(bridge)
 {
+    loadNames();
+    pool.setMaxThreadCount(settings.value("workers/max", 4).toInt());
     connect(bridge, &WebBridge::toApp, this, &Coordinator::processWeb);
 }
 
+Coordinator::~Coordinator()
+{
+    // running usbipc_* calls cannot be interrupted
+    pool.clear();
+    pool.waitForDone();
+    if (namesLoaded) {
+        usbip_names_free();
+    }
+}
+
+// blocking usbipc_* calls run on the pool, and results come back to the event loop by finish()
+quint64 Coordinator::dispatch(const QVariantMap &input, const QString &host, std::function<QVariantMap()> work)
+{
+    auto process(input["process"].toString());
+
+    // a newer listing of the same host supersedes a pending one
+    if (process.compare("attach") != 0 && process.compare("detach") != 0) {
+        for (auto it = tasks.begin(); it != tasks.end(); ) {
+            if (it->process == process && it->host == host) {
+                it->cancelled->storeRelease(1);
+                it = tasks.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    auto id = nextId++;
+    auto cancelled = QSharedPointer<QAtomicInt>::create(0);
+    tasks.insert(id, Task{process, host, cancelled});
+
+    pool.start(new UsbipTask([this, id, cancelled, work]() {
+        if (cancelled->loadAcquire()) {
+            return;
+        }
+        auto result(work());
+        QMetaObject::invokeMethod(this, [this, id, result]() { finish(id, result); }, Qt::QueuedConnection);
+    }));
+
+    bool ok;
+    auto timeout(input["timeout"].toInt(&ok));
+    if (!ok || timeout <= 0) {
+        timeout = settings.value("workers/timeoutMs", 30000).toInt();
+    }
+    QTimer::singleShot(timeout, this, [this, id]() { drop(id, "timeout"); });
+
+    return id;
+}
+
+void Coordinator::finish(quint64 id, QVariantMap result)
+{
+    auto it = tasks.find(id);
+    if (it == tasks.end()) {
+        // cancelled or timed out
+        return;
+    }
+    tasks.erase(it);
+    result.insert("id", id);
+    bridge->toWeb(result);
+}
+
+void Coordinator::drop(quint64 id, const char* reason)
+{
+    auto it = tasks.find(id);
+    if (it == tasks.end()) {
+        return;
+    }
+    it->cancelled->storeRelease(1);
+    bridge->toWeb({
+        {"process", it->process},
+        {"host", it->host},
+        {"id", id},
+        {"error", reason}
+    });
+    tasks.erase(it);
+}
+
+// by id, by host, or all pending requests
+void Coordinator::cancel(const QVariantMap &input)
+{
+    bool ok;
+    auto id(input["id"].toULongLong(&ok));
+    if (ok) {
+        drop(id, "cancelled");
+        return;
+    }
+    auto host(input["host"].toString());
+    for (auto key: tasks.keys()) {
+        if (host.isEmpty() || tasks[key].host == host) {
+            drop(key, "cancelled");
+        }
+    }
+}
+
 // I decided to go with void because I attempted callback
 //  through channel and it was always null in js world.
 void Coordinator::processWeb(const QVariantMap &input)
@@ -27,62 +194,50 @@ void Coordinator::processWeb(const QVariantMap &input)
         bool ok;
         auto port(input["port"].toInt(&ok));
         if (ok) {
-            usbipc_detach(port);
+            dispatch(input, "", [port]() {
+                return QVariantMap({
+                    {"process", "detach"},
+                    {"port", port},
+                    {"result", usbipc_detach(port)}
+                });
+            });
         }
         return;
     }
 
     if (0 == process.compare("attach")) {
-        auto host(input["host"].toString().toStdString());
-        auto busid(input["busid"].toString().toStdString());
+        auto host(input["host"].toString());
+        auto busid(input["busid"].toString());
 
-        if (host.compare("") > 0 && busid.compare("") > 0) {
-            usbipc_attach((char*)host.c_str(), (char*)busid.c_str());
+        if (!host.isEmpty() && !busid.isEmpty()) {
+            dispatch(input, host, [host, busid]() {
+                auto hostStr(host.toStdString());
+                auto busidStr(busid.toStdString());
+                return QVariantMap({
+                    {"process", "attach"},
+                    {"host", host},
+                    {"busid", busid},
+                    {"result", usbipc_attach((char*)hostStr.c_str(), (char*)busidStr.c_str())}
+                });
+            });
         }
         return;
     }
 
     if (0 == process.compare("port")) {
-        QVariantList devices;
-        usbip_devices* linked_device = usbip_list_imported();
-        usbip_devices* current_device = nullptr;
-        while(linked_device != nullptr) {
-            devices.push_back(QVariantMap({
-                {"port", linked_device->port},
-                {"product_name", linked_device->product_name}
-            }));
-            current_device = linked_device;
-            linked_device = linked_device->next;
-            usbip_devices_free(current_device);
-        }
-        bridge->toWeb(QVariantMap({{"devices", devices}}));
+        dispatch(input, "", listImported);
         return;
     }
 
     if (0 == process.compare("list")) {
-        QVariantList devices;
-        auto host(input["host"].toString().toStdString());
-        usbip_external_list* linked_device = usbip_list_remote((char*)host.c_str());
-        usbip_external_list* current_device = nullptr;
-        while(linked_device != nullptr) {
-            QVariantList interfaces;
-            for(int i = 0; i < linked_device->num_interfaces; i++) {
-                interfaces.push_back(linked_device->interfaces[i]);
-            }
-            devices.push_back(QVariantMap({
-                {"product_name", linked_device->product_name},
-                {"busid", linked_device->busid},
-                {"path", linked_device->path},
-                {"interfaces", interfaces}
-            }));
-            current_device = linked_device;
-            linked_device = linked_device->next;
-            usbip_external_list_free(current_device);
-        }
-        bridge->toWeb(QVariantMap({
-            {"devices", devices},
-            {"host", input["host"]}
-        }));
+        auto host(input["host"].toString());
+        dispatch(input, host, [host]() { return listRemote(host); });
+        return;
+    }
+
+    if (0 == process.compare("cancel")) {
+        cancel(input);
+        return;
     }
     if (0 == process.compare("settings")) {
         auto save = input["save"].toBool();
@@ -127,10 +282,10 @@ void Coordinator::sendHost(const QNetworkDatagram datagram)
 
 void Coordinator::sendDgram(const QNetworkDatagram datagram) {
 
-  usbip_names_init();
   auto dataDevices = QJsonDocument::fromJson(datagram.data());
   QJsonArray arr;
   if(dataDevices.isArray()) {
+    loadNames();
     for (auto device : dataDevices.array()) {
         QJsonObject obj(device.toObject());
         auto prodInt(obj["product"].toString().toUInt(nullptr,16));
@@ -158,8 +313,6 @@ void Coordinator::sendDgram(const QNetworkDatagram datagram) {
     {"data", dataDevices},
     {"host", datagram.senderAddress().toString()}
   });
-
-  usbip_names_free();
 }
 
 
@@ -172,6 +325,7 @@ GroupNotifier *Coordinator::getNotifier()
       notifier = new GroupNotifier(groupIPV4Addr, hostPort);
       connect(notifier, &GroupNotifier::hostFound, this, &Coordinator::sendHost);
       connect(notifier, &GroupNotifier::dgramArrived, this, &Coordinator::sendDgram);
+      connect(notifier, &GroupNotifier::inventoryChanged, notifier, &GroupNotifier::listAdmin);
    }
 
   return notifier;
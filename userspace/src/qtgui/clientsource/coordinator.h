@@ -5,6 +5,11 @@
 #include <QObject>
 #include <QSettings>
 #include <QNetworkDatagram>
+#include <QThreadPool>
+#include <QHash>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <functional>
 #include "webbridge.h"
 #include "groupnotifier.h"
 
@@ -13,15 +18,29 @@ class Coordinator : public QObject
     Q_OBJECT
 public:
     explicit Coordinator(WebBridge* bridge, QObject *parent = nullptr);
+    ~Coordinator();
 public slots:
     void processWeb(const QMap<QString, QVariant> &input);
     void sendHost(const QNetworkDatagram datagram);
     void sendDgram(const QNetworkDatagram datagram);
 
 private:
+    // a request running on the pool, whose result is dropped once it is gone from tasks
+    struct Task {
+        QString process;
+        QString host;
+        QSharedPointer<QAtomicInt> cancelled;
+    };
+
     GroupNotifier* getNotifier();
+    quint64 dispatch(const QVariantMap &input, const QString &host, std::function<QVariantMap()> work);
+    void finish(quint64 id, QVariantMap result);
+    void drop(quint64 id, const char* reason);
+    void cancel(const QVariantMap &input);
     WebBridge* bridge;
-    bool nameInit {false};
+    QThreadPool pool;
+    QHash<quint64, Task> tasks;
+    quint64 nextId {1};
     QSettings settings {"AdvancedDynamicsDesign", "qusbip"};
     GroupNotifier* notifier {nullptr};
 };
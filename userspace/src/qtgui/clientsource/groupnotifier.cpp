@@ -3,6 +3,7 @@
 
 #include <QHostAddress>
 #include <QJsonObject>
+#include <QJsonArray>
 #include <QJsonDocument>
 #include <QNetworkInterface>
 #include <Windows.h>
@@ -37,11 +38,19 @@ void GroupNotifier::listAdmin(QString hostAddr) {
   if (hostResolved.error() != QHostInfo::NoError) {
     return;
   }
-  listener.writeDatagram(QJsonDocument(
-     QJsonObject({
-       {"message", LIST_OUT }
-     })
-  ).toJson(), hostResolved.addresses().first(), hostPort);
+  auto addr(hostResolved.addresses().first());
+  auto host(addr.toString());
+  listedHosts.insert(host);
+  pendingLists.insert(host);
+  QJsonObject req({
+    {"message", LIST_OUT }
+  });
+  // usbipd answers with a bare "usbip-host" if a cached list is current
+  auto it = inventories.constFind(host);
+  if (it != inventories.constEnd()) {
+    req.insert("inventory", it->hash);
+  }
+  listener.writeDatagram(QJsonDocument(req).toJson(), addr, hostPort);
 }
 
 void GroupNotifier::bind(QString hostAddr, QString bus)
@@ -69,9 +78,99 @@ void GroupNotifier::dataRecieved()
       continue;
     } else if (datac.contains(IM_A_HOST)) {
       emit hostFound(dgram);
+      checkInventory(dgram);
     }
     else {
+      storeList(dgram);
       emit dgramArrived(dgram);
     }
   }
 }
+
+// FNV-1a over bus ids with their nul and little-endian vendor and product ids, as usbipd hashes them
+QString GroupNotifier::hashInventory(const QMap<QByteArray, QJsonObject>& devices)
+{
+  quint32 hash = 2166136261u;
+  auto hashBytes = [&hash](const char* data, int len) {
+    for (int i = 0; i < len; i++) {
+      hash ^= (quint8)data[i];
+      hash *= 16777619u;
+    }
+  };
+  for (auto it = devices.constBegin(); it != devices.constEnd(); ++it) {
+    hashBytes(it.key().constData(), it.key().size() + 1);
+    for (auto id : {it->value("vendor").toString().toUShort(nullptr, 16), it->value("product").toString().toUShort(nullptr, 16)}) {
+      const char bytes[] = {(char)(id & 0xff), (char)(id >> 8)};
+      hashBytes(bytes, 2);
+    }
+  }
+  return QString("%1").arg(hash, 8, 16, QChar('0'));
+}
+
+// a list which usbipd replies is kept to be updated by announced changes
+void GroupNotifier::storeList(const QNetworkDatagram& dgram)
+{
+  auto doc(QJsonDocument::fromJson(dgram.data()));
+  if (!doc.isArray()) {
+    return;
+  }
+  auto host(dgram.senderAddress().toString());
+  Inventory inventory;
+  for (auto device : doc.array()) {
+    auto obj(device.toObject());
+    inventory.devices.insert(obj["busid"].toString().toLatin1(), obj);
+  }
+  inventory.hash = hashInventory(inventory.devices);
+  inventories.insert(host, inventory);
+  pendingLists.remove(host);
+}
+
+void GroupNotifier::sendList(const QString& host, const Inventory& inventory)
+{
+  QJsonArray arr;
+  for (auto& obj : inventory.devices) {
+    arr.append(obj);
+  }
+  QNetworkDatagram dgram(QJsonDocument(arr).toJson(QJsonDocument::Compact));
+  dgram.setSender(QHostAddress(host), hostPort);
+  emit dgramArrived(dgram);
+}
+
+// usbipd sends a hash of exportable devices, and devices added and bus ids removed when they change
+void GroupNotifier::checkInventory(const QNetworkDatagram& dgram)
+{
+  auto msg(QJsonDocument::fromJson(dgram.data()).object());
+  auto hash(msg["inventory"].toString());
+  if (hash.isEmpty()) {
+    return;
+  }
+  auto host(dgram.senderAddress().toString());
+  auto it = inventories.find(host);
+  if (!listedHosts.contains(host) || it == inventories.end()) {
+    return;
+  }
+
+  if (msg.contains("added")) {
+    Inventory inventory(*it);
+    for (auto busid : msg["removed"].toArray()) {
+      inventory.devices.remove(busid.toString().toLatin1());
+    }
+    for (auto device : msg["added"].toArray()) {
+      auto obj(device.toObject());
+      inventory.devices.insert(obj["busid"].toString().toLatin1(), obj);
+    }
+    inventory.hash = hashInventory(inventory.devices);
+    // a missed announcement leaves a list which a change does not apply to
+    if (inventory.hash == hash) {
+      *it = inventory;
+      sendList(host, inventory);
+      return;
+    }
+  } else if (it->hash == hash) {
+    if (pendingLists.remove(host)) {
+      sendList(host, *it);
+    }
+    return;
+  }
+  emit inventoryChanged(host);
+}
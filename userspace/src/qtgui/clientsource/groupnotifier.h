@@ -5,6 +5,10 @@
 #include <QUdpSocket>
 #include <QObject>
 #include <QNetworkDatagram>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QJsonObject>
 
 class GroupNotifier: public QObject
 {
@@ -17,13 +21,29 @@ public:
 signals:
   void hostFound(QNetworkDatagram datagram);
   void dgramArrived(QNetworkDatagram datagram);
+  // a listed host has an inventory which cannot be told from a cached list
+  void inventoryChanged(QString hostAddr);
 public slots:
   void dataRecieved();
 private:
+  // devices of a host by bus id, sorted as usbipd does, and their hash
+  struct Inventory {
+    QMap<QByteArray, QJsonObject> devices;
+    QString hash;
+  };
+  static QString hashInventory(const QMap<QByteArray, QJsonObject>& devices);
+  void storeList(const QNetworkDatagram& dgram);
+  void sendList(const QString& host, const Inventory& inventory);
+  void checkInventory(const QNetworkDatagram& dgram);
   void writeDatagramOnAllNics(const QByteArray& datagram, const QHostAddress& host, quint16 port);
   QUdpSocket listener;
   QHostAddress groupAddress;
   quint16 hostPort;
+  // last list of each host
+  QHash<QString, Inventory> inventories;
+  QSet<QString> listedHosts;
+  // hosts asked to list, which may answer that a cached list is current
+  QSet<QString> pendingLists;
 };
 
 #endif // GROUPNOTIFIER_H
@@ -28,7 +28,6 @@ import_device(SOCKET sockfd, pvhci_pluginfo_t pluginfo, HANDLE* phdev)
 {
 	HANDLE	hdev;
 	int	port;
-	int	rc;
 
 	hdev = usbip_vhci_driver_open();
 	if (hdev == INVALID_HANDLE_VALUE) {
@@ -36,23 +35,14 @@ import_device(SOCKET sockfd, pvhci_pluginfo_t pluginfo, HANDLE* phdev)
 		return ERR_DRIVER;
 	}
 
-	port = usbip_vhci_get_free_port(hdev);
+	port = usbip_vhci_attach_device(hdev, pluginfo);
 	if (port < 0) {
-		dbg("no free port");
+		dbg("failed to attach device: %d", port);
 		usbip_vhci_driver_close(hdev);
-		return ERR_PORTFULL;
+		return port == ERR_PORTFULL ? ERR_PORTFULL: ERR_GENERAL;
 	}
 
-	dbg("got free port: %d", port);
-
-	pluginfo->port = port;
-
-	rc = usbip_vhci_attach_device(hdev, pluginfo);
-	if (rc < 0) {
-		dbg("failed to attach device: %d", rc);
-		usbip_vhci_driver_close(hdev);
-		return ERR_GENERAL;
-	}
+	dbg("attached to port: %d", port);
 
 	*phdev = hdev;
 	return port;
@@ -65,7 +55,7 @@ build_pluginfo(SOCKET sockfd, unsigned devid)
 	unsigned long	pluginfo_size;
 	unsigned short	conf_dscr_len;
 
-	if (fetch_conf_descriptor(sockfd, devid, NULL, &conf_dscr_len) < 0) {
+	if (fetch_conf_descriptor(sockfd, devid, 0, NULL, &conf_dscr_len) < 0) {
 		dbg("failed to get configuration descriptor size");
 		return NULL;
 	}
@@ -76,12 +66,12 @@ build_pluginfo(SOCKET sockfd, unsigned devid)
 		dbg("out of memory or invalid vhci pluginfo size");
 		return NULL;
 	}
-	if (fetch_device_descriptor(sockfd, devid, (char*)pluginfo->dscr_dev) < 0) {
+	if (fetch_device_descriptor(sockfd, devid, 0, (char*)pluginfo->dscr_dev) < 0) {
 		dbg("failed to fetch device descriptor");
 		free(pluginfo);
 		return NULL;
 	}
-	if (fetch_conf_descriptor(sockfd, devid, (char*)pluginfo->dscr_conf, &conf_dscr_len) < 0) {
+	if (fetch_conf_descriptor(sockfd, devid, 0, (char*)pluginfo->dscr_conf, &conf_dscr_len) < 0) {
 		dbg("failed to fetch configuration descriptor");
 		free(pluginfo);
 		return NULL;
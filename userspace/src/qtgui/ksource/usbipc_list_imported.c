@@ -49,16 +49,9 @@ struct usbip_devices* usbip_list_imported(void)
         return NULL;
     }
 
-    if (usbip_names_init()) {
-        dbg("failed to open usb id database");
-    }
-
-
-    for (i = 0; i < 127; i++) {
-        if (idevs[i].port < 0) {
-            break;
-        }
-
+    /* names database is kept loaded by the caller, as for usbip_list_remote() */
+    /* entries end with port -1 */
+    for (i = 0; idevs[i].port >= 0; i++) {
         if (idevs[i].status == VDEV_ST_NULL || idevs[i].status == VDEV_ST_NOTASSIGNED) {
             continue;
         }
@@ -86,7 +79,6 @@ struct usbip_devices* usbip_list_imported(void)
     free(idevs);
 
     usbip_vhci_driver_close(hdev);
-    usbip_names_free();
 
     return first;
 };
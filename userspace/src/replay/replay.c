@@ -0,0 +1,740 @@
+/*
+ * replay: replay a USB/IP trace through the forwarder
+ *
+ * Forwarder endpoints are replaced by named pipes. CMD's of a trace are
+ * written into a source endpoint and RET's into a destination endpoint.
+ * What comes out of the other endpoint is checked byte by byte against the
+ * trace. A PDU is not sent until the PDUs preceding it in the trace have
+ * arrived, which keeps the ordering of the original traffic.
+ */
+
+#include <stdlib.h>
+
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "usbip_compact.h"
+#include "usbip_lz.h"
+#include "usbip_forward.h"
+#include "replay.h"
+
+#define PIPE_BUFSIZE		(64 * 1024)
+#define READ_BUFSIZE		(256 * 1024)
+#define DEFAULT_ROUNDS		5
+#define DEFAULT_XFERS		1000
+/* a round fails if no PDU arrives for STALL_TIMEOUT ms */
+#define STALL_TIMEOUT		10000
+
+static const char replay_help_string[] =
+	"usage: replay [options] <trace.pcap>\n"
+	"\n"
+	"	-g, --generate <msc|hid|uvc|cdc>\n"
+	"		Write a synthetic trace into <trace.pcap> instead of replaying:\n"
+	"		mass-storage bulk, HID interrupt, UVC isochronous or CDC-ACM.\n"
+	"\n"
+	"	-c, --count <n>\n"
+	"		Number of transfers of a synthetic trace. Default is 1000.\n"
+	"\n"
+	"	-n, --rounds <n>\n"
+	"		Replay a trace n times. Default is 5.\n"
+	"\n"
+	"	-o, --outbound\n"
+	"		Replay through the client side forwarder(vhci to socket).\n"
+	"		Default is the server side forwarder(socket to stub).\n"
+	"\n"
+	"	-C, --compact\n"
+	"		Socket side of the forwarder uses compact usbip headers.\n"
+	"\n"
+	"	-Z, --compress\n"
+	"		Socket side of the forwarder also compresses bulk payloads.\n"
+	"		Implies -C.\n"
+	"\n"
+	"	-tPORT, --tcp-port PORT\n"
+	"		USB/IP server port in a trace. Default is 3240.\n"
+	"\n"
+	"	-S, --swap-bench\n"
+	"		Benchmark byte order conversion of headers and ISO descriptors.\n"
+	"		<trace.pcap> is not needed.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+/* index 0: CMD's, 1: RET's */
+typedef struct {
+	replay_trace_t	*trace;
+	BOOL	inbound, compact, zip;
+	HANDLE	hsrc, hdst;
+	/* PDUs of each direction which have arrived */
+	volatile LONG	n_recvd[2];
+	/* signaled when a PDU arrives for a writer of the opposite direction */
+	HANDLE	hevts[2];
+	volatile BOOL	aborted;
+	/* mismatch found by a reader */
+	volatile BOOL	failed;
+	LONGLONG	*ts_sent, *ts_recvd;
+} round_t;
+
+typedef struct {
+	round_t	*round;
+	int	side;
+} worker_t;
+
+typedef struct {
+	HANDLE	hsrc, hdst;
+	BOOL	inbound;
+	UINT32	features, devid;
+} fwd_ctx_t;
+
+static void
+replay_help(void)
+{
+	printf("%s\n", replay_help_string);
+}
+
+static LONGLONG
+get_ts(void)
+{
+	LARGE_INTEGER	now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static double
+ts_to_us(LONGLONG ts)
+{
+	LARGE_INTEGER	freq;
+
+	QueryPerformanceFrequency(&freq);
+	return (double)ts * 1000000.0 / (double)freq.QuadPart;
+}
+
+static BOOL
+create_pipe(HANDLE *phfwd, HANDLE *phend)
+{
+	static LONG	n_pipes;
+	char	name[64];
+
+	sprintf_s(name, sizeof(name), "\\\\.\\pipe\\usbip-replay-%lu-%ld", GetCurrentProcessId(), InterlockedIncrement(&n_pipes));
+
+	*phfwd = CreateNamedPipe(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, PIPE_BUFSIZE, PIPE_BUFSIZE, 0, NULL);
+	if (*phfwd == INVALID_HANDLE_VALUE) {
+		dbg("failed to create pipe: 0x%lx", GetLastError());
+		return FALSE;
+	}
+	*phend = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (*phend == INVALID_HANDLE_VALUE) {
+		dbg("failed to open pipe: 0x%lx", GetLastError());
+		CloseHandle(*phfwd);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* CMD's enter at the source endpoint, RET's at the destination */
+static HANDLE
+get_write_handle(round_t *round, BOOL is_req)
+{
+	return is_req ? round->hsrc : round->hdst;
+}
+
+/* server side forwarder has a socket at the source, client side at the destination */
+static const char *
+get_data(round_t *round, const replay_pdu_t *pdu, BOOL at_src, DWORD *plen)
+{
+	if (at_src != round->inbound) {
+		*plen = pdu->len;
+		return pdu->data_host;
+	}
+	if (round->compact) {
+		*plen = pdu->len_compact;
+		return pdu->data_compact;
+	}
+	*plen = pdu->len;
+	return pdu->data;
+}
+
+static BOOL
+write_all(HANDLE hdev, OVERLAPPED *ov, const char *buf, DWORD len)
+{
+	DWORD	nwrite;
+
+	while (len > 0) {
+		if (!WriteFile(hdev, buf, len, NULL, ov) && GetLastError() != ERROR_IO_PENDING)
+			return FALSE;
+		if (!GetOverlappedResult(hdev, ov, &nwrite, TRUE))
+			return FALSE;
+		buf += nwrite;
+		len -= nwrite;
+	}
+	return TRUE;
+}
+
+static DWORD WINAPI
+writer(LPVOID ctx)
+{
+	worker_t	*worker = (worker_t *)ctx;
+	round_t	*round = worker->round;
+	replay_trace_t	*trace = round->trace;
+	BOOL	is_req = worker->side == 0;
+	HANDLE	hdev = get_write_handle(round, is_req);
+	OVERLAPPED	ov;
+	unsigned	i;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ov.hEvent == NULL)
+		return 1;
+
+	for (i = 0; i < trace->n_pdus && !round->aborted; i++) {
+		replay_pdu_t	*pdu = &trace->pdus[i];
+		const char	*data;
+		DWORD	len;
+
+		if (pdu->is_req != is_req)
+			continue;
+		while ((unsigned)round->n_recvd[!worker->side] < pdu->n_prevs && !round->aborted)
+			WaitForSingleObject(round->hevts[worker->side], INFINITE);
+		if (round->aborted)
+			break;
+
+		data = get_data(round, pdu, is_req, &len);
+		round->ts_sent[i] = get_ts();
+		if (!write_all(hdev, &ov, data, len)) {
+			dbg("failed to write %s: 0x%lx", is_req ? "CMD" : "RET", GetLastError());
+			break;
+		}
+	}
+	CloseHandle(ov.hEvent);
+	return 0;
+}
+
+static BOOL
+read_some(HANDLE hdev, OVERLAPPED *ov, char *buf, DWORD *pnread)
+{
+	if (!ReadFile(hdev, buf, READ_BUFSIZE, NULL, ov) && GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+	return GetOverlappedResult(hdev, ov, pnread, TRUE) && *pnread > 0;
+}
+
+static void
+pdu_arrived(round_t *round, int side, unsigned i)
+{
+	round->ts_recvd[i] = get_ts();
+	InterlockedIncrement(&round->n_recvd[side]);
+	SetEvent(round->hevts[!side]);
+}
+
+/*
+ * Which payloads the forwarder compresses depends on its timing. A compressed
+ * PDU is decoded and checked against a host byte order PDU of a trace.
+ * Returns the length of a PDU at buf, 0 if more bytes are needed, or -1 on a mismatch.
+ */
+static long
+check_zipped(round_t *round, unsigned i, const char *buf, unsigned long len, char *unzipped)
+{
+	const replay_pdu_t	*pdu = &round->trace->pdus[i];
+	const char	*expected = pdu->data_host + sizeof(struct usbip_header);
+	const char	*data;
+	struct usbip_header	hdr;
+	unsigned long	len_hdr, len_zip, len_iso, len_wire;
+
+	if (len < USBIP_COMPACT_HDR_MIN)
+		return 0;
+	len_hdr = (UCHAR)buf[0];
+	if (len < len_hdr)
+		return 0;
+	if (usbip_compact_unpack(round->trace->devid, buf, len_hdr, &hdr, &len_zip) < 0) {
+		err("%s PDU #%u has a malformed compact header", pdu->is_req ? "CMD" : "RET", i);
+		return -1;
+	}
+	len_iso = pdu->n_isos * sizeof(struct usbip_iso_packet_descriptor);
+	len_wire = len_hdr + (len_zip > 0 ? len_zip : pdu->len_xfer) + len_iso;
+	if (len < len_wire)
+		return 0;
+
+	if (memcmp(&hdr, pdu->data_host, sizeof(hdr)) != 0) {
+		err("%s PDU #%u mismatches in a header", pdu->is_req ? "CMD" : "RET", i);
+		return -1;
+	}
+	data = buf + len_hdr;
+	if (len_zip > 0) {
+		if (usbip_lz_decompress(data, len_zip, unzipped, pdu->len_xfer) != (int)pdu->len_xfer) {
+			err("%s PDU #%u has a malformed compressed payload", pdu->is_req ? "CMD" : "RET", i);
+			return -1;
+		}
+		data = unzipped;
+	}
+	if (memcmp(data, expected, pdu->len_xfer) != 0 || memcmp(buf + len_wire - len_iso, expected + pdu->len_xfer, len_iso) != 0) {
+		err("%s PDU #%u mismatches in a payload", pdu->is_req ? "CMD" : "RET", i);
+		return -1;
+	}
+	return (long)len_wire;
+}
+
+/* reads PDUs with compressed payloads, which are decoded a PDU at a time */
+static void
+read_zipped(worker_t *worker, HANDLE hdev, OVERLAPPED *ov)
+{
+	round_t	*round = worker->round;
+	replay_trace_t	*trace = round->trace;
+	BOOL	is_req = worker->side == 0;
+	char	*buf, *unzipped;
+	unsigned long	len_max = 0, len = 0;
+	unsigned	i;
+
+	for (i = 0; i < trace->n_pdus; i++) {
+		if (trace->pdus[i].len > len_max)
+			len_max = trace->pdus[i].len;
+	}
+	len_max += USBIP_COMPACT_HDR_MAX;
+	buf = (char *)malloc(len_max + READ_BUFSIZE);
+	unzipped = (char *)malloc(len_max);
+	if (buf == NULL || unzipped == NULL) {
+		free(buf);
+		free(unzipped);
+		round->failed = TRUE;
+		return;
+	}
+
+	i = 0;
+	for (;;) {
+		DWORD	nread;
+		unsigned long	consumed = 0;
+
+		while (i < trace->n_pdus && trace->pdus[i].is_req != is_req)
+			i++;
+		if (i == trace->n_pdus || round->aborted)
+			break;
+		if (!read_some(hdev, ov, buf + len, &nread)) {
+			dbg("failed to read %s: 0x%lx", is_req ? "CMD" : "RET", GetLastError());
+			break;
+		}
+		len += nread;
+
+		while (consumed < len) {
+			long	len_pdu;
+
+			while (i < trace->n_pdus && trace->pdus[i].is_req != is_req)
+				i++;
+			if (i == trace->n_pdus) {
+				err("%lu bytes more than a trace", len - consumed);
+				round->failed = TRUE;
+				break;
+			}
+			len_pdu = check_zipped(round, i, buf + consumed, len - consumed, unzipped);
+			if (len_pdu < 0) {
+				round->failed = TRUE;
+				break;
+			}
+			if (len_pdu == 0)
+				break;
+			consumed += len_pdu;
+			pdu_arrived(round, worker->side, i);
+			i++;
+		}
+		if (round->failed)
+			break;
+		memmove(buf, buf + consumed, len - consumed);
+		len -= consumed;
+	}
+
+	free(buf);
+	free(unzipped);
+}
+
+/* reads PDUs of a direction, which come out of the opposite endpoint */
+static DWORD WINAPI
+reader(LPVOID ctx)
+{
+	worker_t	*worker = (worker_t *)ctx;
+	round_t	*round = worker->round;
+	replay_trace_t	*trace = round->trace;
+	BOOL	is_req = worker->side == 0;
+	HANDLE	hdev = get_write_handle(round, !is_req);
+	OVERLAPPED	ov;
+	char	*buf;
+	unsigned	i = 0;
+	unsigned long	off = 0;
+
+	buf = (char *)malloc(READ_BUFSIZE);
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (buf == NULL || ov.hEvent == NULL) {
+		free(buf);
+		round->failed = TRUE;
+		return 1;
+	}
+
+	/* socket side of the forwarder */
+	if (round->zip && is_req != round->inbound) {
+		read_zipped(worker, hdev, &ov);
+		free(buf);
+		CloseHandle(ov.hEvent);
+		return 0;
+	}
+
+	for (;;) {
+		DWORD	nread, consumed = 0;
+
+		while (i < trace->n_pdus && trace->pdus[i].is_req != is_req)
+			i++;
+		if (i == trace->n_pdus || round->aborted)
+			break;
+		if (!read_some(hdev, &ov, buf, &nread)) {
+			dbg("failed to read %s: 0x%lx", is_req ? "CMD" : "RET", GetLastError());
+			break;
+		}
+
+		while (consumed < nread) {
+			replay_pdu_t	*pdu;
+			const char	*expected;
+			DWORD	len, len_pdu;
+
+			while (i < trace->n_pdus && trace->pdus[i].is_req != is_req)
+				i++;
+			if (i == trace->n_pdus) {
+				err("%lu bytes more than a trace", nread - consumed);
+				round->failed = TRUE;
+				break;
+			}
+			pdu = &trace->pdus[i];
+			expected = get_data(round, pdu, !is_req, &len_pdu);
+			len = len_pdu - off;
+			if (len > nread - consumed)
+				len = nread - consumed;
+			if (memcmp(expected + off, buf + consumed, len) != 0) {
+				unsigned long	j;
+
+				for (j = 0; expected[off + j] == buf[consumed + j]; j++);
+				err("%s PDU #%u mismatches at byte %lu", is_req ? "CMD" : "RET", i, off + j);
+				round->failed = TRUE;
+				break;
+			}
+			consumed += len;
+			off += len;
+			if (off == len_pdu) {
+				pdu_arrived(round, worker->side, i);
+				off = 0;
+				i++;
+			}
+		}
+		if (round->failed)
+			break;
+	}
+
+	free(buf);
+	CloseHandle(ov.hEvent);
+	return 0;
+}
+
+static DWORD WINAPI
+forwarder(LPVOID ctx)
+{
+	fwd_ctx_t	*fwd = (fwd_ctx_t *)ctx;
+
+	usbip_forward(fwd->hsrc, fwd->hdst, fwd->inbound, fwd->features, fwd->devid, NULL, INVALID_HANDLE_VALUE, NULL);
+	return 0;
+}
+
+static void
+abort_round(round_t *round)
+{
+	round->aborted = TRUE;
+	SetEvent(round->hevts[0]);
+	SetEvent(round->hevts[1]);
+	CancelIoEx(round->hsrc, NULL);
+	CancelIoEx(round->hdst, NULL);
+}
+
+/* returns elapsed time in QueryPerformanceCounter ticks, -1 on failure */
+static LONGLONG
+run_round(replay_trace_t *trace, BOOL inbound, BOOL compact, BOOL zip, LONGLONG *ts_sent, LONGLONG *ts_recvd)
+{
+	round_t	round;
+	worker_t	workers[4];
+	HANDLE	hthreads[5];
+	fwd_ctx_t	fwd;
+	LONG	n_recvd_last = -1;
+	DWORD	ms_stalled = 0;
+	LONGLONG	ts_start, ts_end = 0;
+	BOOL	ok = TRUE;
+	int	i;
+
+	memset(&round, 0, sizeof(round));
+	round.trace = trace;
+	round.inbound = inbound;
+	round.compact = compact;
+	round.zip = zip;
+	round.ts_sent = ts_sent;
+	round.ts_recvd = ts_recvd;
+
+	round.hevts[0] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	round.hevts[1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (round.hevts[0] == NULL || round.hevts[1] == NULL) {
+		dbg("failed to create event");
+		if (round.hevts[0] != NULL)
+			CloseHandle(round.hevts[0]);
+		return -1;
+	}
+	if (!create_pipe(&fwd.hsrc, &round.hsrc)) {
+		CloseHandle(round.hevts[0]);
+		CloseHandle(round.hevts[1]);
+		return -1;
+	}
+	if (!create_pipe(&fwd.hdst, &round.hdst)) {
+		CloseHandle(fwd.hsrc);
+		CloseHandle(round.hsrc);
+		CloseHandle(round.hevts[0]);
+		CloseHandle(round.hevts[1]);
+		return -1;
+	}
+	fwd.inbound = inbound;
+	fwd.features = (compact ? USBIP_EXT_COMPACT : 0) | (zip ? USBIP_EXT_COMPRESS : 0);
+	fwd.devid = trace->devid;
+
+	ts_start = get_ts();
+	hthreads[0] = CreateThread(NULL, 0, forwarder, &fwd, 0, NULL);
+	for (i = 0; i < 4; i++) {
+		workers[i].round = &round;
+		workers[i].side = i % 2;
+		hthreads[i + 1] = CreateThread(NULL, 0, i < 2 ? writer : reader, &workers[i], 0, NULL);
+	}
+	for (i = 0; i < 5; i++) {
+		if (hthreads[i] == NULL) {
+			dbg("failed to create thread");
+			abort_round(&round);
+			ok = FALSE;
+			break;
+		}
+	}
+
+	/* wait for readers */
+	while (ok && WaitForMultipleObjects(2, &hthreads[3], TRUE, 100) == WAIT_TIMEOUT) {
+		LONG	n_recvd = round.n_recvd[0] + round.n_recvd[1];
+
+		if (round.failed) {
+			abort_round(&round);
+			ok = FALSE;
+		}
+		else if (n_recvd != n_recvd_last) {
+			n_recvd_last = n_recvd;
+			ms_stalled = 0;
+		}
+		else if ((ms_stalled += 100) >= STALL_TIMEOUT) {
+			err("forwarding stalled: %ld of %u PDUs", n_recvd, trace->n_pdus);
+			abort_round(&round);
+			ok = FALSE;
+		}
+	}
+	if ((unsigned)(round.n_recvd[0] + round.n_recvd[1]) == trace->n_pdus && !round.failed)
+		ts_end = get_ts();
+	else
+		ok = FALSE;
+
+	/* closing endpoints makes the forwarder quit */
+	abort_round(&round);
+	for (i = 1; i < 5; i++) {
+		if (hthreads[i] != NULL)
+			WaitForSingleObject(hthreads[i], INFINITE);
+	}
+	CloseHandle(round.hsrc);
+	CloseHandle(round.hdst);
+	if (hthreads[0] != NULL)
+		WaitForSingleObject(hthreads[0], INFINITE);
+	CloseHandle(fwd.hsrc);
+	CloseHandle(fwd.hdst);
+
+	for (i = 0; i < 5; i++) {
+		if (hthreads[i] != NULL)
+			CloseHandle(hthreads[i]);
+	}
+	CloseHandle(round.hevts[0]);
+	CloseHandle(round.hevts[1]);
+
+	return ok ? ts_end - ts_start : -1;
+}
+
+static int
+compare_ts(const void *a, const void *b)
+{
+	LONGLONG	ta = *(const LONGLONG *)a, tb = *(const LONGLONG *)b;
+
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+static void
+print_stats(const char *label, replay_trace_t *trace, unsigned n_rounds, LONGLONG elapsed, LONGLONG *lats, unsigned n_lats)
+{
+	double	secs = ts_to_us(elapsed) / 1000000.0;
+
+	qsort(lats, n_lats, sizeof(LONGLONG), compare_ts);
+	printf("%6s %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+		(double)trace->n_pdus * n_rounds / secs,
+		(double)trace->n_bytes * n_rounds / secs / (1024 * 1024),
+		ts_to_us(lats[n_lats / 2]),
+		ts_to_us(lats[(unsigned)((n_lats - 1) * 0.99)]),
+		ts_to_us(lats[(unsigned)((n_lats - 1) * 0.999)]),
+		ts_to_us(lats[n_lats - 1]));
+}
+
+static int
+replay(replay_trace_t *trace, BOOL inbound, BOOL compact, BOOL zip, unsigned n_rounds)
+{
+	LONGLONG	*ts_sent, *ts_recvd, *lats, *lats_round, elapsed_all = 0;
+	unsigned	round, i;
+
+	ts_sent = (LONGLONG *)malloc(sizeof(LONGLONG) * trace->n_pdus);
+	ts_recvd = (LONGLONG *)malloc(sizeof(LONGLONG) * trace->n_pdus);
+	lats = (LONGLONG *)malloc(sizeof(LONGLONG) * trace->n_pdus * n_rounds);
+	if (ts_sent == NULL || ts_recvd == NULL || lats == NULL) {
+		err("out of memory");
+		free(ts_sent);
+		free(ts_recvd);
+		free(lats);
+		return -1;
+	}
+
+	printf("%u PDUs(%u CMD, %u RET), %.1f MB, %s forwarder\n", trace->n_pdus, trace->n_reqs, trace->n_pdus - trace->n_reqs,
+		(double)trace->n_bytes / (1024 * 1024), inbound ? "server side" : "client side");
+	if (compact)
+		printf("%s: %.1f MB on the wire(%.1f%%)\n", zip ? "compact headers, compressed" : "compact headers",
+			(double)trace->n_bytes_compact / (1024 * 1024), (double)trace->n_bytes_compact * 100 / trace->n_bytes);
+	printf("%6s %10s %9s %9s %9s %9s %9s\n", "round", "PDUs/s", "MB/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+
+	for (round = 0; round < n_rounds; round++) {
+		LONGLONG	elapsed;
+		char	label[16];
+
+		elapsed = run_round(trace, inbound, compact, zip, ts_sent, ts_recvd);
+		if (elapsed < 0) {
+			err("replay failed at round %u", round + 1);
+			free(ts_sent);
+			free(ts_recvd);
+			free(lats);
+			return -1;
+		}
+		lats_round = lats + trace->n_pdus * round;
+		for (i = 0; i < trace->n_pdus; i++)
+			lats_round[i] = ts_recvd[i] - ts_sent[i];
+		elapsed_all += elapsed;
+
+		sprintf_s(label, sizeof(label), "%u", round + 1);
+		print_stats(label, trace, 1, elapsed, lats_round, trace->n_pdus);
+	}
+	print_stats("all", trace, n_rounds, elapsed_all, lats, trace->n_pdus * n_rounds);
+
+	free(ts_sent);
+	free(ts_recvd);
+	free(lats);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "generate", required_argument, NULL, 'g' },
+		{ "count",    required_argument, NULL, 'c' },
+		{ "rounds",   required_argument, NULL, 'n' },
+		{ "outbound", no_argument,       NULL, 'o' },
+		{ "compact",  no_argument,       NULL, 'C' },
+		{ "compress", no_argument,       NULL, 'Z' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "swap-bench", no_argument,     NULL, 'S' },
+		{ "debug",    no_argument,       NULL, 'd' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL,       0,                 NULL,  0 }
+	};
+	replay_trace_t	trace;
+	const char	*kind = NULL;
+	unsigned	n_xfers = DEFAULT_XFERS, n_rounds = DEFAULT_ROUNDS;
+	BOOL	inbound = TRUE, compact = FALSE, zip = FALSE, swap_bench = FALSE;
+	int	ret;
+
+	usbip_progname = "replay";
+	usbip_use_stderr = 1;
+
+	for (;;) {
+		int	opt;
+
+		opt = getopt_long(argc, argv, "g:c:n:oCZt:Sdh", opts, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'g':
+			kind = optarg;
+			break;
+		case 'c':
+			if (sscanf_s(optarg, "%u", &n_xfers) != 1 || n_xfers == 0) {
+				err("invalid count: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			if (sscanf_s(optarg, "%u", &n_rounds) != 1 || n_rounds == 0) {
+				err("invalid rounds: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			inbound = FALSE;
+			break;
+		case 'C':
+			compact = TRUE;
+			break;
+		case 'Z':
+			compact = TRUE;
+			zip = TRUE;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'S':
+			swap_bench = TRUE;
+			break;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+			replay_help();
+			return EXIT_SUCCESS;
+		default:
+			replay_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (swap_bench)
+		return replay_swap_bench() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	if (argc - optind != 1) {
+		replay_help();
+		return EXIT_FAILURE;
+	}
+
+	if (kind != NULL) {
+		if (replay_gen_trace(&trace, kind, n_xfers) < 0)
+			return EXIT_FAILURE;
+		ret = replay_save_trace(&trace, argv[optind]);
+		if (ret == 0)
+			info("%s: %u PDUs", argv[optind], trace.n_pdus);
+	}
+	else {
+		if (replay_load_trace(&trace, argv[optind], usbip_port) < 0)
+			return EXIT_FAILURE;
+		if (compact && replay_compact_trace(&trace, zip) < 0)
+			ret = -1;
+		else
+			ret = replay(&trace, inbound, compact, zip, n_rounds);
+	}
+	replay_free_trace(&trace);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <windows.h>
+
+#include "usbip_common.h"
+
+/* a PDU of a trace */
+typedef struct {
+	BOOL	is_req;
+	unsigned long	len;
+	/* transfer buffer length which precedes ISO descriptors */
+	unsigned long	len_xfer;
+	unsigned	n_isos;
+	/* PDUs of the opposite direction which precede this one in a trace */
+	unsigned	n_prevs;
+	char	*data;		/* wire byte order */
+	char	*data_host;	/* host byte order */
+	/* wire data with a compact header, see usbip_compact.h. payload may be compressed */
+	char	*data_compact;
+	unsigned long	len_compact;
+} replay_pdu_t;
+
+typedef struct {
+	replay_pdu_t	*pdus;
+	unsigned	n_pdus, n_max;
+	unsigned	n_reqs;
+	unsigned long long	n_bytes, n_bytes_compact;
+	/* devid which compact headers take as the one of an imported device */
+	UINT32	devid;
+} replay_trace_t;
+
+extern int replay_load_trace(replay_trace_t *trace, const char *path, int port);
+extern int replay_gen_trace(replay_trace_t *trace, const char *kind, unsigned n_xfers);
+extern int replay_save_trace(replay_trace_t *trace, const char *path);
+extern int replay_compact_trace(replay_trace_t *trace, BOOL zip);
+extern void replay_free_trace(replay_trace_t *trace);
+
+extern int replay_swap_bench(void);
@@ -0,0 +1,204 @@
+/*
+ * byte order conversion benchmark
+ *
+ * ntohl rows convert field by field as the forwarder used to do. Other
+ * rows are kernels of usbip_swap.h.
+ */
+
+#include <stdlib.h>
+
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "usbip_swap.h"
+#include "replay.h"
+
+/* descriptors or headers converted for a row */
+#define BENCH_TOTAL	(16 * 1024 * 1024)
+#define BENCH_N_HDRS	1024
+
+typedef void (*swap_words_t)(UINT32 *words, size_t n);
+
+static double
+elapsed_secs(LONGLONG ts_start)
+{
+	LARGE_INTEGER	now, freq;
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (double)(now.QuadPart - ts_start) / (double)freq.QuadPart;
+}
+
+static LONGLONG
+get_ts(void)
+{
+	LARGE_INTEGER	now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static void
+swap_words_ntohl(UINT32 *words, size_t n)
+{
+	struct usbip_iso_packet_descriptor	*iso_desc = (struct usbip_iso_packet_descriptor *)words;
+	size_t	i;
+
+	for (i = 0; i < n / 4; i++, iso_desc++) {
+		iso_desc->offset = ntohl(iso_desc->offset);
+		iso_desc->status = ntohl(iso_desc->status);
+		iso_desc->length = ntohl(iso_desc->length);
+		iso_desc->actual_length = ntohl(iso_desc->actual_length);
+	}
+}
+
+static void
+swap_header_ntohl(struct usbip_header *hdr, UINT32 cmd)
+{
+	hdr->base.command = ntohl(hdr->base.command);
+	hdr->base.seqnum = ntohl(hdr->base.seqnum);
+	hdr->base.devid = ntohl(hdr->base.devid);
+	hdr->base.direction = ntohl(hdr->base.direction);
+	hdr->base.ep = ntohl(hdr->base.ep);
+	if (cmd == USBIP_CMD_SUBMIT) {
+		hdr->u.cmd_submit.transfer_flags = ntohl(hdr->u.cmd_submit.transfer_flags);
+		hdr->u.cmd_submit.transfer_buffer_length = ntohl(hdr->u.cmd_submit.transfer_buffer_length);
+		hdr->u.cmd_submit.start_frame = ntohl(hdr->u.cmd_submit.start_frame);
+		hdr->u.cmd_submit.number_of_packets = ntohl(hdr->u.cmd_submit.number_of_packets);
+		hdr->u.cmd_submit.interval = ntohl(hdr->u.cmd_submit.interval);
+	}
+	else {
+		hdr->u.ret_submit.status = ntohl(hdr->u.ret_submit.status);
+		hdr->u.ret_submit.actual_length = ntohl(hdr->u.ret_submit.actual_length);
+		hdr->u.ret_submit.start_frame = ntohl(hdr->u.ret_submit.start_frame);
+		hdr->u.ret_submit.number_of_packets = ntohl(hdr->u.ret_submit.number_of_packets);
+		hdr->u.ret_submit.error_count = ntohl(hdr->u.ret_submit.error_count);
+	}
+}
+
+static void
+swap_header_scalar(struct usbip_header *hdr, UINT32 cmd)
+{
+	UNREFERENCED_PARAMETER(cmd);
+
+	usbip_swap_words_scalar((UINT32 *)hdr, 10);
+}
+
+static double
+bench_descs(swap_words_t swap_words, UINT32 *words, unsigned n_descs)
+{
+	unsigned	n_loops = BENCH_TOTAL / n_descs, i;
+	LONGLONG	ts_start = get_ts();
+
+	for (i = 0; i < n_loops; i++)
+		swap_words(words, (size_t)n_descs * 4);
+	return (double)n_loops * n_descs / elapsed_secs(ts_start) / 1000000.0;
+}
+
+static double
+bench_hdrs(void (*swap_header)(struct usbip_header *, UINT32), struct usbip_header *hdrs)
+{
+	unsigned	n_loops = BENCH_TOTAL / BENCH_N_HDRS, i, j;
+	LONGLONG	ts_start = get_ts();
+
+	for (i = 0; i < n_loops; i++) {
+		for (j = 0; j < BENCH_N_HDRS; j++)
+			swap_header(hdrs + j, (j & 1) ? USBIP_RET_SUBMIT : USBIP_CMD_SUBMIT);
+	}
+	return (double)n_loops * BENCH_N_HDRS / elapsed_secs(ts_start) / 1000000.0;
+}
+
+static BOOL
+check_kernel(swap_words_t swap_words, const UINT32 *words, unsigned n_words)
+{
+	UINT32	*copy;
+	unsigned	i;
+	BOOL	ok = TRUE;
+
+	copy = (UINT32 *)malloc(sizeof(UINT32) * n_words);
+	if (copy == NULL)
+		return FALSE;
+	memcpy(copy, words, sizeof(UINT32) * n_words);
+	/* odd word count and misaligned start exercise the tails */
+	swap_words(copy + 1, n_words - 2);
+	for (i = 1; i < n_words - 1; i++) {
+		if (copy[i] != _byteswap_ulong(words[i]))
+			ok = FALSE;
+	}
+	if (copy[0] != words[0] || copy[n_words - 1] != words[n_words - 1])
+		ok = FALSE;
+	free(copy);
+	return ok;
+}
+
+int
+replay_swap_bench(void)
+{
+	static const unsigned	n_descs_list[] = { 8, 64, 1024 };
+	static const char	*level_names[] = { "scalar", "ssse3", "avx2" };
+	struct {
+		const char	*name;
+		swap_words_t	swap_words;
+	} kernels[4];
+	struct usbip_header	*hdrs;
+	UINT32	*words;
+	int	level = usbip_swap_level();
+	int	n_kernels = 0, i, j;
+
+	kernels[n_kernels].name = "ntohl";
+	kernels[n_kernels++].swap_words = swap_words_ntohl;
+	kernels[n_kernels].name = "scalar";
+	kernels[n_kernels++].swap_words = usbip_swap_words_scalar;
+#ifdef USBIP_SWAP_SIMD
+	if (level >= USBIP_SWAP_SSSE3) {
+		kernels[n_kernels].name = "ssse3";
+		kernels[n_kernels++].swap_words = usbip_swap_words_ssse3;
+	}
+	if (level >= USBIP_SWAP_AVX2) {
+		kernels[n_kernels].name = "avx2";
+		kernels[n_kernels++].swap_words = usbip_swap_words_avx2;
+	}
+#endif
+
+	words = (UINT32 *)malloc(sizeof(UINT32) * 4 * 1024 + sizeof(UINT32) * 2);
+	hdrs = (struct usbip_header *)malloc(sizeof(struct usbip_header) * BENCH_N_HDRS);
+	if (words == NULL || hdrs == NULL) {
+		err("out of memory");
+		free(words);
+		free(hdrs);
+		return -1;
+	}
+	for (i = 0; i < 4 * 1024 + 2; i++)
+		words[i] = (UINT32)i * 0x01030507;
+	memset(hdrs, 0x5a, sizeof(struct usbip_header) * BENCH_N_HDRS);
+
+	for (i = 1; i < n_kernels; i++) {
+		if (!check_kernel(kernels[i].swap_words, words, 4 * 64 + 3)) {
+			err("%s kernel converts wrongly", kernels[i].name);
+			free(words);
+			free(hdrs);
+			return -1;
+		}
+	}
+
+	printf("dispatch: %s\n", level_names[level]);
+	printf("%-8s", "descs");
+	for (i = 0; i < n_kernels; i++)
+		printf(" %12s", kernels[i].name);
+	printf("   (Mdescs/s)\n");
+	for (j = 0; j < (int)(sizeof(n_descs_list) / sizeof(n_descs_list[0])); j++) {
+		printf("%-8u", n_descs_list[j]);
+		for (i = 0; i < n_kernels; i++)
+			printf(" %12.1f", bench_descs(kernels[i].swap_words, words, n_descs_list[j]));
+		printf("\n");
+	}
+
+	printf("\n%-8s %12s %12s %12s   (Mhdrs/s)\n", "", "ntohl", "scalar", level_names[level]);
+	printf("%-8s %12.1f %12.1f %12.1f\n", "headers",
+		bench_hdrs(swap_header_ntohl, hdrs), bench_hdrs(swap_header_scalar, hdrs), bench_hdrs(usbip_swap_header, hdrs));
+
+	free(words);
+	free(hdrs);
+	return 0;
+}
@@ -0,0 +1,884 @@
+/*
+ * replay traces: loading from pcap files and synthetic generation
+ */
+
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_proto.h"
+#include "usbip_network.h"
+#include "usbip_compact.h"
+#include "usbip_zip.h"
+#include "usbip_pcap.h"
+#include "replay.h"
+
+#define MAX_CONNS	32
+#define DIR_CACHE_SIZE	4096
+
+/* sanity limits of a PDU read from a trace */
+#define MAX_XFER_LEN	(16 * 1024 * 1024)
+#define MAX_ISO_PKTS	1024
+
+#define GEN_DEVID	0x00010002
+
+typedef struct {
+	char	*buf;
+	unsigned long	len, max;
+	UINT32	seq_next;
+	BOOL	seq_valid;
+	BOOL	handshaked;
+} halfconn_t;
+
+typedef struct {
+	UINT32	seqnum;
+	UINT32	direction;
+} dir_cache_t;
+
+/* a TCP connection of a trace */
+typedef struct {
+	USHORT	port_client;
+	/* devlist or failed import */
+	BOOL	ignored;
+	/* 0: client to server, 1: server to client */
+	halfconn_t	halves[2];
+	dir_cache_t	dirs[DIR_CACHE_SIZE];
+	replay_trace_t	trace;
+} conn_t;
+
+static replay_pdu_t *
+add_pdu(replay_trace_t *trace, BOOL is_req, const char *data, unsigned long len)
+{
+	replay_pdu_t	*pdu;
+
+	if (trace->n_pdus == trace->n_max) {
+		unsigned	n_max = trace->n_max == 0 ? 1024 : trace->n_max * 2;
+		replay_pdu_t	*pdus;
+
+		pdus = (replay_pdu_t *)realloc(trace->pdus, sizeof(replay_pdu_t) * n_max);
+		if (pdus == NULL)
+			return NULL;
+		trace->pdus = pdus;
+		trace->n_max = n_max;
+	}
+
+	pdu = &trace->pdus[trace->n_pdus];
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->data = (char *)malloc(len);
+	if (pdu->data == NULL)
+		return NULL;
+	if (data != NULL)
+		memcpy(pdu->data, data, len);
+	else
+		memset(pdu->data, 0, len);
+	pdu->is_req = is_req;
+	pdu->len = len;
+	pdu->n_prevs = is_req ? trace->n_pdus - trace->n_reqs : trace->n_reqs;
+
+	trace->n_pdus++;
+	if (is_req)
+		trace->n_reqs++;
+	trace->n_bytes += len;
+	return pdu;
+}
+
+/*
+ * Convert a PDU between wire and host byte order, the same way as the
+ * forwarder does. Unlike the forwarder, fields are swapped as plain words
+ * so that replay does not share a bug with it.
+ */
+static void
+swap_pdu(const replay_pdu_t *pdu, char *buf, UINT32 cmd)
+{
+	UINT32	*words = (UINT32 *)buf;
+	unsigned	n_words, i;
+
+	/* basic header and command specific fields except setup */
+	if (cmd == USBIP_CMD_SUBMIT || cmd == USBIP_RET_SUBMIT)
+		n_words = 5 + 5;
+	else
+		n_words = 5 + 1;
+	for (i = 0; i < n_words; i++)
+		words[i] = ntohl(words[i]);
+
+	words = (UINT32 *)(buf + sizeof(struct usbip_header) + pdu->len_xfer);
+	for (i = 0; i < pdu->n_isos * 4; i++)
+		words[i] = ntohl(words[i]);
+}
+
+static int
+prepare_host(replay_trace_t *trace)
+{
+	unsigned	i;
+
+	for (i = 0; i < trace->n_pdus; i++) {
+		replay_pdu_t	*pdu = &trace->pdus[i];
+
+		pdu->data_host = (char *)malloc(pdu->len);
+		if (pdu->data_host == NULL)
+			return -1;
+		memcpy(pdu->data_host, pdu->data, pdu->len);
+		swap_pdu(pdu, pdu->data_host, ntohl(((struct usbip_header *)pdu->data)->base.command));
+	}
+	return 0;
+}
+
+typedef struct {
+	UINT32	seqnum;
+	UINT32	ep;
+} ep_cache_t;
+
+/*
+ * Compact headers are built from host byte order PDUs, whose payload follows.
+ * If zip, bulk payloads are compressed as a forwarder would do.
+ */
+int
+replay_compact_trace(replay_trace_t *trace, BOOL zip)
+{
+	char	buf[USBIP_COMPACT_HDR_MAX];
+	usbip_zip_t	zipper;
+	ep_cache_t	*eps;
+	unsigned	i;
+
+	/* RET_SUBMIT takes an ep of its CMD_SUBMIT */
+	eps = (ep_cache_t *)calloc(DIR_CACHE_SIZE, sizeof(ep_cache_t));
+	if (eps == NULL) {
+		err("out of memory");
+		return -1;
+	}
+	usbip_zip_init(&zipper);
+
+	for (i = 0; i < trace->n_pdus; i++) {
+		if (trace->pdus[i].is_req) {
+			trace->devid = ((struct usbip_header *)trace->pdus[i].data_host)->base.devid;
+			break;
+		}
+	}
+
+	trace->n_bytes_compact = 0;
+	for (i = 0; i < trace->n_pdus; i++) {
+		replay_pdu_t	*pdu = &trace->pdus[i];
+		struct usbip_header	*hdr = (struct usbip_header *)pdu->data_host;
+		ep_cache_t	*cached = &eps[hdr->base.seqnum % DIR_CACHE_SIZE];
+		const char	*data = pdu->data_host + sizeof(struct usbip_header);
+		unsigned long	len_data = pdu->len - sizeof(struct usbip_header), len_zip = 0;
+		UINT32	ep = hdr->base.ep;
+		int	len_hdr;
+
+		if (pdu->is_req) {
+			cached->seqnum = hdr->base.seqnum;
+			cached->ep = ep;
+		}
+		else if (cached->seqnum == hdr->base.seqnum) {
+			ep = cached->ep;
+		}
+		if (zip) {
+			usbip_zip_snoop(&zipper, hdr, ep, data, pdu->len_xfer);
+			if (pdu->len_xfer > 0 && pdu->n_isos == 0)
+				len_zip = usbip_zip_compress(&zipper, ep, hdr->base.direction, data, pdu->len_xfer);
+		}
+		len_hdr = usbip_compact_pack(trace->devid, hdr, len_zip, buf);
+		if (len_zip > 0) {
+			data = zipper.buf;
+			len_data = len_zip;
+		}
+
+		pdu->data_compact = (char *)malloc(len_hdr + len_data);
+		if (pdu->data_compact == NULL) {
+			err("out of memory");
+			free(eps);
+			usbip_zip_cleanup(&zipper);
+			return -1;
+		}
+		memcpy(pdu->data_compact, buf, len_hdr);
+		memcpy(pdu->data_compact + len_hdr, data, len_data);
+		pdu->len_compact = len_hdr + len_data;
+		trace->n_bytes_compact += pdu->len_compact;
+	}
+	free(eps);
+	usbip_zip_cleanup(&zipper);
+	return 0;
+}
+
+void
+replay_free_trace(replay_trace_t *trace)
+{
+	unsigned	i;
+
+	for (i = 0; i < trace->n_pdus; i++) {
+		free(trace->pdus[i].data);
+		free(trace->pdus[i].data_host);
+		free(trace->pdus[i].data_compact);
+	}
+	free(trace->pdus);
+	memset(trace, 0, sizeof(*trace));
+}
+
+static conn_t *
+get_conn(conn_t *conns, int *pn_conns, USHORT port_client)
+{
+	int	i;
+
+	for (i = 0; i < *pn_conns; i++) {
+		if (conns[i].port_client == port_client)
+			return &conns[i];
+	}
+	if (*pn_conns == MAX_CONNS)
+		return NULL;
+	conns[i].port_client = port_client;
+	(*pn_conns)++;
+	return &conns[i];
+}
+
+static int
+append_seg(halfconn_t *half, const usbip_pcap_seg_t *seg)
+{
+	const char	*data = seg->data;
+	unsigned long	len = seg->len;
+	INT32	diff;
+
+	if (len == 0)
+		return 0;
+	if (!half->seq_valid) {
+		half->seq_next = seg->seq;
+		half->seq_valid = TRUE;
+	}
+
+	diff = (INT32)(seg->seq - half->seq_next);
+	if (diff > 0) {
+		err("TCP segment is missing in a trace: seq %u", half->seq_next);
+		return -1;
+	}
+	/* retransmitted data */
+	if ((unsigned long)-diff >= len)
+		return 0;
+	data += -diff;
+	len -= -diff;
+
+	if (half->len + len > half->max) {
+		unsigned long	max = half->max == 0 ? 256 * 1024 : half->max;
+		char	*buf;
+
+		while (max < half->len + len)
+			max *= 2;
+		buf = (char *)realloc(half->buf, max);
+		if (buf == NULL) {
+			err("out of memory");
+			return -1;
+		}
+		half->buf = buf;
+		half->max = max;
+	}
+	memcpy(half->buf + half->len, data, len);
+	half->len += len;
+	half->seq_next += len;
+	return 0;
+}
+
+/* returns handshake length, 0 if more data is needed. conn is ignored if not for import */
+static unsigned long
+get_handshake_len(conn_t *conn, BOOL is_req, const char *buf, unsigned long len)
+{
+	const struct op_common	*op = (const struct op_common *)buf;
+
+	if (len < sizeof(struct op_common))
+		return 0;
+	if (is_req) {
+		if (ntohs(op->code) != OP_REQ_IMPORT) {
+			conn->ignored = TRUE;
+			return 0;
+		}
+		if (len < sizeof(struct op_common) + sizeof(struct op_import_request))
+			return 0;
+		return sizeof(struct op_common) + sizeof(struct op_import_request);
+	}
+	if (ntohs(op->code) != OP_REP_IMPORT || op->status != 0) {
+		conn->ignored = TRUE;
+		return 0;
+	}
+	if (len < sizeof(struct op_common) + sizeof(struct op_import_reply))
+		return 0;
+	return sizeof(struct op_common) + sizeof(struct op_import_reply);
+}
+
+/*
+ * RET_SUBMIT's from linux have no direction. The forwarder restores it from
+ * the CMD_SUBMIT. A trace does the same so that it is kept intact by forwarding.
+ */
+static UINT32
+fix_ret_direction(conn_t *conn, struct usbip_header *hdr)
+{
+	dir_cache_t	*cache = &conn->dirs[ntohl(hdr->base.seqnum) % DIR_CACHE_SIZE];
+
+	if (cache->seqnum == ntohl(hdr->base.seqnum))
+		hdr->base.direction = htonl(cache->direction);
+	return ntohl(hdr->base.direction);
+}
+
+/* returns PDU length, 0 if more data is needed, -1 for an invalid PDU */
+static long
+get_pdu_len(conn_t *conn, BOOL is_req, const char *buf, unsigned long len, unsigned long *plen_xfer, unsigned *pn_isos)
+{
+	struct usbip_header	hdr;
+	UINT32	cmd, dir;
+	INT32	len_xfer = 0, n_isos = 0;
+
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	cmd = ntohl(hdr.base.command);
+	switch (cmd) {
+	case USBIP_CMD_SUBMIT:
+		if (!is_req)
+			return -1;
+		dir = ntohl(hdr.base.direction);
+		conn->dirs[ntohl(hdr.base.seqnum) % DIR_CACHE_SIZE].seqnum = ntohl(hdr.base.seqnum);
+		conn->dirs[ntohl(hdr.base.seqnum) % DIR_CACHE_SIZE].direction = dir;
+		if (dir == USBIP_DIR_OUT)
+			len_xfer = (INT32)ntohl(hdr.u.cmd_submit.transfer_buffer_length);
+		n_isos = (INT32)ntohl(hdr.u.cmd_submit.number_of_packets);
+		break;
+	case USBIP_RET_SUBMIT:
+		if (is_req)
+			return -1;
+		dir = fix_ret_direction(conn, (struct usbip_header *)buf);
+		if (dir == USBIP_DIR_IN)
+			len_xfer = (INT32)ntohl(hdr.u.ret_submit.actual_length);
+		n_isos = (INT32)ntohl(hdr.u.ret_submit.number_of_packets);
+		break;
+	case USBIP_CMD_UNLINK:
+	case USBIP_RET_UNLINK:
+		if (is_req != (cmd == USBIP_CMD_UNLINK))
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	if (len_xfer < 0 || len_xfer > MAX_XFER_LEN || n_isos < 0 || n_isos > MAX_ISO_PKTS)
+		return -1;
+
+	*plen_xfer = len_xfer;
+	*pn_isos = n_isos;
+	if (len < sizeof(hdr) + len_xfer + n_isos * sizeof(struct usbip_iso_packet_descriptor))
+		return 0;
+	return (long)(sizeof(hdr) + len_xfer + n_isos * sizeof(struct usbip_iso_packet_descriptor));
+}
+
+static int
+parse_pdus(conn_t *conn, BOOL is_req)
+{
+	halfconn_t	*half = &conn->halves[is_req ? 0 : 1];
+	unsigned long	off = 0;
+
+	if (!half->handshaked) {
+		/* traces by PDU capture have no handshake. op_common starts with non-zero version */
+		if (half->len > 0 && half->buf[0] != 0) {
+			off = get_handshake_len(conn, is_req, half->buf, half->len);
+			if (off == 0)
+				return 0;
+		}
+		if (half->len > 0)
+			half->handshaked = TRUE;
+	}
+
+	while (!conn->ignored) {
+		replay_pdu_t	*pdu;
+		unsigned long	len_xfer;
+		unsigned	n_isos;
+		long	len;
+
+		len = get_pdu_len(conn, is_req, half->buf + off, half->len - off, &len_xfer, &n_isos);
+		if (len < 0) {
+			err("invalid %s PDU in a trace: connection from port %hu", is_req ? "request" : "reply", conn->port_client);
+			return -1;
+		}
+		if (len == 0)
+			break;
+		pdu = add_pdu(&conn->trace, is_req, half->buf + off, len);
+		if (pdu == NULL) {
+			err("out of memory");
+			return -1;
+		}
+		pdu->len_xfer = len_xfer;
+		pdu->n_isos = n_isos;
+		off += len;
+	}
+
+	memmove(half->buf, half->buf + off, half->len - off);
+	half->len -= off;
+	return 0;
+}
+
+static void
+free_conns(conn_t *conns, int n_conns)
+{
+	int	i;
+
+	for (i = 0; i < n_conns; i++) {
+		free(conns[i].halves[0].buf);
+		free(conns[i].halves[1].buf);
+		replay_free_trace(&conns[i].trace);
+	}
+	free(conns);
+}
+
+/* The connection with the most PDUs is loaded if a trace has many */
+int
+replay_load_trace(replay_trace_t *trace, const char *path, int port)
+{
+	usbip_pcap_reader_t	*rd;
+	usbip_pcap_seg_t	seg;
+	conn_t	*conns, *conn_best = NULL;
+	FILE	*fp;
+	int	n_conns = 0, i, res;
+
+	if (fopen_s(&fp, path, "rb") != 0) {
+		err("failed to open: %s", path);
+		return -1;
+	}
+	rd = (usbip_pcap_reader_t *)malloc(sizeof(usbip_pcap_reader_t));
+	conns = (conn_t *)calloc(MAX_CONNS, sizeof(conn_t));
+	if (rd == NULL || conns == NULL) {
+		err("out of memory");
+		free(rd);
+		free(conns);
+		fclose(fp);
+		return -1;
+	}
+	if (!usbip_pcap_open_reader(rd, fp)) {
+		err("not a supported pcap file: %s", path);
+		free(rd);
+		free(conns);
+		fclose(fp);
+		return -1;
+	}
+
+	while ((res = usbip_pcap_read_seg(rd, &seg)) > 0) {
+		conn_t	*conn;
+		BOOL	is_req;
+
+		if (seg.dport == port)
+			is_req = TRUE;
+		else if (seg.sport == port)
+			is_req = FALSE;
+		else
+			continue;
+
+		conn = get_conn(conns, &n_conns, is_req ? seg.sport : seg.dport);
+		if (conn == NULL || conn->ignored)
+			continue;
+		if (append_seg(&conn->halves[is_req ? 0 : 1], &seg) < 0 || parse_pdus(conn, is_req) < 0) {
+			res = -1;
+			break;
+		}
+	}
+	free(rd);
+	fclose(fp);
+
+	if (res < 0) {
+		free_conns(conns, n_conns);
+		return -1;
+	}
+
+	for (i = 0; i < n_conns; i++) {
+		conn_t	*conn = &conns[i];
+
+		if (conn->ignored)
+			continue;
+		if (conn_best == NULL || conn->trace.n_pdus > conn_best->trace.n_pdus)
+			conn_best = conn;
+	}
+	if (conn_best == NULL || conn_best->trace.n_pdus == 0) {
+		err("no USB/IP PDU on port %d: %s", port, path);
+		free_conns(conns, n_conns);
+		return -1;
+	}
+	if (conn_best->halves[0].len > 0 || conn_best->halves[1].len > 0)
+		info("incomplete PDU at the end of a trace is ignored");
+
+	*trace = conn_best->trace;
+	memset(&conn_best->trace, 0, sizeof(conn_best->trace));
+	free_conns(conns, n_conns);
+
+	if (prepare_host(trace) < 0) {
+		err("out of memory");
+		replay_free_trace(trace);
+		return -1;
+	}
+	return 0;
+}
+
+int
+replay_save_trace(replay_trace_t *trace, const char *path)
+{
+	usbip_pcap_stream_t	stream;
+	FILE	*fp;
+	unsigned	i;
+
+	if (fopen_s(&fp, path, "wb") != 0) {
+		err("failed to create: %s", path);
+		return -1;
+	}
+	usbip_pcap_write_header(fp);
+	usbip_pcap_init_stream(&stream, 0);
+	/* fixed timestamps keep generated traces identical */
+	for (i = 0; i < trace->n_pdus; i++)
+		usbip_pcap_write_pdu(fp, &stream, trace->pdus[i].is_req, i, trace->pdus[i].data, trace->pdus[i].len);
+	if (ferror(fp)) {
+		err("failed to write: %s", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Synthetic traces. PDUs are built in host byte order, and converted into
+ * wire byte order when generation is done.
+ */
+typedef struct {
+	replay_trace_t	*trace;
+	UINT32	seqnum;
+	UINT32	rand;
+	/* payloads are filled with disk sectors instead of random bytes */
+	BOOL	sectors;
+	UINT32	lba;
+	BOOL	failed;
+} gen_t;
+
+static void
+gen_fill(gen_t *gen, char *buf, unsigned long len)
+{
+	unsigned long	i;
+
+	for (i = 0; i < len; i++) {
+		/* xorshift32 */
+		gen->rand ^= gen->rand << 13;
+		gen->rand ^= gen->rand >> 17;
+		gen->rand ^= gen->rand << 5;
+		buf[i] = (char)gen->rand;
+	}
+}
+
+/* a filesystem-like mix: empty sectors, text and random(already compressed) data */
+static void
+gen_fill_sectors(gen_t *gen, char *buf, unsigned long len)
+{
+	char	line[64];
+	unsigned long	off;
+	int	n, i;
+
+	for (off = 0; off + 512 <= len; off += 512, gen->lba++) {
+		switch (gen->lba % 4) {
+		case 0:
+			memset(buf + off, 0, 512);
+			break;
+		case 1:
+			n = sprintf_s(line, sizeof(line), "LBA %08x: the quick brown fox jumps over the lazy dog\n", gen->lba);
+			for (i = 0; i < 512; i++)
+				buf[off + i] = line[i % n];
+			break;
+		default:
+			gen_fill(gen, buf + off, 512);
+			break;
+		}
+	}
+	gen_fill(gen, buf + off, len - off);
+}
+
+static replay_pdu_t *
+gen_pdu(gen_t *gen, BOOL is_req, unsigned long len_xfer, unsigned n_isos)
+{
+	replay_pdu_t	*pdu;
+
+	if (gen->failed)
+		return NULL;
+	pdu = add_pdu(gen->trace, is_req, NULL, sizeof(struct usbip_header) + len_xfer + n_isos * sizeof(struct usbip_iso_packet_descriptor));
+	if (pdu == NULL) {
+		gen->failed = TRUE;
+		return NULL;
+	}
+	pdu->len_xfer = len_xfer;
+	pdu->n_isos = n_isos;
+	if (gen->sectors)
+		gen_fill_sectors(gen, pdu->data + sizeof(struct usbip_header), len_xfer);
+	else
+		gen_fill(gen, pdu->data + sizeof(struct usbip_header), len_xfer);
+	return pdu;
+}
+
+static UINT32
+gen_cmd_submit(gen_t *gen, UINT32 dir, UINT32 ep, UINT32 len, unsigned n_isos, const char *setup)
+{
+	replay_pdu_t	*pdu;
+	struct usbip_header	*hdr;
+	struct usbip_iso_packet_descriptor	*isos;
+	unsigned	i;
+
+	pdu = gen_pdu(gen, TRUE, dir == USBIP_DIR_OUT ? len : 0, n_isos);
+	if (pdu == NULL)
+		return 0;
+
+	hdr = (struct usbip_header *)pdu->data;
+	hdr->base.command = USBIP_CMD_SUBMIT;
+	hdr->base.seqnum = ++gen->seqnum;
+	hdr->base.devid = GEN_DEVID;
+	hdr->base.direction = dir;
+	hdr->base.ep = ep;
+	hdr->u.cmd_submit.transfer_buffer_length = len;
+	hdr->u.cmd_submit.number_of_packets = n_isos;
+	hdr->u.cmd_submit.interval = n_isos > 0 ? 1 : (ep == 0 ? 0 : 8);
+	if (setup != NULL)
+		memcpy(hdr->u.cmd_submit.setup, setup, 8);
+
+	isos = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + pdu->len_xfer);
+	for (i = 0; i < n_isos; i++) {
+		isos[i].offset = i * (len / n_isos);
+		isos[i].length = len / n_isos;
+		isos[i].actual_length = 0;
+		isos[i].status = 0;
+	}
+	return hdr->base.seqnum;
+}
+
+/* ISO packets complete with len_iso bytes each */
+static void
+gen_ret_submit(gen_t *gen, UINT32 seqnum, UINT32 dir, UINT32 len, unsigned n_isos, UINT32 len_iso)
+{
+	replay_pdu_t	*pdu;
+	struct usbip_header	*hdr;
+	struct usbip_iso_packet_descriptor	*isos;
+	UINT32	actual_length = n_isos > 0 ? len_iso * n_isos : len;
+	unsigned	i;
+
+	pdu = gen_pdu(gen, FALSE, dir == USBIP_DIR_IN ? actual_length : 0, n_isos);
+	if (pdu == NULL)
+		return;
+
+	hdr = (struct usbip_header *)pdu->data;
+	hdr->base.command = USBIP_RET_SUBMIT;
+	hdr->base.seqnum = seqnum;
+	hdr->base.direction = dir;
+	hdr->u.ret_submit.actual_length = actual_length;
+	hdr->u.ret_submit.number_of_packets = n_isos;
+
+	isos = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + pdu->len_xfer);
+	for (i = 0; i < n_isos; i++) {
+		isos[i].offset = i * (len / n_isos);
+		isos[i].length = len / n_isos;
+		isos[i].actual_length = len_iso;
+		isos[i].status = 0;
+	}
+}
+
+static void
+gen_unlink(gen_t *gen, UINT32 seqnum_unlink)
+{
+	replay_pdu_t	*pdu;
+	struct usbip_header	*hdr;
+	UINT32	seqnum = ++gen->seqnum;
+
+	pdu = gen_pdu(gen, TRUE, 0, 0);
+	if (pdu == NULL)
+		return;
+	hdr = (struct usbip_header *)pdu->data;
+	hdr->base.command = USBIP_CMD_UNLINK;
+	hdr->base.seqnum = seqnum;
+	hdr->base.devid = GEN_DEVID;
+	hdr->u.cmd_unlink.seqnum = seqnum_unlink;
+
+	pdu = gen_pdu(gen, FALSE, 0, 0);
+	if (pdu == NULL)
+		return;
+	hdr = (struct usbip_header *)pdu->data;
+	hdr->base.command = USBIP_RET_UNLINK;
+	hdr->base.seqnum = seqnum;
+	hdr->u.ret_unlink.status = -104;	/* ECONNRESET */
+}
+
+static void
+gen_xfer(gen_t *gen, UINT32 dir, UINT32 ep, UINT32 len, UINT32 actual_length)
+{
+	UINT32	seqnum = gen_cmd_submit(gen, dir, ep, len, 0, NULL);
+
+	gen_ret_submit(gen, seqnum, dir, actual_length, 0, 0);
+}
+
+/* configuration descriptors of synthetic devices, whose endpoints are the ones of traces */
+static const UCHAR	dscr_conf_msc[] = {
+	9, 2, 32, 0, 1, 1, 0, 0x80, 50,
+	9, 4, 0, 0, 2, 0x08, 0x06, 0x50, 0,
+	7, 5, 0x81, 0x02, 0x00, 0x02, 0,
+	7, 5, 0x02, 0x02, 0x00, 0x02, 0
+};
+static const UCHAR	dscr_conf_hid[] = {
+	9, 2, 34, 0, 1, 1, 0, 0xa0, 50,
+	9, 4, 0, 0, 1, 0x03, 0x01, 0x02, 0,
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22, 52, 0,
+	7, 5, 0x81, 0x03, 8, 0, 10
+};
+static const UCHAR	dscr_conf_uvc[] = {
+	9, 2, 43, 0, 2, 1, 0, 0x80, 250,
+	9, 4, 0, 0, 0, 0x0e, 0x01, 0, 0,
+	9, 4, 1, 0, 0, 0x0e, 0x02, 0, 0,
+	9, 4, 1, 1, 1, 0x0e, 0x02, 0, 0,
+	7, 5, 0x81, 0x05, 0x00, 0x14, 1
+};
+static const UCHAR	dscr_conf_cdc[] = {
+	9, 2, 67, 0, 2, 1, 0, 0x80, 50,
+	9, 4, 0, 0, 1, 0x02, 0x02, 0x01, 0,
+	5, 0x24, 0x00, 0x10, 0x01,
+	5, 0x24, 0x01, 0x00, 0x01,
+	4, 0x24, 0x02, 0x02,
+	5, 0x24, 0x06, 0x00, 0x01,
+	7, 5, 0x83, 0x03, 16, 0, 16,
+	9, 4, 1, 0, 2, 0x0a, 0x00, 0x00, 0,
+	7, 5, 0x01, 0x02, 0x00, 0x02, 0,
+	7, 5, 0x82, 0x02, 0x00, 0x02, 0
+};
+
+/* GET_DESCRIPTOR for device and configuration */
+static void
+gen_enum(gen_t *gen, const UCHAR *dscr_conf, USHORT len_conf)
+{
+	static const char	setup_dev[8] = { (char)0x80, 6, 0, 1, 0, 0, 18, 0 };
+	char	setup_conf[8] = { (char)0x80, 6, 0, 2, 0, 0, 0, 0 };
+	UINT32	seqnum;
+
+	seqnum = gen_cmd_submit(gen, USBIP_DIR_IN, 0, 18, 0, setup_dev);
+	gen_ret_submit(gen, seqnum, USBIP_DIR_IN, 18, 0, 0);
+	setup_conf[6] = (char)(len_conf & 0xff);
+	setup_conf[7] = (char)(len_conf >> 8);
+	seqnum = gen_cmd_submit(gen, USBIP_DIR_IN, 0, len_conf, 0, setup_conf);
+	gen_ret_submit(gen, seqnum, USBIP_DIR_IN, len_conf, 0, 0);
+	if (!gen->failed) {
+		replay_pdu_t	*pdu = &gen->trace->pdus[gen->trace->n_pdus - 1];
+
+		memcpy(pdu->data + sizeof(struct usbip_header), dscr_conf, len_conf);
+	}
+}
+
+/* mass storage bulk-only transport: CBW, 64KB data and CSW. every 4th is a write */
+static void
+gen_msc(gen_t *gen, unsigned n_xfers)
+{
+	unsigned	i;
+
+	gen_enum(gen, dscr_conf_msc, sizeof(dscr_conf_msc));
+	for (i = 0; i < n_xfers; i++) {
+		gen_xfer(gen, USBIP_DIR_OUT, 2, 31, 31);
+		gen->sectors = TRUE;
+		if (i % 4 == 3)
+			gen_xfer(gen, USBIP_DIR_OUT, 2, 65536, 65536);
+		else
+			gen_xfer(gen, USBIP_DIR_IN, 1, 65536, 65536);
+		gen->sectors = FALSE;
+		gen_xfer(gen, USBIP_DIR_IN, 1, 13, 13);
+	}
+}
+
+/* HID interrupt IN reports, one at a time */
+static void
+gen_hid(gen_t *gen, unsigned n_xfers)
+{
+	unsigned	i;
+
+	gen_enum(gen, dscr_conf_hid, sizeof(dscr_conf_hid));
+	for (i = 0; i < n_xfers; i++)
+		gen_xfer(gen, USBIP_DIR_IN, 1, 8, 8);
+}
+
+#define UVC_N_URBS	3
+#define UVC_N_PKTS	32
+#define UVC_LEN_PKT	3072
+
+/* UVC isochronous IN streaming with 3 outstanding URBs */
+static void
+gen_uvc(gen_t *gen, unsigned n_xfers)
+{
+	UINT32	seqnums[UVC_N_URBS];
+	unsigned	i;
+
+	gen_enum(gen, dscr_conf_uvc, sizeof(dscr_conf_uvc));
+	for (i = 0; i < UVC_N_URBS; i++)
+		seqnums[i] = gen_cmd_submit(gen, USBIP_DIR_IN, 1, UVC_N_PKTS * UVC_LEN_PKT, UVC_N_PKTS, NULL);
+	for (i = 0; i < n_xfers; i++) {
+		/* frames are not always full */
+		gen_ret_submit(gen, seqnums[i % UVC_N_URBS], USBIP_DIR_IN, UVC_N_PKTS * UVC_LEN_PKT, UVC_N_PKTS,
+			UVC_LEN_PKT - (gen->rand % 512));
+		seqnums[i % UVC_N_URBS] = gen_cmd_submit(gen, USBIP_DIR_IN, 1, UVC_N_PKTS * UVC_LEN_PKT, UVC_N_PKTS, NULL);
+	}
+	for (i = 0; i < UVC_N_URBS; i++)
+		gen_unlink(gen, seqnums[i]);
+}
+
+/* CDC-ACM: pending bulk IN and notification, small bulk OUT writes */
+static void
+gen_cdc(gen_t *gen, unsigned n_xfers)
+{
+	UINT32	seqnum_in, seqnum_intr;
+	unsigned	i;
+
+	gen_enum(gen, dscr_conf_cdc, sizeof(dscr_conf_cdc));
+	seqnum_intr = gen_cmd_submit(gen, USBIP_DIR_IN, 3, 16, 0, NULL);
+	seqnum_in = gen_cmd_submit(gen, USBIP_DIR_IN, 2, 512, 0, NULL);
+	for (i = 0; i < n_xfers; i++) {
+		gen_xfer(gen, USBIP_DIR_OUT, 1, 64, 64);
+		gen_ret_submit(gen, seqnum_in, USBIP_DIR_IN, 1 + gen->rand % 64, 0, 0);
+		seqnum_in = gen_cmd_submit(gen, USBIP_DIR_IN, 2, 512, 0, NULL);
+		if (i % 16 == 15) {
+			/* SERIAL_STATE notification */
+			gen_ret_submit(gen, seqnum_intr, USBIP_DIR_IN, 10, 0, 0);
+			seqnum_intr = gen_cmd_submit(gen, USBIP_DIR_IN, 3, 16, 0, NULL);
+		}
+	}
+	gen_unlink(gen, seqnum_in);
+	gen_unlink(gen, seqnum_intr);
+}
+
+int
+replay_gen_trace(replay_trace_t *trace, const char *kind, unsigned n_xfers)
+{
+	gen_t	gen;
+	unsigned	i;
+
+	memset(trace, 0, sizeof(*trace));
+	gen.trace = trace;
+	gen.seqnum = 0;
+	gen.rand = 0x12345678;
+	gen.sectors = FALSE;
+	gen.lba = 0;
+	gen.failed = FALSE;
+
+	if (strcmp(kind, "msc") == 0)
+		gen_msc(&gen, n_xfers);
+	else if (strcmp(kind, "hid") == 0)
+		gen_hid(&gen, n_xfers);
+	else if (strcmp(kind, "uvc") == 0)
+		gen_uvc(&gen, n_xfers);
+	else if (strcmp(kind, "cdc") == 0)
+		gen_cdc(&gen, n_xfers);
+	else {
+		err("unknown trace kind: %s", kind);
+		return -1;
+	}
+	if (gen.failed) {
+		err("out of memory");
+		replay_free_trace(trace);
+		return -1;
+	}
+
+	for (i = 0; i < trace->n_pdus; i++) {
+		replay_pdu_t	*pdu = &trace->pdus[i];
+
+		swap_pdu(pdu, pdu->data, ((struct usbip_header *)pdu->data)->base.command);
+	}
+	if (prepare_host(trace) < 0) {
+		err("out of memory");
+		replay_free_trace(trace);
+		return -1;
+	}
+	return 0;
+}
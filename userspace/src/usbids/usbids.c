@@ -0,0 +1,214 @@
+/*
+ * usbids: precompile usb.ids into a memory-mappable database(usb.ids.bin)
+ */
+
+#include <stdlib.h>
+
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "names.h"
+#include "names_db.h"
+#include "usbids.h"
+
+#define BENCH_ROUNDS	20
+
+static const char usbids_help_string[] =
+	"usage: usbids [options] <usb.ids> <usb.ids.bin>\n"
+	"\n"
+	"	-b, --bench\n"
+	"		Compare load time and lookup latency of usb.ids by the previous and current\n"
+	"		loaders, and of usb.ids.bin.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+static void
+usbids_help(void)
+{
+	printf("%s\n", usbids_help_string);
+}
+
+static double
+elapsed_us(LARGE_INTEGER *start)
+{
+	LARGE_INTEGER	freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)(now.QuadPart - start->QuadPart) * 1000000.0 / (double)freq.QuadPart;
+}
+
+/* product keys from the generated database are used as the lookup set */
+static uint32_t *
+load_product_keys(const char *path_db, unsigned *pcount)
+{
+	names_db_hdr_t	hdr;
+	names_db_entry_t	entry;
+	uint32_t	*keys;
+	FILE	*f;
+	unsigned	i;
+
+	if (fopen_s(&f, path_db, "rb") != 0)
+		return NULL;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		fclose(f);
+		return NULL;
+	}
+	keys = (uint32_t *)malloc(sizeof(uint32_t) * (hdr.tables[NAMES_DB_PRODUCT].count + 1));
+	if (keys == NULL) {
+		fclose(f);
+		return NULL;
+	}
+	fseek(f, hdr.tables[NAMES_DB_PRODUCT].offset, SEEK_SET);
+	for (i = 0; i < hdr.tables[NAMES_DB_PRODUCT].count; i++) {
+		if (fread(&entry, sizeof(entry), 1, f) != 1)
+			break;
+		keys[i] = entry.key;
+	}
+	fclose(f);
+	*pcount = i;
+	return keys;
+}
+
+typedef const char *(*lookup_product_t)(uint16_t vendorid, uint16_t productid);
+
+static double
+bench_lookup(lookup_product_t lookup, uint32_t *keys, unsigned n_keys)
+{
+	LARGE_INTEGER	start;
+	unsigned	i, round, found = 0;
+
+	QueryPerformanceCounter(&start);
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		for (i = 0; i < n_keys; i++) {
+			if (lookup((uint16_t)(keys[i] >> 16), (uint16_t)keys[i]) != NULL)
+				found++;
+			/* miss: same vendor, product id which is unlikely to exist */
+			if (lookup((uint16_t)(keys[i] >> 16), (uint16_t)~keys[i]) != NULL)
+				found++;
+		}
+	}
+	if (found < n_keys * BENCH_ROUNDS)
+		err("lookup failed: %u found", found);
+	return elapsed_us(&start) * 1000.0 / ((double)n_keys * 2 * BENCH_ROUNDS);
+}
+
+static int
+bench(const char *path_ids, const char *path_db)
+{
+	LARGE_INTEGER	start;
+	uint32_t	*keys;
+	unsigned	n_keys;
+	double	us_load, ns_lookup;
+
+	keys = load_product_keys(path_db, &n_keys);
+	if (keys == NULL) {
+		err("failed to read: %s", path_db);
+		return -1;
+	}
+
+	printf("%-14s %14s %16s\n", "database", "load(us)", "lookup(ns/op)");
+
+	QueryPerformanceCounter(&start);
+	if (chained_init(path_ids) != 0) {
+		free(keys);
+		return -1;
+	}
+	us_load = elapsed_us(&start);
+	ns_lookup = bench_lookup(chained_product, keys, n_keys);
+	chained_free();
+	printf("%-14s %14.1f %16.1f\n", "usb.ids(chain)", us_load, ns_lookup);
+
+	QueryPerformanceCounter(&start);
+	if (names_init(path_ids) != 0) {
+		free(keys);
+		return -1;
+	}
+	us_load = elapsed_us(&start);
+	ns_lookup = bench_lookup(names_product, keys, n_keys);
+	names_free();
+	printf("%-14s %14.1f %16.1f\n", "usb.ids", us_load, ns_lookup);
+
+	QueryPerformanceCounter(&start);
+	if (names_init_db(path_db) != 0) {
+		free(keys);
+		return -1;
+	}
+	us_load = elapsed_us(&start);
+	ns_lookup = bench_lookup(names_product, keys, n_keys);
+	names_free();
+	printf("%-14s %14.1f %16.1f\n", "usb.ids.bin", us_load, ns_lookup);
+
+	free(keys);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "bench", no_argument, NULL, 'b' },
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help",  no_argument, NULL, 'h' },
+		{ NULL,    0,           NULL,  0 }
+	};
+	const char	*path_ids, *path_db;
+	BOOL	do_bench = FALSE;
+	int	ret;
+
+	usbip_progname = "usbids";
+	usbip_use_stderr = 1;
+
+	for (;;) {
+		int	opt;
+
+		opt = getopt_long(argc, argv, "bdh", opts, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'b':
+			do_bench = TRUE;
+			break;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+			usbids_help();
+			return EXIT_SUCCESS;
+		default:
+			usbids_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usbids_help();
+		return EXIT_FAILURE;
+	}
+	path_ids = argv[optind];
+	path_db = argv[optind + 1];
+
+	if (names_init(path_ids) != 0) {
+		err("failed to open: %s", path_ids);
+		return EXIT_FAILURE;
+	}
+
+	ret = names_save_db(path_db);
+	names_free();
+
+	if (ret < 0) {
+		err("failed to write: %s", path_db);
+		return EXIT_FAILURE;
+	}
+
+	info("%s is created", path_db);
+
+	if (do_bench && bench(path_ids, path_db) < 0)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
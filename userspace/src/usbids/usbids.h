@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+/* the previous text loader as a baseline of --bench, see usbids_chained.c */
+int chained_init(const char *path);
+const char *chained_product(uint16_t vendorid, uint16_t productid);
+void chained_free(void);
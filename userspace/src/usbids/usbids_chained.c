@@ -0,0 +1,196 @@
+/*
+ * the text loader which names.c had before open addressing, kept as a
+ * baseline of usbids --bench. Entries go into 16 hash chains with an
+ * allocation each, and the same lines of usb.ids are stored.
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "usbids.h"
+
+#define HASH1  0x10
+#define HASH2  0x02
+#define HASHSZ 16
+
+#define TBL_VENDOR	0
+#define TBL_PRODUCT	1
+#define TBL_CLASS	2
+#define TBL_SUBCLASS	3
+#define TBL_PROTOCOL	4
+#define N_TBLS		5
+
+struct chained_entry {
+	struct chained_entry *next;
+	uint32_t key;
+	char name[1];
+};
+
+struct pool {
+	struct pool *next;
+	void *mem;
+};
+
+static struct chained_entry *tbls[N_TBLS][HASHSZ];
+static struct pool *pool_head;
+
+static unsigned int hashnum(unsigned int num)
+{
+	unsigned int mask1 = HASH1 << 27, mask2 = HASH2 << 27;
+
+	for (; mask1 >= HASH1; mask1 >>= 1, mask2 >>= 1)
+		if (num & mask1)
+			num ^= mask2;
+	return num & (HASHSZ-1);
+}
+
+static void *my_malloc(size_t size)
+{
+	struct pool *p;
+
+	p = calloc(1, sizeof(struct pool));
+	if (!p)
+		return NULL;
+
+	p->mem = calloc(1, size);
+	if (!p->mem) {
+		free(p);
+		return NULL;
+	}
+
+	p->next = pool_head;
+	pool_head = p;
+
+	return p->mem;
+}
+
+static int new_entry(int tbl, uint32_t key, const char *name)
+{
+	struct chained_entry *e;
+	unsigned int h = hashnum(key);
+	size_t	namelen;
+
+	for (e = tbls[tbl][h]; e; e = e->next)
+		if (e->key == key)
+			return -1;
+	namelen = strlen(name);
+	e = my_malloc(sizeof(struct chained_entry) + namelen);
+	if (!e)
+		return -1;
+	strcpy_s(e->name, namelen + 1, name);
+	e->key = key;
+	e->next = tbls[tbl][h];
+	tbls[tbl][h] = e;
+	return 0;
+}
+
+const char *chained_product(uint16_t vendorid, uint16_t productid)
+{
+	uint32_t key = ((uint32_t)vendorid << 16) | productid;
+	struct chained_entry *e;
+
+	for (e = tbls[TBL_PRODUCT][hashnum(key)]; e; e = e->next)
+		if (e->key == key)
+			return e->name;
+	return NULL;
+}
+
+void chained_free(void)
+{
+	struct pool *pool;
+
+	for (pool = pool_head; pool != NULL; ) {
+		struct pool *tmp;
+
+		free(pool->mem);
+		tmp = pool;
+		pool = pool->next;
+		free(tmp);
+	}
+	pool_head = NULL;
+	memset(tbls, 0, sizeof(tbls));
+}
+
+/* a value after an id at cp, NULL if there's none */
+static char *skip_id(char *cp, unsigned int *pu)
+{
+	*pu = strtoul(cp, &cp, 16);
+	while (isspace((unsigned char)*cp))
+		cp++;
+	return *cp ? cp : NULL;
+}
+
+static void parse(FILE *f)
+{
+	char buf[512], *cp;
+	int lastvendor = -1;
+	int lastclass = -1;
+	int lastsubclass = -1;
+	unsigned int u;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		cp = strchr(buf, '\r');
+		if (cp)
+			*cp = 0;
+		cp = strchr(buf, '\n');
+		if (cp)
+			*cp = 0;
+		if (buf[0] == '#' || !buf[0])
+			continue;
+		if (buf[0] == 'C' && buf[1] == ' ') {
+			cp = buf + 2;
+			while (isspace((unsigned char)*cp))
+				cp++;
+			if (!isxdigit((unsigned char)*cp) || (cp = skip_id(cp, &u)) == NULL)
+				continue;
+			new_entry(TBL_CLASS, u, cp);
+			lastvendor = lastsubclass = -1;
+			lastclass = u;
+			continue;
+		}
+		if (isxdigit((unsigned char)buf[0])) {
+			if ((cp = skip_id(buf, &u)) == NULL)
+				continue;
+			new_entry(TBL_VENDOR, u, cp);
+			lastvendor = u;
+			lastclass = lastsubclass = -1;
+			continue;
+		}
+		if (buf[0] == '\t' && isxdigit((unsigned char)buf[1])) {
+			if ((cp = skip_id(buf + 1, &u)) == NULL)
+				continue;
+			if (lastvendor != -1)
+				new_entry(TBL_PRODUCT, ((uint32_t)lastvendor << 16) | u, cp);
+			else if (lastclass != -1) {
+				new_entry(TBL_SUBCLASS, ((uint32_t)lastclass << 8) | u, cp);
+				lastsubclass = u;
+			}
+			continue;
+		}
+		if (buf[0] == '\t' && buf[1] == '\t' && isxdigit((unsigned char)buf[2])) {
+			if ((cp = skip_id(buf + 2, &u)) == NULL)
+				continue;
+			if (lastclass != -1 && lastsubclass != -1)
+				new_entry(TBL_PROTOCOL, ((uint32_t)lastclass << 16) | (lastsubclass << 8) | u, cp);
+			continue;
+		}
+		/* other sections are not stored */
+		lastvendor = lastclass = lastsubclass = -1;
+	}
+}
+
+int chained_init(const char *path)
+{
+	FILE *f;
+	errno_t	err;
+
+	if ((err = fopen_s(&f, path, "r")) != 0)
+		return err;
+
+	parse(f);
+	fclose(f);
+	return 0;
+}
@@ -109,6 +109,12 @@ static const struct command cmds[] = {
 		.help  = "Show imported USB devices",
 		.usage = usbip_port_usage
 	},
+	{
+		.name  = "stats",
+		.fn    = usbip_stats_show,
+		.help  = "Show counters of running forwarders",
+		.usage = usbip_stats_usage
+	},
 	{ NULL, NULL, NULL, NULL }
 };
 
@@ -32,6 +32,7 @@ int usbip_unbind(int argc, char *argv[]);
 int usbip_install(int argc, char* argv[]);
 int usbip_uninstall(int argc, char *argv[]);
 int usbip_port_show(int argc, char* argv[]);
+int usbip_stats_show(int argc, char *argv[]);
 
 void usbip_attach_usage(void);
 void usbip_detach_usage(void);
@@ -41,5 +42,6 @@ void usbip_unbind_usage(void);
 void usbip_install_usage(void);
 void usbip_uninstall_usage(void);
 void usbip_port_usage(void);
+void usbip_stats_usage(void);
 
 #endif /* __USBIP_H */
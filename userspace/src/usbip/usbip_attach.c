@@ -27,13 +27,19 @@
 #include "dbgcode.h"
 
 #include "usbip_dscr.h"
+#include "usbip_dscr_cache.h"
 
 static const char usbip_attach_usage_string[] =
 	"usbip attach <args>\n"
 	"    -r, --remote=<host>    The machine with exported USB devices\n"
 	"    -b, --busid=<busid>    Busid of the device on <host>\n"
 	"    -s, --serial=<USB serial>  (Optional) USB serial to be overwritten\n"
-	"    -t, --terse            show port number as a result\n";
+	"    -t, --terse            show port number as a result\n"
+	"    -c, --compact          use compact usbip headers if <host> runs usbip-win\n"
+	"    -z, --compress         compress bulk transfers if <host> runs usbip-win, implies -c\n"
+	"    -d, --dscr-cache       reuse descriptors of a former attach if <host> runs usbip-win\n"
+	"    -R, --resume           keep a device attached over a brief network loss if <host> runs usbip-win\n"
+	"    -I, --iso-channel      forward isochronous transfers over a second connection if <host> runs usbip-win\n";
 
 void usbip_attach_usage(void)
 {
@@ -45,7 +51,6 @@ import_device(SOCKET sockfd, pvhci_pluginfo_t pluginfo, HANDLE *phdev)
 {
 	HANDLE	hdev;
 	int	port;
-	int	rc;
 
 	hdev = usbip_vhci_driver_open();
 	if (hdev == INVALID_HANDLE_VALUE) {
@@ -53,93 +58,172 @@ import_device(SOCKET sockfd, pvhci_pluginfo_t pluginfo, HANDLE *phdev)
 		return ERR_DRIVER;
 	}
 
-	port = usbip_vhci_get_free_port(hdev);
+	port = usbip_vhci_attach_device(hdev, pluginfo);
+	if (port < 0 && port != ERR_PORTFULL && pluginfo->size > VHCI_PLUGINFO_SIZE(((unsigned short *)pluginfo->dscr_conf)[1])) {
+		/* an older vhci driver takes no additional descriptors */
+		dbg("retrying without additional descriptors");
+		pluginfo->size = (unsigned long)VHCI_PLUGINFO_SIZE(((unsigned short *)pluginfo->dscr_conf)[1]);
+		port = usbip_vhci_attach_device(hdev, pluginfo);
+	}
 	if (port < 0) {
-		dbg("no free port");
+		dbg("failed to attach device: %s", dbg_errcode(port));
 		usbip_vhci_driver_close(hdev);
-		return ERR_PORTFULL;
+		return port == ERR_PORTFULL ? ERR_PORTFULL: ERR_GENERAL;
 	}
 
-	dbg("got free port: %d", port);
-
-	pluginfo->port = port;
-
-	rc = usbip_vhci_attach_device(hdev, pluginfo);
-	if (rc < 0) {
-		dbg("failed to attach device: %d", rc);
-		usbip_vhci_driver_close(hdev);
-		return ERR_GENERAL;
-	}
+	dbg("attached to port: %d", port);
 
 	*phdev = hdev;
 	return port;
 }
 
 static pvhci_pluginfo_t
-build_pluginfo(SOCKET sockfd, unsigned devid)
+fetch_pluginfo(SOCKET sockfd, unsigned devid, UINT32 features)
 {
 	pvhci_pluginfo_t	pluginfo;
 	unsigned long	pluginfo_size;
 	unsigned short	conf_dscr_len;
 
-	if (fetch_conf_descriptor(sockfd, devid, NULL, &conf_dscr_len) < 0) {
+	if (fetch_conf_descriptor(sockfd, devid, features, NULL, &conf_dscr_len) < 0) {
 		dbg("failed to get configuration descriptor size");
 		return NULL;
 	}
 
-	pluginfo_size = sizeof(vhci_pluginfo_t) + conf_dscr_len - 9;
+	pluginfo_size = (unsigned long)VHCI_PLUGINFO_SIZE(conf_dscr_len);
 	pluginfo = (pvhci_pluginfo_t)malloc(pluginfo_size);
 	if (pluginfo == NULL) {
 		dbg("out of memory or invalid vhci pluginfo size");
 		return NULL;
 	}
-	if (fetch_device_descriptor(sockfd, devid, pluginfo->dscr_dev) < 0) {
+	if (fetch_device_descriptor(sockfd, devid, features, pluginfo->dscr_dev) < 0) {
 		dbg("failed to fetch device descriptor");
 		free(pluginfo);
 		return NULL;
 	}
-	if (fetch_conf_descriptor(sockfd, devid, pluginfo->dscr_conf, &conf_dscr_len) < 0) {
+	if (fetch_conf_descriptor(sockfd, devid, features, pluginfo->dscr_conf, &conf_dscr_len) < 0) {
 		dbg("failed to fetch configuration descriptor");
 		free(pluginfo);
 		return NULL;
 	}
 
 	pluginfo->size = pluginfo_size;
+	return pluginfo;
+}
+
+/* persisted descriptors other than device and configuration ones follow those */
+static pvhci_pluginfo_t
+load_pluginfo(usbip_dscr_set_t *set)
+{
+	pvhci_pluginfo_t	pluginfo;
+	const unsigned char	*dscr_dev, *dscr_conf;
+	unsigned short	len_conf;
+	unsigned long	len_base;
+
+	if (!usbip_dscr_set_get_dev_conf(set, &dscr_dev, &dscr_conf, &len_conf))
+		return NULL;
+
+	len_base = (unsigned long)VHCI_PLUGINFO_SIZE(len_conf);
+	pluginfo = (pvhci_pluginfo_t)malloc(len_base + usbip_dscr_set_copy_extras(set, NULL));
+	if (pluginfo == NULL) {
+		dbg("out of memory");
+		return NULL;
+	}
+	memcpy(pluginfo->dscr_dev, dscr_dev, sizeof(pluginfo->dscr_dev));
+	memcpy(pluginfo->dscr_conf, dscr_conf, len_conf);
+	pluginfo->size = len_base + usbip_dscr_set_copy_extras(set, (unsigned char *)pluginfo + len_base);
+	return pluginfo;
+}
+
+static void
+save_pluginfo(const char *dscr_key, pvhci_pluginfo_t pluginfo)
+{
+	usbip_dscr_set_t	set;
+	unsigned short	len_conf = ((unsigned short *)pluginfo->dscr_conf)[1];
+
+	usbip_dscr_set_init(&set);
+	usbip_dscr_set_add_dev_conf(&set, pluginfo->dscr_dev, pluginfo->dscr_conf, len_conf);
+	usbip_dscr_cache_save(dscr_key, &set);
+	usbip_dscr_set_cleanup(&set);
+}
+
+/* dscr_key is NULL if a server reports no descriptor hash */
+static pvhci_pluginfo_t
+build_pluginfo(SOCKET sockfd, unsigned devid, UINT32 features, const char *dscr_key, UINT32 dscr_hash)
+{
+	pvhci_pluginfo_t	pluginfo = NULL;
+
+	if (dscr_key != NULL) {
+		usbip_dscr_set_t	set;
+
+		usbip_dscr_set_init(&set);
+		if (usbip_dscr_cache_load(dscr_key, dscr_hash, &set)) {
+			dbg("descriptors are loaded from a cache");
+			pluginfo = load_pluginfo(&set);
+		}
+		usbip_dscr_set_cleanup(&set);
+	}
+	if (pluginfo == NULL) {
+		pluginfo = fetch_pluginfo(sockfd, devid, features);
+		if (pluginfo == NULL)
+			return NULL;
+		if (dscr_key != NULL)
+			save_pluginfo(dscr_key, pluginfo);
+	}
 	pluginfo->devid = devid;
 
 	return pluginfo;
 }
 
 static int
-query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev, const char *serial)
+send_import_request(SOCKET sockfd, const char *busid, UINT32 features)
 {
-	struct op_import_request request;
-	struct op_import_reply   reply;
-	pvhci_pluginfo_t	pluginfo;
-	uint16_t code = OP_REP_IMPORT;
-	unsigned	devid;
-	int	status;
+	struct op_import_ext_request request;
 	int	rc;
 
 	memset(&request, 0, sizeof(request));
-	memset(&reply, 0, sizeof(reply));
 
-	/* send a request */
-	rc = usbip_net_send_op_common(sockfd, OP_REQ_IMPORT, 0);
+	/* protocol extensions are requested only if wanted, which linux servers reject */
+	rc = usbip_net_send_op_common(sockfd, features ? OP_REQ_IMPORT_EXT : OP_REQ_IMPORT, 0);
 	if (rc < 0) {
 		dbg("failed to send common header: %s", dbg_errcode(rc));
 		return ERR_NETWORK;
 	}
 
 	strncpy_s(request.busid, USBIP_BUS_ID_SIZE, busid, sizeof(request.busid));
+	request.features = features;
 
-	PACK_OP_IMPORT_REQUEST(0, &request);
+	PACK_OP_IMPORT_EXT_REQUEST(1, &request);
 
-	rc = usbip_net_send(sockfd, (void *)&request, sizeof(request));
+	/* op_import_request is the head of op_import_ext_request */
+	rc = usbip_net_send(sockfd, (void *)&request, features ? sizeof(request) : sizeof(struct op_import_request));
 	if (rc < 0) {
 		dbg("failed to send import request: %s", dbg_errcode(rc));
 		return ERR_NETWORK;
 	}
+	return 0;
+}
+
+/*
+ * *pdscr_key is set to a key of persisted descriptors if a server reports their hash.
+ * *ptoken is set if a session is resumable, and *ptoken_iso if an ISO channel is accepted.
+ */
+static int
+query_import_device(SOCKET sockfd, const char *host, const char *busid, UINT32 *pfeatures, unsigned *pdevid,
+		    char **pdscr_key, UINT32 *pdscr_hash, UINT32 *ptoken, UINT32 *ptoken_iso, HANDLE *phdev, const char *serial)
+{
+	struct op_import_ext_reply   reply;
+	pvhci_pluginfo_t	pluginfo;
+	uint16_t code = *pfeatures ? OP_REP_IMPORT_EXT : OP_REP_IMPORT;
+	unsigned	devid;
+	int	status;
+	int	rc;
+
+	memset(&reply, 0, sizeof(reply));
+
+	/* send a request */
+	rc = send_import_request(sockfd, busid, *pfeatures);
+	if (rc < 0)
+		return rc;
 
 	/* recieve a reply */
 	rc = usbip_net_recv_op_common(sockfd, &code, &status);
@@ -160,13 +244,15 @@ query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev, const char
 		return rc;
 	}
 
-	rc = usbip_net_recv(sockfd, (void *)&reply, sizeof(reply));
+	rc = usbip_net_recv(sockfd, (void *)&reply, *pfeatures ? sizeof(reply) : sizeof(struct op_import_reply));
 	if (rc < 0) {
 		dbg("failed to recv import reply: %s", dbg_errcode(rc));
 		return ERR_NETWORK;
 	}
 
-	PACK_OP_IMPORT_REPLY(0, &reply);
+	PACK_OP_IMPORT_EXT_REPLY(0, &reply);
+	/* a server never turns on what is not requested */
+	*pfeatures &= reply.features;
 
 	/* check the reply */
 	if (strncmp(reply.udev.busid, busid, sizeof(reply.udev.busid)) != 0) {
@@ -174,8 +260,35 @@ query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev, const char
 		return ERR_PROTOCOL;
 	}
 
+	if (*pfeatures & USBIP_EXT_DSCR_HASH) {
+		rc = usbip_net_recv(sockfd, pdscr_hash, sizeof(*pdscr_hash));
+		if (rc < 0) {
+			dbg("failed to recv descriptor hash: %s", dbg_errcode(rc));
+			return ERR_NETWORK;
+		}
+		usbip_net_pack_uint32_t(0, pdscr_hash);
+		*pdscr_key = usbip_dscr_cache_key(host, &reply.udev);
+	}
+	if (*pfeatures & USBIP_EXT_RESUME) {
+		rc = usbip_net_recv(sockfd, ptoken, sizeof(*ptoken));
+		if (rc < 0) {
+			dbg("failed to recv session token: %s", dbg_errcode(rc));
+			return ERR_NETWORK;
+		}
+		usbip_net_pack_uint32_t(0, ptoken);
+	}
+	if (*pfeatures & USBIP_EXT_ISO_CHANNEL) {
+		rc = usbip_net_recv(sockfd, ptoken_iso, sizeof(*ptoken_iso));
+		if (rc < 0) {
+			dbg("failed to recv iso channel token: %s", dbg_errcode(rc));
+			return ERR_NETWORK;
+		}
+		usbip_net_pack_uint32_t(0, ptoken_iso);
+	}
+
 	devid = reply.udev.busnum << 16 | reply.udev.devnum;
-	pluginfo = build_pluginfo(sockfd, devid);
+	*pdevid = devid;
+	pluginfo = build_pluginfo(sockfd, devid, *pfeatures, *pdscr_key, *pdscr_hash);
 	if (pluginfo == NULL)
 		return ERR_GENERAL;
 
@@ -190,6 +303,47 @@ query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev, const char
 	return rc;
 }
 
+/* ISO transfers go through the same forwarder as others if a channel is not opened */
+static SOCKET
+open_iso_channel(const char *host, UINT32 token)
+{
+	struct op_iso_channel_request	req;
+	SOCKET	sockfd;
+	uint16_t	code = OP_REP_ISO_CHANNEL;
+	int	status;
+	int	rc;
+
+	sockfd = usbip_net_tcp_connect(host, usbip_port_string);
+	if (sockfd == INVALID_SOCKET) {
+		dbg("failed to connect for iso channel");
+		return INVALID_SOCKET;
+	}
+	usbip_net_set_keepalive(sockfd);
+	usbip_net_set_nodelay(sockfd);
+
+	rc = usbip_net_send_op_common(sockfd, OP_REQ_ISO_CHANNEL, 0);
+	if (rc < 0) {
+		dbg("failed to send common header: %s", dbg_errcode(rc));
+		goto err;
+	}
+	req.token = token;
+	PACK_OP_ISO_CHANNEL_REQUEST(1, &req);
+	rc = usbip_net_send(sockfd, &req, sizeof(req));
+	if (rc < 0) {
+		dbg("failed to send iso channel request: %s", dbg_errcode(rc));
+		goto err;
+	}
+	rc = usbip_net_recv_op_common(sockfd, &code, &status);
+	if (rc < 0) {
+		dbg("failed to recv common header: %s", dbg_errcode(rc));
+		goto err;
+	}
+	return sockfd;
+err:
+	closesocket(sockfd);
+	return INVALID_SOCKET;
+}
+
 static BOOL
 write_handle_value(HANDLE hInWrite, HANDLE handle)
 {
@@ -220,13 +374,80 @@ create_pipe(HANDLE *phRead, HANDLE *phWrite)
 	return TRUE;
 }
 
+static BOOL
+write_features(HANDLE hInWrite, UINT32 features, UINT32 devid)
+{
+	UINT32	values[2] = { features, devid };
+	DWORD	nwritten;
+	BOOL	res;
+
+	res = WriteFile(hInWrite, values, sizeof(values), &nwritten, NULL);
+	if (!res || nwritten != sizeof(values)) {
+		dbg("failed to write features");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* an attacher collects descriptors while forwarding, and persists them */
+static BOOL
+write_dscr_cache(HANDLE hInWrite, const char *dscr_key, UINT32 dscr_hash)
+{
+	UINT32	values[2] = { dscr_hash, dscr_key ? (UINT32)strlen(dscr_key) : 0 };
+	DWORD	nwritten;
+	BOOL	res;
+
+	res = WriteFile(hInWrite, values, sizeof(values), &nwritten, NULL);
+	if (!res || nwritten != sizeof(values)) {
+		dbg("failed to write descriptor cache key");
+		return FALSE;
+	}
+	if (values[1] == 0)
+		return TRUE;
+	res = WriteFile(hInWrite, dscr_key, values[1], &nwritten, NULL);
+	if (!res || nwritten != values[1]) {
+		dbg("failed to write descriptor cache key");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* an attacher reconnects to host with a token, which is 0 if a session is not resumable */
+static BOOL
+write_resume(HANDLE hInWrite, const char *host, UINT32 token)
+{
+	UINT32	values[3] = { token, (UINT32)strlen(host), (UINT32)strlen(usbip_port_string) };
+	DWORD	nwritten;
+	BOOL	res;
+
+	res = WriteFile(hInWrite, values, sizeof(values), &nwritten, NULL);
+	if (!res || nwritten != sizeof(values)) {
+		dbg("failed to write session token");
+		return FALSE;
+	}
+	res = WriteFile(hInWrite, host, values[1], &nwritten, NULL);
+	if (!res || nwritten != values[1]) {
+		dbg("failed to write host");
+		return FALSE;
+	}
+	res = WriteFile(hInWrite, usbip_port_string, values[2], &nwritten, NULL);
+	if (!res || nwritten != values[2]) {
+		dbg("failed to write port");
+		return FALSE;
+	}
+	return TRUE;
+}
+
 static int
-execute_attacher(HANDLE hdev, SOCKET sockfd, int rhport)
+execute_attacher(HANDLE hdev, SOCKET sockfd, int rhport, UINT32 features, UINT32 devid, const char *dscr_key, UINT32 dscr_hash,
+		 const char *host, UINT32 token, SOCKET sockfd_iso)
 {
 	STARTUPINFO	si;
 	PROCESS_INFORMATION	pi;
 	HANDLE	hRead, hWrite;
 	HANDLE	hdev_attacher, sockfd_attacher;
+	/* an older attacher.exe does not read it */
+	HANDLE	sockfd_iso_attacher = INVALID_HANDLE_VALUE;
 	BOOL	res;
 	int	ret = ERR_GENERAL;
 
@@ -259,6 +480,21 @@ execute_attacher(HANDLE hdev, SOCKET sockfd, int rhport)
 	}
 	if (!write_handle_value(hWrite, hdev_attacher) || !write_handle_value(hWrite, sockfd_attacher))
 		goto out_proc;
+	if (!write_features(hWrite, features, devid))
+		goto out_proc;
+	if (!write_dscr_cache(hWrite, dscr_key, dscr_hash))
+		goto out_proc;
+	if (!write_resume(hWrite, host, token))
+		goto out_proc;
+	if (sockfd_iso != INVALID_SOCKET) {
+		res = DuplicateHandle(GetCurrentProcess(), (HANDLE)sockfd_iso, pi.hProcess, &sockfd_iso_attacher, 0, FALSE, DUPLICATE_SAME_ACCESS);
+		if (!res) {
+			dbg("failed to dup iso channel sockfd: 0x%lx", GetLastError());
+			goto out_proc;
+		}
+	}
+	if (!write_handle_value(hWrite, sockfd_iso_attacher))
+		goto out_proc;
 	ret = 0;
 out_proc:
 	CloseHandle(pi.hProcess);
@@ -270,10 +506,15 @@ out:
 }
 
 static int
-attach_device(const char *host, const char *busid, const char *serial, BOOL terse)
+attach_device(const char *host, const char *busid, const char *serial, BOOL terse, UINT32 features)
 {
 	SOCKET	sockfd;
 	int	rhport, ret;
+	unsigned	devid = 0;
+	char	*dscr_key = NULL;
+	UINT32	dscr_hash = 0;
+	UINT32	token = 0, token_iso = 0;
+	SOCKET	sockfd_iso = INVALID_SOCKET;
 	HANDLE	hdev = INVALID_HANDLE_VALUE;
 
 	sockfd = usbip_net_tcp_connect(host, usbip_port_string);
@@ -282,7 +523,23 @@ attach_device(const char *host, const char *busid, const char *serial, BOOL ters
 		return 2;
 	}
 
-	rhport = query_import_device(sockfd, busid, &hdev, serial);
+	rhport = query_import_device(sockfd, host, busid, &features, &devid, &dscr_key, &dscr_hash, &token, &token_iso, &hdev, serial);
+	if (features && (rhport == ERR_NETWORK || rhport == ERR_PROTOCOL)) {
+		/* linux or older servers drop a connection on OP_REQ_IMPORT_EXT */
+		info("%s does not support protocol extensions, retrying without them", host);
+		closesocket(sockfd);
+		sockfd = usbip_net_tcp_connect(host, usbip_port_string);
+		if (sockfd == INVALID_SOCKET) {
+			err("failed to connect a remote host: %s", host);
+			return 2;
+		}
+		features = 0;
+		free(dscr_key);
+		dscr_key = NULL;
+		token = 0;
+		token_iso = 0;
+		rhport = query_import_device(sockfd, host, busid, &features, &devid, &dscr_key, &dscr_hash, &token, &token_iso, &hdev, serial);
+	}
 	if (rhport < 0) {
 		switch (rhport) {
 		case ERR_DRIVER:
@@ -301,10 +558,19 @@ attach_device(const char *host, const char *busid, const char *serial, BOOL ters
 			err("failed to attach");
 			break;
 		}
+		free(dscr_key);
 		return 3;
 	}
 
-	ret = execute_attacher(hdev, sockfd, rhport);
+	/* a server forwards ISO transfers through a socket if a channel is not opened in time */
+	if (token_iso != 0) {
+		sockfd_iso = open_iso_channel(host, token_iso);
+		if (sockfd_iso == INVALID_SOCKET)
+			info("failed to open iso channel, isochronous transfers share a connection");
+	}
+
+	ret = execute_attacher(hdev, sockfd, rhport, features, devid, dscr_key, dscr_hash, host, token, sockfd_iso);
+	free(dscr_key);
 	if (ret == 0) {
 		if (terse) {
 			printf("%d\n", rhport);
@@ -326,6 +592,8 @@ attach_device(const char *host, const char *busid, const char *serial, BOOL ters
 	}
 	usbip_vhci_driver_close(hdev);
 	closesocket(sockfd);
+	if (sockfd_iso != INVALID_SOCKET)
+		closesocket(sockfd_iso);
 
 	return ret;
 }
@@ -337,15 +605,21 @@ int usbip_attach(int argc, char *argv[])
 		{ "busid", required_argument, NULL, 'b' },
 		{ "serial", optional_argument, NULL, 's' },
 		{ "terse", required_argument, NULL, 't' },
+		{ "compact", no_argument, NULL, 'c' },
+		{ "compress", no_argument, NULL, 'z' },
+		{ "dscr-cache", no_argument, NULL, 'd' },
+		{ "resume", no_argument, NULL, 'R' },
+		{ "iso-channel", no_argument, NULL, 'I' },
 		{ NULL, 0, NULL, 0 }
 	};
 	char	*host = NULL;
 	char	*busid = NULL;
 	char	*serial = NULL;
 	BOOL	terse = FALSE;
+	UINT32	features = 0;
 
 	for (;;) {
-		int	opt = getopt_long(argc, argv, "r:b:s:t", opts, NULL);
+		int	opt = getopt_long(argc, argv, "r:b:s:tczdRI", opts, NULL);
 
 		if (opt == -1)
 			break;
@@ -363,6 +637,21 @@ int usbip_attach(int argc, char *argv[])
 		case 't':
 			terse = TRUE;
 			break;
+		case 'c':
+			features |= USBIP_EXT_COMPACT;
+			break;
+		case 'z':
+			features |= USBIP_EXT_COMPACT | USBIP_EXT_COMPRESS;
+			break;
+		case 'd':
+			features |= USBIP_EXT_DSCR_HASH;
+			break;
+		case 'R':
+			features |= USBIP_EXT_RESUME;
+			break;
+		case 'I':
+			features |= USBIP_EXT_ISO_CHANNEL;
+			break;
 		default:
 			err("invalid option: %c", opt);
 			usbip_attach_usage();
@@ -381,5 +670,5 @@ int usbip_attach(int argc, char *argv[])
 		return 1;
 	}
 
-	return attach_device(host, busid, serial, terse);
+	return attach_device(host, busid, serial, terse, features);
 }
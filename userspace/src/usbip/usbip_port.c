@@ -20,7 +20,8 @@
 
 static const char usbip_port_usage_string[] =
 	"usbip port <args>\n"
-	"    -p, --port=<port>      list only given port(for port checking)\n";
+	"    -p, --port=<port>      list only given port(for port checking)\n"
+	"    -w, --watch            keep showing changes of ports\n";
 
 void
 usbip_port_usage(void)
@@ -48,24 +49,17 @@ usbip_vhci_imported_device_dump(pioctl_usbip_vhci_imported_dev_t idev)
 	return 0;
 }
 
+/* 2 if port is not found */
 static int
-list_imported_devices(int port)
+dump_imported_devices(HANDLE hdev, int port)
 {
-	HANDLE hdev;
 	ioctl_usbip_vhci_imported_dev	*idevs;
 	BOOL	found = FALSE;
 	int	res;
 	int	i;
 
-	hdev = usbip_vhci_driver_open();
-	if (hdev == INVALID_HANDLE_VALUE) {
-		err("failed to open vhci driver");
-		return 3;
-	}
-
 	res = usbip_vhci_get_imported_devs(hdev, &idevs);
 	if (res < 0) {
-		usbip_vhci_driver_close(hdev);
 		err("failed to get attach information");
 		return 2;
 	}
@@ -73,13 +67,8 @@ list_imported_devices(int port)
 	printf("Imported USB devices\n");
 	printf("====================\n");
 
-	if (usbip_names_init()) {
-		dbg("failed to open usb id database");
-	}
-
-	for (i = 0; i < 127; i++) {
-		if (idevs[i].port < 0)
-			break;
+	/* entries end with port -1 */
+	for (i = 0; idevs[i].port >= 0; i++) {
 		if (port >= 0) {
 			if (port != idevs[i].port)
 				continue;
@@ -90,9 +79,6 @@ list_imported_devices(int port)
 
 	free(idevs);
 
-	usbip_vhci_driver_close(hdev);
-	usbip_names_free();
-
 	if (port >= 0 && !found) {
 		/* port check failed */
 		return 2;
@@ -100,17 +86,99 @@ list_imported_devices(int port)
 	return 0;
 }
 
+static void
+port_event_dump(const vhci_port_event_t *ev, void *data)
+{
+	int	port = *(int *)data;
+	char	product_name[128];
+
+	if (port >= 0 && port != ev->port)
+		return;
+
+	printf("Port %02d: %s", ev->port, usbip_port_event_string(ev->type));
+	if (ev->vendor != 0 || ev->product != 0) {
+		usbip_names_get_product(product_name, sizeof(product_name), ev->vendor, ev->product);
+		printf(" at %s: %s", usbip_speed_string(ev->speed), product_name);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/* changes are waited for instead of polling imported devices */
+static int
+watch_imported_devices(HANDLE hdev, int port)
+{
+	usbip_port_event_src_t	src;
+	usbip_port_events_t	pevs;
+	int	rc;
+
+	usbip_vhci_port_event_src(hdev, &src);
+	rc = usbip_port_events_init(&pevs, &src, 16);
+	if (rc < 0) {
+		if (rc == ERR_VERSION)
+			err("vhci driver cannot report changes of ports");
+		else
+			err("failed to watch ports");
+		return 2;
+	}
+
+	dump_imported_devices(hdev, port);
+	for (;;) {
+		rc = usbip_port_events_wait(&pevs, port_event_dump, &port);
+		if (rc < 0) {
+			err("failed to get changes of ports");
+			break;
+		}
+		if (pevs.lost) {
+			info("some changes are lost");
+			dump_imported_devices(hdev, port);
+		}
+	}
+
+	usbip_port_events_cleanup(&pevs);
+	return 2;
+}
+
+static int
+list_imported_devices(int port, BOOL watch)
+{
+	HANDLE hdev;
+	int	res;
+
+	hdev = usbip_vhci_driver_open();
+	if (hdev == INVALID_HANDLE_VALUE) {
+		err("failed to open vhci driver");
+		return 3;
+	}
+
+	if (usbip_names_init()) {
+		dbg("failed to open usb id database");
+	}
+
+	if (watch)
+		res = watch_imported_devices(hdev, port);
+	else
+		res = dump_imported_devices(hdev, port);
+
+	usbip_vhci_driver_close(hdev);
+	usbip_names_free();
+
+	return res;
+}
+
 int
 usbip_port_show(int argc, char *argv[])
 {
 	static const struct option opts[] = {
 		{ "port", required_argument, NULL, 'p' },
+		{ "watch", no_argument, NULL, 'w' },
 		{ NULL, 0, NULL, 0 }
 	};
 	int	port = -1;
+	BOOL	watch = FALSE;
 
 	for (;;) {
-		int	opt = getopt_long(argc, argv, "p:", opts, NULL);
+		int	opt = getopt_long(argc, argv, "p:w", opts, NULL);
 
 		if (opt == -1)
 			break;
@@ -123,11 +191,14 @@ usbip_port_show(int argc, char *argv[])
 				return 1;
 			}
 			break;
+		case 'w':
+			watch = TRUE;
+			break;
 		default:
 			err("invalid option: %c", opt);
 			usbip_port_usage();
 			return 1;
 		}
 	}
-	return list_imported_devices(port);
+	return list_imported_devices(port, watch);
 }
@@ -0,0 +1,117 @@
+#include "usbip_windows.h"
+#include "usbip_common.h"
+#include "usbip_stats.h"
+#include <stdlib.h>
+
+#define PIPE_NAME_PREFIX	"usbip-stats-"
+#define PIPE_WAIT_MS		2000
+
+static const char usbip_stats_usage_string[] =
+	"usbip stats <args>\n"
+	"    -p, --pid=<pid>        show only forwarders of a given usbip or usbipd process\n";
+
+void
+usbip_stats_usage(void)
+{
+	printf("usage: %s", usbip_stats_usage_string);
+}
+
+static HANDLE
+open_stats_pipe(const char *name)
+{
+	for (;;) {
+		HANDLE	hpipe;
+
+		hpipe = CreateFileA(name, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (hpipe != INVALID_HANDLE_VALUE)
+			return hpipe;
+		/* all instances are serving other clients */
+		if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(name, PIPE_WAIT_MS))
+			return INVALID_HANDLE_VALUE;
+	}
+}
+
+static int
+show_stats(unsigned long pid)
+{
+	char	name[64];
+	char	buf[4096];
+	HANDLE	hpipe;
+	DWORD	nread;
+
+	snprintf(name, sizeof(name), USBIP_STATS_PIPE_PREFIX "%lu", pid);
+	hpipe = open_stats_pipe(name);
+	if (hpipe == INVALID_HANDLE_VALUE) {
+		err("failed to connect to process %lu: err: 0x%lx", pid, GetLastError());
+		return 2;
+	}
+	while (ReadFile(hpipe, buf, sizeof(buf), &nread, NULL) && nread > 0)
+		fwrite(buf, 1, nread, stdout);
+	CloseHandle(hpipe);
+	printf("\n");
+	return 0;
+}
+
+/* every process with forwarders has a pipe, which is listed under \\.\pipe\ */
+static int
+show_all_stats(void)
+{
+	WIN32_FIND_DATAA	data;
+	HANDLE	hfind;
+	int	n_shown = 0;
+
+	hfind = FindFirstFileA("\\\\.\\pipe\\*", &data);
+	if (hfind == INVALID_HANDLE_VALUE) {
+		err("failed to list pipes: err: 0x%lx", GetLastError());
+		return 2;
+	}
+	do {
+		unsigned long	pid;
+
+		if (strncmp(data.cFileName, PIPE_NAME_PREFIX, sizeof(PIPE_NAME_PREFIX) - 1) != 0)
+			continue;
+		if (sscanf_s(data.cFileName + sizeof(PIPE_NAME_PREFIX) - 1, "%lu", &pid) != 1)
+			continue;
+		if (show_stats(pid) == 0)
+			n_shown++;
+	} while (FindNextFileA(hfind, &data));
+	FindClose(hfind);
+
+	if (n_shown == 0)
+		printf("no forwarder is running\n");
+	return 0;
+}
+
+int
+usbip_stats_show(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "pid", required_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 }
+	};
+	unsigned long	pid = 0;
+
+	for (;;) {
+		int	opt = getopt_long(argc, argv, "p:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'p':
+			if (sscanf_s(optarg, "%lu", &pid) != 1) {
+				err("invalid pid: %s", optarg);
+				usbip_stats_usage();
+				return 1;
+			}
+			break;
+		default:
+			err("invalid option: %c", opt);
+			usbip_stats_usage();
+			return 1;
+		}
+	}
+	if (pid != 0)
+		return show_stats(pid);
+	return show_all_stats();
+}
@@ -21,6 +21,8 @@
 #define PROGNAME "usbipd"
 
 #define MAIN_LOOP_TIMEOUT 10
+#define METRICS_PORT_DEFAULT	"9240"
+#define DISCOVERY_GROUP_DEFAULT	"239.255.22.71:5191"
 
 extern SOCKET *get_listen_sockfds(int family);
 extern void accept_request(SOCKET *sockfds, fd_set *pfds);
@@ -42,6 +44,19 @@ static const char usbipd_help_string[] =
 	"	-tPORT, --tcp-port PORT\n"
 	"		Listen on TCP/IP port PORT.\n"
 	"\n"
+	"	-m[PORT], --metrics[=PORT]\n"
+	"		Serve Prometheus metrics on 127.0.0.1:PORT(default: " METRICS_PORT_DEFAULT ").\n"
+	"\n"
+	"	-bRATE, --egress-rate RATE\n"
+	"		Share RATE bytes/s(K, M or G suffixed) among bulk transfers of exported devices.\n"
+	"\n"
+	"	-wRULE, --weight RULE\n"
+	"		Weight and cap devices which RULE matches, as in BUSID|VID:PID|CLASS=WEIGHT[/RATE].\n"
+	"		Control, interrupt and ISO transfers are never held.\n"
+	"\n"
+	"	-D[GROUP], --discovery[=GROUP]\n"
+	"		Answer multicast discovery of clients on GROUP(ADDR[:PORT], default: " DISCOVERY_GROUP_DEFAULT ").\n"
+	"\n"
 	"	-h, --help\n"
 	"		Print this help.\n"
 	"\n"
@@ -55,6 +70,10 @@ static enum {
 } cmd = cmd_standalone_mode;
 
 static int	family = AF_UNSPEC;
+/* port of a metrics server, NULL if disabled */
+static const char	*metrics_port;
+/* multicast group of discovery, NULL if disabled */
+static const char	*discovery_group;
 
 static void
 usbipd_help(void)
@@ -107,6 +126,13 @@ do_standalone_mode(void)
 		return 2;
 	}
 
+	if (metrics_port != NULL && !start_metrics_server(metrics_port))
+		err("failed to start a metrics server: port %s", metrics_port);
+	start_shaper();
+
+	if (discovery_group != NULL && !start_discovery(discovery_group))
+		err("failed to start a discovery responder: %s", discovery_group);
+
 	n_sockfds = setup_fds(sockfds, &fds);
 	while (TRUE) {
 		struct timeval	timeout;
@@ -143,6 +169,10 @@ parse_args(int argc, char *argv[])
 	{ "device",   no_argument,       NULL, 'e' },
 	{ "pid",      optional_argument, NULL, 'P' },
 	{ "tcp-port", required_argument, NULL, 't' },
+	{ "metrics",  optional_argument, NULL, 'm' },
+	{ "discovery", optional_argument, NULL, 'D' },
+	{ "egress-rate", required_argument, NULL, 'b' },
+	{ "weight",   required_argument, NULL, 'w' },
 	{ "help",     no_argument,       NULL, 'h' },
 	{ "version",  no_argument,       NULL, 'v' },
 	{ NULL,	      0,                 NULL,  0 }
@@ -152,7 +182,7 @@ parse_args(int argc, char *argv[])
 	for (;;) {
 		int	opt;
 
-		opt = getopt_long(argc, argv, "46Ddt:hv", longopts, NULL);
+		opt = getopt_long(argc, argv, "46D::dt:m::b:w:hv", longopts, NULL);
 
 		if (opt == -1)
 			break;
@@ -173,6 +203,20 @@ parse_args(int argc, char *argv[])
 		case 't':
 			usbip_setup_port_number(optarg);
 			break;
+		case 'm':
+			metrics_port = optarg != NULL ? optarg : METRICS_PORT_DEFAULT;
+			break;
+		case 'D':
+			discovery_group = optarg != NULL ? optarg : DISCOVERY_GROUP_DEFAULT;
+			break;
+		case 'b':
+			if (!set_egress_rate(optarg))
+				return FALSE;
+			break;
+		case 'w':
+			if (!add_shaper_rule(optarg))
+				return FALSE;
+			break;
 		case 'v':
 			cmd = cmd_version;
 			break;
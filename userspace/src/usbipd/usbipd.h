@@ -6,4 +6,18 @@
 #include "usbip_common.h"
 
 extern int recv_request_import(SOCKET sockfd);
-extern int recv_request_devlist(SOCKET connfd);
\ No newline at end of file
+extern int recv_request_import_ext(SOCKET sockfd);
+extern int recv_request_resume(SOCKET sockfd);
+extern int recv_request_iso_channel(SOCKET sockfd);
+extern int recv_request_devlist(SOCKET connfd);
+extern int get_exported_devices(struct usbip_usb_device **pudevs);
+
+extern BOOL start_metrics_server(const char *port);
+extern void metrics_count_conn(void);
+extern void metrics_count_request(uint16_t code, int ret, LONGLONG ticks);
+
+extern BOOL start_discovery(const char *group);
+
+extern BOOL set_egress_rate(const char *rate);
+extern BOOL add_shaper_rule(const char *rule);
+extern void start_shaper(void);
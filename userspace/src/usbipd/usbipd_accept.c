@@ -9,11 +9,14 @@ static void
 recv_pdu(SOCKET connfd, BOOL *pneed_close_sockfd)
 {
 	uint16_t	code = OP_UNSPEC;
+	LARGE_INTEGER	ts_start, ts_end;
 	int	status;
 	int	ret;
 
 	*pneed_close_sockfd = TRUE;
 
+	QueryPerformanceCounter(&ts_start);
+
 	ret = usbip_net_recv_op_common(connfd, &code, &status);
 	if (ret < 0) {
 		dbg("could not receive opcode: %#0x, %x", code, status);
@@ -31,13 +34,35 @@ recv_pdu(SOCKET connfd, BOOL *pneed_close_sockfd)
 		if (ret == 0)
 			*pneed_close_sockfd = FALSE;
 		break;
+	case OP_REQ_IMPORT_EXT:
+		dbg("received request: %#0x - attach device with extensions", code);
+		ret = recv_request_import_ext(connfd);
+		if (ret == 0)
+			*pneed_close_sockfd = FALSE;
+		break;
+	case OP_REQ_RESUME:
+		dbg("received request: %#0x - resume session", code);
+		ret = recv_request_resume(connfd);
+		if (ret == 0)
+			*pneed_close_sockfd = FALSE;
+		break;
+	case OP_REQ_ISO_CHANNEL:
+		dbg("received request: %#0x - open iso channel", code);
+		ret = recv_request_iso_channel(connfd);
+		if (ret == 0)
+			*pneed_close_sockfd = FALSE;
+		break;
 	case OP_REQ_DEVINFO:
 	case OP_REQ_CRYPKEY:
 	default:
 		dbg("received an unknown opcode: %#0x", code);
+		ret = -1;
 		break;
 	}
 
+	QueryPerformanceCounter(&ts_end);
+	metrics_count_request(code, ret, ts_end.QuadPart - ts_start.QuadPart);
+
 	dbg("request %#0x: done: err: %d", code, ret);
 }
 
@@ -57,6 +82,8 @@ do_accept(SOCKET listenfd)
 		char	host[NI_MAXHOST], port[NI_MAXSERV];
 		int		rc;
 
+		metrics_count_conn();
+
 		rc = getnameinfo((struct sockaddr *)&ss, len, host, sizeof(host),
 			port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
 		if (rc != 0) {
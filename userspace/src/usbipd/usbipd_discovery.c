@@ -0,0 +1,427 @@
+#include "usbipd.h"
+
+#include <ws2tcpip.h>
+#include <stdlib.h>
+
+#include "usbip_network.h"
+
+/*
+ * A responder to multicast discovery of clients such as qtgui. "usbip-find"
+ * is answered with "usbip-host", which has a hash and a version of exportable
+ * devices. "usbip-list" is answered with a json array of them, or with
+ * "usbip-host" if it has an "inventory" of the same hash. Devices are cached
+ * and rescanned periodically. A change is announced to a group with devices
+ * added and bus ids removed so that a client lists a host again only when
+ * its inventory changes. Clients drop anything with "usbip-find" or
+ * "usbip-list", which replies never have.
+ */
+#define DISCOVERY_PORT_DEFAULT	5191
+#define DISCOVERY_SCAN_INTERVAL	3
+#define DISCOVERY_REQ_MAX	1024
+/* json of a device is shorter than this */
+#define DISCOVERY_DEV_JSON_MAX	96
+#define DISCOVERY_DGRAM_MAX	65507
+
+#define FIND_MESSAGE	"usbip-find"
+#define LIST_MESSAGE	"usbip-list"
+#define HOST_MESSAGE	"usbip-host"
+
+typedef struct {
+	/* sorted by bus id */
+	struct usbip_usb_device	*udevs;
+	int	n_udevs;
+	unsigned int	hash;
+	unsigned int	version;
+} inventory_t;
+
+typedef struct {
+	SOCKET	sockfd;
+	struct sockaddr_in	addr_group;
+	inventory_t	inv;
+} discovery_t;
+
+static discovery_t	disc;
+
+static int
+compare_udev(const void *a, const void *b)
+{
+	return strcmp(((const struct usbip_usb_device *)a)->busid, ((const struct usbip_usb_device *)b)->busid);
+}
+
+static unsigned int
+hash_bytes(unsigned int hash, const void *data, size_t len)
+{
+	const unsigned char	*p = (const unsigned char *)data;
+	size_t	i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static unsigned int
+hash_inventory(const inventory_t *inv)
+{
+	unsigned int	hash = 2166136261;
+	int	i;
+
+	for (i = 0; i < inv->n_udevs; i++) {
+		const struct usbip_usb_device	*udev = inv->udevs + i;
+
+		hash = hash_bytes(hash, udev->busid, strlen(udev->busid) + 1);
+		hash = hash_bytes(hash, &udev->idVendor, sizeof(udev->idVendor));
+		hash = hash_bytes(hash, &udev->idProduct, sizeof(udev->idProduct));
+	}
+	return hash;
+}
+
+static BOOL
+scan_inventory(inventory_t *inv)
+{
+	inv->n_udevs = get_exported_devices(&inv->udevs);
+	if (inv->n_udevs < 0)
+		return FALSE;
+	qsort(inv->udevs, inv->n_udevs, sizeof(struct usbip_usb_device), compare_udev);
+	inv->hash = hash_inventory(inv);
+	return TRUE;
+}
+
+static const struct usbip_usb_device *
+find_udev(const inventory_t *inv, const struct usbip_usb_device *udev)
+{
+	return (const struct usbip_usb_device *)bsearch(udev, inv->udevs, inv->n_udevs, sizeof(struct usbip_usb_device), compare_udev);
+}
+
+static BOOL
+is_same_udev(const struct usbip_usb_device *udev1, const struct usbip_usb_device *udev2)
+{
+	return udev1->idVendor == udev2->idVendor && udev1->idProduct == udev2->idProduct;
+}
+
+static BOOL
+is_same_inventory(const inventory_t *inv1, const inventory_t *inv2)
+{
+	int	i;
+
+	if (inv1->n_udevs != inv2->n_udevs)
+		return FALSE;
+	for (i = 0; i < inv1->n_udevs; i++) {
+		if (compare_udev(inv1->udevs + i, inv2->udevs + i) != 0 || !is_same_udev(inv1->udevs + i, inv2->udevs + i))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+append_udev(char *buf, int len, const struct usbip_usb_device *udev, BOOL first)
+{
+	return len + sprintf(buf + len, "%s{\"busid\":\"%s\",\"vendor\":\"%04x\",\"product\":\"%04x\"}",
+		first ? "" : ",", udev->busid, udev->idVendor, udev->idProduct);
+}
+
+/* a json array of devices, which a caller frees */
+static char *
+build_list_message(const inventory_t *inv)
+{
+	char	*msg;
+	int	len = 0, i;
+
+	msg = (char *)malloc(3 + inv->n_udevs * DISCOVERY_DEV_JSON_MAX);
+	if (msg == NULL)
+		return NULL;
+	msg[len++] = '[';
+	for (i = 0; i < inv->n_udevs; i++)
+		len = append_udev(msg, len, inv->udevs + i, i == 0);
+	strcpy(msg + len, "]");
+	return msg;
+}
+
+/*
+ * "usbip-host" of an inventory, which a caller frees. A change from inv_old
+ * is added if it's not NULL. A device whose vendor or product differs on the
+ * same bus id is added only.
+ */
+static char *
+build_host_message(const inventory_t *inv, const inventory_t *inv_old)
+{
+	char	*msg;
+	int	len, i;
+	BOOL	first = TRUE;
+
+	len = 128;
+	if (inv_old != NULL)
+		len += inv->n_udevs * DISCOVERY_DEV_JSON_MAX + inv_old->n_udevs * (USBIP_BUS_ID_SIZE + 4);
+	msg = (char *)malloc(len);
+	if (msg == NULL)
+		return NULL;
+
+	len = sprintf(msg, "{\"message\":\"" HOST_MESSAGE "\",\"inventory\":\"%08x\",\"version\":%u,\"ndev\":%d",
+		inv->hash, inv->version, inv->n_udevs);
+	if (inv_old != NULL) {
+		len += sprintf(msg + len, ",\"added\":[");
+		for (i = 0; i < inv->n_udevs; i++) {
+			const struct usbip_usb_device	*udev_old = find_udev(inv_old, inv->udevs + i);
+
+			if (udev_old == NULL || !is_same_udev(udev_old, inv->udevs + i)) {
+				len = append_udev(msg, len, inv->udevs + i, first);
+				first = FALSE;
+			}
+		}
+		len += sprintf(msg + len, "],\"removed\":[");
+		first = TRUE;
+		for (i = 0; i < inv_old->n_udevs; i++) {
+			if (find_udev(inv, inv_old->udevs + i) == NULL) {
+				len += sprintf(msg + len, "%s\"%s\"", first ? "" : ",", inv_old->udevs[i].busid);
+				first = FALSE;
+			}
+		}
+		len += sprintf(msg + len, "]");
+	}
+	strcpy(msg + len, "}");
+	return msg;
+}
+
+static void
+send_message(const char *msg, const struct sockaddr_in *addr)
+{
+	size_t	len = strlen(msg);
+
+	if (len > DISCOVERY_DGRAM_MAX) {
+		dbg("too long discovery message: %zu", len);
+		return;
+	}
+	if (sendto(disc.sockfd, msg, (int)len, 0, (const struct sockaddr *)addr, sizeof(*addr)) == SOCKET_ERROR)
+		dbg("failed to send a discovery message: err: %d", WSAGetLastError());
+}
+
+static void
+send_host_message(const inventory_t *inv_old, const struct sockaddr_in *addr)
+{
+	char	*msg;
+
+	msg = build_host_message(&disc.inv, inv_old);
+	if (msg == NULL) {
+		dbg("out of memory");
+		return;
+	}
+	send_message(msg, addr);
+	free(msg);
+}
+
+static void
+send_list_message(const struct sockaddr_in *addr)
+{
+	char	*msg;
+
+	msg = build_list_message(&disc.inv);
+	if (msg == NULL) {
+		dbg("out of memory");
+		return;
+	}
+	send_message(msg, addr);
+	free(msg);
+}
+
+/* "inventory" of a request, if any */
+static BOOL
+get_req_inventory(const char *req, unsigned int *phash)
+{
+	const char	*p;
+
+	p = strstr(req, "\"inventory\"");
+	if (p == NULL)
+		return FALSE;
+	p = strchr(p + 11, '"');
+	if (p == NULL)
+		return FALSE;
+	return sscanf(p + 1, "%8x", phash) == 1;
+}
+
+static void
+recv_discovery_request(void)
+{
+	struct sockaddr_in	addr;
+	char	req[DISCOVERY_REQ_MAX + 1];
+	int	addrlen = sizeof(addr);
+	int	len;
+	unsigned int	hash;
+
+	len = recvfrom(disc.sockfd, req, DISCOVERY_REQ_MAX, 0, (struct sockaddr *)&addr, &addrlen);
+	if (len == SOCKET_ERROR) {
+		/* WSAECONNRESET by an ICMP error of a former reply is not fatal */
+		dbg("failed to receive a discovery request: err: %d", WSAGetLastError());
+		return;
+	}
+	if (addr.sin_family != AF_INET)
+		return;
+	req[len] = '\0';
+
+	/* a list request is json, which could have anything else */
+	if (strstr(req, LIST_MESSAGE) != NULL) {
+		if (get_req_inventory(req, &hash) && hash == disc.inv.hash)
+			send_host_message(NULL, &addr);
+		else
+			send_list_message(&addr);
+	}
+	else if (strstr(req, FIND_MESSAGE) != NULL) {
+		send_host_message(NULL, &addr);
+	}
+}
+
+static void
+rescan_inventory(void)
+{
+	inventory_t	inv, inv_old;
+
+	if (!scan_inventory(&inv))
+		return;
+	if (is_same_inventory(&inv, &disc.inv)) {
+		free(inv.udevs);
+		return;
+	}
+	inv.version = disc.inv.version + 1;
+	inv_old = disc.inv;
+	disc.inv = inv;
+	dbg("inventory changed: version: %u, devices: %d", inv.version, inv.n_udevs);
+
+	send_host_message(&inv_old, &disc.addr_group);
+	free(inv_old.udevs);
+}
+
+static DWORD WINAPI
+discovery_responder(LPVOID ctx)
+{
+	ULONGLONG	t_scan;
+
+	UNREFERENCED_PARAMETER(ctx);
+
+	t_scan = GetTickCount64() + DISCOVERY_SCAN_INTERVAL * 1000;
+	while (TRUE) {
+		fd_set	fds;
+		struct timeval	timeout;
+		ULONGLONG	now;
+		int	rc;
+
+		FD_ZERO(&fds);
+		FD_SET(disc.sockfd, &fds);
+		timeout.tv_sec = DISCOVERY_SCAN_INTERVAL;
+		timeout.tv_usec = 0;
+		rc = select(0, &fds, NULL, NULL, &timeout);
+		if (rc == SOCKET_ERROR) {
+			dbg("failed to select: err: %d", WSAGetLastError());
+			break;
+		}
+		if (rc > 0)
+			recv_discovery_request();
+
+		/* requests are answered from a cache however frequent they are */
+		now = GetTickCount64();
+		if (now >= t_scan) {
+			rescan_inventory();
+			t_scan = now + DISCOVERY_SCAN_INTERVAL * 1000;
+		}
+	}
+	err("discovery responder halted by socket error");
+	closesocket(disc.sockfd);
+	return 0;
+}
+
+/* group is ADDR[:PORT] */
+static BOOL
+parse_group(const char *group, struct sockaddr_in *addr)
+{
+	char	host[INET_ADDRSTRLEN];
+	const char	*colon;
+	size_t	len;
+	int	port = DISCOVERY_PORT_DEFAULT;
+
+	colon = strchr(group, ':');
+	len = colon != NULL ? (size_t)(colon - group) : strlen(group);
+	if (len == 0 || len >= sizeof(host))
+		return FALSE;
+	memcpy(host, group, len);
+	host[len] = '\0';
+	if (colon != NULL) {
+		port = atoi(colon + 1);
+		if (port <= 0 || port > 65535)
+			return FALSE;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons((u_short)port);
+	if (inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+		return FALSE;
+	return IN_MULTICAST(ntohl(addr->sin_addr.s_addr));
+}
+
+static SOCKET
+build_discovery_sockfd(const struct sockaddr_in *addr_group)
+{
+	struct sockaddr_in	addr;
+	struct ip_mreq	mreq;
+	SOCKET	sockfd;
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sockfd == INVALID_SOCKET) {
+		dbg("socket error: err: %d", WSAGetLastError());
+		return INVALID_SOCKET;
+	}
+	/* qtgui on the same host shares a port */
+	usbip_net_set_reuseaddr(sockfd);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = addr_group->sin_port;
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+		dbg("failed to bind: err: %d", WSAGetLastError());
+		closesocket(sockfd);
+		return INVALID_SOCKET;
+	}
+
+	mreq.imr_multiaddr = addr_group->sin_addr;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *)&mreq, sizeof(mreq)) == SOCKET_ERROR) {
+		dbg("failed to join a group: err: %d", WSAGetLastError());
+		closesocket(sockfd);
+		return INVALID_SOCKET;
+	}
+	return sockfd;
+}
+
+BOOL
+start_discovery(const char *group)
+{
+	HANDLE	hthread;
+
+	if (!parse_group(group, &disc.addr_group)) {
+		err("invalid multicast group: %s", group);
+		return FALSE;
+	}
+	disc.sockfd = build_discovery_sockfd(&disc.addr_group);
+	if (disc.sockfd == INVALID_SOCKET)
+		return FALSE;
+	if (!scan_inventory(&disc.inv)) {
+		closesocket(disc.sockfd);
+		return FALSE;
+	}
+	disc.inv.version = 1;
+
+	/* clients which have looked for hosts learn of a new one */
+	send_host_message(NULL, &disc.addr_group);
+
+	hthread = CreateThread(NULL, 0, discovery_responder, NULL, 0, NULL);
+	if (hthread == NULL) {
+		dbg("failed to start discovery responder: err: 0x%lx", GetLastError());
+		closesocket(disc.sockfd);
+		free(disc.inv.udevs);
+		return FALSE;
+	}
+	CloseHandle(hthread);
+	info("answering discovery on %s", group);
+	return TRUE;
+}
@@ -4,22 +4,157 @@
 #include "usbipd_stub.h"
 #include "usbip_setupdi.h"
 #include "usbip_forward.h"
+#include "usbip_dscr_hash.h"
+#include "usbip_session.h"
 
-typedef struct {
+/* protocol extensions which usbipd accepts */
+#define EXT_SUPPORTED	(USBIP_EXT_COMPACT | USBIP_EXT_COMPRESS | USBIP_EXT_DSCR_HASH | USBIP_EXT_RESUME | USBIP_EXT_ISO_CHANNEL)
+
+/* how long a forwarder waits for OP_REQ_ISO_CHANNEL before it starts without it */
+#define ISO_CHANNEL_WAIT_MS	5000
+
+typedef struct _forwarder_ctx {
 	HANDLE	hdev;
 	SOCKET	sockfd;
+	UINT32	features;
+	UINT32	devid;
+	/* NULL unless USBIP_EXT_RESUME is accepted */
+	usbip_session_t	*sess;
+	/* a token of OP_REQ_ISO_CHANNEL, 0 if not accepted or no longer waited for */
+	UINT32	token_iso;
+	SOCKET	sockfd_iso;
+	HANDLE	hEventIso;
+	/* NULL if egress is not shaped */
+	usbip_shaper_dev_t	*shaper;
+	PTP_WORK	work;
+	struct _forwarder_ctx	*next;
 } forwarder_ctx_t;
 
+/* forwarders which OP_REQ_RESUME or OP_REQ_ISO_CHANNEL look up by a token */
+static forwarder_ctx_t	*forwarders;
+static SRWLOCK	lock_forwarders = SRWLOCK_INIT;
+
+static void
+register_forwarder(forwarder_ctx_t *pctx)
+{
+	AcquireSRWLockExclusive(&lock_forwarders);
+	pctx->next = forwarders;
+	forwarders = pctx;
+	ReleaseSRWLockExclusive(&lock_forwarders);
+}
+
+static void
+unregister_forwarder(forwarder_ctx_t *pctx)
+{
+	forwarder_ctx_t	**pnext;
+
+	AcquireSRWLockExclusive(&lock_forwarders);
+	for (pnext = &forwarders; *pnext != NULL; pnext = &(*pnext)->next) {
+		if (*pnext == pctx) {
+			*pnext = pctx->next;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_forwarders);
+}
+
+static BOOL
+hand_over_resumable(UINT32 token, SOCKET sockfd, UINT32 *seqnums, UINT32 n_seqnums)
+{
+	forwarder_ctx_t	*pctx;
+	BOOL	res = FALSE;
+
+	AcquireSRWLockShared(&lock_forwarders);
+	for (pctx = forwarders; pctx != NULL; pctx = pctx->next) {
+		if (pctx->sess != NULL && pctx->sess->token == token) {
+			res = usbip_session_hand_over(pctx->sess, sockfd, seqnums, n_seqnums);
+			break;
+		}
+	}
+	ReleaseSRWLockShared(&lock_forwarders);
+	return res;
+}
+
+/* a reply goes ahead of PDUs, which a forwarder may send as soon as handed over */
+static BOOL
+hand_over_iso_channel(UINT32 token, SOCKET sockfd)
+{
+	forwarder_ctx_t	*pctx;
+	BOOL	res = FALSE;
+
+	AcquireSRWLockExclusive(&lock_forwarders);
+	for (pctx = forwarders; pctx != NULL; pctx = pctx->next) {
+		if (pctx->token_iso != 0 && pctx->token_iso == token) {
+			if (usbip_net_send_op_common(sockfd, OP_REP_ISO_CHANNEL, ST_OK) < 0) {
+				dbg("usbip_net_send_op_common failed: %#0x", OP_REP_ISO_CHANNEL);
+				break;
+			}
+			pctx->sockfd_iso = sockfd;
+			pctx->token_iso = 0;
+			SetEvent(pctx->hEventIso);
+			res = TRUE;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_forwarders);
+	return res;
+}
+
+/* an ISO channel handed over later than this is refused */
+static SOCKET
+wait_iso_channel(forwarder_ctx_t *pctx)
+{
+	SOCKET	sockfd;
+
+	WaitForSingleObject(pctx->hEventIso, ISO_CHANNEL_WAIT_MS);
+
+	AcquireSRWLockExclusive(&lock_forwarders);
+	pctx->token_iso = 0;
+	sockfd = pctx->sockfd_iso;
+	ReleaseSRWLockExclusive(&lock_forwarders);
+
+	if (sockfd == INVALID_SOCKET)
+		dbg("no iso channel opened, iso transfers go through a socket");
+	return sockfd;
+}
+
+static void
+free_session(usbip_session_t *sess)
+{
+	usbip_session_cleanup(sess);
+	free(sess);
+}
+
 static VOID CALLBACK
 forwarder_stub(PTP_CALLBACK_INSTANCE inst, PVOID ctx, PTP_WORK work)
 {
 	forwarder_ctx_t	*pctx = (forwarder_ctx_t *)ctx;
+	SOCKET	sockfd_iso = INVALID_SOCKET;
+
+	if (pctx->hEventIso != NULL)
+		sockfd_iso = wait_iso_channel(pctx);
 
 	dbg("stub forwarding started");
 
-	usbip_forward((HANDLE)pctx->sockfd, pctx->hdev, TRUE);
+	usbip_forward((HANDLE)pctx->sockfd, pctx->hdev, TRUE, pctx->features, pctx->devid, pctx->sess, (HANDLE)sockfd_iso, pctx->shaper);
 
-	closesocket(pctx->sockfd);
+	if (pctx->sess != NULL || pctx->hEventIso != NULL)
+		unregister_forwarder(pctx);
+	if (pctx->hEventIso != NULL) {
+		if (sockfd_iso != INVALID_SOCKET)
+			closesocket(sockfd_iso);
+		CloseHandle(pctx->hEventIso);
+	}
+	if (pctx->sess != NULL) {
+		/* a connection may have been replaced on resumption */
+		if (pctx->sess->sockfd != INVALID_SOCKET)
+			closesocket(pctx->sess->sockfd);
+		free_session(pctx->sess);
+	}
+	else
+		closesocket(pctx->sockfd);
+	if (pctx->shaper != NULL)
+		usbip_shaper_close(pctx->shaper);
 	CloseHandle(pctx->hdev);
 	free(pctx);
 
@@ -28,10 +163,14 @@ forwarder_stub(PTP_CALLBACK_INSTANCE inst, PVOID ctx, PTP_WORK work)
 	dbg("stub forwarding stopped");
 }
 
+/*
+ * a forwarder is created before an import is replied, and started after it.
+ * shaper is closed by a forwarder, or by a caller on an error
+ */
 static int
-export_device(devno_t devno, SOCKET sockfd)
+create_forwarder(devno_t devno, SOCKET sockfd, UINT32 features, UINT32 devid, usbip_session_t *sess, UINT32 token_iso,
+		 usbip_shaper_dev_t *shaper, forwarder_ctx_t **ppctx)
 {
-	PTP_WORK	work;
 	forwarder_ctx_t	*pctx;
 
 	pctx = (forwarder_ctx_t *)malloc(sizeof(forwarder_ctx_t));
@@ -42,18 +181,199 @@ export_device(devno_t devno, SOCKET sockfd)
 	pctx->hdev = open_stub_dev(devno);
 	if (pctx->hdev == INVALID_HANDLE_VALUE) {
 		dbg("cannot open devno: %hhu", devno);
+		free(pctx);
 		return ERR_NOTEXIST;
 	}
 	pctx->sockfd = sockfd;
+	pctx->features = features;
+	pctx->devid = devid;
+	pctx->sess = sess;
+	pctx->token_iso = token_iso;
+	pctx->sockfd_iso = INVALID_SOCKET;
+	pctx->hEventIso = NULL;
+	pctx->shaper = shaper;
+	if (token_iso != 0) {
+		pctx->hEventIso = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (pctx->hEventIso == NULL) {
+			dbg("failed to create event: 0x%lx", GetLastError());
+			CloseHandle(pctx->hdev);
+			free(pctx);
+			return ERR_GENERAL;
+		}
+	}
 
-	work = CreateThreadpoolWork(forwarder_stub, pctx, NULL);
-	if (work == NULL) {
+	pctx->work = CreateThreadpoolWork(forwarder_stub, pctx, NULL);
+	if (pctx->work == NULL) {
 		dbg("failed to create thread pool work: error: %lx", GetLastError());
+		if (pctx->hEventIso != NULL)
+			CloseHandle(pctx->hEventIso);
 		CloseHandle(pctx->hdev);
 		free(pctx);
 		return ERR_GENERAL;
 	}
-	SubmitThreadpoolWork(work);
+	*ppctx = pctx;
+	return 0;
+}
+
+/* a forwarder not started leaves a socket, a session and a shaper to a caller */
+static void
+free_forwarder(forwarder_ctx_t *pctx)
+{
+	CloseThreadpoolWork(pctx->work);
+	if (pctx->hEventIso != NULL)
+		CloseHandle(pctx->hEventIso);
+	CloseHandle(pctx->hdev);
+	free(pctx);
+}
+
+/*
+ * a socket belongs to a forwarder once started. Requests are accepted one by one,
+ * so a forwarder is registered before a request with its tokens is received
+ */
+static void
+start_forwarder(forwarder_ctx_t *pctx)
+{
+	if (pctx->sess != NULL || pctx->hEventIso != NULL)
+		register_forwarder(pctx);
+	SubmitThreadpoolWork(pctx->work);
+}
+
+static int
+send_import_reply(SOCKET sockfd, uint16_t code, struct usbip_usb_device *udev, UINT32 features, UINT32 dscr_hash,
+		  UINT32 token, UINT32 token_iso)
+{
+	int rc;
+
+	rc = usbip_net_send_op_common(sockfd, code, ST_OK);
+	if (rc < 0) {
+		dbg("usbip_net_send_op_common failed: %#0x", code);
+		return -1;
+	}
+
+	usbip_net_pack_usb_device(1, udev);
+
+	rc = usbip_net_send(sockfd, udev, sizeof(*udev));
+	if (rc < 0) {
+		dbg("usbip_net_send failed: devinfo");
+		return -1;
+	}
+
+	if (code == OP_REP_IMPORT_EXT) {
+		UINT32	features_net = features;
+
+		usbip_net_pack_uint32_t(1, &features_net);
+		rc = usbip_net_send(sockfd, &features_net, sizeof(features_net));
+		if (rc < 0) {
+			dbg("usbip_net_send failed: features");
+			return -1;
+		}
+	}
+	if (features & USBIP_EXT_DSCR_HASH) {
+		usbip_net_pack_uint32_t(1, &dscr_hash);
+		rc = usbip_net_send(sockfd, &dscr_hash, sizeof(dscr_hash));
+		if (rc < 0) {
+			dbg("usbip_net_send failed: descriptor hash");
+			return -1;
+		}
+	}
+	if (features & USBIP_EXT_RESUME) {
+		usbip_net_pack_uint32_t(1, &token);
+		rc = usbip_net_send(sockfd, &token, sizeof(token));
+		if (rc < 0) {
+			dbg("usbip_net_send failed: session token");
+			return -1;
+		}
+	}
+	if (features & USBIP_EXT_ISO_CHANNEL) {
+		usbip_net_pack_uint32_t(1, &token_iso);
+		rc = usbip_net_send(sockfd, &token_iso, sizeof(token_iso));
+		if (rc < 0) {
+			dbg("usbip_net_send failed: iso channel token");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * features are sent after udev if an import is requested with OP_REQ_IMPORT_EXT,
+ * followed by a descriptor hash if USBIP_EXT_DSCR_HASH is accepted, by a token
+ * of a session if USBIP_EXT_RESUME is accepted, and by a token of an ISO channel
+ * if USBIP_EXT_ISO_CHANNEL is accepted
+ */
+static int
+import_device(SOCKET sockfd, const char *busid, uint16_t code, UINT32 features)
+{
+	struct usbip_usb_device	udev;
+	UINT32	dscr_hash = USBIP_DSCR_HASH_NONE;
+	UINT32	token = 0, token_iso = 0;
+	usbip_session_t	*sess = NULL;
+	usbip_shaper_dev_t	*shaper;
+	forwarder_ctx_t	*pctx;
+	devno_t	devno;
+	UINT32	devid;
+	int rc;
+
+	devno = get_devno_from_busid(busid);
+	if (devno == 0) {
+		dbg("invalid bus id: %s", busid);
+		usbip_net_send_op_common(sockfd, code, ST_NODEV);
+		return -1;
+	}
+
+	build_udev(devno, &udev, (features & USBIP_EXT_DSCR_HASH) ? &dscr_hash : NULL);
+	/* an old stub driver does not report a hash */
+	if ((features & USBIP_EXT_DSCR_HASH) && dscr_hash == USBIP_DSCR_HASH_NONE)
+		features &= ~USBIP_EXT_DSCR_HASH;
+
+	usbip_net_set_keepalive(sockfd);
+
+	/* should set TCP_NODELAY for usbip */
+	usbip_net_set_nodelay(sockfd);
+
+	if (features & USBIP_EXT_RESUME) {
+		sess = (usbip_session_t *)malloc(sizeof(usbip_session_t));
+		if (sess != NULL && usbip_session_init_server(sess, sockfd))
+			token = sess->token;
+		else {
+			free(sess);
+			sess = NULL;
+			features &= ~USBIP_EXT_RESUME;
+		}
+	}
+
+	if (features & USBIP_EXT_ISO_CHANNEL)
+		token_iso = usbip_session_gen_token();
+
+	devid = udev.busnum << 16 | udev.devnum;
+	shaper = open_shaper_dev(devno, &udev, devid);
+
+	/* export device needs a TCP/IP socket descriptor */
+	rc = create_forwarder(devno, sockfd, features, devid, sess, token_iso, shaper, &pctx);
+	if (rc < 0) {
+		dbg("failed to export device: %s, err:%d", busid, rc);
+		if (shaper != NULL)
+			usbip_shaper_close(shaper);
+		if (sess != NULL)
+			free_session(sess);
+		usbip_net_send_op_common(sockfd, code, ST_NA);
+		return -1;
+	}
+
+	/* nothing is registered for resumption yet, so a caller closes a socket */
+	if (send_import_reply(sockfd, code, &udev, features, dscr_hash, token, token_iso) < 0) {
+		free_forwarder(pctx);
+		if (shaper != NULL)
+			usbip_shaper_close(shaper);
+		if (sess != NULL)
+			free_session(sess);
+		return -1;
+	}
+
+	start_forwarder(pctx);
+
+	dbg("import request busid %s: complete", busid);
+
 	return 0;
 }
 
@@ -61,8 +381,6 @@ int
 recv_request_import(SOCKET sockfd)
 {
 	struct op_import_request req;
-	struct usbip_usb_device	udev;
-	devno_t	devno;
 	int rc;
 
 	memset(&req, 0, sizeof(req));
@@ -74,42 +392,118 @@ recv_request_import(SOCKET sockfd)
 	}
 	PACK_OP_IMPORT_REQUEST(0, &req);
 
-	devno = get_devno_from_busid(req.busid);
-	if (devno == 0) {
-		dbg("invalid bus id: %s", req.busid);
-		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NODEV);
+	return import_device(sockfd, req.busid, OP_REP_IMPORT, 0);
+}
+
+int
+recv_request_import_ext(SOCKET sockfd)
+{
+	struct op_import_ext_request req;
+	UINT32	features;
+	int rc;
+
+	memset(&req, 0, sizeof(req));
+
+	rc = usbip_net_recv(sockfd, &req, sizeof(req));
+	if (rc < 0) {
+		dbg("usbip_net_recv failed: import ext request");
 		return -1;
 	}
+	PACK_OP_IMPORT_EXT_REQUEST(0, &req);
 
-	usbip_net_set_keepalive(sockfd);
+	dbg("requested features: %x", req.features);
 
-	/* should set TCP_NODELAY for usbip */
-	usbip_net_set_nodelay(sockfd);
+	features = req.features & EXT_SUPPORTED;
+	if (!(features & USBIP_EXT_COMPACT))
+		features &= ~USBIP_EXT_COMPRESS;
+	/* a session does not cover an ISO channel */
+	if (features & USBIP_EXT_RESUME)
+		features &= ~USBIP_EXT_ISO_CHANNEL;
 
-	/* export device needs a TCP/IP socket descriptor */
-	rc = export_device(devno, sockfd);
+	return import_device(sockfd, req.busid, OP_REP_IMPORT_EXT, features);
+}
+
+/* a connection is handed over to a forwarder, which replies to a request */
+int
+recv_request_resume(SOCKET sockfd)
+{
+	struct op_resume_request	req;
+	UINT32	*seqnums;
+	UINT32	i;
+	int	rc;
+
+	memset(&req, 0, sizeof(req));
+
+	rc = usbip_net_recv(sockfd, &req, sizeof(req));
 	if (rc < 0) {
-		dbg("failed to export device: %s, err:%d", req.busid, rc);
-		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NA);
+		dbg("usbip_net_recv failed: resume request");
 		return -1;
 	}
+	PACK_OP_RESUME_REQUEST(0, &req);
 
-	rc = usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_OK);
-	if (rc < 0) {
-		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
+	if (req.n_seqnums > USBIP_SESSION_MAX_INFLIGHT) {
+		dbg("too many seqnums to resume: %u", req.n_seqnums);
+		usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_ERROR);
+		return -1;
+	}
+	seqnums = (UINT32 *)malloc(sizeof(UINT32) * (req.n_seqnums + 1));
+	if (seqnums == NULL) {
+		dbg("out of memory");
+		usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_ERROR);
 		return -1;
 	}
+	if (req.n_seqnums > 0) {
+		rc = usbip_net_recv(sockfd, seqnums, sizeof(UINT32) * req.n_seqnums);
+		if (rc < 0) {
+			dbg("usbip_net_recv failed: seqnums");
+			free(seqnums);
+			return -1;
+		}
+	}
+	for (i = 0; i < req.n_seqnums; i++)
+		usbip_net_pack_uint32_t(0, &seqnums[i]);
 
-	build_udev(devno, &udev);
-	usbip_net_pack_usb_device(1, &udev);
+	usbip_net_set_keepalive(sockfd);
+	usbip_net_set_nodelay(sockfd);
 
-	rc = usbip_net_send(sockfd, &udev, sizeof(udev));
+	if (!hand_over_resumable(req.token, sockfd, seqnums, req.n_seqnums)) {
+		dbg("no session to resume: token: %x", req.token);
+		free(seqnums);
+		usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_NA);
+		return -1;
+	}
+
+	dbg("resume request: handed over");
+
+	return 0;
+}
+
+/* a connection is handed over to a forwarder waiting for it, which forwards ISO transfers */
+int
+recv_request_iso_channel(SOCKET sockfd)
+{
+	struct op_iso_channel_request	req;
+	int	rc;
+
+	memset(&req, 0, sizeof(req));
+
+	rc = usbip_net_recv(sockfd, &req, sizeof(req));
 	if (rc < 0) {
-		dbg("usbip_net_send failed: devinfo");
+		dbg("usbip_net_recv failed: iso channel request");
 		return -1;
 	}
+	PACK_OP_ISO_CHANNEL_REQUEST(0, &req);
 
-	dbg("import request busid %s: complete", req.busid);
+	usbip_net_set_keepalive(sockfd);
+	usbip_net_set_nodelay(sockfd);
+
+	if (!hand_over_iso_channel(req.token, sockfd)) {
+		dbg("no forwarder waits for an iso channel: token: %x", req.token);
+		usbip_net_send_op_common(sockfd, OP_REP_ISO_CHANNEL, ST_NA);
+		return -1;
+	}
+
+	dbg("iso channel request: handed over");
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -42,14 +42,14 @@ walker_edev_list(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t dev
 	edev_t	*edev;
 	edev_list_ctx_t	*pctx = (edev_list_ctx_t *)ctx;
 
+	if (!is_stub_devno(devno))
+		return 0;
 	edev = (edev_t *)malloc(sizeof(edev_t));
 	if (edev == NULL) {
 		dbg("out of memory");
 		return 0;
 	}
-	if (!is_stub_devno(devno))
-		return 0;
-	if (!build_udev(devno, &edev->udev)) {
+	if (!build_udev(devno, &edev->udev, NULL)) {
 		dbg("cannot build usbip dev");
 		free(edev);
 		return 0;
@@ -85,6 +85,29 @@ free_edev_list(struct list_head *head)
 	}
 }
 
+/* exportable devices in an array, which a caller frees. -1 if out of memory */
+int
+get_exported_devices(struct usbip_usb_device **pudevs)
+{
+	struct list_head	edev_list, *p;
+	struct usbip_usb_device	*udevs;
+	int	n_edevs, i = 0;
+
+	get_edev_list(&edev_list, &n_edevs);
+	udevs = (struct usbip_usb_device *)malloc(sizeof(struct usbip_usb_device) * (n_edevs > 0 ? n_edevs : 1));
+	if (udevs == NULL) {
+		dbg("out of memory");
+		free_edev_list(&edev_list);
+		return -1;
+	}
+	list_for_each(p, &edev_list) {
+		udevs[i++] = list_entry(p, edev_t, list)->udev;
+	}
+	free_edev_list(&edev_list);
+	*pudevs = udevs;
+	return n_edevs;
+}
+
 static int
 send_reply_devlist(SOCKET connfd)
 {
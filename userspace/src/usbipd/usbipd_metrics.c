@@ -0,0 +1,408 @@
+#include "usbipd.h"
+
+#include <ws2tcpip.h>
+
+#include "usbip_network.h"
+#include "usbip_util.h"
+#include "usbip_stats.h"
+#include "usbip_shaper.h"
+
+#define METRICS_REQ_MAX		4096
+#define METRICS_RESP_INIT	16384
+#define METRICS_RECV_TIMEOUT	3000
+
+/* kinds of requests which are counted */
+#define REQ_DEVLIST	0
+#define REQ_IMPORT	1
+#define REQ_IMPORT_EXT	2
+#define REQ_RESUME	3
+#define REQ_ISO_CHANNEL	4
+#define REQ_UNKNOWN	5
+#define N_REQS		6
+
+/* upper bounds in seconds of latency buckets for requests */
+static const double	req_buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5 };
+#define N_REQ_BUCKETS	(sizeof(req_buckets) / sizeof(req_buckets[0]))
+
+static const char	*req_names[N_REQS] = { "devlist", "import", "import_ext", "resume", "iso_channel", "unknown" };
+
+typedef struct {
+	unsigned long	n_oks, n_errors;
+	/* the last bucket is +Inf */
+	unsigned long	buckets[N_REQ_BUCKETS + 1];
+	double	sum;
+} req_metrics_t;
+
+/* totals of endpoints of a device being forwarded */
+typedef struct {
+	UINT32	devid;
+	unsigned long long	n_pdus, n_bytes, n_errors, n_unlinks;
+	LONG	outstanding;
+	unsigned long	len_bufs, len_queued;
+} dev_metrics_t;
+
+typedef struct {
+	dev_metrics_t	*devs;
+	int	n_devs, n_devs_max;
+} dev_walk_t;
+
+/* copies of shaped devices, of which us_throttled includes a current hold */
+typedef struct {
+	usbip_shaper_dev_t	*devs;
+	int	n_devs, n_devs_max;
+} shaper_walk_t;
+
+static unsigned long	n_conns;
+static req_metrics_t	reqs[N_REQS];
+static SRWLOCK	lock_metrics = SRWLOCK_INIT;
+static LONGLONG	ticks_per_sec;
+
+static int
+get_req_kind(uint16_t code)
+{
+	switch (code) {
+	case OP_REQ_DEVLIST:
+		return REQ_DEVLIST;
+	case OP_REQ_IMPORT:
+		return REQ_IMPORT;
+	case OP_REQ_IMPORT_EXT:
+		return REQ_IMPORT_EXT;
+	case OP_REQ_RESUME:
+		return REQ_RESUME;
+	case OP_REQ_ISO_CHANNEL:
+		return REQ_ISO_CHANNEL;
+	default:
+		return REQ_UNKNOWN;
+	}
+}
+
+void
+metrics_count_conn(void)
+{
+	AcquireSRWLockExclusive(&lock_metrics);
+	n_conns++;
+	ReleaseSRWLockExclusive(&lock_metrics);
+}
+
+void
+metrics_count_request(uint16_t code, int ret, LONGLONG ticks)
+{
+	req_metrics_t	*req = &reqs[get_req_kind(code)];
+	double	secs;
+	unsigned	i;
+
+	if (ticks_per_sec == 0)
+		return;
+	secs = (double)ticks / ticks_per_sec;
+
+	AcquireSRWLockExclusive(&lock_metrics);
+	if (ret == 0)
+		req->n_oks++;
+	else
+		req->n_errors++;
+	for (i = 0; i < N_REQ_BUCKETS; i++) {
+		if (secs <= req_buckets[i])
+			break;
+	}
+	req->buckets[i]++;
+	req->sum += secs;
+	ReleaseSRWLockExclusive(&lock_metrics);
+}
+
+static void
+collect_dev(usbip_stats_t *stats, void *ctx)
+{
+	dev_walk_t	*walk = (dev_walk_t *)ctx;
+	dev_metrics_t	*dev;
+	int	i;
+
+	if (walk->n_devs == walk->n_devs_max) {
+		int	n_devs_max = walk->n_devs_max > 0 ? walk->n_devs_max * 2 : 64;
+		dev_metrics_t	*devsnew;
+
+		devsnew = (dev_metrics_t *)realloc(walk->devs, sizeof(dev_metrics_t) * n_devs_max);
+		if (devsnew == NULL)
+			return;
+		walk->devs = devsnew;
+		walk->n_devs_max = n_devs_max;
+	}
+	dev = &walk->devs[walk->n_devs++];
+	memset(dev, 0, sizeof(dev_metrics_t));
+	dev->devid = stats->devid;
+	dev->len_bufs = stats->len_bufs;
+	dev->len_queued = stats->len_queued;
+	for (i = 0; i < USBIP_STATS_N_EPS; i++) {
+		usbip_stats_ep_t	*sep = &stats->eps[i];
+
+		dev->n_pdus += sep->n_cmds + sep->n_rets;
+		dev->n_bytes += sep->n_bytes;
+		dev->n_errors += sep->n_errors;
+		dev->n_unlinks += sep->n_unlinks;
+		dev->outstanding += sep->outstanding;
+	}
+}
+
+static void
+collect_shaper_dev(usbip_shaper_dev_t *sdev, void *ctx)
+{
+	shaper_walk_t	*walk = (shaper_walk_t *)ctx;
+
+	if (walk->n_devs == walk->n_devs_max) {
+		int	n_devs_max = walk->n_devs_max > 0 ? walk->n_devs_max * 2 : 64;
+		usbip_shaper_dev_t	*devsnew;
+
+		devsnew = (usbip_shaper_dev_t *)realloc(walk->devs, sizeof(usbip_shaper_dev_t) * n_devs_max);
+		if (devsnew == NULL)
+			return;
+		walk->devs = devsnew;
+		walk->n_devs_max = n_devs_max;
+	}
+	walk->devs[walk->n_devs] = *sdev;
+	walk->devs[walk->n_devs].us_throttled = usbip_shaper_us_throttled(sdev);
+	walk->n_devs++;
+}
+
+static void
+write_family(strbuf_t *resp, const char *name, const char *type, const char *help)
+{
+	strbuf_printf(resp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+write_req_metrics(strbuf_t *resp)
+{
+	req_metrics_t	snap[N_REQS];
+	unsigned long	n_conns_snap;
+	int	i;
+	unsigned	j;
+
+	AcquireSRWLockShared(&lock_metrics);
+	memcpy(snap, reqs, sizeof(snap));
+	n_conns_snap = n_conns;
+	ReleaseSRWLockShared(&lock_metrics);
+
+	write_family(resp, "usbipd_connections_accepted_total", "counter", "Connections accepted.");
+	strbuf_printf(resp, "usbipd_connections_accepted_total %lu\n", n_conns_snap);
+
+	write_family(resp, "usbipd_requests_total", "counter", "Requests by operation and result.");
+	for (i = 0; i < N_REQS; i++) {
+		strbuf_printf(resp, "usbipd_requests_total{op=\"%s\",result=\"ok\"} %lu\n", req_names[i], snap[i].n_oks);
+		strbuf_printf(resp, "usbipd_requests_total{op=\"%s\",result=\"error\"} %lu\n", req_names[i], snap[i].n_errors);
+	}
+
+	write_family(resp, "usbipd_request_duration_seconds", "histogram", "Time to serve a request.");
+	for (i = 0; i < N_REQS; i++) {
+		unsigned long	n_sum = 0;
+
+		for (j = 0; j < N_REQ_BUCKETS; j++) {
+			n_sum += snap[i].buckets[j];
+			strbuf_printf(resp, "usbipd_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n", req_names[i], req_buckets[j], n_sum);
+		}
+		n_sum += snap[i].buckets[N_REQ_BUCKETS];
+		strbuf_printf(resp, "usbipd_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", req_names[i], n_sum);
+		strbuf_printf(resp, "usbipd_request_duration_seconds_sum{op=\"%s\"} %.6f\n", req_names[i], snap[i].sum);
+		strbuf_printf(resp, "usbipd_request_duration_seconds_count{op=\"%s\"} %lu\n", req_names[i], n_sum);
+	}
+}
+
+#define WRITE_DEV_FAMILY(resp, walk, name, type, help, fmt, field)	\
+	do {	\
+		int	_i;	\
+		write_family(resp, name, type, help);	\
+		for (_i = 0; _i < (walk)->n_devs; _i++)	\
+			strbuf_printf(resp, name "{devid=\"%08x\"} " fmt "\n", (walk)->devs[_i].devid, (walk)->devs[_i].field);	\
+	} while (0)
+
+/* counters of forwarders are gathered in a walk, which holds their lock shortly */
+static void
+write_dev_metrics(strbuf_t *resp)
+{
+	dev_walk_t	walk = { NULL, 0, 0 };
+
+	usbip_stats_walk(collect_dev, &walk);
+
+	write_family(resp, "usbipd_forwarders", "gauge", "Devices being forwarded.");
+	strbuf_printf(resp, "usbipd_forwarders %d\n", walk.n_devs);
+
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_pdus_total", "counter", "PDUs forwarded.", "%llu", n_pdus);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_bytes_total", "counter", "Payload bytes forwarded.", "%llu", n_bytes);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_errors_total", "counter", "RET_SUBMITs with an error status.", "%llu", n_errors);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_unlinks_total", "counter", "URBs asked to be unlinked.", "%llu", n_unlinks);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_outstanding_urbs", "gauge", "URBs submitted to a stub and not returned.", "%ld", outstanding);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_buffer_bytes", "gauge", "Bytes of forwarder buffers.", "%lu", len_bufs);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_device_queued_bytes", "gauge", "Bytes read by a forwarder and not written yet.", "%lu", len_queued);
+
+	free(walk.devs);
+}
+
+/* nothing is written if shaping is off */
+static void
+write_shaper_metrics(strbuf_t *resp)
+{
+	shaper_walk_t	walk = { NULL, 0, 0 };
+	int	i;
+
+	usbip_shaper_walk(collect_shaper_dev, &walk);
+	if (walk.n_devs == 0) {
+		free(walk.devs);
+		return;
+	}
+
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_shaper_weight", "gauge", "Weight of a device in a share of an egress rate.", "%u", weight);
+	WRITE_DEV_FAMILY(resp, &walk, "usbipd_shaper_throttles_total", "counter", "Times bulk PDUs have been held.", "%llu", n_throttles);
+	write_family(resp, "usbipd_shaper_throttled_seconds_total", "counter", "Time bulk PDUs have been held.");
+	for (i = 0; i < walk.n_devs; i++)
+		strbuf_printf(resp, "usbipd_shaper_throttled_seconds_total{devid=\"%08x\"} %.6f\n", walk.devs[i].devid, walk.devs[i].us_throttled / 1e6);
+	write_family(resp, "usbipd_shaper_bytes_total", "counter", "Bytes written into a socket by class.");
+	for (i = 0; i < walk.n_devs; i++) {
+		strbuf_printf(resp, "usbipd_shaper_bytes_total{devid=\"%08x\",class=\"bulk\"} %llu\n", walk.devs[i].devid, walk.devs[i].n_bytes_bulk);
+		strbuf_printf(resp, "usbipd_shaper_bytes_total{devid=\"%08x\",class=\"priority\"} %llu\n", walk.devs[i].devid, walk.devs[i].n_bytes_prio);
+	}
+
+	free(walk.devs);
+}
+
+/* a request is read up to an end of its headers, which are not looked into */
+static BOOL
+recv_http_request(SOCKET sockfd, char *buf, int len)
+{
+	int	nread = 0;
+
+	while (nread < len - 1) {
+		int	n = recv(sockfd, buf + nread, len - 1 - nread, 0);
+
+		if (n <= 0)
+			return FALSE;
+		nread += n;
+		buf[nread] = '\0';
+		if (strstr(buf, "\r\n\r\n") != NULL || strstr(buf, "\n\n") != NULL)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+send_all(SOCKET sockfd, const char *buf, int len)
+{
+	while (len > 0) {
+		int	n = send(sockfd, buf, len, 0);
+
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void
+serve_http(SOCKET sockfd)
+{
+	char	req[METRICS_REQ_MAX];
+	char	hdr[256];
+	strbuf_t	resp = { NULL, 0, 0, METRICS_RESP_INIT };
+	const char	*status = "200 OK";
+	int	len_hdr;
+
+	if (!recv_http_request(sockfd, req, sizeof(req)))
+		return;
+
+	if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0) {
+		write_req_metrics(&resp);
+		write_dev_metrics(&resp);
+		write_shaper_metrics(&resp);
+	}
+	else {
+		status = "404 Not Found";
+		strbuf_printf(&resp, "only /metrics is served\n");
+	}
+	if (resp.buf == NULL)
+		return;
+
+	len_hdr = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %d\r\nConnection: close\r\n\r\n", status, resp.len);
+	send_all(sockfd, hdr, len_hdr);
+	send_all(sockfd, resp.buf, resp.len);
+	free(resp.buf);
+}
+
+static DWORD WINAPI
+metrics_server(LPVOID ctx)
+{
+	SOCKET	listenfd = (SOCKET)ctx;
+
+	for (;;) {
+		SOCKET	connfd;
+		DWORD	timeout = METRICS_RECV_TIMEOUT;
+
+		connfd = accept(listenfd, NULL, NULL);
+		if (connfd == INVALID_SOCKET) {
+			dbg("failed to accept metrics connection: err: %d", WSAGetLastError());
+			continue;
+		}
+		/* a stalled scraper does not hold the server */
+		setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+		serve_http(connfd);
+		shutdown(connfd, SD_SEND);
+		closesocket(connfd);
+	}
+	return 0;
+}
+
+/* metrics are served only on a loopback address */
+static SOCKET
+build_metrics_sockfd(const char *port)
+{
+	struct addrinfo	hints, *ainfo;
+	SOCKET	sockfd;
+	int	rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo("127.0.0.1", port, &hints, &ainfo);
+	if (rc != 0) {
+		dbg("failed to get a metrics address %s: %s", port, gai_strerror(rc));
+		return INVALID_SOCKET;
+	}
+	sockfd = socket(ainfo->ai_family, ainfo->ai_socktype, ainfo->ai_protocol);
+	if (sockfd == INVALID_SOCKET) {
+		dbg("socket error: err: %d", WSAGetLastError());
+		freeaddrinfo(ainfo);
+		return INVALID_SOCKET;
+	}
+	usbip_net_set_reuseaddr(sockfd);
+	if (bind(sockfd, ainfo->ai_addr, (int)ainfo->ai_addrlen) == SOCKET_ERROR ||
+		listen(sockfd, SOMAXCONN) == SOCKET_ERROR) {
+		dbg("failed to listen on metrics port %s: err: %d", port, WSAGetLastError());
+		closesocket(sockfd);
+		freeaddrinfo(ainfo);
+		return INVALID_SOCKET;
+	}
+	freeaddrinfo(ainfo);
+	return sockfd;
+}
+
+BOOL
+start_metrics_server(const char *port)
+{
+	LARGE_INTEGER	freq;
+	SOCKET	sockfd;
+	HANDLE	hthread;
+
+	QueryPerformanceFrequency(&freq);
+	ticks_per_sec = freq.QuadPart;
+
+	sockfd = build_metrics_sockfd(port);
+	if (sockfd == INVALID_SOCKET)
+		return FALSE;
+	hthread = CreateThread(NULL, 0, metrics_server, (LPVOID)sockfd, 0, NULL);
+	if (hthread == NULL) {
+		dbg("failed to start metrics server: err: 0x%lx", GetLastError());
+		closesocket(sockfd);
+		return FALSE;
+	}
+	CloseHandle(hthread);
+	info("serving metrics on 127.0.0.1:%s", port);
+	return TRUE;
+}
@@ -0,0 +1,201 @@
+#include "usbipd.h"
+
+#include <stdlib.h>
+
+#include "usbipd_stub.h"
+
+/*
+ * Weights and caps of exported devices for usbip_shaper. A rule matches a bus
+ * id, VID:PID or a class in hex, and a later one wins. A device which no rule
+ * matches is weighted by its class.
+ */
+#define N_RULES_MAX	32
+#define WEIGHT_DEFAULT	2
+#define WEIGHT_MAX	1000
+
+typedef struct {
+	/* empty if a rule is not of a bus id */
+	char	busid[USBIP_BUS_ID_SIZE];
+	/* -1 if a rule is not of them */
+	int	vendor, product, class;
+	unsigned	weight;
+	unsigned long long	rate_max;
+} shaper_rule_t;
+
+/* interactive devices go ahead of storage */
+static const struct {
+	unsigned char	class;
+	unsigned	weight;
+} class_weights[] = {
+	{ 0x01, 8 },	/* audio */
+	{ 0x03, 8 },	/* HID */
+	{ 0x0b, 8 },	/* smart card */
+	{ 0x0e, 4 },	/* video */
+	{ 0x08, 1 },	/* mass storage */
+};
+
+static shaper_rule_t	rules[N_RULES_MAX];
+static int	n_rules;
+static unsigned long long	rate_egress;
+static BOOL	shaping;
+
+/* bytes per second, which may have K, M or G for 10^3, 10^6 or 10^9 */
+static BOOL
+parse_rate(const char *str, unsigned long long *prate)
+{
+	unsigned long long	rate;
+	char	*end;
+
+	rate = strtoull(str, &end, 10);
+	if (end == str)
+		return FALSE;
+	switch (*end) {
+	case 'K':
+	case 'k':
+		rate *= 1000;
+		end++;
+		break;
+	case 'M':
+	case 'm':
+		rate *= 1000000;
+		end++;
+		break;
+	case 'G':
+	case 'g':
+		rate *= 1000000000;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if (*end != '\0')
+		return FALSE;
+	*prate = rate;
+	return TRUE;
+}
+
+BOOL
+set_egress_rate(const char *rate)
+{
+	if (!parse_rate(rate, &rate_egress) || rate_egress == 0) {
+		err("invalid egress rate: %s", rate);
+		return FALSE;
+	}
+	shaping = TRUE;
+	return TRUE;
+}
+
+/* BUSID|VID:PID|CLASS=WEIGHT[/RATE] */
+BOOL
+add_shaper_rule(const char *rule)
+{
+	shaper_rule_t	*prule;
+	char	match[USBIP_BUS_ID_SIZE];
+	const char	*eq, *slash;
+	char	*end;
+	size_t	len;
+
+	if (n_rules == N_RULES_MAX) {
+		err("too many shaping rules: %s", rule);
+		return FALSE;
+	}
+	prule = &rules[n_rules];
+	memset(prule, 0, sizeof(shaper_rule_t));
+	prule->vendor = prule->product = prule->class = -1;
+
+	eq = strchr(rule, '=');
+	if (eq == NULL || eq == rule || (size_t)(eq - rule) >= sizeof(match))
+		goto err_rule;
+	len = eq - rule;
+	memcpy(match, rule, len);
+	match[len] = '\0';
+
+	if (strchr(match, '-') != NULL)
+		strcpy_s(prule->busid, sizeof(prule->busid), match);
+	else if (strchr(match, ':') != NULL) {
+		if (sscanf_s(match, "%x:%x", &prule->vendor, &prule->product) != 2)
+			goto err_rule;
+	}
+	else {
+		prule->class = (int)strtoul(match, &end, 16);
+		if (*end != '\0' || prule->class > 0xff)
+			goto err_rule;
+	}
+
+	prule->weight = (unsigned)strtoul(eq + 1, &end, 10);
+	if (end == eq + 1 || prule->weight == 0 || prule->weight > WEIGHT_MAX)
+		goto err_rule;
+	slash = end;
+	if (*slash == '/') {
+		if (!parse_rate(slash + 1, &prule->rate_max))
+			goto err_rule;
+	}
+	else if (*slash != '\0')
+		goto err_rule;
+
+	n_rules++;
+	shaping = TRUE;
+	return TRUE;
+err_rule:
+	err("invalid shaping rule: %s", rule);
+	return FALSE;
+}
+
+void
+start_shaper(void)
+{
+	if (!shaping)
+		return;
+	usbip_shaper_setup(rate_egress);
+	if (rate_egress > 0)
+		info("shaping egress at %llu bytes/s, rules: %d", rate_egress, n_rules);
+	else
+		info("shaping egress with caps only, rules: %d", n_rules);
+}
+
+static BOOL
+is_rule_matched(const shaper_rule_t *prule, const struct usbip_usb_device *udev, int class)
+{
+	if (prule->busid[0] != '\0')
+		return strcmp(prule->busid, udev->busid) == 0;
+	if (prule->vendor >= 0)
+		return prule->vendor == udev->idVendor && prule->product == udev->idProduct;
+	return prule->class == class;
+}
+
+static unsigned
+get_class_weight(unsigned char class)
+{
+	int	i;
+
+	for (i = 0; i < sizeof(class_weights) / sizeof(class_weights[0]); i++) {
+		if (class_weights[i].class == class)
+			return class_weights[i].weight;
+	}
+	return WEIGHT_DEFAULT;
+}
+
+/* udev should be in host byte order. NULL if shaping is off */
+usbip_shaper_dev_t *
+open_shaper_dev(devno_t devno, const struct usbip_usb_device *udev, UINT32 devid)
+{
+	unsigned char	class;
+	unsigned	weight;
+	unsigned long long	rate_max = 0;
+	int	i;
+
+	if (!shaping)
+		return NULL;
+
+	class = get_usbdev_class(devno, udev);
+	weight = get_class_weight(class);
+	for (i = n_rules - 1; i >= 0; i--) {
+		if (is_rule_matched(&rules[i], udev, class)) {
+			weight = rules[i].weight;
+			rate_max = rules[i].rate_max;
+			break;
+		}
+	}
+	dbg("shaping %s: class: %02x, weight: %u, rate: %llu", udev->busid, class, weight, rate_max);
+	return usbip_shaper_open(devid, weight, rate_max);
+}
@@ -9,6 +9,7 @@
 
 #include "usbip_common.h"
 #include "usbip_stub_api.h"
+#include "usbip_dscr_hash.h"
 #include "usbip_setupdi.h"
 
 #include <winsock2.h>
@@ -60,25 +61,31 @@ get_device_path(const char *id_inst)
 	return devpath_ctx.devpath;
 }
 
+/*
+ * An old stub fills the first fields of devinfo only. bcdDevice and a hash are
+ * asked for only if with_hash is set since a hash costs fetching descriptors.
+ */
 static BOOL
-get_devinfo(const char *devpath, ioctl_usbip_stub_devinfo_t *devinfo)
+get_devinfo(const char *devpath, ioctl_usbip_stub_devinfo_t *devinfo, BOOL with_hash)
 {
 	HANDLE	hdev;
-	DWORD	len;
+	DWORD	len, outlen;
 
 	hdev = CreateFile(devpath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
 	if (hdev == INVALID_HANDLE_VALUE) {
 		dbg("get_devinfo: cannot open device: %s", devpath);
 		return FALSE;
 	}
-	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_GET_DEVINFO, NULL, 0, devinfo, sizeof(ioctl_usbip_stub_devinfo_t), &len, NULL)) {
+	memset(devinfo, 0, sizeof(ioctl_usbip_stub_devinfo_t));
+	outlen = with_hash ? sizeof(ioctl_usbip_stub_devinfo_t) : IOCTL_USBIP_STUB_DEVINFO_SIZE_V1;
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_GET_DEVINFO, NULL, 0, devinfo, outlen, &len, NULL)) {
 		dbg("get_devinfo: DeviceIoControl failed: err: 0x%lx", GetLastError());
 		CloseHandle(hdev);
 		return FALSE;
 	}
 	CloseHandle(hdev);
 
-	if (len != sizeof(ioctl_usbip_stub_devinfo_t)) {
+	if (len != outlen && len != IOCTL_USBIP_STUB_DEVINFO_SIZE_V1) {
 		dbg("get_devinfo: DeviceIoControl failed: invalid size: len: %d", len);
 		return FALSE;
 	}
@@ -145,7 +152,7 @@ is_stub_devno(devno_t devno)
 }
 
 BOOL
-build_udev(devno_t devno, struct usbip_usb_device *pudev)
+build_udev(devno_t devno, struct usbip_usb_device *pudev, UINT32 *pdscr_hash)
 {
 	char	*devpath;
 	ioctl_usbip_stub_devinfo_t	Devinfo;
@@ -163,19 +170,69 @@ build_udev(devno_t devno, struct usbip_usb_device *pudev)
 	snprintf(pudev->path, USBIP_DEV_PATH_MAX, devpath);
 	snprintf(pudev->busid, USBIP_BUS_ID_SIZE, "1-%hhu", devno);
 
-	if (get_devinfo(devpath, &Devinfo)) {
+	if (pdscr_hash != NULL)
+		*pdscr_hash = USBIP_DSCR_HASH_NONE;
+	if (get_devinfo(devpath, &Devinfo, pdscr_hash != NULL)) {
 		pudev->idVendor = Devinfo.vendor;
 		pudev->idProduct = Devinfo.product;
 		pudev->speed = Devinfo.speed;
 		pudev->bDeviceClass = Devinfo.class;
 		pudev->bDeviceSubClass = Devinfo.subclass;
 		pudev->bDeviceProtocol = Devinfo.protocol;
+		pudev->bcdDevice = Devinfo.bcdDevice;
+		if (pdscr_hash != NULL)
+			*pdscr_hash = Devinfo.dscr_hash;
 	}
 	free(devpath);
 
 	return TRUE;
 }
 
+typedef struct {
+	devno_t	devno;
+	char	*id_compat;
+} get_id_compat_ctx_t;
+
+static int
+walker_get_id_compat(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t devno, void *ctx)
+{
+	get_id_compat_ctx_t	*pctx = (get_id_compat_ctx_t *)ctx;
+
+	if (devno == pctx->devno) {
+		pctx->id_compat = get_id_compat(dev_info, pdev_info_data);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Most devices leave a class to interfaces. USB\Class_XX of compatible ids
+ * has that of an interface, which a composite device does not have.
+ */
+unsigned char
+get_usbdev_class(devno_t devno, const struct usbip_usb_device *udev)
+{
+	get_id_compat_ctx_t	ctx;
+	const char	*id;
+	unsigned char	class = 0;
+
+	if (udev->bDeviceClass != 0 && udev->bDeviceClass != 0xef)
+		return udev->bDeviceClass;
+
+	ctx.devno = devno;
+	ctx.id_compat = NULL;
+	if (traverse_usbdevs(walker_get_id_compat, TRUE, &ctx) != -1 || ctx.id_compat == NULL)
+		return 0;
+	for (id = ctx.id_compat; *id != '\0'; id += strlen(id) + 1) {
+		if (_strnicmp(id, "USB\\Class_", 10) == 0) {
+			sscanf_s(id + 10, "%2hhx", &class);
+			break;
+		}
+	}
+	free(ctx.id_compat);
+	return class;
+}
+
 HANDLE
 open_stub_dev(devno_t devno)
 {
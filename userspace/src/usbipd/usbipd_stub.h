@@ -27,9 +27,15 @@
 #include "list.h"
 #include "usbip_common.h"
 #include "usbip_setupdi.h"
+#include "usbip_shaper.h"
 
 #include <winsock2.h>
 
 BOOL is_stub_devno(devno_t devno);
-BOOL build_udev(devno_t devno, struct usbip_usb_device *pudev);
+/* pdscr_hash gets a hash of descriptors if not NULL. See usbip_dscr_hash.h */
+BOOL build_udev(devno_t devno, struct usbip_usb_device *pudev, UINT32 *pdscr_hash);
 HANDLE open_stub_dev(devno_t devno);
+/* a class of a device, or of its interface if it has only one. 0 if unknown */
+unsigned char get_usbdev_class(devno_t devno, const struct usbip_usb_device *udev);
+/* see usbipd_shaper.c */
+usbip_shaper_dev_t *open_shaper_dev(devno_t devno, const struct usbip_usb_device *udev, UINT32 devid);